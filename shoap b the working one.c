@@ -1,22 +1,105 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
 
-#define MAX_PRODUCTS 100
-#define MAX_SALES 1000
+#define SALE_CHUNK_SIZE 4096 // sales per arena chunk (a multiple of 4 for the SIMD kernels)
+#define BATCH_SIZE 10000     // transactions per commit in batch mode
 #define MAX_NAME_LENGTH 50
 #define FILENAME_PRODUCTS "products.dat"
 #define FILENAME_SALES "sales.dat"
+#define PRODUCT_FILE_MAGIC 0x50534f50u // "POSP"
+#define PRODUCT_FILE_VERSION 4 // 2 made prices integer cents, 3 added block checksums, 4 compact
+#define PRODUCT_CHECKSUM_BLOCK 1024 // products covered by one CRC32C
+#define PRODUCT_FILE_HEADER_SIZE 20 // version 4: magic, version, count, block size, checksum
+#define PRODUCT_RECORD_MAX (5 * 10 + MAX_NAME_LENGTH) // longest encoded product
+#define PRODUCT_INITIAL_CAPACITY 256
+#define FILENAME_PRICES "prices.dat"
+#define PRICE_FILE_MAGIC 0x48534f50u // "POSH"
+#define PRICE_FILE_VERSION 1
+#define PRICE_FILE_HEADER_SIZE 20 // magic, version, product count, payload CRC32C, header CRC32C
+#define FILENAME_ROLLUPS "rollups.dat"
+#define ROLLUP_FILE_MAGIC 0x52534f50u // "POSR"
+#define ROLLUP_FILE_VERSION 2
+#define SALES_FILE_MAGIC 0x53534f50u // "POSS"
+#define SALES_FILE_VERSION 4   // 2 made prices and totals integer cents, 3 checksummed blocks, 4 compact
+#define SALE_BLOCK_MAGIC 0x42534f50u // "POSB"
+#define SALE_BLOCK_HEADER_SIZE 20 // version 4: magic, count, raw size, stored size, checksum
+#define SALE_RECORD_MAX (7 * 10 + MAX_NAME_LENGTH + 1) // longest encoded sale, with a new name
+#define SEARCH_MAX_EDITS 2   // largest edit distance fuzzy search accepts
+#define SEARCH_MAX_RESULTS 20
+#define MONEY_TEXT_LENGTH 24 // longest formatted Money plus terminator
+#define RANK_BY_QUANTITY 0
+#define RANK_BY_REVENUE 1
+#define REPORT_MAX_TOP 1000  // most products a top-N report lists
+#define REPORT_MAX_THREADS 64 // most threads one report is split across
+#define OUTPUT_BUFFER_SIZE (1 << 16) // listings are written to stdout in pieces this big
+#define STAT_SUB_BITS 4      // latency histogram steps per power of two, as a power of two
+#define STAT_BUCKETS ((64 - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+#define STATS_DUMP_INTERVAL 10 // seconds between POS_STATS_FILE rewrites unless POS_STATS_INTERVAL says
+#define CHAIN_DIRECTORY "stores" // a chain keeps store n's files in CHAIN_DIRECTORY/store-<n>
+#define CHAIN_MAX_STORES 1024
+#define CHAIN_QUEUE_SIZE 4096  // requests a store's mailbox holds before senders wait
+#define CHAIN_BATCH 256        // requests a store worker takes out of its mailbox at once
+
+// Money is held in whole cents so sums are exact however many sales go in.
+typedef long long Money;
 
 typedef struct {
     int id;
     char name[MAX_NAME_LENGTH];
-    float price;
+    Money price;
     int quantity;
     int min_stock_level;
 } Product;
 
+// One price a product has had, from since until the next version's since.
+typedef struct {
+    long long since;                // 0 = from before price history was kept
+    Money price;
+} PriceVersion;
+
+// Every price a product has had, oldest first. Versions are only appended,
+// never changed, so a report resolving prices as of some earlier time keeps
+// seeing the same ones however many price changes land meanwhile. A product
+// with no versions has always had its current price.
+typedef struct {
+    PriceVersion *versions;
+    int count;
+    int capacity;
+} PriceChain;
+
+typedef struct {
+    int id;
+    int product_id;
+    char product_name[MAX_NAME_LENGTH];
+    int quantity;
+    Money price;
+    Money total;
+    time_t timestamp;
+} Sale;
+
+// Records as stored by version 1 files (and the unversioned files before
+// them), with float money; only read when converting those files.
+typedef struct {
+    int id;
+    char name[MAX_NAME_LENGTH];
+    float price;
+    int quantity;
+    int min_stock_level;
+} LegacyProduct;
+
 typedef struct {
     int id;
     int product_id;
@@ -25,40 +108,548 @@ typedef struct {
     float price;
     float total;
     time_t timestamp;
-} Sale;
+} LegacySale;
+
+// Revenue rollups maintained at sale time, one entry per day and one per
+// (day, product), both kept sorted by day.
+typedef struct {
+    int day;
+    int sales;
+    int quantity;
+    Money revenue;
+} DailyRollup;
+
+typedef struct {
+    int day;
+    int product_id;
+    int quantity;
+    Money revenue;
+} ProductDayRollup;
+
+// One product's units and revenue over a report range.
+typedef struct {
+    int product_id;
+    long long quantity;
+    Money revenue;
+} ProductTotal;
+
+// Per-product totals being summed, in an open-addressing hash by product id.
+typedef struct {
+    ProductTotal *totals;
+    int count;
+    int capacity;
+    int *slots;                         // product id -> totals index, -1 = empty
+    int slot_capacity;                  // power of two
+} ProductAggregate;
+
+// What a report needs from a range of sales.
+typedef struct {
+    long long sales;
+    long long quantity;
+    Money revenue;
+    ProductAggregate products;
+    char padding[16];                   // partials of different threads on separate lines
+} SalesSummary;
+
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    int sale_count;         // sales folded into the rollups
+    int day_count;
+    int product_day_count;
+    unsigned checksum;
+} RollupFileHeader;
+
+// Sales history is held column-wise: each chunk stores SALE_CHUNK_SIZE sales as
+// parallel arrays so aggregations stream only the columns they need. Money is
+// in integer cents and product names live once in the name dictionary.
+typedef struct {
+    long long timestamp[SALE_CHUNK_SIZE];
+    long long total_cents[SALE_CHUNK_SIZE];
+    long long price_cents[SALE_CHUNK_SIZE];
+    int id[SALE_CHUNK_SIZE];
+    int product_id[SALE_CHUNK_SIZE];
+    int quantity[SALE_CHUNK_SIZE];
+    int name_id[SALE_CHUNK_SIZE];
+} SaleChunk;
+
+// One line of a basket handed to a register.
+typedef struct {
+    int product_id;
+    int quantity;
+} LineItem;
+
+// One product in a basket, by catalog index, with every scan of it added up.
+typedef struct {
+    int index;
+    int quantity;
+} BasketLine;
+
+// A sale being rung up. Lines only collect while the customer shops: stock is
+// not touched until commitBasket(), so a basket can be abandoned at any point.
+// Scanning a product again adds to its line. There is no limit on lines.
+typedef struct {
+    BasketLine *lines;
+    int count;
+    int capacity;
+    int *slots;                         // open-addressing hash of product index -> line, -1 = empty
+    int slot_capacity;
+    Sale *sales;                        // one per line, filled in by commitBasket()
+    int sale_capacity;
+    Money total;                        // of the last commit
+    int short_line;                     // after a failed commit, the line stock could not cover
+} Basket;
+
+// A till selling concurrently with other tills against the same catalog.
+// Stock is taken with per-product compare-and-swap, and sold lines collect in
+// the register's own buffer until the owning thread calls flushRegisters().
+typedef struct {
+    Sale *sales;
+    int sale_count;
+    int sale_capacity;
+    Money revenue;
+    long long baskets;
+    long long rejected;
+} Register;
+
+// Name search trie over lower-cased product names. Children of a node form a
+// list sorted by character, so a walk visits names in alphabetical order.
+typedef struct {
+    int first_child;                    // -1 = none
+    int next_sibling;                   // -1 = none
+    int first_product;                  // products whose name ends here, -1 = none
+    unsigned char ch;
+} SearchNode;
+
+// Called when a product's stock crosses its min_stock_level: low is 1 when it
+// has just dropped to the level or below, 0 when it has been restocked above it.
+typedef void (*LowStockCallback)(Product *product, int low);
+
+// Header of FILENAME_SALES; Sale records follow it in the order they were made.
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    unsigned record_size;
+    int count;
+    Money total_revenue;            // version 1 had a float in the first half
+    char reserved[8];
+} SalesFileHeader;
+
+// From version 3 the sales file is append-only. The header above is written
+// once, with count and total_revenue left zero, and is followed by two commit
+// slots. Each save appends blocks, syncs them, then writes the next slot, so
+// the slot with the higher valid sequence always describes complete data.
+// Version 4 stores the header, the slots and the blocks little-endian field by
+// field; the slots keep the layout version 3 had on x86.
+typedef struct {
+    long long sequence;
+    long long size;                 // bytes of the file holding committed sales
+    int count;
+    unsigned checksum;              // CRC32C of the fields above
+} SaleCommit;
+
+#define SALE_COMMIT_SIZE 24
+#define SALES_FIRST_BLOCK (32 + 2 * SALE_COMMIT_SIZE)
+
+// Version 3 block: up to SALE_CHUNK_SIZE raw Sale records follow it.
+typedef struct {
+    unsigned magic;
+    int count;
+    unsigned checksum;              // CRC32C of count and the records
+    unsigned reserved;
+} SaleBlockHeader;
+
+// Header of FILENAME_PRODUCTS up to version 3.
+// Version 3 files hold `count` Product records after it, then a CRC32C for
+// each run of block_size records. Version 2 files held `capacity` records and
+// no checksums. Version 4 files are encoded by saveProducts instead.
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    unsigned header_size;
+    unsigned record_size;
+    int count;
+    int capacity;
+    unsigned block_size;
+    unsigned checksum;              // CRC32C of the fields above
+    char reserved[32];
+} ProductFileHeader;
 
 typedef struct {
-    Product products[MAX_PRODUCTS];
+    Product *products;                  // loaded from FILENAME_PRODUCTS, saved as a whole
     int product_count;
-    Sale sales[MAX_SALES];
+    int product_capacity;
+    SaleChunk **sale_chunks;            // never moved once allocated
+    int sale_chunk_count;
+    int sale_chunk_capacity;
     int sale_count;
-    float daily_revenue;
+    int saved_sale_count;               // sales already written to FILENAME_SALES
+    long long sales_file_size;          // bytes of FILENAME_SALES in the last commit, 0 = no file yet
+    long long sales_sequence;           // sequence of that commit
+    int saved_name_count;               // names already written to FILENAME_SALES
+    char (*names)[MAX_NAME_LENGTH];     // name dictionary for the sale columns
+    int name_count;
+    int name_capacity;
+    int *name_slots;                    // open-addressing hash of names, -1 = empty
+    int name_slot_capacity;
+    Money daily_revenue;
+    DailyRollup *days;
+    int day_count;
+    int day_capacity;
+    ProductDayRollup *product_days;
+    int product_day_count;
+    int product_day_capacity;
+    int *product_day_slots;             // (day, product) -> product_days index, -1 = empty
+    int product_day_slot_capacity;
+    int rollup_sale_count;              // sales folded into the rollups
+    SearchNode *search_nodes;           // name search trie, node 0 is the root
+    int search_node_count;
+    int search_node_capacity;
+    int *search_next;                   // next product with the same lower-cased name, -1 = end
+    int search_next_capacity;
+    unsigned long long *low_stock;      // bit per product index, set = at or below min_stock_level
+    int low_stock_words;
+    int low_stock_count;
+    LowStockCallback low_stock_alert;   // may be NULL; runs on the thread that crossed the level
+    int dir_fd;                         // directory holding the data files, AT_FDCWD = the working one
+    PriceChain *price_chains;           // per product index, saved to FILENAME_PRICES with the products
+    int price_chain_capacity;
 } POSSystem;
 
+// The catalog as it stood at one moment: the products that existed then, at
+// the prices they had then. Taking one copies nothing, since price versions
+// are never rewritten. Stock is not versioned and reads as it is now.
+typedef struct {
+    time_t at;
+    int product_count;                  // products added after the snapshot are left out
+} CatalogSnapshot;
+
+// Listings are rendered into one reusable buffer and handed to stdio in large
+// writes instead of one printf per row. With POS_OUTPUT=json every row becomes
+// one JSON object per line, tagged with a "type", and table headers are left out.
+typedef struct {
+    FILE *stream;
+    char *buffer;
+    size_t length;
+    int json;
+    int fields;           // fields written to the current JSON record
+    time_t date_slot;     // 15-minute slot date_prefix was rendered for
+    int date_minute;      // minute of the hour the slot starts at
+    char date_prefix[16]; // "Www Mmm dd hh:" as ctime() writes it
+    char date_year[16];   // " yyyy\n"
+} Output;
+
+// Requests a store of a chain carries out on its own thread.
+enum { CHAIN_SALE, CHAIN_ADD_PRODUCT, CHAIN_STOCK, CHAIN_REVENUE, CHAIN_SAVE, CHAIN_READY, CHAIN_STOP };
+
+// One store's answer to a request, in a line of its own so stores answering
+// the same query never write to the same cache line.
+typedef struct {
+    long long quantity;     // units sold, in stock, or the id given to a new product
+    long long sales;
+    Money revenue;
+    int ok;
+    char padding[36];
+} StoreResult;
+
+// Where the answers to a request sent to one or more stores are collected.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;                        // stores yet to answer
+    StoreResult *results;               // one per store asked
+} ChainGather;
+
+typedef struct {
+    int type;
+    int product_id;
+    int quantity;
+    int min_stock_level;
+    int from_day;
+    int to_day;
+    Money price;
+    char name[MAX_NAME_LENGTH];
+    ChainGather *gather;                // NULL = nobody waits for the answer
+    int slot;                           // this store's entry in gather->results
+} StoreRequest;
+
+typedef struct {
+    POSSystem system;                   // touched only by the store's own thread
+    pthread_t thread;
+    int index;
+    int cpu;                            // the worker is pinned here
+    int loaded;                         // 0 if the store could not open its files
+    long long sales;
+    long long rejected;
+    pthread_mutex_t lock;               // guards the mailbox below
+    pthread_cond_t wake;
+    pthread_cond_t room;
+    StoreRequest *queue;                // ring of CHAIN_QUEUE_SIZE requests
+    unsigned head;
+    unsigned tail;
+    Basket basket;                      // reused for every sale, by the store's thread only
+    char padding[64];
+} Store;
+
+typedef struct {
+    Store *stores;
+    int store_count;
+} Chain;
+
+// Operation statistics: per instrumented operation a count, the time spent,
+// the bytes it moved and a latency histogram with 2^STAT_SUB_BITS buckets per
+// power of two, as HDR histograms keep them. Times are in ticks of
+// statTicks() until they are reported. Each thread counts its own operations,
+// so stores of a chain never share a counter. Build with -DPOS_NO_STATS to
+// compile the timing out.
+enum { STAT_SALE, STAT_SAVE_PRODUCTS, STAT_SAVE_SALES, STAT_LOAD_PRODUCTS, STAT_LOAD_SALES, STAT_REPORT, STAT_OPS };
+
+typedef struct {
+    long long count;
+    long long total;
+    long long max;
+    long long bytes;
+    long long buckets[STAT_BUCKETS];
+} OperationStats;
+
+static __thread OperationStats operation_stats[STAT_OPS];
+
+// The time-stamp counter on x86-64 (a few nanoseconds to read, where
+// clock_gettime() takes about 30), nanoseconds elsewhere.
+static inline long long statTicks(void) {
+#ifdef __x86_64__
+    return (long long)__rdtsc();
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+// Below 2^STAT_SUB_BITS one bucket per value, above it 2^STAT_SUB_BITS
+// buckets per power of two.
+static inline int statBucket(long long ticks) {
+    unsigned long long v = ticks > 0 ? (unsigned long long)ticks : 0;
+    int e;
+    
+    if(v < (1u << STAT_SUB_BITS)) {
+        return (int)v;
+    }
+    e = 63 - __builtin_clzll(v);
+    return ((e - STAT_SUB_BITS + 1) << STAT_SUB_BITS) + (int)((v >> (e - STAT_SUB_BITS)) & ((1u << STAT_SUB_BITS) - 1));
+}
+
+static inline void recordStat(int op, long long ticks, long long bytes) {
+    OperationStats *stats = &operation_stats[op];
+    
+    stats->count++;
+    stats->total += ticks;
+    stats->bytes += bytes;
+    if(ticks > stats->max) {
+        stats->max = ticks;
+    }
+    stats->buckets[statBucket(ticks)]++;
+}
+
+#ifndef POS_NO_STATS
+#define STAT_BEGIN(t) long long t = statTicks()
+#define STAT_END(op, t, bytes) recordStat(op, statTicks() - (t), bytes)
+#else
+#define STAT_BEGIN(t) ((void)0)
+#define STAT_END(op, t, bytes) ((void)0)
+#endif
+
 // Function prototypes
 void initializeSystem(POSSystem *system);
 void saveProducts(POSSystem *system);
 void loadProducts(POSSystem *system);
 void saveSales(POSSystem *system);
 void loadSales(POSSystem *system);
+unsigned crc32c(unsigned crc, const void *data, size_t size);
 void displayMenu();
 void addProduct(POSSystem *system);
 void viewProducts(POSSystem *system);
 void updateProduct(POSSystem *system);
+void setProductPrice(POSSystem *system, int index, Money price, time_t when);
+Money priceAt(POSSystem *system, int index, time_t when);
+void takeSnapshot(POSSystem *system, time_t at, CatalogSnapshot *snapshot);
+int snapshotProduct(POSSystem *system, const CatalogSnapshot *snapshot, int index, Product *product);
+void viewPriceHistory(POSSystem *system);
+void savePriceHistory(POSSystem *system);
+void loadPriceHistory(POSSystem *system);
 void processSale(POSSystem *system);
-void printReceipt(Sale *sales, int count, float total);
+void printReceipt(Sale *sales, int count, Money total);
+void *growArray(void *array, int *capacity, size_t size);
+void initBasket(Basket *basket);
+void clearBasket(Basket *basket);
+void freeBasket(Basket *basket);
+int addToBasket(Basket *basket, int index, int quantity);
+int basketQuantity(Basket *basket, int index);
+int commitBasket(POSSystem *system, Basket *basket);
+char *formatMoney(Money amount, char *text);
+int parseMoney(char **cursor, Money *amount);
+int scanMoney(Money *amount);
 void viewDailyRevenue(POSSystem *system);
 void generateSalesReport(POSSystem *system);
+void listAllSales(POSSystem *system);
 void checkLowStock(POSSystem *system);
+void refreshLowStock(POSSystem *system, int index);
+void buildLowStock(POSSystem *system);
+void printLowStockAlert(Product *product, int low);
 int findProductById(POSSystem *system, int id);
 int findProductByName(POSSystem *system, const char *name);
+int findProductsByPrefix(POSSystem *system, const char *prefix, int *matches, int max);
+int findProductsFuzzy(POSSystem *system, const char *name, int max_edits, int *matches, int max);
+void indexProductName(POSSystem *system, int index);
+void unindexProductName(POSSystem *system, int index);
+void searchProducts(POSSystem *system);
+void runSearchBenchmark(int products);
+int reserveProducts(POSSystem *system, int count);
+void getSale(POSSystem *system, int index, Sale *sale);
+void appendSale(POSSystem *system, Sale *sale);
+long long revenueInRange(POSSystem *system, time_t from, time_t to);
+long long productRevenue(POSSystem *system, int product_id, time_t from, time_t to, long long *quantity);
+void viewProductRevenue(POSSystem *system);
+void runColumnBenchmark(int sales);
+int insertProduct(POSSystem *system, Product *product);
+int reserveStock(Product *product, int quantity);
+void releaseStock(Product *product, int quantity);
+int registerSale(POSSystem *system, Register *reg, LineItem *items, int count);
+void flushRegisters(POSSystem *system, Register *registers, int count);
+void runRegisterBenchmark(int max_registers);
+int runBatch(POSSystem *system, const char *path, int batch_size);
+int dayNumber(time_t t);
+void addToRollups(POSSystem *system, Sale *sale);
+void rebuildRollups(POSSystem *system);
+void saveRollups(POSSystem *system);
+void loadRollups(POSSystem *system);
+Money rollupRevenue(POSSystem *system, int from_day, int to_day, int *sales);
+int firstDayAtOrAfter(POSSystem *system, int day);
+ProductDayRollup *findProductDay(POSSystem *system, int day, int product_id);
+void formatDay(int day, char *text);
+void openOutput(Output *out, FILE *stream);
+void flushOutput(Output *out);
+void closeOutput(Output *out);
+void outText(Output *out, const char *text);
+void outField(Output *out, const char *text, int width);
+void outInt(Output *out, long long value, int width);
+void outMoney(Output *out, Money amount, int width);
+void outDate(Output *out, time_t t);
+void outRecord(Output *out, const char *type);
+void outJsonText(Output *out, const char *key, const char *text);
+void outJsonInt(Output *out, const char *key, long long value);
+void outJsonMoney(Output *out, const char *key, Money amount);
+void outEndRecord(Output *out);
+int selectTopProducts(const ProductTotal *totals, int count, int by, ProductTotal *top, int n);
+int topProducts(POSSystem *system, int from_day, int to_day, int by, ProductTotal *top, int n);
+int topProductsInRange(POSSystem *system, time_t from, time_t to, int by, ProductTotal *top, int n);
+void runTopBenchmark(int sales);
+int chooseReportThreads(void);
+void setReportThreads(int threads);
+void summarizeSales(POSSystem *system, time_t from, time_t to, SalesSummary *summary);
+void freeSalesSummary(SalesSummary *summary);
+void runParallelBenchmark(int sales, int max_threads);
+void runChecksumBenchmark(int megabytes);
+void runFormatBenchmark(int sales);
+void runOutputBenchmark(int sales);
+void runBenchmarkSuite(int max_products, int history, int sells, const char *dir);
+void showStats(void);
+int openChain(Chain *chain, int stores);
+void closeChain(Chain *chain);
+void sendToStore(Chain *chain, int store_index, const StoreRequest *request);
+void chainSale(Chain *chain, int store_index, int product_id, int quantity);
+int addChainProduct(Chain *chain, int store_index, const char *name, Money price, int quantity, int min_stock);
+long long chainStock(Chain *chain, const char *name, int *stores);
+Money chainRevenue(Chain *chain, int from_day, int to_day, long long *sales, Money *per_store);
+int runChain(int stores);
+void runChainBenchmark(int max_stores, int sales);
+int dumpStats(const char *path);
+void tickStats(int force);
 
-int main() {
+int main(int argc, char *argv[]) {
     POSSystem system;
+    
+    if(argc > 1 && strcmp(argv[1], "--bench-columns") == 0) {
+        runColumnBenchmark(argc > 2 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-search") == 0) {
+        runSearchBenchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-top") == 0) {
+        runTopBenchmark(argc > 2 ? atoi(argv[2]) : 50000000);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-parallel") == 0) {
+        runParallelBenchmark(argc > 2 ? atoi(argv[2]) : 20000000,
+                             argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-registers") == 0) {
+        runRegisterBenchmark(argc > 2 ? atoi(argv[2]) : 64);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-checksum") == 0) {
+        runChecksumBenchmark(argc > 2 ? atoi(argv[2]) : 256);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-format") == 0) {
+        runFormatBenchmark(argc > 2 ? atoi(argv[2]) : 5000000);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-output") == 0) {
+        runOutputBenchmark(argc > 2 ? atoi(argv[2]) : 2000000);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-chain") == 0) {
+        runChainBenchmark(argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN),
+                          argc > 3 ? atoi(argv[3]) : 1000000);
+        return 0;
+    }
+    if(argc > 2 && strcmp(argv[1], "--chain") == 0) {
+        return runChain(atoi(argv[2]));
+    }
+    if(argc > 1 && strcmp(argv[1], "--bench-suite") == 0) {
+        runBenchmarkSuite(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 1000000,
+                          argc > 4 ? atoi(argv[4]) : 100000, argc > 5 ? argv[5] : ".");
+        return 0;
+    }
+    
     initializeSystem(&system);
     
+    if(argc > 2 && strcmp(argv[1], "--batch") == 0) {
+        int failed;
+        loadProducts(&system);
+        loadSales(&system);
+        failed = runBatch(&system, argv[2], argc > 3 ? atoi(argv[3]) : BATCH_SIZE);
+        tickStats(1);
+        return failed ? 1 : 0;
+    }
+    // Listings for scripts; set POS_OUTPUT=json for JSON lines. What loading
+    // prints goes to stderr so that stdout holds only the listing.
+    if(argc > 1 && (strcmp(argv[1], "--list-products") == 0 || strcmp(argv[1], "--list-sales") == 0)) {
+        int saved = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        loadProducts(&system);
+        loadSales(&system);
+        fflush(stdout);
+        if(saved >= 0) {
+            dup2(saved, STDOUT_FILENO);
+            close(saved);
+        }
+        if(strcmp(argv[1], "--list-products") == 0) {
+            viewProducts(&system);
+        } else {
+            listAllSales(&system);
+        }
+        return 0;
+    }
+    
     loadProducts(&system);
     loadSales(&system);
+    system.low_stock_alert = printLowStockAlert;
     
     int choice;
     
@@ -91,6 +682,18 @@ int main() {
             case 7:
                 checkLowStock(&system);
                 break;
+            case 9:
+                viewProductRevenue(&system);
+                break;
+            case 10:
+                searchProducts(&system);
+                break;
+            case 11:
+                showStats();
+                break;
+            case 12:
+                viewPriceHistory(&system);
+                break;
             case 8:
                 saveProducts(&system);
                 saveSales(&system);
@@ -105,6 +708,7 @@ int main() {
                 printf("Invalid choice! Please try again.\n");
         }
         
+        tickStats(choice == 0);
         printf("\n");
     } while(choice != 0);
     
@@ -112,9 +716,44 @@ int main() {
 }
 
 void initializeSystem(POSSystem *system) {
+    system->products = NULL;
     system->product_count = 0;
+    system->product_capacity = 0;
+    system->sale_chunks = NULL;
+    system->sale_chunk_count = 0;
+    system->sale_chunk_capacity = 0;
     system->sale_count = 0;
-    system->daily_revenue = 0.0;
+    system->saved_sale_count = 0;
+    system->sales_file_size = 0;
+    system->sales_sequence = 0;
+    system->saved_name_count = 0;
+    system->names = NULL;
+    system->name_count = 0;
+    system->name_capacity = 0;
+    system->name_slots = NULL;
+    system->name_slot_capacity = 0;
+    system->daily_revenue = 0;
+    system->days = NULL;
+    system->day_count = 0;
+    system->day_capacity = 0;
+    system->product_days = NULL;
+    system->product_day_count = 0;
+    system->product_day_capacity = 0;
+    system->product_day_slots = NULL;
+    system->product_day_slot_capacity = 0;
+    system->rollup_sale_count = 0;
+    system->search_nodes = NULL;
+    system->search_node_count = 0;
+    system->search_node_capacity = 0;
+    system->search_next = NULL;
+    system->search_next_capacity = 0;
+    system->low_stock = NULL;
+    system->low_stock_words = 0;
+    system->low_stock_count = 0;
+    system->low_stock_alert = NULL;
+    system->dir_fd = AT_FDCWD;
+    system->price_chains = NULL;
+    system->price_chain_capacity = 0;
 }
 
 void displayMenu() {
@@ -127,54 +766,296 @@ void displayMenu() {
     printf("6. Generate Sales Report\n");
     printf("7. Check Low Stock\n");
     printf("8. Save Data\n");
+    printf("9. Product Revenue\n");
+    printf("10. Search Products\n");
+    printf("11. Operation Statistics\n");
+    printf("12. Price History\n");
     printf("0. Exit\n");
 }
 
-void addProduct(POSSystem *system) {
-    if(system->product_count >= MAX_PRODUCTS) {
-        printf("Product limit reached! Cannot add more products.\n");
+// Writes amount as "-123.45" into text (MONEY_TEXT_LENGTH bytes) and returns text,
+// so several amounts can be formatted for one printf.
+char *formatMoney(Money amount, char *text) {
+    char digits[MONEY_TEXT_LENGTH];
+    unsigned long long value = amount < 0 ? 0 - (unsigned long long)amount : (unsigned long long)amount;
+    int count = 0, i;
+    
+    digits[count++] = (char)('0' + value % 10);
+    digits[count++] = (char)('0' + value / 10 % 10);
+    digits[count++] = '.';
+    value /= 100;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while(value != 0);
+    if(amount < 0) {
+        digits[count++] = '-';
+    }
+    for(i = 0; i < count; i++) {
+        text[i] = digits[count - 1 - i];
+    }
+    text[count] = '\0';
+    return text;
+}
+
+// Reads an amount such as "12", "12.5" or "12.34" at *cursor, skipping leading
+// blanks, and moves the cursor past it. Digits past the cents round half up.
+int parseMoney(char **cursor, Money *amount) {
+    char *text = *cursor;
+    Money value = 0;
+    int negative, digits = 0;
+    
+    while(*text == ' ' || *text == '\t') {
+        text++;
+    }
+    negative = *text == '-';
+    if(*text == '-' || *text == '+') {
+        text++;
+    }
+    for(; *text >= '0' && *text <= '9'; text++, digits++) {
+        if(value > (LLONG_MAX - 9) / 1000) {
+            return 0;
+        }
+        value = value * 10 + (*text - '0');
+    }
+    value *= 100;
+    if(*text == '.') {
+        text++;
+        if(*text >= '0' && *text <= '9') {
+            value += 10 * (*text++ - '0');
+            digits++;
+        }
+        if(*text >= '0' && *text <= '9') {
+            value += *text++ - '0';
+        }
+        if(*text >= '5' && *text <= '9') {
+            value++;
+        }
+        while(*text >= '0' && *text <= '9') {
+            text++;
+        }
+    }
+    if(digits == 0) {
+        return 0;
+    }
+    *amount = negative ? -value : value;
+    *cursor = text;
+    return 1;
+}
+
+// Reads one amount typed at the prompt; returns 0 if it is not a valid price.
+int scanMoney(Money *amount) {
+    char text[32], *cursor = text;
+    
+    if(scanf("%31s", text) != 1 || !parseMoney(&cursor, amount) || *cursor != '\0' || *amount < 0) {
+        return 0;
+    }
+    return 1;
+}
+
+// Converts an amount older versions kept as a float. It goes through the "%.2f"
+// text those versions displayed, so a migrated price reads just as users saw
+// it. An amount too large to hold in cents comes out as 0.
+static Money moneyFromFloat(float amount) {
+    char text[64], *cursor = text;
+    Money value = 0;
+    
+    snprintf(text, sizeof(text), "%.2f", (double)amount);
+    if(!parseMoney(&cursor, &value)) {
+        return 0;
+    }
+    return value;
+}
+
+static void reservePriceChains(POSSystem *system, int count) {
+    int capacity = system->price_chain_capacity ? system->price_chain_capacity : PRODUCT_INITIAL_CAPACITY;
+    PriceChain *grown;
+    
+    if(count <= system->price_chain_capacity) {
+        return;
+    }
+    while(capacity < count) {
+        capacity *= 2;
+    }
+    grown = realloc(system->price_chains, sizeof(PriceChain) * capacity);
+    if(grown == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    memset(grown + system->price_chain_capacity, 0, sizeof(PriceChain) * (capacity - system->price_chain_capacity));
+    system->price_chains = grown;
+    system->price_chain_capacity = capacity;
+}
+
+// Appends a version to product index's chain. Two changes within the same
+// second (or a clock stepped back) cannot be told apart by time, so the later
+// one replaces the last version instead.
+static void addPriceVersion(POSSystem *system, int index, time_t since, Money price) {
+    PriceChain *chain;
+    PriceVersion *grown;
+    
+    reservePriceChains(system, index + 1);
+    chain = &system->price_chains[index];
+    if(chain->count > 0 && since <= chain->versions[chain->count - 1].since) {
+        chain->versions[chain->count - 1].price = price;
+        return;
+    }
+    if(chain->count == chain->capacity) {
+        grown = realloc(chain->versions, sizeof(PriceVersion) * (chain->capacity ? chain->capacity * 2 : 2));
+        if(grown == NULL) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        chain->versions = grown;
+        chain->capacity = chain->capacity ? chain->capacity * 2 : 2;
+    }
+    chain->versions[chain->count].since = since;
+    chain->versions[chain->count].price = price;
+    chain->count++;
+}
+
+// Gives product index a new price from when on. The old price stays in the
+// product's chain rather than being overwritten; a product from before price
+// history was kept first gets a version holding its old price.
+void setProductPrice(POSSystem *system, int index, Money price, time_t when) {
+    Product *product = &system->products[index];
+    
+    if(price == product->price) {
         return;
     }
+    if(index >= system->price_chain_capacity || system->price_chains[index].count == 0) {
+        addPriceVersion(system, index, 0, product->price);
+    }
+    addPriceVersion(system, index, when, price);
+    __atomic_store_n(&product->price, price, __ATOMIC_RELEASE); // registers may be reading it
+}
+
+// The price product index had at time when, found by binary search of its
+// chain, or -1 if it was not in the catalog yet.
+Money priceAt(POSSystem *system, int index, time_t when) {
+    PriceChain *chain;
+    int low = 0, high, middle;
+    
+    if(index >= system->price_chain_capacity || system->price_chains[index].count == 0) {
+        return system->products[index].price;
+    }
+    chain = &system->price_chains[index];
+    high = chain->count;
+    while(low < high) {
+        middle = low + (high - low) / 2;
+        if(chain->versions[middle].since <= when) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 ? chain->versions[low - 1].price : -1;
+}
+
+void takeSnapshot(POSSystem *system, time_t at, CatalogSnapshot *snapshot) {
+    snapshot->at = at;
+    snapshot->product_count = system->product_count;
+}
+
+// Copies product index as snapshot sees it. Returns 0 if it had not been
+// added yet at the snapshot's time.
+int snapshotProduct(POSSystem *system, const CatalogSnapshot *snapshot, int index, Product *product) {
+    Money price;
     
-    Product *product = &system->products[system->product_count];
+    if(index >= snapshot->product_count || (price = priceAt(system, index, snapshot->at)) < 0) {
+        return 0;
+    }
+    *product = system->products[index];
+    product->price = price;
+    return 1;
+}
+
+// Adds a product with the next free ID; returns 0 if the product file cannot grow.
+int insertProduct(POSSystem *system, Product *product) {
+    if(!reserveProducts(system, system->product_count + 1)) {
+        return 0;
+    }
+    product->id = system->product_count + 1;
+    system->products[system->product_count] = *product;
+    system->product_count++;
+    indexProductName(system, system->product_count - 1);
+    refreshLowStock(system, system->product_count - 1);
+    addPriceVersion(system, system->product_count - 1, time(NULL), product->price);
+    return 1;
+}
+
+void addProduct(POSSystem *system) {
+    Product product;
     
+    memset(&product, 0, sizeof(product));
     printf("\n=== ADD NEW PRODUCT ===\n");
-    product->id = system->product_count + 1;
     
     printf("Enter product name: ");
     getchar(); // Clear input buffer
-    fgets(product->name, MAX_NAME_LENGTH, stdin);
-    product->name[strcspn(product->name, "\n")] = 0; // Remove newline
+    fgets(product.name, MAX_NAME_LENGTH, stdin);
+    product.name[strcspn(product.name, "\n")] = 0; // Remove newline
     
     printf("Enter price: ");
-    scanf("%f", &product->price);
+    if(!scanMoney(&product.price)) {
+        printf("Invalid price! Product not added.\n");
+        return;
+    }
     
     printf("Enter quantity: ");
-    scanf("%d", &product->quantity);
+    scanf("%d", &product.quantity);
     
     printf("Enter minimum stock level: ");
-    scanf("%d", &product->min_stock_level);
+    scanf("%d", &product.min_stock_level);
     
-    system->product_count++;
-    printf("Product added successfully! ID: %d\n", product->id);
+    if(!insertProduct(system, &product)) {
+        printf("Cannot grow product file! Product not added.\n");
+        return;
+    }
+    printf("Product added successfully! ID: %d\n", product.id);
 }
 
 void viewProducts(POSSystem *system) {
+    Output out;
     int i;
-    printf("\n=== PRODUCT LIST ===\n");
-    printf("%-5s %-20s %-10s %-10s %-15s\n", 
-           "ID", "Name", "Price", "Quantity", "Min Stock");
-    printf("------------------------------------------------------------\n");
+    
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("\n=== PRODUCT LIST ===\n");
+        printf("%-5s %-20s %-10s %-10s %-15s\n", 
+               "ID", "Name", "Price", "Quantity", "Min Stock");
+        printf("------------------------------------------------------------\n");
+    }
     
     for(i = 0; i < system->product_count; i++) {
         Product *p = &system->products[i];
-        printf("%-5d %-20s $%-9.2f %-10d %-15d\n", 
-               p->id, p->name, p->price, p->quantity, p->min_stock_level);
+        if(out.json) {
+            outRecord(&out, "product");
+            outJsonInt(&out, "id", p->id);
+            outJsonText(&out, "name", p->name);
+            outJsonMoney(&out, "price", p->price);
+            outJsonInt(&out, "quantity", p->quantity);
+            outJsonInt(&out, "min_stock", p->min_stock_level);
+            outEndRecord(&out);
+            continue;
+        }
+        outInt(&out, p->id, 5);
+        outText(&out, " ");
+        outField(&out, p->name, 20);
+        outText(&out, " $");
+        outMoney(&out, p->price, 9);
+        outText(&out, " ");
+        outInt(&out, p->quantity, 10);
+        outText(&out, " ");
+        outInt(&out, p->min_stock_level, 15);
+        outText(&out, "\n");
     }
+    closeOutput(&out);
 }
 
 void updateProduct(POSSystem *system) {
+    char price[MONEY_TEXT_LENGTH];
     int id, choice;
+    Money new_price;
     printf("Enter product ID to update: ");
     scanf("%d", &id);
     
@@ -188,7 +1069,7 @@ void updateProduct(POSSystem *system) {
     
     printf("\nCurrent details:\n");
     printf("Name: %s\n", product->name);
-    printf("Price: $%.2f\n", product->price);
+    printf("Price: $%s\n", formatMoney(product->price, price));
     printf("Quantity: %d\n", product->quantity);
     printf("Min Stock: %d\n", product->min_stock_level);
     
@@ -196,21 +1077,36 @@ void updateProduct(POSSystem *system) {
     printf("1. Price\n");
     printf("2. Quantity\n");
     printf("3. Minimum Stock Level\n");
+    printf("4. Name\n");
     printf("Enter choice: ");
     scanf("%d", &choice);
     
     switch(choice) {
         case 1:
             printf("Enter new price: ");
-            scanf("%f", &product->price);
+            if(!scanMoney(&new_price)) {
+                printf("Invalid price!\n");
+                return;
+            }
+            setProductPrice(system, index, new_price, time(NULL));
             break;
         case 2:
             printf("Enter new quantity: ");
             scanf("%d", &product->quantity);
+            refreshLowStock(system, index);
             break;
         case 3:
             printf("Enter new minimum stock level: ");
             scanf("%d", &product->min_stock_level);
+            refreshLowStock(system, index);
+            break;
+        case 4:
+            printf("Enter new name: ");
+            getchar(); // Clear input buffer
+            unindexProductName(system, index);
+            fgets(product->name, MAX_NAME_LENGTH, stdin);
+            product->name[strcspn(product->name, "\n")] = 0; // Remove newline
+            indexProductName(system, index);
             break;
         default:
             printf("Invalid choice!\n");
@@ -220,127 +1116,612 @@ void updateProduct(POSSystem *system) {
     printf("Product updated successfully!\n");
 }
 
-void processSale(POSSystem *system) {
-    if(system->product_count == 0) {
-        printf("No products available for sale!\n");
-        return;
-    }
+// Reads "YYYY-MM-DD" as the last second of that local day, so a price set at
+// any time that day counts; "0" means now.
+static int parseDayEnd(const char *text, time_t *at) {
+    struct tm date;
     
-    Sale current_sales[MAX_PRODUCTS];
-    int sale_items = 0;
-    float total_amount = 0.0;
-    char continue_sale;
+    memset(&date, 0, sizeof(date));
+    if(strcmp(text, "0") == 0) {
+        *at = time(NULL);
+        return 1;
+    }
+    if(sscanf(text, "%d-%d-%d", &date.tm_year, &date.tm_mon, &date.tm_mday) != 3 || date.tm_mon < 1 ||
+       date.tm_mon > 12 || date.tm_mday < 1 || date.tm_mday > 31) {
+        return 0;
+    }
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    date.tm_mday += 1;
+    date.tm_isdst = -1;
+    *at = mktime(&date) - 1;
+    return 1;
+}
+
+// Shows one product's price chain and its price on a given day, or the whole
+// catalog as it was priced that day.
+void viewPriceHistory(POSSystem *system) {
+    char text[16], day[11];
+    int id, index, i;
+    CatalogSnapshot snapshot;
+    Product product;
+    PriceChain *chain;
+    Output out;
+    time_t at;
     
-    printf("\n=== PROCESS SALE ===\n");
+    printf("\n=== PRICE HISTORY ===\n");
+    printf("Enter product ID (0 for the whole catalog): ");
+    scanf("%d", &id);
+    printf("Enter date as YYYY-MM-DD (0 for now): ");
+    scanf("%15s", text);
+    if(!parseDayEnd(text, &at)) {
+        printf("Invalid date!\n");
+        return;
+    }
+    formatDay(dayNumber(at), day);
+    takeSnapshot(system, at, &snapshot);
     
-    do {
-        int product_id, quantity;
-        int index;
-        
-        viewProducts(system);
-        printf("\nEnter product ID: ");
-        scanf("%d", &product_id);
-        
-        index = findProductById(system, product_id);
-        if(index == -1) {
-            printf("Product not found!\n");
-            continue;
+    openOutput(&out, stdout);
+    if(id == 0) {
+        if(!out.json) {
+            printf("\nCatalog prices on %s\n", day);
+            printf("%-5s %-20s %-10s %-10s\n", "ID", "Name", "Then", "Now");
+            printf("------------------------------------------------\n");
         }
-        
-        Product *product = &system->products[index];
-        printf("Enter quantity: ");
-        scanf("%d", &quantity);
-        
-        if(quantity > product->quantity) {
-            printf("Insufficient stock! Available: %d\n", product->quantity);
-            continue;
+        for(i = 0; i < system->product_count; i++) {
+            if(!snapshotProduct(system, &snapshot, i, &product)) {
+                continue;
+            }
+            if(out.json) {
+                outRecord(&out, "price");
+                outJsonInt(&out, "id", product.id);
+                outJsonText(&out, "name", product.name);
+                outJsonText(&out, "day", day);
+                outJsonMoney(&out, "price", product.price);
+                outJsonMoney(&out, "current_price", system->products[i].price);
+                outEndRecord(&out);
+                continue;
+            }
+            outInt(&out, product.id, 5);
+            outText(&out, " ");
+            outField(&out, product.name, 20);
+            outText(&out, " $");
+            outMoney(&out, product.price, 9);
+            outText(&out, " $");
+            outMoney(&out, system->products[i].price, 9);
+            outText(&out, "\n");
         }
-        
-        // Add to current sale
-        Sale *sale = &current_sales[sale_items];
-        sale->id = system->sale_count + sale_items + 1;
-        sale->product_id = product_id;
-        strcpy(sale->product_name, product->name);
-        sale->quantity = quantity;
-        sale->price = product->price;
-        sale->total = quantity * product->price;
-        sale->timestamp = time(NULL);
-        
-        // Update product quantity
-        product->quantity -= quantity;
-        
-        total_amount += sale->total;
-        sale_items++;
-        
-        printf("Added: %s x %d = $%.2f\n", product->name, quantity, sale->total);
-        
-        printf("Add another product? (y/n): ");
-        scanf(" %c", &continue_sale);
-        
-    } while((continue_sale == 'y' || continue_sale == 'Y') && sale_items < MAX_PRODUCTS);
+        closeOutput(&out);
+        return;
+    }
     
-    if(sale_items > 0) {
-        // Print receipt
-        printReceipt(current_sales, sale_items, total_amount);
-        
-        // Save sales to system
-        int i;
-        for(i = 0; i < sale_items; i++) {
-            if(system->sale_count < MAX_SALES) {
-                system->sales[system->sale_count] = current_sales[i];
-                system->sale_count++;
+    index = findProductById(system, id);
+    if(index == -1) {
+        closeOutput(&out);
+        printf("Product not found!\n");
+        return;
+    }
+    chain = index < system->price_chain_capacity ? &system->price_chains[index] : NULL;
+    if(out.json) {
+        for(i = 0; chain != NULL && i < chain->count; i++) {
+            outRecord(&out, "price_version");
+            outJsonInt(&out, "id", id);
+            outJsonInt(&out, "since", chain->versions[i].since);
+            outJsonMoney(&out, "price", chain->versions[i].price);
+            outEndRecord(&out);
+        }
+        if(snapshotProduct(system, &snapshot, index, &product)) {
+            outRecord(&out, "price");
+            outJsonInt(&out, "id", id);
+            outJsonText(&out, "name", product.name);
+            outJsonText(&out, "day", day);
+            outJsonMoney(&out, "price", product.price);
+            outEndRecord(&out);
+        }
+    } else {
+        outText(&out, "\n");
+        outText(&out, system->products[index].name);
+        outText(&out, "\n");
+        for(i = 0; chain != NULL && i < chain->count; i++) {
+            outText(&out, "  $");
+            outMoney(&out, chain->versions[i].price, 9);
+            outText(&out, chain->versions[i].since ? "  from " : "  from before price history was kept\n");
+            if(chain->versions[i].since) {
+                outDate(&out, chain->versions[i].since);
             }
         }
-        
-        system->daily_revenue += total_amount;
-        printf("Sale completed! Total: $%.2f\n", total_amount);
+        if(snapshotProduct(system, &snapshot, index, &product)) {
+            outText(&out, "Price on ");
+            outText(&out, day);
+            outText(&out, ": $");
+            outMoney(&out, product.price, 0);
+            outText(&out, "\n");
+        } else {
+            outText(&out, "Not in the catalog yet on ");
+            outText(&out, day);
+            outText(&out, "\n");
+        }
     }
+    closeOutput(&out);
+}
+
+// Fills in one line item for quantity units of product at its current price and
+// takes the units out of stock. sequence is the line's position in the sale.
+static void fillSale(POSSystem *system, Sale *sale, Product *product, int quantity, int sequence, time_t when) {
+    sale->id = system->sale_count + sequence + 1;
+    sale->product_id = product->id;
+    memcpy(sale->product_name, product->name, MAX_NAME_LENGTH);
+    sale->quantity = quantity;
+    sale->price = product->price;
+    sale->total = quantity * product->price;
+    sale->timestamp = when;
+    product->quantity -= quantity;
 }
 
-void printReceipt(Sale *sales, int count, float total) {
+void initBasket(Basket *basket) {
+    memset(basket, 0, sizeof(*basket));
+    basket->short_line = -1;
+}
+
+// Empties basket for the next sale, keeping its memory.
+void clearBasket(Basket *basket) {
     int i;
-    printf("\n=== RECEIPT ===\n");
-    printf("%-20s %-10s %-10s %-10s\n", "Product", "Qty", "Price", "Total");
-    printf("--------------------------------------------------\n");
     
-    for(i = 0; i < count; i++) {
-        printf("%-20s %-10d $%-9.2f $%-9.2f\n", 
-               sales[i].product_name, sales[i].quantity, 
-               sales[i].price, sales[i].total);
+    for(i = 0; i < basket->count; i++) {
+        unsigned mask = (unsigned)basket->slot_capacity - 1, slot = ((unsigned)basket->lines[i].index * 2654435761u) & mask;
+        while(basket->slots[slot] != -1) {
+            basket->slots[slot] = -1; // cheaper than clearing the whole table
+            slot = (slot + 1) & mask;
+        }
+    }
+    basket->count = 0;
+    basket->total = 0;
+    basket->short_line = -1;
+}
+
+void freeBasket(Basket *basket) {
+    free(basket->lines);
+    free(basket->slots);
+    free(basket->sales);
+    initBasket(basket);
+}
+
+// Returns the slot of product index's line, or the empty slot where it would go.
+static unsigned basketSlot(Basket *basket, int index) {
+    unsigned mask = (unsigned)basket->slot_capacity - 1, slot = ((unsigned)index * 2654435761u) & mask;
+    
+    while(basket->slots[slot] != -1 && basket->lines[basket->slots[slot]].index != index) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Units of product index in basket so far.
+int basketQuantity(Basket *basket, int index) {
+    int line;
+    
+    if(basket->slot_capacity == 0) {
+        return 0;
+    }
+    line = basket->slots[basketSlot(basket, index)];
+    return line == -1 ? 0 : basket->lines[line].quantity;
+}
+
+// Adds quantity units of product index, on its existing line if it has one.
+// Nothing is checked against stock yet. Returns 0 if quantity is not positive
+// or the line would overflow.
+int addToBasket(Basket *basket, int index, int quantity) {
+    unsigned slot;
+    int i;
+    
+    if(quantity <= 0) {
+        return 0;
+    }
+    if((basket->count + 1) * 2 > basket->slot_capacity) {
+        int capacity = basket->slot_capacity ? basket->slot_capacity * 2 : 16;
+        int *slots = malloc(sizeof(int) * capacity);
+        if(slots == NULL) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        free(basket->slots);
+        basket->slots = slots;
+        basket->slot_capacity = capacity;
+        memset(slots, -1, sizeof(int) * capacity);
+        for(i = 0; i < basket->count; i++) {
+            basket->slots[basketSlot(basket, basket->lines[i].index)] = i;
+        }
+    }
+    slot = basketSlot(basket, index);
+    if(basket->slots[slot] != -1) {
+        BasketLine *line = &basket->lines[basket->slots[slot]];
+        if(line->quantity > INT_MAX - quantity) {
+            return 0;
+        }
+        line->quantity += quantity;
+        return 1;
+    }
+    if(basket->count == basket->capacity) {
+        basket->lines = growArray(basket->lines, &basket->capacity, sizeof(BasketLine));
+    }
+    basket->lines[basket->count].index = index;
+    basket->lines[basket->count].quantity = quantity;
+    basket->slots[slot] = basket->count++;
+    return 1;
+}
+
+// Sells everything in basket as one sale. Every line's stock is checked first,
+// in one pass; only if all of it is there are the stock taken, the lines
+// appended to the history and the rollups updated, all together. Otherwise
+// nothing changes and basket->short_line is the line that could not be
+// filled. On success basket->sales holds the lines as sold. Returns 1 if the
+// sale went through.
+int commitBasket(POSSystem *system, Basket *basket) {
+    STAT_BEGIN(t0);
+    time_t now = time(NULL);
+    int i;
+    
+    basket->total = 0;
+    basket->short_line = -1;
+    for(i = 0; i < basket->count; i++) {
+        if(basket->lines[i].quantity > system->products[basket->lines[i].index].quantity) {
+            basket->short_line = i;
+            return 0;
+        }
+    }
+    while(basket->sale_capacity < basket->count) {
+        basket->sales = growArray(basket->sales, &basket->sale_capacity, sizeof(Sale));
+    }
+    
+    for(i = 0; i < basket->count; i++) {
+        fillSale(system, &basket->sales[i], &system->products[basket->lines[i].index], basket->lines[i].quantity, i,
+                 now);
+        basket->total += basket->sales[i].total;
+    }
+    for(i = 0; i < basket->count; i++) {
+        appendSale(system, &basket->sales[i]);
+        addToRollups(system, &basket->sales[i]);
+        refreshLowStock(system, basket->lines[i].index);
+    }
+    system->daily_revenue += basket->total;
+    STAT_END(STAT_SALE, t0, 0);
+    return 1;
+}
+
+void processSale(POSSystem *system) {
+    if(system->product_count == 0) {
+        printf("No products available for sale!\n");
+        return;
+    }
+    
+    Basket basket;
+    char continue_sale = 'y', amount[MONEY_TEXT_LENGTH];
+    
+    initBasket(&basket);
+    printf("\n=== PROCESS SALE ===\n");
+    viewProducts(system);
+    
+    do {
+        int product_id, quantity;
+        int index;
+        
+        printf("\nEnter product ID: ");
+        scanf("%d", &product_id);
+        
+        index = findProductById(system, product_id);
+        if(index == -1) {
+            printf("Product not found!\n");
+            continue;
+        }
+        
+        Product *product = &system->products[index];
+        printf("Enter quantity: ");
+        scanf("%d", &quantity);
+        
+        // only a warning here: stock is checked again, and taken, when the sale commits
+        if(quantity > product->quantity - basketQuantity(&basket, index)) {
+            printf("Insufficient stock! Available: %d\n", product->quantity - basketQuantity(&basket, index));
+            continue;
+        }
+        if(!addToBasket(&basket, index, quantity)) {
+            printf("Invalid quantity!\n");
+            continue;
+        }
+        
+        printf("Added: %s x %d = $%s\n", product->name, quantity, formatMoney(quantity * product->price, amount));
+        
+        printf("Add another product? (y/n, c to cancel the sale): ");
+        scanf(" %c", &continue_sale);
+        
+    } while(continue_sale == 'y' || continue_sale == 'Y');
+    
+    if(continue_sale == 'c' || continue_sale == 'C') {
+        printf("Sale cancelled.\n");
+    } else if(basket.count > 0) {
+        if(!commitBasket(system, &basket)) {
+            printf("Insufficient stock for %s! Sale cancelled.\n",
+                   system->products[basket.lines[basket.short_line].index].name);
+        } else {
+            printReceipt(basket.sales, basket.count, basket.total);
+            printf("Sale completed! Total: $%s\n", formatMoney(basket.total, amount));
+        }
+    }
+    freeBasket(&basket);
+}
+
+void printReceipt(Sale *sales, int count, Money total) {
+    Output out;
+    int i;
+    
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("\n=== RECEIPT ===\n");
+        printf("%-20s %-10s %-10s %-10s\n", "Product", "Qty", "Price", "Total");
+        printf("--------------------------------------------------\n");
+    }
+    
+    for(i = 0; i < count; i++) {
+        if(out.json) {
+            outRecord(&out, "receipt_line");
+            outJsonInt(&out, "product_id", sales[i].product_id);
+            outJsonText(&out, "product", sales[i].product_name);
+            outJsonInt(&out, "quantity", sales[i].quantity);
+            outJsonMoney(&out, "price", sales[i].price);
+            outJsonMoney(&out, "total", sales[i].total);
+            outEndRecord(&out);
+            continue;
+        }
+        outField(&out, sales[i].product_name, 20);
+        outText(&out, " ");
+        outInt(&out, sales[i].quantity, 10);
+        outText(&out, " $");
+        outMoney(&out, sales[i].price, 9);
+        outText(&out, " $");
+        outMoney(&out, sales[i].total, 9);
+        outText(&out, "\n");
     }
     
-    printf("--------------------------------------------------\n");
-    printf("%-20s $%-30.2f\n", "TOTAL:", total);
-    printf("Thank you for your business!\n");
-    printf("Date: %s", ctime(&sales[0].timestamp));
+    if(out.json) {
+        outRecord(&out, "receipt");
+        outJsonInt(&out, "items", count);
+        outJsonMoney(&out, "total", total);
+        outJsonInt(&out, "timestamp", sales[0].timestamp);
+        outEndRecord(&out);
+    } else {
+        outText(&out, "--------------------------------------------------\n");
+        outField(&out, "TOTAL:", 20);
+        outText(&out, " $");
+        outMoney(&out, total, 30);
+        outText(&out, "\nThank you for your business!\nDate: ");
+        outDate(&out, sales[0].timestamp);
+    }
+    closeOutput(&out);
 }
 
 void viewDailyRevenue(POSSystem *system) {
     printf("\n=== DAILY REVENUE ===\n");
     
-    // Calculate today's revenue from sales
-    time_t now = time(NULL);
-    struct tm *today = localtime(&now);
-    float today_revenue = 0.0;
-    int today_sales = 0;
+    // Read today's and recent totals from the rollups
+    int today = dayNumber(time(NULL));
+    int today_sales, week_sales, month_sales;
+    Money today_revenue = rollupRevenue(system, today, today, &today_sales);
+    Money week_revenue = rollupRevenue(system, today - 6, today, &week_sales);
+    Money month_revenue = rollupRevenue(system, today - 29, today, &month_sales);
+    char amount[MONEY_TEXT_LENGTH];
+    
+    printf("Today's Sales: %d\n", today_sales);
+    printf("Today's Revenue: $%s\n", formatMoney(today_revenue, amount));
+    printf("Last 7 Days: %d sales, $%s\n", week_sales, formatMoney(week_revenue, amount));
+    printf("Last 30 Days: %d sales, $%s\n", month_sales, formatMoney(month_revenue, amount));
+    printf("Total Revenue (All Time): $%s\n", formatMoney(system->daily_revenue, amount));
+}
+
+// One row of the sales listing.
+static void outSale(Output *out, Sale *s) {
+    if(out->json) {
+        outRecord(out, "sale");
+        outJsonInt(out, "id", s->id);
+        outJsonInt(out, "product_id", s->product_id);
+        outJsonText(out, "product", s->product_name);
+        outJsonInt(out, "quantity", s->quantity);
+        outJsonMoney(out, "price", s->price);
+        outJsonMoney(out, "total", s->total);
+        outJsonInt(out, "timestamp", s->timestamp);
+        outEndRecord(out);
+        return;
+    }
+    outInt(out, s->id, 5);
+    outText(out, " ");
+    outField(out, s->product_name, 20);
+    outText(out, " ");
+    outInt(out, s->quantity, 10);
+    outText(out, " $");
+    outMoney(out, s->price, 9);
+    outText(out, " $");
+    outMoney(out, s->total, 14);
+    outText(out, " ");
+    outDate(out, s->timestamp);
+}
+
+// Lists every sale in the order it was made.
+void listAllSales(POSSystem *system) {
+    Output out;
+    Money revenue = revenueInRange(system, 0, LLONG_MAX);
     int i;
     
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("%-5s %-20s %-10s %-10s %-15s %-20s\n", 
+               "ID", "Product", "Qty", "Price", "Total", "Date");
+        printf("----------------------------------------------------------------------------\n");
+    }
+    
     for(i = 0; i < system->sale_count; i++) {
-        struct tm *sale_date = localtime(&system->sales[i].timestamp);
-        if(sale_date->tm_year == today->tm_year &&
-           sale_date->tm_mon == today->tm_mon &&
-           sale_date->tm_mday == today->tm_mday) {
-            today_revenue += system->sales[i].total;
-            today_sales++;
+        Sale s;
+        getSale(system, i, &s);
+        outSale(&out, &s);
+    }
+    
+    if(out.json) {
+        outRecord(&out, "sales_total");
+        outJsonInt(&out, "sales", system->sale_count);
+        outJsonMoney(&out, "revenue", revenue);
+        outEndRecord(&out);
+    } else {
+        outText(&out, "\nTotal Sales: ");
+        outInt(&out, system->sale_count, 0);
+        outText(&out, "\nTotal Revenue: $");
+        outMoney(&out, revenue, 0);
+        outText(&out, "\n");
+    }
+    closeOutput(&out);
+}
+
+static void printTopProducts(POSSystem *system, int from_day, int to_day, int by, int n) {
+    ProductTotal *top;
+    Output out;
+    int i, count, index;
+    const char *name;
+    
+    if(n < 1 || n > REPORT_MAX_TOP) {
+        n = n < 1 ? 1 : REPORT_MAX_TOP;
+    }
+    top = malloc(sizeof(ProductTotal) * n);
+    if(top == NULL) {
+        printf("Out of memory!\n");
+        return;
+    }
+    count = topProducts(system, from_day, to_day, by, top, n);
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("%-5s %-5s %-20s %-10s %-15s\n", "Rank", "ID", "Product", "Qty", "Revenue");
+        printf("------------------------------------------------------------\n");
+    }
+    for(i = 0; i < count; i++) {
+        index = findProductById(system, top[i].product_id);
+        name = index >= 0 ? system->products[index].name : "(deleted)";
+        if(out.json) {
+            outRecord(&out, "top");
+            outJsonInt(&out, "rank", i + 1);
+            outJsonInt(&out, "product_id", top[i].product_id);
+            outJsonText(&out, "product", name);
+            outJsonInt(&out, "quantity", top[i].quantity);
+            outJsonMoney(&out, "revenue", top[i].revenue);
+            outEndRecord(&out);
+            continue;
         }
+        outInt(&out, i + 1, 5);
+        outText(&out, " ");
+        outInt(&out, top[i].product_id, 5);
+        outText(&out, " ");
+        outField(&out, name, 20);
+        outText(&out, " ");
+        outInt(&out, top[i].quantity, 10);
+        outText(&out, " $");
+        outMoney(&out, top[i].revenue, 14);
+        outText(&out, "\n");
+    }
+    if(count == 0 && !out.json) {
+        outText(&out, "No sales in this range.\n");
     }
+    closeOutput(&out);
+    free(top);
+}
+
+static void printDailyBreakdown(POSSystem *system, int from_day, int to_day) {
+    Output out;
+    DailyRollup *rollup;
+    int i;
+    char day[16];
     
-    printf("Today's Sales: %d\n", today_sales);
-    printf("Today's Revenue: $%.2f\n", today_revenue);
-    printf("Total Revenue (All Time): $%.2f\n", system->daily_revenue);
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("%-12s %-8s %-10s %-15s\n", "Date", "Sales", "Qty", "Revenue");
+        printf("------------------------------------------------\n");
+    }
+    for(i = firstDayAtOrAfter(system, from_day); i < system->day_count && system->days[i].day <= to_day; i++) {
+        rollup = &system->days[i];
+        formatDay(rollup->day, day);
+        if(out.json) {
+            outRecord(&out, "day");
+            outJsonText(&out, "date", day);
+            outJsonInt(&out, "sales", rollup->sales);
+            outJsonInt(&out, "quantity", rollup->quantity);
+            outJsonMoney(&out, "revenue", rollup->revenue);
+            outEndRecord(&out);
+            continue;
+        }
+        outField(&out, day, 12);
+        outText(&out, " ");
+        outInt(&out, rollup->sales, 8);
+        outText(&out, " ");
+        outInt(&out, rollup->quantity, 10);
+        outText(&out, " $");
+        outMoney(&out, rollup->revenue, 14);
+        outText(&out, "\n");
+    }
+    closeOutput(&out);
+}
+
+// One product's sales per day: a hash probe per day that had any sales.
+static void printProductHistory(POSSystem *system, int product_id, int from_day, int to_day) {
+    int i;
+    long long quantity = 0;
+    Money revenue = 0;
+    ProductDayRollup *entry;
+    Output out;
+    char day[16];
+    
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("%-12s %-10s %-15s\n", "Date", "Qty", "Revenue");
+        printf("------------------------------------\n");
+    }
+    for(i = firstDayAtOrAfter(system, from_day); i < system->day_count && system->days[i].day <= to_day; i++) {
+        entry = findProductDay(system, system->days[i].day, product_id);
+        if(entry == NULL) {
+            continue;
+        }
+        formatDay(entry->day, day);
+        quantity += entry->quantity;
+        revenue += entry->revenue;
+        if(out.json) {
+            outRecord(&out, "product_day");
+            outJsonText(&out, "date", day);
+            outJsonInt(&out, "product_id", product_id);
+            outJsonInt(&out, "quantity", entry->quantity);
+            outJsonMoney(&out, "revenue", entry->revenue);
+            outEndRecord(&out);
+            continue;
+        }
+        outField(&out, day, 12);
+        outText(&out, " ");
+        outInt(&out, entry->quantity, 10);
+        outText(&out, " $");
+        outMoney(&out, entry->revenue, 14);
+        outText(&out, "\n");
+    }
+    if(out.json) {
+        outRecord(&out, "product_total");
+        outJsonInt(&out, "product_id", product_id);
+        outJsonInt(&out, "quantity", quantity);
+        outJsonMoney(&out, "revenue", revenue);
+        outEndRecord(&out);
+    } else {
+        outText(&out, "------------------------------------\n");
+        outField(&out, "Total", 12);
+        outText(&out, " ");
+        outInt(&out, quantity, 10);
+        outText(&out, " $");
+        outMoney(&out, revenue, 14);
+        outText(&out, "\n");
+    }
+    closeOutput(&out);
 }
 
 void generateSalesReport(POSSystem *system) {
+    int report, days, n = 10, id = 0, from_day, to_day;
+    
     printf("\n=== SALES REPORT ===\n");
     
     if(system->sale_count == 0) {
@@ -348,112 +1729,4870 @@ void generateSalesReport(POSSystem *system) {
         return;
     }
     
-    int i;
-    printf("%-5s %-20s %-10s %-10s %-15s %-20s\n", 
-           "ID", "Product", "Qty", "Price", "Total", "Date");
-    printf("----------------------------------------------------------------------------\n");
-    
-    for(i = 0; i < system->sale_count; i++) {
-        Sale *s = &system->sales[i];
-        printf("%-5d %-20s %-10d $%-9.2f $%-14.2f %s", 
-               s->id, s->product_name, s->quantity, s->price, 
-               s->total, ctime(&s->timestamp));
+    printf("1. All sales\n");
+    printf("2. Best sellers by quantity\n");
+    printf("3. Best sellers by revenue\n");
+    printf("4. Daily breakdown\n");
+    printf("5. Product history\n");
+    printf("Choose report: ");
+    scanf("%d", &report);
+    if(report == 1) {
+        listAllSales(system);
+        return;
+    }
+    if(report < 2 || report > 5) {
+        printf("Invalid report!\n");
+        return;
+    }
+    if(report == 5) {
+        printf("Enter product ID: ");
+        scanf("%d", &id);
+    }
+    printf("Enter number of days (0 for all time): ");
+    scanf("%d", &days);
+    if(report == 2 || report == 3) {
+        printf("How many products: ");
+        scanf("%d", &n);
     }
     
-    printf("\nTotal Sales: %d\n", system->sale_count);
-    printf("Total Revenue: $%.2f\n", system->daily_revenue);
+    STAT_BEGIN(t0);
+    to_day = dayNumber(time(NULL));
+    from_day = days > 0 ? to_day - (days - 1) : INT_MIN;
+    if(days <= 0) {
+        to_day = INT_MAX;
+    }
+    printf("\n");
+    switch(report) {
+        case 2:
+            printTopProducts(system, from_day, to_day, RANK_BY_QUANTITY, n);
+            break;
+        case 3:
+            printTopProducts(system, from_day, to_day, RANK_BY_REVENUE, n);
+            break;
+        case 4:
+            printDailyBreakdown(system, from_day, to_day);
+            break;
+        case 5:
+            printProductHistory(system, id, from_day, to_day);
+            break;
+    }
+    STAT_END(STAT_REPORT, t0, 0);
 }
 
 void checkLowStock(POSSystem *system) {
     printf("\n=== LOW STOCK ALERTS ===\n");
     
-    int low_stock_count = 0;
-    int i;
+    int word, bit;
+    unsigned long long bits;
     
-    for(i = 0; i < system->product_count; i++) {
-        Product *p = &system->products[i];
-        if(p->quantity <= p->min_stock_level) {
+    // Only the words of the low-stock bitmap that have a bit set are looked at
+    for(word = 0; word < system->low_stock_words; word++) {
+        for(bits = system->low_stock[word]; bits != 0; bits &= bits - 1) {
+            bit = __builtin_ctzll(bits);
+            Product *p = &system->products[word * 64 + bit];
             printf("ALERT: %s (ID: %d) - Stock: %d, Min: %d\n", 
                    p->name, p->id, p->quantity, p->min_stock_level);
-            low_stock_count++;
         }
     }
     
-    if(low_stock_count == 0) {
+    if(system->low_stock_count == 0) {
         printf("All products have sufficient stock.\n");
     } else {
-        printf("Total products with low stock: %d\n", low_stock_count);
+        printf("Total products with low stock: %d\n", system->low_stock_count);
     }
 }
 
-int findProductById(POSSystem *system, int id) {
+// Makes the low-stock bitmap cover count products; new bits start clear.
+static void reserveLowStock(POSSystem *system, int count) {
+    int words = system->low_stock_words ? system->low_stock_words : 4;
+    unsigned long long *grown;
+    
+    if(count <= system->low_stock_words * 64) {
+        return;
+    }
+    while(words * 64 < count) {
+        words *= 2;
+    }
+    grown = realloc(system->low_stock, sizeof(unsigned long long) * words);
+    if(grown == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    memset(grown + system->low_stock_words, 0, sizeof(unsigned long long) * (words - system->low_stock_words));
+    system->low_stock = grown;
+    system->low_stock_words = words;
+}
+
+// Brings product index's low-stock bit in line with its stock, and reports the
+// crossing if the bit changed. Call after every change to a product's quantity
+// or minimum. Registers may call this concurrently: the bit is flipped
+// atomically, so each crossing is reported once, and the check is repeated
+// until no other register has moved the stock across the level meanwhile.
+void refreshLowStock(POSSystem *system, int index) {
+    Product *product = &system->products[index];
+    unsigned long long *word, bit = 1ULL << (index % 64), old;
+    int low;
+    
+    reserveLowStock(system, index + 1);
+    word = &system->low_stock[index / 64];
+    do {
+        low = __atomic_load_n(&product->quantity, __ATOMIC_ACQUIRE) <= product->min_stock_level;
+        if(low) {
+            old = __atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL);
+        } else {
+            old = __atomic_fetch_and(word, ~bit, __ATOMIC_ACQ_REL);
+        }
+        if(((old & bit) != 0) != low) {
+            __atomic_add_fetch(&system->low_stock_count, low ? 1 : -1, __ATOMIC_RELAXED);
+            if(system->low_stock_alert != NULL) {
+                system->low_stock_alert(product, low);
+            }
+        }
+    } while((__atomic_load_n(&product->quantity, __ATOMIC_ACQUIRE) <= product->min_stock_level) != low);
+}
+
+// Sets the bitmap from scratch for all products, without reporting crossings.
+void buildLowStock(POSSystem *system) {
     int i;
+    
+    reserveLowStock(system, system->product_count);
+    memset(system->low_stock, 0, sizeof(unsigned long long) * system->low_stock_words);
+    system->low_stock_count = 0;
     for(i = 0; i < system->product_count; i++) {
-        if(system->products[i].id == id) {
-            return i;
+        if(system->products[i].quantity <= system->products[i].min_stock_level) {
+            system->low_stock[i / 64] |= 1ULL << (i % 64);
+            system->low_stock_count++;
         }
     }
-    return -1;
 }
 
-int findProductByName(POSSystem *system, const char *name) {
+void printLowStockAlert(Product *product, int low) {
+    if(low) {
+        printf("LOW STOCK: %s (ID: %d) is down to %d, minimum %d\n", 
+               product->name, product->id, product->quantity, product->min_stock_level);
+    }
+}
+
+int findProductById(POSSystem *system, int id) {
     int i;
+    // IDs are handed out in order, so product id normally sits at index id - 1
+    if(id >= 1 && id <= system->product_count && system->products[id - 1].id == id) {
+        return id - 1;
+    }
     for(i = 0; i < system->product_count; i++) {
-        if(strcmp(system->products[i].name, name) == 0) {
+        if(system->products[i].id == id) {
             return i;
         }
     }
     return -1;
 }
 
-void saveProducts(POSSystem *system) {
-    FILE *file = fopen(FILENAME_PRODUCTS, "wb");
-    if(file == NULL) {
-        printf("Error saving products!\n");
-        return;
+// Days since 1970-01-01 of the local calendar date of t. Time zone offsets and
+// DST changes fall on 15-minute boundaries, so the answer is reused for any t
+// in the same 15-minute slot instead of calling localtime_r() again.
+int dayNumber(time_t t) {
+    static __thread time_t cached_slot = -1;
+    static __thread int cached_day;
+    struct tm date;
+    int y, m, d, era, yoe, doy, doe;
+    
+    if(t >= 0 && t / 900 == cached_slot) {
+        return cached_day;
     }
+    localtime_r(&t, &date);
+    y = date.tm_year + 1900;
+    m = date.tm_mon + 1;
+    d = date.tm_mday;
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    cached_slot = t >= 0 ? t / 900 : -1;
+    cached_day = era * 146097 + doe - 719468;
+    return cached_day;
+}
+
+// Writes a day number as YYYY-MM-DD (text holds at least 11 bytes); the inverse
+// of the calendar arithmetic in dayNumber().
+void formatDay(int day, char *text) {
+    int z = day + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    int d = doy - (153 * mp + 2) / 5 + 1;
+    int m = mp + (mp < 10 ? 3 : -9);
     
-    fwrite(&system->product_count, sizeof(int), 1, file);
-    fwrite(system->products, sizeof(Product), system->product_count, file);
-    fclose(file);
+    sprintf(text, "%04d-%02d-%02d", yoe + era * 400 + (m <= 2), m, d);
 }
 
-void loadProducts(POSSystem *system) {
-    FILE *file = fopen(FILENAME_PRODUCTS, "rb");
-    if(file == NULL) {
-        printf("No previous product data found. Starting fresh.\n");
+// The buffer every Output renders into; listings never overlap, so one is
+// allocated on first use and reused from then on.
+static char *output_buffer;
+
+void openOutput(Output *out, FILE *stream) {
+    const char *mode = getenv("POS_OUTPUT");
+    
+    if(output_buffer == NULL) {
+        output_buffer = malloc(OUTPUT_BUFFER_SIZE);
+        if(output_buffer == NULL) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+    }
+    out->stream = stream;
+    out->buffer = output_buffer;
+    out->length = 0;
+    out->json = mode != NULL && strcmp(mode, "json") == 0;
+    out->date_slot = -1;
+}
+
+// Hands what has been rendered so far to stdio in one write, which keeps it in
+// order with anything printed through printf() around the listing.
+void flushOutput(Output *out) {
+    if(out->length > 0) {
+        fwrite(out->buffer, 1, out->length, out->stream);
+        out->length = 0;
+    }
+}
+
+void closeOutput(Output *out) {
+    flushOutput(out);
+}
+
+// Returns room for size more bytes (at most OUTPUT_BUFFER_SIZE), flushing first
+// if the buffer is too full.
+static char *outReserve(Output *out, size_t size) {
+    if(out->length + size > OUTPUT_BUFFER_SIZE) {
+        flushOutput(out);
+    }
+    return out->buffer + out->length;
+}
+
+static void outBytes(Output *out, const char *text, size_t size) {
+    if(size > OUTPUT_BUFFER_SIZE) {
+        flushOutput(out);
+        fwrite(text, 1, size, out->stream);
         return;
     }
+    memcpy(outReserve(out, size), text, size);
+    out->length += size;
+}
+
+static void outPad(Output *out, size_t size) {
+    memset(outReserve(out, size), ' ', size);
+    out->length += size;
+}
+
+void outText(Output *out, const char *text) {
+    outBytes(out, text, strlen(text));
+}
+
+// Writes text left-aligned in a field at least width wide, like "%-*s".
+void outField(Output *out, const char *text, int width) {
+    size_t size = strlen(text);
     
-    fread(&system->product_count, sizeof(int), 1, file);
-    fread(system->products, sizeof(Product), system->product_count, file);
-    fclose(file);
-    printf("Loaded %d products.\n", system->product_count);
+    outBytes(out, text, size);
+    if(width > 0 && (size_t)width > size) {
+        outPad(out, width - size);
+    }
 }
 
-void saveSales(POSSystem *system) {
-    FILE *file = fopen(FILENAME_SALES, "wb");
-    if(file == NULL) {
-        printf("Error saving sales!\n");
-        return;
+// Writes value left-aligned in a field at least width wide, like "%-*lld",
+// converting the digits directly instead of going through printf().
+void outInt(Output *out, long long value, int width) {
+    char digits[24], *text;
+    unsigned long long rest = value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+    int count = 0, i;
+    
+    do {
+        digits[count++] = (char)('0' + rest % 10);
+        rest /= 10;
+    } while(rest != 0);
+    if(value < 0) {
+        digits[count++] = '-';
+    }
+    text = outReserve(out, count);
+    for(i = 0; i < count; i++) {
+        text[i] = digits[count - 1 - i];
+    }
+    out->length += count;
+    if(width > count) {
+        outPad(out, width - count);
     }
+}
+
+void outMoney(Output *out, Money amount, int width) {
+    char text[MONEY_TEXT_LENGTH];
     
-    fwrite(&system->sale_count, sizeof(int), 1, file);
-    fwrite(system->sales, sizeof(Sale), system->sale_count, file);
-    fwrite(&system->daily_revenue, sizeof(float), 1, file);
-    fclose(file);
+    outField(out, formatMoney(amount, text), width);
 }
 
-void loadSales(POSSystem *system) {
-    FILE *file = fopen(FILENAME_SALES, "rb");
-    if(file == NULL) {
-        printf("No previous sales data found. Starting fresh.\n");
-        return;
+static void outTwoDigits(char *text, int value) {
+    text[0] = (char)('0' + value / 10);
+    text[1] = (char)('0' + value % 10);
+}
+
+// Writes t the way ctime() does, newline included. Like dayNumber() it relies
+// on local time changing only on 15-minute boundaries: localtime_r() runs once
+// per slot and the minutes and seconds inside it are added on.
+void outDate(Output *out, time_t t) {
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    time_t slot = t - ((t % 900) + 900) % 900;
+    struct tm date;
+    char *text;
+    int offset;
+    
+    if(slot != out->date_slot) {
+        localtime_r(&slot, &date);
+        if(date.tm_sec != 0 || date.tm_min % 15 != 0) {
+            // An offset that is not a whole quarter hour (old local mean times)
+            localtime_r(&t, &date);
+            text = outReserve(out, 64);
+            out->length += sprintf(text, "%.3s %.3s%3d %.2d:%.2d:%.2d %d\n", days + 3 * date.tm_wday,
+                                   months + 3 * date.tm_mon, date.tm_mday, date.tm_hour, date.tm_min,
+                                   date.tm_sec, date.tm_year + 1900);
+            return;
+        }
+        snprintf(out->date_prefix, sizeof(out->date_prefix), "%.3s %.3s%3d %.2d:", days + 3 * date.tm_wday,
+                 months + 3 * date.tm_mon, date.tm_mday, date.tm_hour);
+        snprintf(out->date_year, sizeof(out->date_year), " %d\n", date.tm_year + 1900);
+        out->date_minute = date.tm_min;
+        out->date_slot = slot;
     }
+    offset = (int)(t - slot);
+    outText(out, out->date_prefix);
+    text = outReserve(out, 5);
+    outTwoDigits(text, out->date_minute + offset / 60);
+    text[2] = ':';
+    outTwoDigits(text + 3, offset % 60);
+    out->length += 5;
+    outText(out, out->date_year);
+}
+
+// Writes text as a quoted JSON string.
+static void outJsonString(Output *out, const char *text) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *c;
+    char *next;
     
-    fread(&system->sale_count, sizeof(int), 1, file);
-    fread(system->sales, sizeof(Sale), system->sale_count, file);
-    fread(&system->daily_revenue, sizeof(float), 1, file);
-    fclose(file);
-    printf("Loaded %d sales records.\n", system->sale_count);
-}
\ No newline at end of file
+    outBytes(out, "\"", 1);
+    for(c = (const unsigned char *)text; *c != '\0'; c++) {
+        next = outReserve(out, 6);
+        if(*c == '"' || *c == '\\') {
+            next[0] = '\\';
+            next[1] = (char)*c;
+            out->length += 2;
+        } else if(*c < 0x20) {
+            memcpy(next, "\\u00", 4);
+            next[4] = hex[*c >> 4];
+            next[5] = hex[*c & 15];
+            out->length += 6;
+        } else {
+            next[0] = (char)*c;
+            out->length++;
+        }
+    }
+    outBytes(out, "\"", 1);
+}
+
+static void outJsonKey(Output *out, const char *key) {
+    outBytes(out, ",\"", 2);
+    outText(out, key);
+    outBytes(out, "\":", 2);
+}
+
+// Starts a JSON record; every record carries the kind of row it is.
+void outRecord(Output *out, const char *type) {
+    outText(out, "{\"type\":");
+    outJsonString(out, type);
+}
+
+void outJsonText(Output *out, const char *key, const char *text) {
+    outJsonKey(out, key);
+    outJsonString(out, text);
+}
+
+void outJsonInt(Output *out, const char *key, long long value) {
+    outJsonKey(out, key);
+    outInt(out, value, 0);
+}
+
+// Money goes out as a plain decimal number, exactly as stored.
+void outJsonMoney(Output *out, const char *key, Money amount) {
+    outJsonKey(out, key);
+    outMoney(out, amount, 0);
+}
+
+void outEndRecord(Output *out) {
+    outBytes(out, "}\n", 2);
+}
+
+static const char *stat_names[STAT_OPS] = {"sale", "save_products", "save_sales", "load_products", "load_sales",
+                                           "report"};
+
+// Nanoseconds per statTicks() tick, measured against the clock since the
+// first call (which waits 10 ms to have something to measure).
+static double nanosPerTick(void) {
+#ifdef __x86_64__
+    static long long base_ticks, base_ns;
+    struct timespec ts;
+    long long ticks, ns;
+    
+    if(base_ns == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);  // the first call can take a millisecond
+    }
+    do {
+        ticks = statTicks();
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        if(base_ns == 0) {
+            base_ticks = ticks;
+            base_ns = ns;
+        }
+    } while(ns - base_ns < 10000000);
+    return (double)(ns - base_ns) / (double)(ticks - base_ticks);
+#else
+    return 1;
+#endif
+}
+
+// The latency in ticks below which fraction q of the operations completed.
+static long long statQuantile(const OperationStats *stats, double q) {
+    long long want = (long long)(q * stats->count + 0.5), seen = 0, top;
+    int b, e, sub;
+    
+    if(want < 1) {
+        want = 1;
+    }
+    for(b = 0; b < STAT_BUCKETS; b++) {
+        seen += stats->buckets[b];
+        if(seen >= want) {
+            if(b < (1 << STAT_SUB_BITS)) {
+                top = b;
+            } else {
+                e = (b >> STAT_SUB_BITS) + STAT_SUB_BITS - 1;
+                sub = b & ((1 << STAT_SUB_BITS) - 1);
+                top = ((long long)((1 << STAT_SUB_BITS) + sub + 1) << (e - STAT_SUB_BITS)) - 1;
+            }
+            return top < stats->max ? top : stats->max;
+        }
+    }
+    return stats->max;
+}
+
+// One operation's figures; as a table row they are in microseconds.
+static void outStats(Output *out, int op, double ns_per_tick) {
+    const OperationStats *stats = &operation_stats[op];
+    long long mean = stats->count > 0 ? (long long)((double)stats->total / stats->count * ns_per_tick) : 0;
+    long long p50 = stats->count > 0 ? (long long)(statQuantile(stats, 0.5) * ns_per_tick) : 0;
+    long long p99 = stats->count > 0 ? (long long)(statQuantile(stats, 0.99) * ns_per_tick) : 0;
+    long long max = (long long)(stats->max * ns_per_tick);
+    
+    if(out->json) {
+        outRecord(out, "op_stats");
+        outJsonText(out, "op", stat_names[op]);
+        outJsonInt(out, "count", stats->count);
+        outJsonInt(out, "total_ns", (long long)(stats->total * ns_per_tick));
+        outJsonInt(out, "mean_ns", mean);
+        outJsonInt(out, "p50_ns", p50);
+        outJsonInt(out, "p90_ns", stats->count > 0 ? (long long)(statQuantile(stats, 0.9) * ns_per_tick) : 0);
+        outJsonInt(out, "p99_ns", p99);
+        outJsonInt(out, "p999_ns", stats->count > 0 ? (long long)(statQuantile(stats, 0.999) * ns_per_tick) : 0);
+        outJsonInt(out, "max_ns", max);
+        outJsonInt(out, "bytes", stats->bytes);
+        outEndRecord(out);
+        return;
+    }
+    outField(out, stat_names[op], 15);
+    outInt(out, stats->count, 10);
+    outInt(out, mean / 1000, 10);
+    outInt(out, p50 / 1000, 10);
+    outInt(out, p99 / 1000, 10);
+    outInt(out, max / 1000, 10);
+    outInt(out, stats->bytes, 0);
+    outText(out, "\n");
+}
+
+void showStats(void) {
+    double ns_per_tick = nanosPerTick();
+    Output out;
+    int op;
+    
+    openOutput(&out, stdout);
+    if(!out.json) {
+        printf("\n=== OPERATION STATISTICS ===\n");
+        printf("%-15s%-10s%-10s%-10s%-10s%-10s%s\n", "Operation", "Count", "Mean us", "p50 us", "p99 us", "Max us",
+               "Bytes");
+        printf("----------------------------------------------------------------------\n");
+    }
+    for(op = 0; op < STAT_OPS; op++) {
+        outStats(&out, op, ns_per_tick);
+    }
+    closeOutput(&out);
+}
+
+// Rewrites path with the statistics as JSON lines, through a temp file so
+// readers never see half a dump. Returns 0 if it cannot be written.
+int dumpStats(const char *path) {
+    double ns_per_tick = nanosPerTick();
+    char temp[512];
+    FILE *file;
+    Output out;
+    int op, ok;
+    
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    file = fopen(temp, "w");
+    if(file == NULL) {
+        return 0;
+    }
+    openOutput(&out, file);
+    out.json = 1;
+    outRecord(&out, "stats");
+    outJsonInt(&out, "time", time(NULL));
+    outEndRecord(&out);
+    for(op = 0; op < STAT_OPS; op++) {
+        outStats(&out, op, ns_per_tick);
+    }
+    closeOutput(&out);
+    ok = fclose(file) == 0 && rename(temp, path) == 0;
+    if(!ok) {
+        unlink(temp);
+    }
+    return ok;
+}
+
+// With POS_STATS_FILE set, dumps the statistics there once every
+// POS_STATS_INTERVAL seconds, or now if force is set.
+void tickStats(int force) {
+    static const char *path;
+    static double interval = -1, next_dump;
+    struct timespec ts;
+    double now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec + ts.tv_nsec / 1e9;
+    if(interval < 0) {
+        const char *every = getenv("POS_STATS_INTERVAL");
+        path = getenv("POS_STATS_FILE");
+        interval = every != NULL && atof(every) > 0 ? atof(every) : STATS_DUMP_INTERVAL;
+        next_dump = now + interval;
+    }
+    if(path == NULL || (!force && now < next_dump)) {
+        return;
+    }
+    if(!dumpStats(path)) {
+        printf("Cannot write %s!\n", path);
+    }
+    next_dump = now + interval;
+}
+
+static unsigned productDayHash(int day, int product_id) {
+    return ((unsigned)day * 2654435761u) ^ ((unsigned)product_id * 2246822519u);
+}
+
+void *growArray(void *array, int *capacity, size_t size) {
+    int new_capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(array, size * new_capacity);
+    
+    if(grown == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+static void rehashProductDays(POSSystem *system, int capacity) {
+    int i;
+    unsigned h;
+    
+    free(system->product_day_slots);
+    system->product_day_slots = malloc(sizeof(int) * capacity);
+    if(system->product_day_slots == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    system->product_day_slot_capacity = capacity;
+    for(i = 0; i < capacity; i++) {
+        system->product_day_slots[i] = -1;
+    }
+    for(i = 0; i < system->product_day_count; i++) {
+        h = productDayHash(system->product_days[i].day, system->product_days[i].product_id) & (capacity - 1);
+        while(system->product_day_slots[h] >= 0) {
+            h = (h + 1) & (capacity - 1);
+        }
+        system->product_day_slots[h] = i;
+    }
+}
+
+// Index of the first daily rollup on or after day.
+int firstDayAtOrAfter(POSSystem *system, int day) {
+    int low = 0, high = system->day_count, mid;
+    
+    while(low < high) {
+        mid = (low + high) / 2;
+        if(system->days[mid].day < day) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void addToRollups(POSSystem *system, Sale *sale) {
+    int day = dayNumber(sale->timestamp);
+    int pos, moved;
+    unsigned h, mask;
+    DailyRollup *daily;
+    ProductDayRollup *entry = NULL;
+    
+    // Daily total; sales normally arrive in time order, so this appends
+    if(system->day_count > 0 && system->days[system->day_count - 1].day == day) {
+        pos = system->day_count - 1;
+    } else {
+        pos = firstDayAtOrAfter(system, day);
+    }
+    if(pos == system->day_count || system->days[pos].day != day) {
+        if(system->day_count == system->day_capacity) {
+            system->days = growArray(system->days, &system->day_capacity, sizeof(DailyRollup));
+        }
+        memmove(&system->days[pos + 1], &system->days[pos], sizeof(DailyRollup) * (system->day_count - pos));
+        system->days[pos].day = day;
+        system->days[pos].sales = 0;
+        system->days[pos].quantity = 0;
+        system->days[pos].revenue = 0;
+        system->day_count++;
+    }
+    daily = &system->days[pos];
+    daily->sales++;
+    daily->quantity += sale->quantity;
+    daily->revenue += sale->total;
+    
+    // Per-product total for the day
+    if((system->product_day_count + 1) * 2 > system->product_day_slot_capacity) {
+        rehashProductDays(system, system->product_day_slot_capacity ? system->product_day_slot_capacity * 2 : 256);
+    }
+    mask = (unsigned)system->product_day_slot_capacity - 1;
+    for(h = productDayHash(day, sale->product_id) & mask; system->product_day_slots[h] >= 0; h = (h + 1) & mask) {
+        ProductDayRollup *candidate = &system->product_days[system->product_day_slots[h]];
+        if(candidate->day == day && candidate->product_id == sale->product_id) {
+            entry = candidate;
+            break;
+        }
+    }
+    if(entry == NULL) {
+        if(system->product_day_count == system->product_day_capacity) {
+            system->product_days = growArray(system->product_days, &system->product_day_capacity,
+                                             sizeof(ProductDayRollup));
+        }
+        pos = system->product_day_count;
+        while(pos > 0 && system->product_days[pos - 1].day > day) {
+            pos--; // clock moved back: keep entries sorted by day
+        }
+        moved = system->product_day_count - pos;
+        memmove(&system->product_days[pos + 1], &system->product_days[pos], sizeof(ProductDayRollup) * moved);
+        entry = &system->product_days[pos];
+        entry->day = day;
+        entry->product_id = sale->product_id;
+        entry->quantity = 0;
+        entry->revenue = 0;
+        system->product_day_count++;
+        if(moved > 0) {
+            rehashProductDays(system, system->product_day_slot_capacity);
+        } else {
+            system->product_day_slots[h] = pos;
+        }
+    }
+    entry->quantity += sale->quantity;
+    entry->revenue += sale->total;
+    system->rollup_sale_count++;
+}
+
+// Sum of daily rollups in [from_day, to_day]; costs O(days in range).
+Money rollupRevenue(POSSystem *system, int from_day, int to_day, int *sales) {
+    Money revenue = 0;
+    int i;
+    
+    *sales = 0;
+    for(i = firstDayAtOrAfter(system, from_day); i < system->day_count && system->days[i].day <= to_day; i++) {
+        revenue += system->days[i].revenue;
+        *sales += system->days[i].sales;
+    }
+    return revenue;
+}
+
+void rebuildRollups(POSSystem *system) {
+    int i;
+    
+    system->day_count = 0;
+    system->product_day_count = 0;
+    system->rollup_sale_count = 0;
+    if(system->product_day_slots != NULL) {
+        rehashProductDays(system, system->product_day_slot_capacity);
+    }
+    for(i = 0; i < system->sale_count; i++) {
+        Sale sale;
+        getSale(system, i, &sale);
+        addToRollups(system, &sale);
+    }
+}
+
+static unsigned rollupChecksum(POSSystem *system) {
+    const unsigned char *bytes;
+    unsigned h = 2166136261u;
+    size_t i, size;
+    
+    bytes = (const unsigned char *)system->days;
+    size = sizeof(DailyRollup) * system->day_count;
+    for(i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    bytes = (const unsigned char *)system->product_days;
+    size = sizeof(ProductDayRollup) * system->product_day_count;
+    for(i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+void saveRollups(POSSystem *system) {
+    RollupFileHeader header;
+    int fd = openat(system->dir_fd, FILENAME_ROLLUPS, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    
+    if(file == NULL) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        printf("Error saving rollups!\n");
+        return;
+    }
+    header.magic = ROLLUP_FILE_MAGIC;
+    header.version = ROLLUP_FILE_VERSION;
+    header.sale_count = system->rollup_sale_count;
+    header.day_count = system->day_count;
+    header.product_day_count = system->product_day_count;
+    header.checksum = rollupChecksum(system);
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(system->days, sizeof(DailyRollup), system->day_count, file);
+    fwrite(system->product_days, sizeof(ProductDayRollup), system->product_day_count, file);
+    fclose(file);
+}
+
+// Loads saved rollups; rebuilds them from the sales if missing, corrupt or stale.
+void loadRollups(POSSystem *system) {
+    RollupFileHeader header;
+    int fd = openat(system->dir_fd, FILENAME_ROLLUPS, O_RDONLY), ok = 0, capacity = 256, i;
+    FILE *file = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    
+    if(file == NULL && fd >= 0) {
+        close(fd);
+    }
+    if(file != NULL && fread(&header, sizeof(header), 1, file) == 1 &&
+       header.magic == ROLLUP_FILE_MAGIC && header.version == ROLLUP_FILE_VERSION &&
+       header.sale_count >= 0 && header.sale_count <= system->sale_count &&
+       header.day_count >= 0 && header.product_day_count >= 0) {
+        while(system->day_capacity < header.day_count) {
+            system->days = growArray(system->days, &system->day_capacity, sizeof(DailyRollup));
+        }
+        while(system->product_day_capacity < header.product_day_count) {
+            system->product_days = growArray(system->product_days, &system->product_day_capacity,
+                                             sizeof(ProductDayRollup));
+        }
+        system->day_count = header.day_count;
+        system->product_day_count = header.product_day_count;
+        ok = fread(system->days, sizeof(DailyRollup), system->day_count, file) == (size_t)system->day_count &&
+             fread(system->product_days, sizeof(ProductDayRollup), system->product_day_count, file) ==
+                 (size_t)system->product_day_count &&
+             rollupChecksum(system) == header.checksum;
+    }
+    if(file != NULL) {
+        fclose(file);
+    }
+    
+    if(!ok) {
+        if(system->sale_count > 0) {
+            printf("Rebuilding revenue rollups...\n");
+        }
+        rebuildRollups(system);
+        return;
+    }
+    while(capacity < system->product_day_count * 2 + 2) {
+        capacity *= 2;
+    }
+    rehashProductDays(system, capacity);
+    system->rollup_sale_count = header.sale_count;
+    for(i = header.sale_count; i < system->sale_count; i++) {
+        Sale sale;
+        getSale(system, i, &sale);
+        addToRollups(system, &sale);
+    }
+}
+
+// Child of node for ch, or -1; with create set a missing child is added in order.
+static int searchChild(POSSystem *system, int node, unsigned char ch, int create) {
+    int *link = &system->search_nodes[node].first_child;
+    int child;
+    
+    while(*link != -1 && system->search_nodes[*link].ch < ch) {
+        link = &system->search_nodes[*link].next_sibling;
+    }
+    if(*link != -1 && system->search_nodes[*link].ch == ch) {
+        return *link;
+    }
+    if(!create) {
+        return -1;
+    }
+    if(system->search_node_count == system->search_node_capacity) {
+        // link points into the array, so remember where it was
+        ptrdiff_t offset = (char *)link - (char *)system->search_nodes;
+        system->search_nodes = growArray(system->search_nodes, &system->search_node_capacity, sizeof(SearchNode));
+        link = (int *)((char *)system->search_nodes + offset);
+    }
+    child = system->search_node_count++;
+    system->search_nodes[child].first_child = -1;
+    system->search_nodes[child].next_sibling = *link;
+    system->search_nodes[child].first_product = -1;
+    system->search_nodes[child].ch = ch;
+    *link = child;
+    return child;
+}
+
+// Trie node of the lower-cased name, or -1 if no product name has it as a prefix.
+static int searchNode(POSSystem *system, const char *name, int create) {
+    int node = 0;
+    
+    if(system->search_node_count == 0) {
+        if(!create) {
+            return -1;
+        }
+        system->search_nodes = growArray(system->search_nodes, &system->search_node_capacity, sizeof(SearchNode));
+        system->search_nodes[0].first_child = -1;
+        system->search_nodes[0].next_sibling = -1;
+        system->search_nodes[0].first_product = -1;
+        system->search_nodes[0].ch = 0;
+        system->search_node_count = 1;
+    }
+    for(; *name && node != -1; name++) {
+        node = searchChild(system, node, (unsigned char)tolower((unsigned char)*name), create);
+    }
+    return node;
+}
+
+// Adds products[index] to the name search index under its current name.
+void indexProductName(POSSystem *system, int index) {
+    int node = searchNode(system, system->products[index].name, 1);
+    
+    while(index >= system->search_next_capacity) {
+        system->search_next = growArray(system->search_next, &system->search_next_capacity, sizeof(int));
+    }
+    system->search_next[index] = system->search_nodes[node].first_product;
+    system->search_nodes[node].first_product = index;
+}
+
+// Removes products[index] from the index; call before its name changes.
+void unindexProductName(POSSystem *system, int index) {
+    int node = searchNode(system, system->products[index].name, 0);
+    int *link;
+    
+    if(node == -1) {
+        return;
+    }
+    for(link = &system->search_nodes[node].first_product; *link != -1; link = &system->search_next[*link]) {
+        if(*link == index) {
+            *link = system->search_next[index];
+            return;
+        }
+    }
+}
+
+static void buildSearchIndex(POSSystem *system) {
+    int i;
+    
+    system->search_node_count = 0;
+    for(i = 0; i < system->product_count; i++) {
+        indexProductName(system, i);
+    }
+}
+
+// Exact, case-sensitive match; the first product added wins among duplicates.
+int findProductByName(POSSystem *system, const char *name) {
+    int node = searchNode(system, name, 0);
+    int i, found = -1;
+    
+    if(node == -1) {
+        return -1;
+    }
+    for(i = system->search_nodes[node].first_product; i != -1; i = system->search_next[i]) {
+        if(strcmp(system->products[i].name, name) == 0 && (found == -1 || i < found)) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+// Appends the products under node to matches in alphabetical order.
+static int collectProducts(POSSystem *system, int node, int *matches, int count, int max) {
+    int i, child;
+    
+    for(i = system->search_nodes[node].first_product; i != -1 && count < max; i = system->search_next[i]) {
+        matches[count++] = i;
+    }
+    for(child = system->search_nodes[node].first_child; child != -1 && count < max;
+        child = system->search_nodes[child].next_sibling) {
+        count = collectProducts(system, child, matches, count, max);
+    }
+    return count;
+}
+
+// Up to max products whose name starts with prefix, ignoring case, in
+// alphabetical order. Returns how many were stored in matches.
+int findProductsByPrefix(POSSystem *system, const char *prefix, int *matches, int max) {
+    int node = searchNode(system, prefix, 0);
+    
+    return node == -1 ? 0 : collectProducts(system, node, matches, 0, max);
+}
+
+typedef struct {
+    POSSystem *system;
+    const char *target;                 // lower-cased search text
+    int length;
+    int max_edits;
+    int *matches;
+    int distances[SEARCH_MAX_RESULTS];
+    int count;
+    int max;
+} FuzzySearch;
+
+// Keeps matches ordered by edit distance, dropping the farthest when full.
+static void addFuzzyMatch(FuzzySearch *search, int index, int distance) {
+    int i;
+    
+    if(search->count < search->max) {
+        i = search->count++;
+    } else if(search->distances[search->max - 1] > distance) {
+        i = search->max - 1;
+    } else {
+        return;
+    }
+    while(i > 0 && search->distances[i - 1] > distance) {
+        search->matches[i] = search->matches[i - 1];
+        search->distances[i] = search->distances[i - 1];
+        i--;
+    }
+    search->matches[i] = index;
+    search->distances[i] = distance;
+}
+
+// Levenshtein walk: row holds the distances from the name spelled by the path
+// to node to each prefix of the target. Subtrees whose best entry already
+// exceeds max_edits cannot contain a match and are skipped.
+static void fuzzyWalk(FuzzySearch *search, int node, const int *row) {
+    SearchNode *nodes = search->system->search_nodes;
+    int next[MAX_NAME_LENGTH + 1];
+    int child, i, best;
+    
+    if(row[search->length] <= search->max_edits) {
+        for(i = nodes[node].first_product; i != -1; i = search->system->search_next[i]) {
+            addFuzzyMatch(search, i, row[search->length]);
+        }
+    }
+    for(child = nodes[node].first_child; child != -1; child = nodes[child].next_sibling) {
+        next[0] = row[0] + 1;
+        best = next[0];
+        for(i = 1; i <= search->length; i++) {
+            int cost = row[i - 1] + (search->target[i - 1] != nodes[child].ch);
+            if(row[i] + 1 < cost) {
+                cost = row[i] + 1;
+            }
+            if(next[i - 1] + 1 < cost) {
+                cost = next[i - 1] + 1;
+            }
+            next[i] = cost;
+            if(cost < best) {
+                best = cost;
+            }
+        }
+        if(best <= search->max_edits) {
+            fuzzyWalk(search, child, next);
+        }
+    }
+}
+
+// Up to max products whose name is within max_edits insertions, deletions or
+// substitutions of name, ignoring case, closest first.
+int findProductsFuzzy(POSSystem *system, const char *name, int max_edits, int *matches, int max) {
+    FuzzySearch search;
+    char target[MAX_NAME_LENGTH];
+    int row[MAX_NAME_LENGTH + 1];
+    int i;
+    
+    if(system->search_node_count == 0 || max <= 0) {
+        return 0;
+    }
+    for(i = 0; name[i] && i < MAX_NAME_LENGTH - 1; i++) {
+        target[i] = (char)tolower((unsigned char)name[i]);
+        row[i] = i;
+    }
+    row[i] = i;
+    search.system = system;
+    search.target = target;
+    search.length = i;
+    search.max_edits = max_edits > SEARCH_MAX_EDITS ? SEARCH_MAX_EDITS : max_edits;
+    search.matches = matches;
+    search.count = 0;
+    search.max = max > SEARCH_MAX_RESULTS ? SEARCH_MAX_RESULTS : max;
+    fuzzyWalk(&search, 0, row);
+    return search.count;
+}
+
+void searchProducts(POSSystem *system) {
+    char text[MAX_NAME_LENGTH], price[MONEY_TEXT_LENGTH];
+    int matches[SEARCH_MAX_RESULTS];
+    int count, i;
+    
+    printf("\n=== SEARCH PRODUCTS ===\n");
+    printf("Enter name or start of name: ");
+    getchar(); // Clear input buffer
+    if(fgets(text, MAX_NAME_LENGTH, stdin) == NULL) {
+        return;
+    }
+    text[strcspn(text, "\n")] = 0; // Remove newline
+    
+    count = findProductsByPrefix(system, text, matches, SEARCH_MAX_RESULTS);
+    if(count == 0) {
+        count = findProductsFuzzy(system, text, SEARCH_MAX_EDITS, matches, SEARCH_MAX_RESULTS);
+        if(count > 0) {
+            printf("No product starts with \"%s\". Did you mean:\n", text);
+        }
+    }
+    if(count == 0) {
+        printf("No matching products.\n");
+        return;
+    }
+    printf("%-5s %-20s %-10s %-10s\n", "ID", "Name", "Price", "Quantity");
+    printf("----------------------------------------------\n");
+    for(i = 0; i < count; i++) {
+        Product *p = &system->products[matches[i]];
+        printf("%-5d %-20s $%-9s %-10d\n", p->id, p->name, formatMoney(p->price, price), p->quantity);
+    }
+}
+
+// Gives the catalog room for capacity products, keeping those already there.
+// Edits never reach FILENAME_PRODUCTS until saveProducts replaces it, so a
+// crash cannot leave it half written.
+static int resizeProducts(POSSystem *system, int capacity) {
+    Product *products = realloc(system->products, sizeof(Product) * capacity);
+    
+    if(products == NULL) {
+        return 0;
+    }
+    system->products = products;
+    system->product_capacity = capacity;
+    return 1;
+}
+
+// Ensures room for count products, doubling the capacity when it is full.
+int reserveProducts(POSSystem *system, int count) {
+    int capacity = system->product_capacity ? system->product_capacity : PRODUCT_INITIAL_CAPACITY;
+    
+    if(count <= system->product_capacity) {
+        return 1;
+    }
+    while(capacity < count) {
+        capacity *= 2;
+    }
+    return resizeProducts(system, capacity);
+}
+
+static int writeFully(int fd, const void *data, size_t size) {
+    const char *p = data;
+    ssize_t written;
+    
+    while(size > 0) {
+        written = write(fd, p, size);
+        if(written <= 0) {
+            return 0;
+        }
+        p += written;
+        size -= written;
+    }
+    return 1;
+}
+
+// Syncing the directory holding the data files makes a create or rename in it
+// durable.
+static void syncDirectory(int dir_fd) {
+    int dir = dir_fd == AT_FDCWD ? open(".", O_RDONLY) : dir_fd;
+    
+    if(dir >= 0) {
+        fsync(dir);
+        if(dir != dir_fd) {
+            close(dir);
+        }
+    }
+}
+
+// Puts the finished temp file fd in place of path, both in directory dir_fd.
+// The data is on disk before the rename, so after a crash path holds either the
+// old or the new contents.
+static int replaceFile(int dir_fd, int fd, const char *temp, const char *path) {
+    int ok = fsync(fd) == 0;
+    
+    ok = close(fd) == 0 && ok;
+    if(!ok || renameat(dir_fd, temp, dir_fd, path) != 0) {
+        unlinkat(dir_fd, temp, 0);
+        return 0;
+    }
+    syncDirectory(dir_fd);
+    return 1;
+}
+
+static void putLe32(unsigned char *p, unsigned v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned getLe32(const unsigned char *p) {
+    return p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+static void putLe64(unsigned char *p, unsigned long long v) {
+    putLe32(p, (unsigned)v);
+    putLe32(p + 4, (unsigned)(v >> 32));
+}
+
+static unsigned long long getLe64(const unsigned char *p) {
+    return getLe32(p) | (unsigned long long)getLe32(p + 4) << 32;
+}
+
+// Varints hold seven bits per byte, low bits first, with the top bit set on
+// every byte but the last. Signed values are zigzag-mapped first so that small
+// negative numbers stay short too.
+static unsigned char *putVarint(unsigned char *p, unsigned long long v) {
+    while(v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned char *putSigned(unsigned char *p, long long v) {
+    return putVarint(p, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+// Returns the byte after the varint, or NULL if it runs past end. A NULL p
+// passes straight through, so a run of reads needs one check at the end.
+static const unsigned char *getVarint(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    unsigned long long result = 0;
+    int shift;
+    
+    if(p == NULL) {
+        return NULL;
+    }
+    for(shift = 0; p < end && shift < 64; shift += 7) {
+        result |= (unsigned long long)(*p & 0x7f) << shift;
+        if((*p++ & 0x80) == 0) {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const unsigned char *getSigned(const unsigned char *p, const unsigned char *end, long long *v) {
+    unsigned long long u = 0;
+    
+    p = getVarint(p, end, &u);
+    *v = (long long)(u >> 1) ^ -(long long)(u & 1);
+    return p;
+}
+
+// A small LZ77 codec using the LZ4 block layout: each sequence is a token
+// (literal count << 4 | match length - 4), any extra length bytes, the
+// literals, then a two-byte little-endian offset and extra match length bytes.
+// The last sequence has literals only. Matches are found through a hash of the
+// next four bytes, which is fast and does well on the repetitive columns.
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_END_LITERALS 5 // the last bytes are always literals
+
+static unsigned lzRead32(const unsigned char *p) {
+    unsigned v;
+    
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned char *lzPutLength(unsigned char *p, size_t length) {
+    for(; length >= 255; length -= 255) {
+        *p++ = 255;
+    }
+    *p++ = (unsigned char)length;
+    return p;
+}
+
+static unsigned char *lzPutSequence(unsigned char *out, const unsigned char *literals, size_t literal_count,
+                                    size_t offset, size_t match) {
+    unsigned char *token = out++;
+    
+    *token = (unsigned char)((literal_count < 15 ? literal_count : 15) << 4);
+    if(literal_count >= 15) {
+        out = lzPutLength(out, literal_count - 15);
+    }
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+    if(match > 0) {
+        *out++ = (unsigned char)offset;
+        *out++ = (unsigned char)(offset >> 8);
+        match -= LZ_MIN_MATCH;
+        *token |= (unsigned char)(match < 15 ? match : 15);
+        if(match >= 15) {
+            out = lzPutLength(out, match - 15);
+        }
+    }
+    return out;
+}
+
+// Compresses size bytes into out, which has room for capacity. Returns the
+// compressed size, or 0 when it would not fit.
+static size_t lzCompress(const unsigned char *in, size_t size, unsigned char *out, size_t capacity) {
+    int table[1 << LZ_HASH_BITS];
+    size_t i = 0, anchor = 0, match, used = 0;
+    unsigned h;
+    int candidate;
+    
+    memset(table, -1, sizeof(table));
+    while(size >= 12 && i + 12 <= size) {
+        h = (lzRead32(in + i) * 2654435761u) >> (32 - LZ_HASH_BITS);
+        candidate = table[h];
+        table[h] = (int)i;
+        if(candidate < 0 || i - candidate > 65535 || lzRead32(in + candidate) != lzRead32(in + i)) {
+            i++;
+            continue;
+        }
+        for(match = LZ_MIN_MATCH; i + match < size - LZ_END_LITERALS && in[candidate + match] == in[i + match];
+            match++) {
+        }
+        // token, two offsets, lengths and the literals
+        if(used + (i - anchor) + (i - anchor) / 255 + match / 255 + 8 > capacity) {
+            return 0;
+        }
+        used = lzPutSequence(out + used, in + anchor, i - anchor, i - candidate, match) - out;
+        i += match;
+        anchor = i;
+    }
+    if(used + (size - anchor) + (size - anchor) / 255 + 2 > capacity) {
+        return 0;
+    }
+    return lzPutSequence(out + used, in + anchor, size - anchor, 0, 0) - out;
+}
+
+// Decompresses size bytes into out. Returns the decompressed size, or -1 when
+// the input is malformed or would overflow capacity.
+static long long lzDecompress(const unsigned char *in, size_t size, unsigned char *out, size_t capacity) {
+    const unsigned char *end = in + size;
+    size_t used = 0, length, offset;
+    unsigned token;
+    
+    while(in < end) {
+        token = *in++;
+        length = token >> 4;
+        if(length == 15) {
+            do {
+                if(in >= end) {
+                    return -1;
+                }
+                length += *in;
+            } while(*in++ == 255);
+        }
+        if(length > (size_t)(end - in) || length > capacity - used) {
+            return -1;
+        }
+        memcpy(out + used, in, length);
+        in += length;
+        used += length;
+        if(in == end) {
+            break;
+        }
+        if(end - in < 2) {
+            return -1;
+        }
+        offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        length = (token & 15) + LZ_MIN_MATCH;
+        if((token & 15) == 15) {
+            do {
+                if(in >= end) {
+                    return -1;
+                }
+                length += *in;
+            } while(*in++ == 255);
+        }
+        if(offset == 0 || offset > used || length > capacity - used) {
+            return -1;
+        }
+        for(; length > 0; length--, used++) {
+            out[used] = out[used - offset]; // may overlap: copy forwards
+        }
+    }
+    return (long long)used;
+}
+
+static unsigned char *encodeProduct(unsigned char *p, const Product *product) {
+    size_t length = strnlen(product->name, MAX_NAME_LENGTH - 1);
+    
+    p = putSigned(p, product->id);
+    p = putVarint(p, length);
+    memcpy(p, product->name, length);
+    p += length;
+    p = putSigned(p, product->price);
+    p = putSigned(p, product->quantity);
+    return putSigned(p, product->min_stock_level);
+}
+
+static const unsigned char *decodeProduct(const unsigned char *p, const unsigned char *end, Product *product) {
+    unsigned long long length = 0;
+    long long id = 0, price = 0, quantity = 0, min_stock = 0;
+    
+    memset(product, 0, sizeof(*product));
+    p = getSigned(p, end, &id);
+    p = getVarint(p, end, &length);
+    if(p == NULL || length >= MAX_NAME_LENGTH || length > (unsigned long long)(end - p)) {
+        return NULL;
+    }
+    memcpy(product->name, p, length);
+    p = getSigned(p + length, end, &price);
+    p = getSigned(p, end, &quantity);
+    p = getSigned(p, end, &min_stock);
+    product->id = (int)id;
+    product->price = price;
+    product->quantity = (int)quantity;
+    product->min_stock_level = (int)min_stock;
+    return p;
+}
+
+static unsigned productHeaderChecksum(const ProductFileHeader *header) {
+    return crc32c(0, header, offsetof(ProductFileHeader, checksum));
+}
+
+static unsigned productBlockChecksum(const Product *products, int count, int block, int block_size) {
+    int rows = count - block * block_size < block_size ? count - block * block_size : block_size;
+    
+    return crc32c(0, products + (size_t)block * block_size, sizeof(Product) * rows);
+}
+
+// Converts count float-price records stored from offset (an unversioned
+// "int count + raw records" file or a version 1 file) into the catalog.
+static int readLegacyProducts(POSSystem *system, int fd, off_t offset, int count) {
+    LegacyProduct *legacy = malloc(sizeof(LegacyProduct) * (count > 0 ? count : 1));
+    int i;
+    
+    if(legacy == NULL ||
+       pread(fd, legacy, sizeof(LegacyProduct) * count, offset) != (ssize_t)(sizeof(LegacyProduct) * count)) {
+        free(legacy);
+        return 0;
+    }
+    for(i = 0; i < count; i++) {
+        memset(&system->products[i], 0, sizeof(Product));
+        system->products[i].id = legacy[i].id;
+        memcpy(system->products[i].name, legacy[i].name, MAX_NAME_LENGTH);
+        system->products[i].price = moneyFromFloat(legacy[i].price);
+        system->products[i].quantity = legacy[i].quantity;
+        system->products[i].min_stock_level = legacy[i].min_stock_level;
+    }
+    free(legacy);
+    return 1;
+}
+
+// Writes the whole catalog to a temp file and renames it over the old one.
+// After the header come blocks of up to PRODUCT_CHECKSUM_BLOCK encoded
+// products, each led by its length and CRC32C.
+void saveProducts(POSSystem *system) {
+    STAT_BEGIN(t0);
+    int count = system->product_count, i, n, fd, ok;
+    unsigned char *buffer, *p, *block;
+    
+    if(system->products == NULL) {
+        return;
+    }
+    buffer = malloc(PRODUCT_FILE_HEADER_SIZE + (size_t)count * PRODUCT_RECORD_MAX +
+                    ((size_t)count / PRODUCT_CHECKSUM_BLOCK + 1) * 8);
+    if(buffer == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    putLe32(buffer, PRODUCT_FILE_MAGIC);
+    putLe32(buffer + 4, PRODUCT_FILE_VERSION);
+    putLe32(buffer + 8, (unsigned)count);
+    putLe32(buffer + 12, PRODUCT_CHECKSUM_BLOCK);
+    putLe32(buffer + 16, crc32c(0, buffer, 16));
+    p = buffer + PRODUCT_FILE_HEADER_SIZE;
+    for(i = 0; i < count;) {
+        block = p;
+        p += 8;
+        for(n = 0; n < PRODUCT_CHECKSUM_BLOCK && i < count; n++) {
+            p = encodeProduct(p, &system->products[i++]);
+        }
+        putLe32(block, (unsigned)(p - block - 8));
+        putLe32(block + 4, crc32c(0, block + 8, p - block - 8));
+    }
+    
+    fd = openat(system->dir_fd, FILENAME_PRODUCTS ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && writeFully(fd, buffer, p - buffer);
+    if(!ok && fd >= 0) {
+        close(fd);
+        unlinkat(system->dir_fd, FILENAME_PRODUCTS ".tmp", 0);
+    }
+    if(!ok || !replaceFile(system->dir_fd, fd, FILENAME_PRODUCTS ".tmp", FILENAME_PRODUCTS)) {
+        printf("Error saving products!\n");
+    } else {
+        STAT_END(STAT_SAVE_PRODUCTS, t0, p - buffer);
+    }
+    free(buffer);
+    savePriceHistory(system);
+}
+
+// Writes the price chains to FILENAME_PRICES through a temp file, like the
+// products. After the header comes each product's version count and then its
+// versions, with times stored as the gap from the version before.
+void savePriceHistory(POSSystem *system) {
+    int count = system->product_count < system->price_chain_capacity ? system->product_count
+                                                                     : system->price_chain_capacity;
+    size_t size = PRICE_FILE_HEADER_SIZE;
+    unsigned char *buffer, *p;
+    PriceChain *chain;
+    long long since;
+    int i, j, fd, ok;
+    
+    for(i = 0; i < count; i++) {
+        size += 10 + (size_t)system->price_chains[i].count * 20;
+    }
+    buffer = malloc(size);
+    if(buffer == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    p = buffer + PRICE_FILE_HEADER_SIZE;
+    for(i = 0; i < count; i++) {
+        chain = &system->price_chains[i];
+        p = putVarint(p, (unsigned)chain->count);
+        for(j = 0, since = 0; j < chain->count; j++) {
+            p = putSigned(p, chain->versions[j].since - since);
+            p = putSigned(p, chain->versions[j].price);
+            since = chain->versions[j].since;
+        }
+    }
+    putLe32(buffer, PRICE_FILE_MAGIC);
+    putLe32(buffer + 4, PRICE_FILE_VERSION);
+    putLe32(buffer + 8, (unsigned)count);
+    putLe32(buffer + 12, crc32c(0, buffer + PRICE_FILE_HEADER_SIZE, p - buffer - PRICE_FILE_HEADER_SIZE));
+    putLe32(buffer + 16, crc32c(0, buffer, 16));
+    
+    fd = openat(system->dir_fd, FILENAME_PRICES ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && writeFully(fd, buffer, p - buffer);
+    if(!ok && fd >= 0) {
+        close(fd);
+        unlinkat(system->dir_fd, FILENAME_PRICES ".tmp", 0);
+    }
+    if(!ok || !replaceFile(system->dir_fd, fd, FILENAME_PRICES ".tmp", FILENAME_PRICES)) {
+        printf("Error saving price history!\n");
+    }
+    free(buffer);
+}
+
+// Reads FILENAME_PRICES back into the price chains. Without the file every
+// product has only ever had its current price.
+void loadPriceHistory(POSSystem *system) {
+    struct stat st;
+    unsigned char *buffer = NULL;
+    const unsigned char *p, *end;
+    unsigned long long versions;
+    long long since, gap, price;
+    unsigned count = 0;
+    int fd = openat(system->dir_fd, FILENAME_PRICES, O_RDONLY);
+    int ok, i, j;
+    
+    if(fd < 0) {
+        return;
+    }
+    ok = fstat(fd, &st) == 0 && st.st_size >= PRICE_FILE_HEADER_SIZE && (buffer = malloc(st.st_size)) != NULL &&
+         pread(fd, buffer, st.st_size, 0) == (ssize_t)st.st_size;
+    close(fd);
+    ok = ok && getLe32(buffer) == PRICE_FILE_MAGIC && getLe32(buffer + 4) == PRICE_FILE_VERSION &&
+         getLe32(buffer + 16) == crc32c(0, buffer, 16) &&
+         getLe32(buffer + 12) == crc32c(0, buffer + PRICE_FILE_HEADER_SIZE, st.st_size - PRICE_FILE_HEADER_SIZE) &&
+         (count = getLe32(buffer + 8)) <= (unsigned)system->product_count;
+    if(ok) {
+        reservePriceChains(system, (int)count);
+        p = buffer + PRICE_FILE_HEADER_SIZE;
+        end = buffer + st.st_size;
+        for(i = 0; ok && i < (int)count; i++) {
+            p = getVarint(p, end, &versions);
+            for(j = 0, since = 0; p != NULL && (unsigned long long)j < versions; j++) {
+                p = getSigned(p, end, &gap);
+                p = getSigned(p, end, &price);
+                since += gap;
+                addPriceVersion(system, i, since, price);
+            }
+            ok = p != NULL;
+        }
+    }
+    free(buffer);
+    if(!ok) {
+        printf("%s has an unsupported version or is corrupt!\n", FILENAME_PRICES);
+        exit(1);
+    }
+}
+
+// Reads a version 4 file into the catalog. Returns the product count, or -1 if
+// the file is malformed.
+static int readCompactProducts(POSSystem *system, int fd, off_t file_size) {
+    unsigned char *buffer = malloc(file_size);
+    const unsigned char *p, *end = buffer + file_size, *block_end;
+    unsigned count = 0, block_size = 0, length, i;
+    unsigned loaded = 0;
+    int ok;
+    
+    ok = buffer != NULL && file_size >= PRODUCT_FILE_HEADER_SIZE &&
+         pread(fd, buffer, file_size, 0) == (ssize_t)file_size && getLe32(buffer + 16) == crc32c(0, buffer, 16);
+    if(ok) {
+        count = getLe32(buffer + 8);
+        block_size = getLe32(buffer + 12);
+        // every product takes at least six bytes, which bounds count by the file
+        ok = block_size > 0 && count <= (unsigned)(file_size / 6) &&
+             resizeProducts(system, count > PRODUCT_INITIAL_CAPACITY ? (int)count : PRODUCT_INITIAL_CAPACITY);
+    }
+    p = buffer + PRODUCT_FILE_HEADER_SIZE;
+    while(ok && loaded < count) {
+        length = end - p >= 8 ? getLe32(p) : 0;
+        ok = end - p >= 8 && length <= (size_t)(end - p - 8);
+        if(ok && crc32c(0, p + 8, length) != getLe32(p + 4)) {
+            printf("%s is corrupt: products from record %u fail their checksum!\n", FILENAME_PRODUCTS, loaded);
+            exit(1);
+        }
+        block_end = p + 8 + length;
+        for(p += 8, i = 0; ok && i < block_size && loaded < count; i++) {
+            p = decodeProduct(p, block_end, &system->products[loaded++]);
+            ok = p != NULL;
+        }
+        ok = ok && p == block_end;
+    }
+    ok = ok && p == end;
+    free(buffer);
+    return ok ? (int)count : -1;
+}
+
+// Reads the catalog into memory. Every size is checked against the file before
+// it is trusted, and from version 3 every block against its CRC32C. Older
+// versions held raw Product records and are converted on the way in.
+void loadProducts(POSSystem *system) {
+    STAT_BEGIN(t0);
+    ProductFileHeader header;
+    unsigned char prefix[8];
+    struct stat st;
+    int fd = openat(system->dir_fd, FILENAME_PRODUCTS, O_RDONLY);
+    int count = 0, blocks = 0, version = PRODUCT_FILE_VERSION, legacy = 0, ok = 1, i;
+    off_t offset = sizeof(ProductFileHeader);
+    unsigned *sums = NULL;
+    
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        printf("No previous product data found. Starting fresh.\n");
+        if(!resizeProducts(system, PRODUCT_INITIAL_CAPACITY)) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        system->product_count = 0;
+        buildSearchIndex(system);
+        buildLowStock(system);
+        return;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    if(pread(fd, prefix, sizeof(prefix), 0) == (ssize_t)sizeof(prefix) && getLe32(prefix) == PRODUCT_FILE_MAGIC &&
+       getLe32(prefix + 4) == PRODUCT_FILE_VERSION) {
+        count = readCompactProducts(system, fd, st.st_size);
+        ok = count >= 0;
+    } else if(pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+              header.magic != PRODUCT_FILE_MAGIC) {
+        version = 0;
+        legacy = 1;
+        offset = sizeof(int);
+        ok = pread(fd, &count, sizeof(int), 0) == (ssize_t)sizeof(int) && count >= 0 &&
+             st.st_size == (off_t)sizeof(int) + (off_t)count * (off_t)sizeof(LegacyProduct);
+        if(!ok) {
+            printf("%s is not a POS product file!\n", FILENAME_PRODUCTS);
+            exit(1);
+        }
+    } else {
+        version = header.version;
+        count = header.count;
+        if(version == 1) {
+            legacy = 1;
+            ok = header.record_size == sizeof(LegacyProduct) &&
+                 offset + (off_t)count * (off_t)sizeof(LegacyProduct) <= st.st_size;
+        } else if(version == 2) {
+            ok = header.record_size == sizeof(Product) && count <= header.capacity &&
+                 offset + (off_t)count * (off_t)sizeof(Product) <= st.st_size;
+        } else if(version == 3) {
+            blocks = header.block_size > 0 ? (int)((count + (long long)header.block_size - 1) / header.block_size) : 0;
+            ok = header.checksum == productHeaderChecksum(&header) && header.record_size == sizeof(Product) &&
+                 header.block_size > 0 && header.block_size <= INT_MAX &&
+                 st.st_size == offset + (off_t)count * (off_t)sizeof(Product) + (off_t)blocks * (off_t)sizeof(unsigned);
+        } else {
+            ok = 0;
+        }
+        ok = ok && header.header_size == sizeof(ProductFileHeader) && count >= 0;
+    }
+    
+    if(ok && version < PRODUCT_FILE_VERSION) {
+        if(!resizeProducts(system, count > PRODUCT_INITIAL_CAPACITY ? count : PRODUCT_INITIAL_CAPACITY)) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        if(legacy) {
+            ok = readLegacyProducts(system, fd, offset, count);
+        } else {
+            ok = pread(fd, system->products, sizeof(Product) * count, offset) == (ssize_t)(sizeof(Product) * count);
+        }
+    }
+    if(ok && blocks > 0) {
+        sums = malloc(sizeof(unsigned) * blocks);
+        ok = sums != NULL && pread(fd, sums, sizeof(unsigned) * blocks, offset + (off_t)count * sizeof(Product)) ==
+                                 (ssize_t)(sizeof(unsigned) * blocks);
+        for(i = 0; ok && i < blocks; i++) {
+            if(sums[i] != productBlockChecksum(system->products, count, i, (int)header.block_size)) {
+                printf("%s is corrupt: products from record %lld fail their checksum!\n", FILENAME_PRODUCTS,
+                       (long long)i * header.block_size);
+                exit(1);
+            }
+        }
+        free(sums);
+    }
+    close(fd);
+    if(!ok) {
+        printf("%s has an unsupported version or is corrupt!\n", FILENAME_PRODUCTS);
+        exit(1);
+    }
+    
+    system->product_count = count;
+    if(version < PRODUCT_FILE_VERSION) {
+        saveProducts(system);
+        printf("Converted product file to version %d.\n", PRODUCT_FILE_VERSION);
+    }
+    loadPriceHistory(system);
+    buildSearchIndex(system);
+    buildLowStock(system);
+    STAT_END(STAT_LOAD_PRODUCTS, t0, st.st_size);
+    printf("Loaded %d products.\n", system->product_count);
+}
+
+static unsigned nameHash(const char *name) {
+    unsigned h = 2166136261u;
+    
+    while(*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+// Returns the dictionary id of name, adding it if it is new.
+static int internName(POSSystem *system, const char *name) {
+    unsigned h, mask;
+    int i, id;
+    
+    if((system->name_count + 1) * 2 > system->name_slot_capacity) {
+        int capacity = system->name_slot_capacity ? system->name_slot_capacity * 2 : 256;
+        free(system->name_slots);
+        system->name_slots = malloc(sizeof(int) * capacity);
+        if(system->name_slots == NULL) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+        system->name_slot_capacity = capacity;
+        for(i = 0; i < capacity; i++) {
+            system->name_slots[i] = -1;
+        }
+        for(i = 0; i < system->name_count; i++) {
+            h = nameHash(system->names[i]) & (capacity - 1);
+            while(system->name_slots[h] >= 0) {
+                h = (h + 1) & (capacity - 1);
+            }
+            system->name_slots[h] = i;
+        }
+    }
+    mask = (unsigned)system->name_slot_capacity - 1;
+    for(h = nameHash(name) & mask; system->name_slots[h] >= 0; h = (h + 1) & mask) {
+        if(strcmp(system->names[system->name_slots[h]], name) == 0) {
+            return system->name_slots[h];
+        }
+    }
+    if(system->name_count == system->name_capacity) {
+        system->names = growArray(system->names, &system->name_capacity, MAX_NAME_LENGTH);
+    }
+    id = system->name_count++;
+    snprintf(system->names[id], MAX_NAME_LENGTH, "%s", name);
+    system->name_slots[h] = id;
+    return id;
+}
+
+// Reassembles sale number index from the columns.
+void getSale(POSSystem *system, int index, Sale *sale) {
+    SaleChunk *chunk = system->sale_chunks[index / SALE_CHUNK_SIZE];
+    int row = index % SALE_CHUNK_SIZE;
+    
+    sale->id = chunk->id[row];
+    sale->product_id = chunk->product_id[row];
+    memcpy(sale->product_name, system->names[chunk->name_id[row]], MAX_NAME_LENGTH);
+    sale->quantity = chunk->quantity[row];
+    sale->price = chunk->price_cents[row];
+    sale->total = chunk->total_cents[row];
+    sale->timestamp = (time_t)chunk->timestamp[row];
+}
+
+// Makes sure the chunk holding sale number index exists.
+static void reserveSaleChunk(POSSystem *system, int index) {
+    int chunk = index / SALE_CHUNK_SIZE;
+    
+    if(chunk < system->sale_chunk_count) {
+        return;
+    }
+    if(system->sale_chunk_count == system->sale_chunk_capacity) {
+        system->sale_chunks = growArray(system->sale_chunks, &system->sale_chunk_capacity, sizeof(SaleChunk *));
+    }
+    system->sale_chunks[chunk] = aligned_alloc(64, sizeof(SaleChunk));
+    if(system->sale_chunks[chunk] == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    system->sale_chunk_count++;
+}
+
+// Appends a sale to the columns. Existing sales are never copied or moved.
+void appendSale(POSSystem *system, Sale *sale) {
+    SaleChunk *chunk;
+    int row = system->sale_count % SALE_CHUNK_SIZE;
+    
+    reserveSaleChunk(system, system->sale_count);
+    chunk = system->sale_chunks[system->sale_count / SALE_CHUNK_SIZE];
+    chunk->timestamp[row] = sale->timestamp;
+    chunk->total_cents[row] = sale->total;
+    chunk->price_cents[row] = sale->price;
+    chunk->id[row] = sale->id;
+    chunk->product_id[row] = sale->product_id;
+    chunk->quantity[row] = sale->quantity;
+    chunk->name_id[row] = internName(system, sale->product_name);
+    system->sale_count++;
+}
+
+// Aggregation kernels over one chunk's columns. The AVX2 and SSE4.2 versions
+// are compiled for their targets and picked at run time; all return exactly
+// what the scalar loop returns.
+static long long rangeSumScalar(const long long *timestamp, const long long *cents, int count,
+                                long long from, long long to) {
+    long long sum = 0;
+    int i;
+    
+    for(i = 0; i < count; i++) {
+        if(timestamp[i] >= from && timestamp[i] < to) {
+            sum += cents[i];
+        }
+    }
+    return sum;
+}
+
+static long long productSumScalar(const int *product_id, const int *quantity, const long long *timestamp,
+                                  const long long *cents, int count, int product,
+                                  long long from, long long to, long long *units) {
+    long long sum = 0;
+    int i;
+    
+    for(i = 0; i < count; i++) {
+        if(product_id[i] == product && timestamp[i] >= from && timestamp[i] < to) {
+            sum += cents[i];
+            *units += quantity[i];
+        }
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static long long rangeSumAvx2(const long long *timestamp, const long long *cents, int count,
+                              long long from, long long to) {
+    __m256i low = _mm256_set1_epi64x(from - 1), high = _mm256_set1_epi64x(to), sum = _mm256_setzero_si256();
+    long long lanes[4];
+    int i;
+    
+    for(i = 0; i + 4 <= count; i += 4) {
+        __m256i t = _mm256_loadu_si256((const __m256i *)(timestamp + i));
+        __m256i in = _mm256_and_si256(_mm256_cmpgt_epi64(t, low), _mm256_cmpgt_epi64(high, t));
+        sum = _mm256_add_epi64(sum, _mm256_and_si256(in, _mm256_loadu_si256((const __m256i *)(cents + i))));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + rangeSumScalar(timestamp + i, cents + i, count - i, from, to);
+}
+
+__attribute__((target("sse4.2")))
+static long long rangeSumSse(const long long *timestamp, const long long *cents, int count,
+                             long long from, long long to) {
+    __m128i low = _mm_set1_epi64x(from - 1), high = _mm_set1_epi64x(to), sum = _mm_setzero_si128();
+    long long lanes[2];
+    int i;
+    
+    for(i = 0; i + 2 <= count; i += 2) {
+        __m128i t = _mm_loadu_si128((const __m128i *)(timestamp + i));
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi64(t, low), _mm_cmpgt_epi64(high, t));
+        sum = _mm_add_epi64(sum, _mm_and_si128(in, _mm_loadu_si128((const __m128i *)(cents + i))));
+    }
+    _mm_storeu_si128((__m128i *)lanes, sum);
+    return lanes[0] + lanes[1] + rangeSumScalar(timestamp + i, cents + i, count - i, from, to);
+}
+
+// Product kernels compare 8 (AVX2) or 4 (SSE) product ids at once and only
+// touch the other columns for the rare blocks that contain a match.
+__attribute__((target("avx2")))
+static long long productSumAvx2(const int *product_id, const int *quantity, const long long *timestamp,
+                                const long long *cents, int count, int product,
+                                long long from, long long to, long long *units) {
+    __m256i want = _mm256_set1_epi32(product);
+    long long sum = 0;
+    int i, mask;
+    
+    for(i = 0; i + 8 <= count; i += 8) {
+        __m256i id = _mm256_loadu_si256((const __m256i *)(product_id + i));
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(id, want)));
+        while(mask) {
+            int row = i + __builtin_ctz(mask);
+            if(timestamp[row] >= from && timestamp[row] < to) {
+                sum += cents[row];
+                *units += quantity[row];
+            }
+            mask &= mask - 1;
+        }
+    }
+    return sum + productSumScalar(product_id + i, quantity + i, timestamp + i, cents + i, count - i,
+                                  product, from, to, units);
+}
+
+__attribute__((target("sse4.2")))
+static long long productSumSse(const int *product_id, const int *quantity, const long long *timestamp,
+                               const long long *cents, int count, int product,
+                               long long from, long long to, long long *units) {
+    __m128i want = _mm_set1_epi32(product);
+    long long sum = 0;
+    int i, mask;
+    
+    for(i = 0; i + 4 <= count; i += 4) {
+        __m128i id = _mm_loadu_si128((const __m128i *)(product_id + i));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(id, want)));
+        while(mask) {
+            int row = i + __builtin_ctz(mask);
+            if(timestamp[row] >= from && timestamp[row] < to) {
+                sum += cents[row];
+                *units += quantity[row];
+            }
+            mask &= mask - 1;
+        }
+    }
+    return sum + productSumScalar(product_id + i, quantity + i, timestamp + i, cents + i, count - i,
+                                  product, from, to, units);
+}
+
+__attribute__((target("sse4.2")))
+static unsigned crc32cSse(unsigned crc, const void *data, size_t size) {
+    const unsigned char *p = data;
+    unsigned long long c = ~crc;
+    unsigned word;
+    
+#ifdef __x86_64__
+    unsigned long long wide;
+    
+    for(; size >= 8; p += 8, size -= 8) {
+        memcpy(&wide, p, 8);
+        c = _mm_crc32_u64(c, wide);
+    }
+#endif
+    for(; size >= 4; p += 4, size -= 4) {
+        memcpy(&word, p, 4);
+        c = _mm_crc32_u32((unsigned)c, word);
+    }
+    for(; size > 0; p++, size--) {
+        c = _mm_crc32_u8((unsigned)c, *p);
+    }
+    return ~(unsigned)c;
+}
+#endif
+
+typedef long long (*RangeSumKernel)(const long long *, const long long *, int, long long, long long);
+typedef long long (*ProductSumKernel)(const int *, const int *, const long long *, const long long *, int, int,
+                                      long long, long long, long long *);
+
+static RangeSumKernel rangeSum = NULL;
+static ProductSumKernel productSum = NULL;
+
+// Picks the widest kernels this CPU supports. POS_SIMD=scalar|sse|avx2 overrides.
+static const char *selectKernels(void) {
+    const char *force = getenv("POS_SIMD");
+    
+    rangeSum = rangeSumScalar;
+    productSum = productSumScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if((force == NULL || strcmp(force, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        rangeSum = rangeSumAvx2;
+        productSum = productSumAvx2;
+        return "avx2";
+    }
+    if((force == NULL || strcmp(force, "sse") == 0) && __builtin_cpu_supports("sse4.2")) {
+        rangeSum = rangeSumSse;
+        productSum = productSumSse;
+        return "sse4.2";
+    }
+#endif
+    (void)force;
+    return "scalar";
+}
+
+static unsigned crcTable[256];
+
+static unsigned crc32cScalar(unsigned crc, const void *data, size_t size) {
+    const unsigned char *p = data;
+    unsigned c;
+    int i, k;
+    
+    if(crcTable[1] == 0) {
+        for(i = 0; i < 256; i++) {
+            c = i;
+            for(k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+            }
+            crcTable[i] = c;
+        }
+    }
+    crc = ~crc;
+    while(size-- > 0) {
+        crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+typedef unsigned (*ChecksumKernel)(unsigned, const void *, size_t);
+
+static ChecksumKernel checksum = NULL;
+
+// CRC32C (Castagnoli) of size bytes, carrying on from crc; start with 0. The
+// SSE4.2 crc32 instruction is used when the CPU has it, unless POS_SIMD=scalar.
+unsigned crc32c(unsigned crc, const void *data, size_t size) {
+    if(checksum == NULL) {
+        const char *force = getenv("POS_SIMD");
+        ChecksumKernel kernel = crc32cScalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if((force == NULL || strcmp(force, "scalar") != 0) && __builtin_cpu_supports("sse4.2")) {
+            kernel = crc32cSse;
+        }
+#endif
+        (void)force;
+        checksum = kernel;
+    }
+    return checksum(crc, data, size);
+}
+
+static int rowsInChunk(POSSystem *system, int chunk) {
+    int rows = system->sale_count - chunk * SALE_CHUNK_SIZE;
+    return rows < SALE_CHUNK_SIZE ? rows : SALE_CHUNK_SIZE;
+}
+
+// Report engine: totals per product over a range are gathered in an
+// open-addressing hash keyed by product id, then the best n are picked with a
+// bounded min-heap, so ranking costs O(products * log n) rather than a sort.
+static void initAggregate(ProductAggregate *aggregate) {
+    aggregate->totals = NULL;
+    aggregate->count = 0;
+    aggregate->capacity = 0;
+    aggregate->slots = NULL;
+    aggregate->slot_capacity = 0;
+}
+
+static void freeAggregate(ProductAggregate *aggregate) {
+    free(aggregate->totals);
+    free(aggregate->slots);
+    initAggregate(aggregate);
+}
+
+static void rehashAggregate(ProductAggregate *aggregate, int capacity) {
+    int i;
+    unsigned h;
+    
+    free(aggregate->slots);
+    aggregate->slots = malloc(sizeof(int) * capacity);
+    if(aggregate->slots == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    aggregate->slot_capacity = capacity;
+    for(i = 0; i < capacity; i++) {
+        aggregate->slots[i] = -1;
+    }
+    for(i = 0; i < aggregate->count; i++) {
+        h = ((unsigned)aggregate->totals[i].product_id * 2654435761u) & (capacity - 1);
+        while(aggregate->slots[h] >= 0) {
+            h = (h + 1) & (capacity - 1);
+        }
+        aggregate->slots[h] = i;
+    }
+}
+
+static void addToAggregate(ProductAggregate *aggregate, int product_id, long long quantity, Money revenue) {
+    unsigned h, mask;
+    ProductTotal *total;
+    
+    if((aggregate->count + 1) * 2 > aggregate->slot_capacity) {
+        rehashAggregate(aggregate, aggregate->slot_capacity ? aggregate->slot_capacity * 2 : 256);
+    }
+    mask = (unsigned)aggregate->slot_capacity - 1;
+    for(h = ((unsigned)product_id * 2654435761u) & mask; aggregate->slots[h] >= 0; h = (h + 1) & mask) {
+        total = &aggregate->totals[aggregate->slots[h]];
+        if(total->product_id == product_id) {
+            total->quantity += quantity;
+            total->revenue += revenue;
+            return;
+        }
+    }
+    if(aggregate->count == aggregate->capacity) {
+        aggregate->totals = growArray(aggregate->totals, &aggregate->capacity, sizeof(ProductTotal));
+    }
+    total = &aggregate->totals[aggregate->count];
+    total->product_id = product_id;
+    total->quantity = quantity;
+    total->revenue = revenue;
+    aggregate->slots[h] = aggregate->count++;
+}
+
+// Index of the first product-day rollup on or after day.
+static int firstProductDayAtOrAfter(POSSystem *system, int day) {
+    int low = 0, high = system->product_day_count, mid;
+    
+    while(low < high) {
+        mid = (low + high) / 2;
+        if(system->product_days[mid].day < day) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Rollup entry for (day, product), or NULL if nothing was sold.
+ProductDayRollup *findProductDay(POSSystem *system, int day, int product_id) {
+    unsigned h, mask;
+    ProductDayRollup *entry;
+    
+    if(system->product_day_slot_capacity == 0) {
+        return NULL;
+    }
+    mask = (unsigned)system->product_day_slot_capacity - 1;
+    for(h = productDayHash(day, product_id) & mask; system->product_day_slots[h] >= 0; h = (h + 1) & mask) {
+        entry = &system->product_days[system->product_day_slots[h]];
+        if(entry->day == day && entry->product_id == product_id) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// 1 if a ranks above b: larger quantity or revenue first, lower id on ties.
+static int ranksAbove(const ProductTotal *a, const ProductTotal *b, int by) {
+    long long x = by == RANK_BY_REVENUE ? a->revenue : a->quantity;
+    long long y = by == RANK_BY_REVENUE ? b->revenue : b->quantity;
+    
+    return x != y ? x > y : a->product_id < b->product_id;
+}
+
+// Restores the heap below position i; the root is the lowest-ranked kept total.
+static void siftDown(ProductTotal *heap, int count, int i, int by) {
+    int child;
+    ProductTotal moving = heap[i];
+    
+    for(; (child = 2 * i + 1) < count; i = child) {
+        if(child + 1 < count && ranksAbove(&heap[child], &heap[child + 1], by)) {
+            child++;
+        }
+        if(!ranksAbove(&moving, &heap[child], by)) {
+            break;
+        }
+        heap[i] = heap[child];
+    }
+    heap[i] = moving;
+}
+
+// Copies the n best of totals[0..count) into top, best first; returns how many.
+int selectTopProducts(const ProductTotal *totals, int count, int by, ProductTotal *top, int n) {
+    int i, kept = 0;
+    ProductTotal last;
+    
+    if(n <= 0) {
+        return 0;
+    }
+    for(i = 0; i < count; i++) {
+        if(kept < n) {
+            // sift the new total up from the bottom
+            int at = kept++, parent;
+            for(; at > 0 && ranksAbove(&top[parent = (at - 1) / 2], &totals[i], by); at = parent) {
+                top[at] = top[parent];
+            }
+            top[at] = totals[i];
+        } else if(ranksAbove(&totals[i], &top[0], by)) {
+            top[0] = totals[i];
+            siftDown(top, kept, 0, by);
+        }
+    }
+    // heap sort in place: repeatedly move the lowest-ranked to the end
+    for(i = kept - 1; i > 0; i--) {
+        last = top[i];
+        top[i] = top[0];
+        top[0] = last;
+        siftDown(top, i, 0, by);
+    }
+    return kept;
+}
+
+// Best n products by quantity or revenue over days [from_day, to_day], read
+// from the product-day rollups.
+int topProducts(POSSystem *system, int from_day, int to_day, int by, ProductTotal *top, int n) {
+    ProductAggregate aggregate;
+    ProductDayRollup *entry;
+    int i, kept;
+    
+    initAggregate(&aggregate);
+    for(i = firstProductDayAtOrAfter(system, from_day); i < system->product_day_count; i++) {
+        entry = &system->product_days[i];
+        if(entry->day > to_day) {
+            break;
+        }
+        addToAggregate(&aggregate, entry->product_id, entry->quantity, entry->revenue);
+    }
+    kept = selectTopProducts(aggregate.totals, aggregate.count, by, top, n);
+    freeAggregate(&aggregate);
+    return kept;
+}
+
+// Report pool: reports split a run of sale chunks between the calling thread
+// and a set of long-lived workers. Each participant owns a range of chunks
+// packed into one word (first << 32 | end) that is only ever changed by
+// compare-and-swap: the owner takes chunks off the front and, once its range
+// is empty, steals the back half of another participant's range. Every
+// participant folds its chunks into its own partial result, and the caller
+// merges the partials in participant order once all are done. The reports
+// only add integers, so the merged result is exactly the serial one however
+// the chunks were shared out.
+typedef void (*ChunkTask)(POSSystem *system, int chunk, const void *query, void *partial);
+
+typedef struct {
+    unsigned long long range;           // first << 32 | end of the chunks left
+    char padding[56];                   // one cache line per participant
+} WorkRange;
+
+typedef struct {
+    pthread_t *threads;
+    int thread_count;                   // workers; the caller is participant 0
+    WorkRange *ranges;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;           // bumped for every job
+    int participants;
+    int running;                        // participants still working
+    POSSystem *system;
+    ChunkTask task;
+    const void *query;
+    char *partials;
+    size_t partial_size;
+} ReportPool;
+
+static ReportPool reportPool = {NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, NULL, NULL, NULL, 0};
+static int reportThreads = 0;           // participants per report, 0 = not chosen yet
+static __thread int reportSerial = 0;   // set on store threads of a chain, which run reports alone
+
+// Threads reports may use: POS_THREADS if set, otherwise the online CPUs.
+int chooseReportThreads(void) {
+    const char *forced = getenv("POS_THREADS");
+    long threads = forced != NULL ? atol(forced) : sysconf(_SC_NPROCESSORS_ONLN);
+    
+    setReportThreads(threads > 0 ? (int)threads : 1);
+    return reportThreads;
+}
+
+void setReportThreads(int threads) {
+    reportThreads = threads < 1 ? 1 : threads > REPORT_MAX_THREADS ? REPORT_MAX_THREADS : threads;
+}
+
+// Takes the next chunk for participant self, stealing if its own range is
+// empty; returns -1 once every chunk of the job has been taken.
+static int takeChunk(ReportPool *pool, int self) {
+    unsigned long long range, first, end, middle;
+    int i, victim;
+    
+    for(;;) {
+        range = __atomic_load_n(&pool->ranges[self].range, __ATOMIC_ACQUIRE);
+        first = range >> 32;
+        end = range & 0xffffffffu;
+        if(first >= end) {
+            break;
+        }
+        if(__atomic_compare_exchange_n(&pool->ranges[self].range, &range, (first + 1) << 32 | end, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (int)first;
+        }
+    }
+    for(i = 1; i < pool->participants; i++) {
+        victim = (self + i) % pool->participants;
+        range = __atomic_load_n(&pool->ranges[victim].range, __ATOMIC_ACQUIRE);
+        while((first = range >> 32) < (end = range & 0xffffffffu)) {
+            if(end - first == 1) {
+                // a single chunk is taken whole
+                if(__atomic_compare_exchange_n(&pool->ranges[victim].range, &range, end << 32 | end, 0,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    return (int)first;
+                }
+                continue;
+            }
+            middle = first + (end - first) / 2;
+            if(__atomic_compare_exchange_n(&pool->ranges[victim].range, &range, first << 32 | middle, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                // keep the stolen back half, minus the chunk returned now
+                __atomic_store_n(&pool->ranges[self].range, (middle + 1) << 32 | end, __ATOMIC_RELEASE);
+                return (int)middle;
+            }
+        }
+    }
+    return -1;
+}
+
+static void runParticipant(ReportPool *pool, int self) {
+    void *partial = pool->partials + pool->partial_size * self;
+    int chunk;
+    
+    while((chunk = takeChunk(pool, self)) >= 0) {
+        pool->task(pool->system, chunk, pool->query, partial);
+    }
+}
+
+static void *reportWorker(void *arg) {
+    ReportPool *pool = &reportPool;
+    int self = (int)(ptrdiff_t)arg;
+    unsigned long seen = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        seen = pool->generation;
+        if(self >= pool->participants) {
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        runParticipant(pool, self);
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->running == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    return NULL;
+}
+
+// Runs task over chunks [0, chunks) on up to reportThreads threads. partials
+// holds one partial result of partial_size bytes per participant; returns how
+// many participants were used (and so how many partials to merge).
+static int runChunks(POSSystem *system, int chunks, ChunkTask task, const void *query, void *partials,
+              size_t partial_size) {
+    ReportPool *pool = &reportPool;
+    int participants, i;
+    
+    participants = reportSerial ? 1 : reportThreads ? reportThreads : chooseReportThreads();
+    if(participants > chunks) {
+        participants = chunks > 0 ? chunks : 1;
+    }
+    if(participants == 1) {
+        for(i = 0; i < chunks; i++) {
+            task(system, i, query, partials);
+        }
+        return 1;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    if(pool->ranges == NULL) {
+        pool->ranges = aligned_alloc(64, sizeof(WorkRange) * REPORT_MAX_THREADS);
+        pool->threads = malloc(sizeof(pthread_t) * REPORT_MAX_THREADS);
+        if(pool->ranges == NULL || pool->threads == NULL) {
+            printf("Out of memory!\n");
+            exit(1);
+        }
+    }
+    while(pool->thread_count < participants - 1) {
+        if(pthread_create(&pool->threads[pool->thread_count], NULL, reportWorker,
+                          (void *)(ptrdiff_t)(pool->thread_count + 1)) != 0) {
+            break;
+        }
+        pthread_detach(pool->threads[pool->thread_count]);
+        pool->thread_count++;
+    }
+    if(participants > pool->thread_count + 1) {
+        participants = pool->thread_count + 1;
+    }
+    // an even split up front; stealing evens out whatever runs slow
+    for(i = 0; i < participants; i++) {
+        pool->ranges[i].range = (unsigned long long)(chunks * (long long)i / participants) << 32 |
+                                (unsigned long long)(chunks * (long long)(i + 1) / participants);
+    }
+    pool->system = system;
+    pool->task = task;
+    pool->query = query;
+    pool->partials = partials;
+    pool->partial_size = partial_size;
+    pool->participants = participants;
+    pool->running = participants;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    
+    runParticipant(pool, 0);
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->running--;
+    while(pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return participants;
+}
+
+typedef struct {
+    long long from;
+    long long to;
+    int product_id;
+} RangeQuery;
+
+typedef struct {
+    long long cents;
+    long long quantity;
+    char padding[48];                   // partials written by different threads
+} RangeSum;
+
+static void rangeSumTask(POSSystem *system, int chunk, const void *query, void *partial) {
+    const RangeQuery *q = query;
+    RangeSum *sum = partial;
+    SaleChunk *c = system->sale_chunks[chunk];
+    
+    sum->cents += rangeSum(c->timestamp, c->total_cents, rowsInChunk(system, chunk), q->from, q->to);
+}
+
+static void productSumTask(POSSystem *system, int chunk, const void *query, void *partial) {
+    const RangeQuery *q = query;
+    RangeSum *sum = partial;
+    SaleChunk *c = system->sale_chunks[chunk];
+    
+    sum->cents += productSum(c->product_id, c->quantity, c->timestamp, c->total_cents, rowsInChunk(system, chunk),
+                             q->product_id, q->from, q->to, &sum->quantity);
+}
+
+static void summaryTask(POSSystem *system, int chunk, const void *query, void *partial) {
+    const RangeQuery *q = query;
+    SalesSummary *summary = partial;
+    SaleChunk *c = system->sale_chunks[chunk];
+    int i, rows = rowsInChunk(system, chunk);
+    long long sales = 0, quantity = 0;
+    Money revenue = 0;
+    
+    for(i = 0; i < rows; i++) {
+        if(c->timestamp[i] >= q->from && c->timestamp[i] < q->to) {
+            sales++;
+            quantity += c->quantity[i];
+            revenue += c->total_cents[i];
+            addToAggregate(&summary->products, c->product_id[i], c->quantity[i], c->total_cents[i]);
+        }
+    }
+    summary->sales += sales;
+    summary->quantity += quantity;
+    summary->revenue += revenue;
+}
+
+static int compareProductIds(const void *a, const void *b) {
+    const ProductTotal *x = a, *y = b;
+    
+    return (x->product_id > y->product_id) - (x->product_id < y->product_id);
+}
+
+// Sales, units, revenue and per-product totals for from <= timestamp < to,
+// aggregated in parallel. summary->products.totals comes out in product id
+// order; release it with freeSalesSummary().
+void summarizeSales(POSSystem *system, time_t from, time_t to, SalesSummary *summary) {
+    RangeQuery query = {from, to, 0};
+    SalesSummary *partials = calloc(REPORT_MAX_THREADS, sizeof(SalesSummary));
+    int used, p, i;
+    
+    if(partials == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    used = runChunks(system, system->sale_chunk_count, summaryTask, &query, partials, sizeof(SalesSummary));
+    memset(summary, 0, sizeof(*summary));
+    initAggregate(&summary->products);
+    for(p = 0; p < used; p++) {
+        summary->sales += partials[p].sales;
+        summary->quantity += partials[p].quantity;
+        summary->revenue += partials[p].revenue;
+        for(i = 0; i < partials[p].products.count; i++) {
+            ProductTotal *t = &partials[p].products.totals[i];
+            addToAggregate(&summary->products, t->product_id, t->quantity, t->revenue);
+        }
+        freeAggregate(&partials[p].products);
+    }
+    free(partials);
+    if(summary->products.count > 0) {
+        qsort(summary->products.totals, summary->products.count, sizeof(ProductTotal), compareProductIds);
+        rehashAggregate(&summary->products, summary->products.slot_capacity);
+    }
+}
+
+void freeSalesSummary(SalesSummary *summary) {
+    freeAggregate(&summary->products);
+}
+
+// Revenue in cents of sales with from <= timestamp < to.
+long long revenueInRange(POSSystem *system, time_t from, time_t to) {
+    RangeQuery query = {from, to, 0};
+    RangeSum partials[REPORT_MAX_THREADS];
+    long long total = 0;
+    int used, p;
+    
+    if(rangeSum == NULL) {
+        selectKernels();
+    }
+    memset(partials, 0, sizeof(partials));
+    used = runChunks(system, system->sale_chunk_count, rangeSumTask, &query, partials, sizeof(RangeSum));
+    for(p = 0; p < used; p++) {
+        total += partials[p].cents;
+    }
+    return total;
+}
+
+// Revenue in cents (and units sold) of one product with from <= timestamp < to.
+long long productRevenue(POSSystem *system, int product_id, time_t from, time_t to, long long *quantity) {
+    RangeQuery query = {from, to, product_id};
+    RangeSum partials[REPORT_MAX_THREADS];
+    long long total = 0;
+    int used, p;
+    
+    if(productSum == NULL) {
+        selectKernels();
+    }
+    memset(partials, 0, sizeof(partials));
+    used = runChunks(system, system->sale_chunk_count, productSumTask, &query, partials, sizeof(RangeSum));
+    *quantity = 0;
+    for(p = 0; p < used; p++) {
+        total += partials[p].cents;
+        *quantity += partials[p].quantity;
+    }
+    return total;
+}
+
+// Same ranking straight from the sale columns, for ranges that do not fall on
+// day boundaries: sales with from <= timestamp < to.
+int topProductsInRange(POSSystem *system, time_t from, time_t to, int by, ProductTotal *top, int n) {
+    SalesSummary summary;
+    int kept;
+    
+    summarizeSales(system, from, to, &summary);
+    kept = selectTopProducts(summary.products.totals, summary.products.count, by, top, n);
+    freeSalesSummary(&summary);
+    return kept;
+}
+
+void viewProductRevenue(POSSystem *system) {
+    int id, days;
+    long long quantity, cents;
+    char amount[MONEY_TEXT_LENGTH];
+    time_t now = time(NULL);
+    
+    printf("Enter product ID: ");
+    scanf("%d", &id);
+    printf("Enter number of days (0 for all time): ");
+    scanf("%d", &days);
+    
+    cents = productRevenue(system, id, days > 0 ? now - (time_t)days * 24 * 3600 : 0, LLONG_MAX, &quantity);
+    printf("\n=== PRODUCT REVENUE ===\n");
+    printf("Units Sold: %lld\n", quantity);
+    printf("Revenue: $%s\n", formatMoney(cents, amount));
+}
+
+static unsigned saleBlockChecksum(const SaleBlockHeader *block, const Sale *sales) {
+    return crc32c(crc32c(0, &block->count, sizeof(block->count)), sales, sizeof(Sale) * block->count);
+}
+
+// Encodes the count sales from index from, which share one chunk, into out and
+// returns the size. The names these sales use for the first time come first,
+// since names are added to the dictionary in the order sales first use them;
+// *names counts the names written so far. Then come the columns one at a time,
+// all as varints: ids and timestamps as deltas from the row before, totals as
+// the difference from price * quantity, and everything else as is.
+static size_t encodeSaleBlock(POSSystem *system, int from, int count, int *names, unsigned char *out) {
+    SaleChunk *chunk = system->sale_chunks[from / SALE_CHUNK_SIZE];
+    int row = from % SALE_CHUNK_SIZE, last = *names - 1, i;
+    unsigned char *p = out;
+    long long previous;
+    size_t length;
+    
+    for(i = row; i < row + count; i++) {
+        if(chunk->name_id[i] > last) {
+            last = chunk->name_id[i];
+        }
+    }
+    p = putVarint(p, (unsigned long long)(last + 1 - *names));
+    for(; *names <= last; (*names)++) {
+        length = strnlen(system->names[*names], MAX_NAME_LENGTH - 1);
+        p = putVarint(p, length);
+        memcpy(p, system->names[*names], length);
+        p += length;
+    }
+    for(previous = 0, i = row; i < row + count; previous = chunk->id[i++]) {
+        p = putSigned(p, chunk->id[i] - previous - 1);
+    }
+    for(i = row; i < row + count; i++) {
+        p = putSigned(p, chunk->product_id[i]);
+    }
+    for(i = row; i < row + count; i++) {
+        p = putVarint(p, (unsigned long long)chunk->name_id[i]);
+    }
+    for(i = row; i < row + count; i++) {
+        p = putSigned(p, chunk->quantity[i]);
+    }
+    for(i = row; i < row + count; i++) {
+        p = putSigned(p, chunk->price_cents[i]);
+    }
+    for(i = row; i < row + count; i++) {
+        p = putSigned(p, chunk->total_cents[i] - chunk->price_cents[i] * chunk->quantity[i]);
+    }
+    for(previous = 0, i = row; i < row + count; previous = chunk->timestamp[i++]) {
+        p = putSigned(p, chunk->timestamp[i] - previous);
+    }
+    return p - out;
+}
+
+// Decodes a block written by encodeSaleBlock straight into the columns.
+static int decodeSaleBlock(POSSystem *system, const unsigned char *p, const unsigned char *end, int count,
+                           int *names) {
+    int row = system->sale_count % SALE_CHUNK_SIZE, i;
+    unsigned long long added = 0, length, name = 0;
+    long long value = 0, previous;
+    char text[MAX_NAME_LENGTH];
+    SaleChunk *chunk;
+    
+    if(row + count > SALE_CHUNK_SIZE) {
+        return 0;
+    }
+    p = getVarint(p, end, &added);
+    for(; p != NULL && added > 0; added--) {
+        p = getVarint(p, end, &length);
+        if(p == NULL || length >= MAX_NAME_LENGTH || length > (unsigned long long)(end - p)) {
+            return 0;
+        }
+        memset(text, 0, sizeof(text));
+        memcpy(text, p, length);
+        p += length;
+        // a name already in the dictionary here means the file repeats one
+        if(internName(system, text) != (*names)++) {
+            return 0;
+        }
+    }
+    reserveSaleChunk(system, system->sale_count);
+    chunk = system->sale_chunks[system->sale_count / SALE_CHUNK_SIZE];
+    for(previous = 0, i = row; i < row + count; previous = chunk->id[i++]) {
+        p = getSigned(p, end, &value);
+        chunk->id[i] = (int)(previous + value + 1);
+    }
+    for(i = row; i < row + count; i++) {
+        p = getSigned(p, end, &value);
+        chunk->product_id[i] = (int)value;
+    }
+    for(i = row; p != NULL && i < row + count; i++) {
+        p = getVarint(p, end, &name);
+        if(name >= (unsigned long long)*names) {
+            return 0;
+        }
+        chunk->name_id[i] = (int)name;
+    }
+    for(i = row; i < row + count; i++) {
+        p = getSigned(p, end, &value);
+        chunk->quantity[i] = (int)value;
+    }
+    for(i = row; i < row + count; i++) {
+        p = getSigned(p, end, &chunk->price_cents[i]);
+    }
+    for(i = row; i < row + count; i++) {
+        p = getSigned(p, end, &value);
+        chunk->total_cents[i] = chunk->price_cents[i] * chunk->quantity[i] + value;
+    }
+    for(previous = 0, i = row; i < row + count; previous = chunk->timestamp[i++]) {
+        p = getSigned(p, end, &value);
+        chunk->timestamp[i] = previous + value;
+    }
+    if(p != end) {
+        return 0;
+    }
+    system->sale_count += count;
+    return 1;
+}
+
+// Appends sales [from, to) at offset as blocks of at most one chunk each. A
+// block is compressed when that makes it at least an eighth smaller, unless
+// POS_COMPRESS=off. Returns the offset after the last block, or -1.
+static off_t writeSaleBlocks(POSSystem *system, int fd, int from, int to, off_t offset, int *names) {
+    size_t capacity = (size_t)SALE_CHUNK_SIZE * SALE_RECORD_MAX + 16, size, stored;
+    unsigned char *raw = malloc(SALE_BLOCK_HEADER_SIZE + capacity);
+    unsigned char *packed = malloc(SALE_BLOCK_HEADER_SIZE + capacity), *block;
+    const char *compress = getenv("POS_COMPRESS");
+    int count;
+    
+    if(raw == NULL || packed == NULL) {
+        free(raw);
+        free(packed);
+        return -1;
+    }
+    while(from < to) {
+        count = SALE_CHUNK_SIZE - from % SALE_CHUNK_SIZE;
+        if(count > to - from) {
+            count = to - from;
+        }
+        size = encodeSaleBlock(system, from, count, names, raw + SALE_BLOCK_HEADER_SIZE);
+        stored = compress == NULL || strcmp(compress, "off") != 0 ?
+                 lzCompress(raw + SALE_BLOCK_HEADER_SIZE, size, packed + SALE_BLOCK_HEADER_SIZE, size - size / 8) : 0;
+        block = stored > 0 ? packed : raw;
+        if(stored == 0) {
+            stored = size;
+        }
+        putLe32(block, SALE_BLOCK_MAGIC);
+        putLe32(block + 4, (unsigned)count);
+        putLe32(block + 8, (unsigned)size);
+        putLe32(block + 12, (unsigned)stored);
+        putLe32(block + 16, crc32c(crc32c(0, block, 16), block + SALE_BLOCK_HEADER_SIZE, stored));
+        if(pwrite(fd, block, SALE_BLOCK_HEADER_SIZE + stored, offset) != (ssize_t)(SALE_BLOCK_HEADER_SIZE + stored)) {
+            offset = -1;
+            break;
+        }
+        offset += SALE_BLOCK_HEADER_SIZE + stored;
+        from += count;
+    }
+    free(raw);
+    free(packed);
+    return offset;
+}
+
+static void encodeSaleCommit(unsigned char *out, long long sequence, off_t size, int count) {
+    putLe64(out, (unsigned long long)sequence);
+    putLe64(out + 8, (unsigned long long)size);
+    putLe32(out + 16, (unsigned)count);
+    putLe32(out + 20, crc32c(0, out, 20));
+}
+
+static int decodeSaleCommit(const unsigned char *in, SaleCommit *commit) {
+    commit->sequence = (long long)getLe64(in);
+    commit->size = (long long)getLe64(in + 8);
+    commit->count = (int)getLe32(in + 16);
+    commit->checksum = getLe32(in + 20);
+    return commit->checksum == crc32c(0, in, 20);
+}
+
+// Writes every sale in memory to temp, then renames it over path. Used when
+// there is no sales file yet and when converting an older version.
+static int writeSalesFile(POSSystem *system, const char *temp, const char *path) {
+    unsigned char head[SALES_FIRST_BLOCK];
+    int fd = openat(system->dir_fd, temp, O_RDWR | O_CREAT | O_TRUNC, 0644), names = 0;
+    off_t end = fd >= 0 ? writeSaleBlocks(system, fd, 0, system->sale_count, SALES_FIRST_BLOCK, &names) : -1;
+    
+    memset(head, 0, sizeof(head));
+    putLe32(head, SALES_FILE_MAGIC);
+    putLe32(head + 4, SALES_FILE_VERSION);
+    encodeSaleCommit(head + 32 + SALE_COMMIT_SIZE, 1, end, system->sale_count);
+    if(end < 0 || pwrite(fd, head, sizeof(head), 0) != (ssize_t)sizeof(head)) {
+        if(fd >= 0) {
+            close(fd);
+            unlinkat(system->dir_fd, temp, 0);
+        }
+        return 0;
+    }
+    if(!replaceFile(system->dir_fd, fd, temp, path)) {
+        return 0;
+    }
+    system->saved_sale_count = system->sale_count;
+    system->saved_name_count = names;
+    system->sales_file_size = end;
+    system->sales_sequence = 1;
+    return 1;
+}
+
+// Only sales made since the last save are appended. They are synced before
+// the other commit slot is written, so a torn append is simply ignored on load
+// and the slot the last save wrote is never overwritten by this one.
+void saveSales(POSSystem *system) {
+    STAT_BEGIN(t0);
+    unsigned char commit[SALE_COMMIT_SIZE];
+    long long sequence = system->sales_sequence + 1;
+    int names = system->saved_name_count;
+    off_t end;
+    int fd;
+    
+    if(system->sales_file_size == 0) {
+        if(!writeSalesFile(system, FILENAME_SALES ".tmp", FILENAME_SALES)) {
+            printf("Error saving sales!\n");
+            return;
+        }
+        saveRollups(system);
+        STAT_END(STAT_SAVE_SALES, t0, system->sales_file_size);
+        return;
+    }
+    fd = openat(system->dir_fd, FILENAME_SALES, O_RDWR);
+    if(fd < 0) {
+        printf("Error saving sales!\n");
+        return;
+    }
+    end = writeSaleBlocks(system, fd, system->saved_sale_count, system->sale_count, system->sales_file_size, &names);
+    encodeSaleCommit(commit, sequence, end, system->sale_count);
+    if(end < 0 || fsync(fd) != 0 ||
+       pwrite(fd, commit, sizeof(commit), 32 + (sequence % 2) * SALE_COMMIT_SIZE) != (ssize_t)sizeof(commit) ||
+       fsync(fd) != 0) {
+        printf("Error saving sales!\n");
+        close(fd);
+        return;
+    }
+    close(fd);
+    STAT_END(STAT_SAVE_SALES, t0, end - system->sales_file_size + SALE_COMMIT_SIZE);
+    system->saved_sale_count = system->sale_count;
+    system->saved_name_count = names;
+    system->sales_file_size = end;
+    system->sales_sequence = sequence;
+    saveRollups(system);
+}
+
+// Reads count sales stored from offset into the columns. legacy says the
+// records have the float layout of version 1 and earlier.
+static int readSaleRange(POSSystem *system, int fd, off_t offset, int count, int legacy) {
+    size_t record = legacy ? sizeof(LegacySale) : sizeof(Sale);
+    char *buffer = malloc(record * SALE_CHUNK_SIZE);
+    int index = 0, batch, i;
+    size_t size;
+    Sale sale;
+    
+    if(buffer == NULL) {
+        return 0;
+    }
+    while(index < count) {
+        batch = count - index < SALE_CHUNK_SIZE ? count - index : SALE_CHUNK_SIZE;
+        size = record * batch;
+        if(pread(fd, buffer, size, offset + (off_t)index * record) != (ssize_t)size) {
+            free(buffer);
+            return 0;
+        }
+        for(i = 0; i < batch; i++) {
+            if(legacy) {
+                LegacySale *old = (LegacySale *)(buffer + i * record);
+                sale.id = old->id;
+                sale.product_id = old->product_id;
+                memcpy(sale.product_name, old->product_name, MAX_NAME_LENGTH);
+                sale.quantity = old->quantity;
+                sale.price = moneyFromFloat(old->price);
+                sale.total = moneyFromFloat(old->total);
+                sale.timestamp = old->timestamp;
+            } else {
+                memcpy(&sale, buffer + i * record, sizeof(Sale));
+            }
+            sale.product_name[MAX_NAME_LENGTH - 1] = '\0';
+            appendSale(system, &sale);
+        }
+        index += batch;
+    }
+    free(buffer);
+    return 1;
+}
+
+// Reads one version 3 block of raw records at *offset, within limit.
+static int readRawSaleBlock(POSSystem *system, int fd, off_t *offset, off_t limit, int remaining, Sale *sales) {
+    SaleBlockHeader block;
+    int i;
+    
+    if(*offset + (off_t)sizeof(block) > limit || pread(fd, &block, sizeof(block), *offset) != (ssize_t)sizeof(block) ||
+       block.magic != SALE_BLOCK_MAGIC || block.count <= 0 || block.count > SALE_CHUNK_SIZE || block.count > remaining ||
+       *offset + (off_t)sizeof(block) + (off_t)block.count * (off_t)sizeof(Sale) > limit ||
+       pread(fd, sales, sizeof(Sale) * block.count, *offset + sizeof(block)) != (ssize_t)(sizeof(Sale) * block.count)) {
+        return 0;
+    }
+    if(block.checksum != saleBlockChecksum(&block, sales)) {
+        printf("%s is corrupt: the block at byte %lld fails its checksum!\n", FILENAME_SALES, (long long)*offset);
+        return 0;
+    }
+    for(i = 0; i < block.count; i++) {
+        sales[i].product_name[MAX_NAME_LENGTH - 1] = '\0';
+        appendSale(system, &sales[i]);
+    }
+    *offset += sizeof(block) + (off_t)block.count * sizeof(Sale);
+    return 1;
+}
+
+// Reads one version 4 block at *offset, within limit. stored and raw have room
+// for a whole block.
+static int readCompactSaleBlock(POSSystem *system, int fd, off_t *offset, off_t limit, int remaining, int *names,
+                                unsigned char *stored, unsigned char *raw) {
+    size_t capacity = (size_t)SALE_CHUNK_SIZE * SALE_RECORD_MAX + 16;
+    unsigned count, size, packed;
+    
+    if(*offset + SALE_BLOCK_HEADER_SIZE > limit ||
+       pread(fd, stored, SALE_BLOCK_HEADER_SIZE, *offset) != SALE_BLOCK_HEADER_SIZE) {
+        return 0;
+    }
+    count = getLe32(stored + 4);
+    size = getLe32(stored + 8);
+    packed = getLe32(stored + 12);
+    if(getLe32(stored) != SALE_BLOCK_MAGIC || count == 0 || count > SALE_CHUNK_SIZE || count > (unsigned)remaining ||
+       size > capacity || packed > size || *offset + SALE_BLOCK_HEADER_SIZE + (off_t)packed > limit ||
+       pread(fd, stored + SALE_BLOCK_HEADER_SIZE, packed, *offset + SALE_BLOCK_HEADER_SIZE) != (ssize_t)packed) {
+        return 0;
+    }
+    if(getLe32(stored + 16) != crc32c(crc32c(0, stored, 16), stored + SALE_BLOCK_HEADER_SIZE, packed)) {
+        printf("%s is corrupt: the block at byte %lld fails its checksum!\n", FILENAME_SALES, (long long)*offset);
+        return 0;
+    }
+    if(packed < size) {
+        if(lzDecompress(stored + SALE_BLOCK_HEADER_SIZE, packed, raw, capacity) != (long long)size) {
+            return 0;
+        }
+    } else {
+        raw = stored + SALE_BLOCK_HEADER_SIZE;
+    }
+    if(!decodeSaleBlock(system, raw, raw + size, (int)count, names)) {
+        return 0;
+    }
+    *offset += SALE_BLOCK_HEADER_SIZE + packed;
+    return 1;
+}
+
+// Reads the sales of a version 3 or 4 file up to its newest valid commit,
+// checking every block against its CRC32C. Anything after the commit is an
+// append that never finished and is left to be overwritten by the next save.
+static int readSaleBlocks(POSSystem *system, int fd, off_t file_size, int version) {
+    unsigned char slots[2 * SALE_COMMIT_SIZE];
+    SaleCommit commits[2], *commit = NULL;
+    size_t capacity = (size_t)SALE_CHUNK_SIZE * SALE_RECORD_MAX + 16;
+    unsigned char *stored = malloc(SALE_BLOCK_HEADER_SIZE + capacity), *raw = malloc(capacity);
+    off_t offset = SALES_FIRST_BLOCK;
+    int i, ok, names = 0;
+    
+    ok = stored != NULL && raw != NULL && pread(fd, slots, sizeof(slots), 32) == (ssize_t)sizeof(slots);
+    for(i = 0; ok && i < 2; i++) {
+        if(decodeSaleCommit(slots + i * SALE_COMMIT_SIZE, &commits[i]) &&
+           (commit == NULL || commits[i].sequence > commit->sequence)) {
+            commit = &commits[i];
+        }
+    }
+    ok = ok && commit != NULL && commit->count >= 0 && commit->size >= (long long)SALES_FIRST_BLOCK &&
+         commit->size <= file_size;
+    while(ok && system->sale_count < commit->count) {
+        if(version == 3) {
+            ok = readRawSaleBlock(system, fd, &offset, commit->size, commit->count - system->sale_count,
+                                  (Sale *)stored);
+        } else {
+            ok = readCompactSaleBlock(system, fd, &offset, commit->size, commit->count - system->sale_count, &names,
+                                      stored, raw);
+        }
+    }
+    free(stored);
+    free(raw);
+    if(!ok || offset != commit->size) {
+        return 0;
+    }
+    system->sales_file_size = commit->size;
+    system->sales_sequence = commit->sequence;
+    system->saved_name_count = names;
+    return 1;
+}
+
+void loadSales(POSSystem *system) {
+    STAT_BEGIN(t0);
+    SalesFileHeader header;
+    unsigned char prefix[8];
+    struct stat st;
+    int fd = openat(system->dir_fd, FILENAME_SALES, O_RDONLY);
+    int converted = 0, version = 0;
+    
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        printf("No previous sales data found. Starting fresh.\n");
+        return;
+    }
+    
+    if(pread(fd, prefix, sizeof(prefix), 0) == (ssize_t)sizeof(prefix) && getLe32(prefix) == SALES_FILE_MAGIC) {
+        version = (int)getLe32(prefix + 4);
+    }
+    if(version == 3 || version == SALES_FILE_VERSION) {
+        if(!readSaleBlocks(system, fd, st.st_size, version)) {
+            printf("%s has an unsupported version or is corrupt!\n", FILENAME_SALES);
+            exit(1);
+        }
+        converted = version < SALES_FILE_VERSION;
+    } else if(pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.magic != SALES_FILE_MAGIC) {
+        int count;
+        if(pread(fd, &count, sizeof(int), 0) != (ssize_t)sizeof(int) || count < 0 ||
+           st.st_size != (off_t)(sizeof(int) + (size_t)count * sizeof(LegacySale) + sizeof(float)) ||
+           !readSaleRange(system, fd, sizeof(int), count, 1)) {
+            printf("%s is not a POS sales file!\n", FILENAME_SALES);
+            exit(1);
+        }
+        converted = 1;
+    } else if(header.version == 1 && header.record_size == sizeof(LegacySale) && header.count >= 0 &&
+              (off_t)sizeof(header) + (off_t)header.count * (off_t)sizeof(LegacySale) <= st.st_size) {
+        if(!readSaleRange(system, fd, sizeof(header), header.count, 1)) {
+            printf("Cannot convert %s!\n", FILENAME_SALES);
+            exit(1);
+        }
+        converted = 1;
+    } else if(header.version == 2 && header.record_size == sizeof(Sale) && header.count >= 0 &&
+              (off_t)sizeof(header) + (off_t)header.count * (off_t)sizeof(Sale) <= st.st_size) {
+        if(!readSaleRange(system, fd, sizeof(header), header.count, 0)) {
+            printf("Cannot convert %s!\n", FILENAME_SALES);
+            exit(1);
+        }
+        converted = 1;
+    } else {
+        printf("%s has an unsupported version or is corrupt!\n", FILENAME_SALES);
+        exit(1);
+    }
+    close(fd);
+    // Older files kept a running total (version 1 as a float that drifted);
+    // summing the line totals again is exact and costs one column scan.
+    system->daily_revenue = revenueInRange(system, 0, LLONG_MAX);
+    system->saved_sale_count = system->sale_count;
+    if(converted) {
+        if(!writeSalesFile(system, FILENAME_SALES ".tmp", FILENAME_SALES)) {
+            printf("Cannot convert %s!\n", FILENAME_SALES);
+            exit(1);
+        }
+        printf("Converted sales file to version %d.\n", SALES_FILE_VERSION);
+    }
+    printf("Loaded %d sales records.\n", system->sale_count);
+    loadRollups(system);
+    STAT_END(STAT_LOAD_SALES, t0, st.st_size);
+}
+
+// Takes quantity units of product if they are in stock. Safe to call from many
+// registers at once: the check and the decrement are one compare-and-swap, so
+// stock can never go below zero however the calls interleave.
+int reserveStock(Product *product, int quantity) {
+    int available = __atomic_load_n(&product->quantity, __ATOMIC_ACQUIRE);
+    
+    do {
+        if(quantity <= 0 || quantity > available) {
+            return 0;
+        }
+    } while(!__atomic_compare_exchange_n(&product->quantity, &available, available - quantity, 1,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+void releaseStock(Product *product, int quantity) {
+    __atomic_fetch_add(&product->quantity, quantity, __ATOMIC_RELEASE);
+}
+
+// Sells a basket at one register. Every line is reserved before anything is
+// recorded; if one fails, the lines already reserved are released and the
+// basket is rejected. The catalog must not grow while registers are selling.
+int registerSale(POSSystem *system, Register *reg, LineItem *items, int count) {
+    int i, index, reserved;
+    time_t now = time(NULL);
+    
+    for(reserved = 0; reserved < count; reserved++) {
+        index = findProductById(system, items[reserved].product_id);
+        if(index == -1 || !reserveStock(&system->products[index], items[reserved].quantity)) {
+            break;
+        }
+    }
+    if(reserved < count) {
+        for(i = 0; i < reserved; i++) {
+            index = findProductById(system, items[i].product_id);
+            releaseStock(&system->products[index], items[i].quantity);
+            refreshLowStock(system, index);
+        }
+        reg->rejected++;
+        return 0;
+    }
+    
+    for(i = 0; i < count; i++) {
+        Product *product = &system->products[findProductById(system, items[i].product_id)];
+        Sale *sale;
+        refreshLowStock(system, (int)(product - system->products));
+        if(reg->sale_count == reg->sale_capacity) {
+            reg->sales = growArray(reg->sales, &reg->sale_capacity, sizeof(Sale));
+        }
+        sale = &reg->sales[reg->sale_count++];
+        sale->id = 0; // numbered when flushed into the history
+        sale->product_id = product->id;
+        memcpy(sale->product_name, product->name, MAX_NAME_LENGTH);
+        sale->quantity = items[i].quantity;
+        sale->price = product->price;
+        sale->total = sale->quantity * sale->price;
+        sale->timestamp = now;
+        reg->revenue += sale->total;
+    }
+    reg->baskets++;
+    return 1;
+}
+
+// Moves the lines sold at each register into the shared history. Call from
+// one thread, while the registers are not selling.
+void flushRegisters(POSSystem *system, Register *registers, int count) {
+    int r, i;
+    
+    for(r = 0; r < count; r++) {
+        for(i = 0; i < registers[r].sale_count; i++) {
+            registers[r].sales[i].id = system->sale_count + 1;
+            appendSale(system, &registers[r].sales[i]);
+            addToRollups(system, &registers[r].sales[i]);
+        }
+        system->daily_revenue += registers[r].revenue;
+        registers[r].sale_count = 0;
+        registers[r].revenue = 0;
+    }
+}
+
+// Batch mode reads one transaction per line and applies it through the same
+// product and sale logic as the menu:
+//   A name|price|quantity|min_stock   add a product
+//   S id:qty [id:qty ...]             one sale with any number of line items
+//   P id price                        set a product's price
+//   Q id delta                        adjust a product's stock
+// Blank lines and lines starting with # are skipped. A sale is all or nothing:
+// if any line item fails the stock check none of it is applied. Every
+// batch_size transactions the data is saved and one summary line is printed:
+//   B <batch> ok=<n> rejected=<n> items=<n> revenue=<amount>
+// preceded by an "E <line> <reason>" line for each rejected transaction.
+// Products crossing their minimum stock level are reported as they happen:
+//   L <id> <quantity> <min_stock>     dropped to the minimum or below
+//   R <id> <quantity> <min_stock>     restocked above it
+typedef struct {
+    long batch;
+    long ok;
+    long rejected;
+    long items;
+    Money revenue;
+} BatchResult;
+
+static int parseNumber(char **cursor, int *value) {
+    char *end;
+    long number = strtol(*cursor, &end, 10);
+    
+    if(end == *cursor) {
+        return 0;
+    }
+    *value = (int)number;
+    *cursor = end;
+    return 1;
+}
+
+static void batchLowStockAlert(Product *product, int low) {
+    printf("%c %d %d %d\n", low ? 'L' : 'R', product->id, product->quantity, product->min_stock_level);
+}
+
+static void flushBatch(POSSystem *system, BatchResult *result) {
+    char revenue[MONEY_TEXT_LENGTH];
+    
+    saveProducts(system);
+    saveSales(system);
+    printf("B %ld ok=%ld rejected=%ld items=%ld revenue=%s\n",
+           result->batch, result->ok, result->rejected, result->items, formatMoney(result->revenue, revenue));
+    result->batch++;
+    result->ok = result->rejected = result->items = 0;
+    result->revenue = 0;
+}
+
+// Applies one "S" line. Returns NULL on success or the reason it was rejected.
+static const char *batchSale(POSSystem *system, char *cursor, Basket *basket, BatchResult *result) {
+    int id, quantity, index;
+    const char *error = NULL;
+    
+    clearBasket(basket);
+    while(error == NULL) {
+        while(*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+        if(*cursor == '\0' || *cursor == '\n' || *cursor == '\r') {
+            break;
+        }
+        if(!parseNumber(&cursor, &id) || *cursor++ != ':' || !parseNumber(&cursor, &quantity)) {
+            error = "malformed line item";
+        } else if((index = findProductById(system, id)) == -1) {
+            error = "product not found";
+        } else if(!addToBasket(basket, index, quantity)) {
+            error = "invalid quantity";
+        }
+    }
+    if(error == NULL && basket->count == 0) {
+        error = "sale has no line items";
+    }
+    if(error == NULL && !commitBasket(system, basket)) {
+        error = "insufficient stock";
+    }
+    if(error != NULL) {
+        return error;
+    }
+    result->items += basket->count;
+    result->revenue += basket->total;
+    return NULL;
+}
+
+static const char *batchTransaction(POSSystem *system, char *line, Basket *basket, BatchResult *result) {
+    Product product;
+    char *cursor = line + 1, *field;
+    int id, value, index;
+    Money price;
+    
+    switch(line[0]) {
+        case 'S':
+            return batchSale(system, cursor, basket, result);
+        case 'A':
+            memset(&product, 0, sizeof(product));
+            while(*cursor == ' ') {
+                cursor++;
+            }
+            field = strchr(cursor, '|');
+            if(field == NULL || field == cursor || field - cursor >= MAX_NAME_LENGTH) {
+                return "bad product name";
+            }
+            memcpy(product.name, cursor, field - cursor);
+            cursor = field + 1;
+            if(!parseMoney(&cursor, &product.price) || *cursor != '|' ||
+               sscanf(cursor + 1, "%d|%d", &product.quantity, &product.min_stock_level) != 2 ||
+               product.price < 0 || product.quantity < 0) {
+                return "malformed product";
+            }
+            return insertProduct(system, &product) ? NULL : "cannot grow product file";
+        case 'P':
+            if(!parseNumber(&cursor, &id) || !parseMoney(&cursor, &price) || price < 0) {
+                return "malformed price update";
+            }
+            if((index = findProductById(system, id)) == -1) {
+                return "product not found";
+            }
+            setProductPrice(system, index, price, time(NULL));
+            return NULL;
+        case 'Q':
+            if(!parseNumber(&cursor, &id) || !parseNumber(&cursor, &value)) {
+                return "malformed stock adjustment";
+            }
+            if((index = findProductById(system, id)) == -1) {
+                return "product not found";
+            }
+            if(system->products[index].quantity + value < 0) {
+                return "stock would go negative";
+            }
+            system->products[index].quantity += value;
+            refreshLowStock(system, index);
+            return NULL;
+        default:
+            return "unknown transaction type";
+    }
+}
+
+// Runs the transactions in path ("-" for stdin). Returns the number rejected.
+int runBatch(POSSystem *system, const char *path, int batch_size) {
+    FILE *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    BatchResult result = {1, 0, 0, 0, 0};
+    Basket basket;
+    long line_number = 0, pending = 0, rejected = 0;
+    char *line = NULL;
+    size_t size = 0;
+    const char *error;
+    
+    if(input == NULL) {
+        printf("Cannot open %s!\n", path);
+        return 1;
+    }
+    if(batch_size <= 0) {
+        batch_size = BATCH_SIZE;
+    }
+    setvbuf(input, NULL, _IOFBF, 1 << 20);
+    initBasket(&basket);
+    system->low_stock_alert = batchLowStockAlert;
+    while(getline(&line, &size, input) != -1) {
+        line_number++;
+        if(line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        error = batchTransaction(system, line, &basket, &result);
+        if(error == NULL) {
+            result.ok++;
+        } else {
+            result.rejected++;
+            rejected++;
+            printf("E %ld %s\n", line_number, error);
+        }
+        if(++pending == batch_size) {
+            flushBatch(system, &result);
+            pending = 0;
+        }
+    }
+    if(pending > 0) {
+        flushBatch(system, &result);
+    }
+    free(line);
+    freeBasket(&basket);
+    if(input != stdin) {
+        fclose(input);
+    }
+    return rejected > 0;
+}
+
+static double benchSeconds(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compares the old array-of-structs loops with the column kernels on a
+// synthetic history of `sales` sales spread over 90 days.
+void runColumnBenchmark(int sales) {
+    POSSystem system;
+    Sale *rows = malloc(sizeof(Sale) * (size_t)sales);
+    time_t now = time(NULL), start = now - 90 * 24 * 3600, from = now - 7 * 24 * 3600;
+    unsigned seed = 7;
+    int i, k, localtime_rows = sales < 1000000 ? sales : 1000000;
+    const char *variants[] = {"scalar", "sse", "avx2"};
+    double t0, elapsed;
+    Money struct_sum;
+    volatile Money sink; // keeps the struct loops from being optimised away
+    long long cents, quantity, expected = 0, expected_product = 0;
+    
+    if(rows == NULL) {
+        printf("Out of memory!\n");
+        return;
+    }
+    initializeSystem(&system);
+    for(i = 0; i < sales; i++) {
+        seed = seed * 1103515245u + 12345u;
+        rows[i].id = i + 1;
+        rows[i].product_id = (int)(seed >> 8) % 5000 + 1;
+        snprintf(rows[i].product_name, MAX_NAME_LENGTH, "Item %d", rows[i].product_id);
+        rows[i].quantity = (int)(seed >> 4) % 5 + 1;
+        rows[i].price = (Money)((seed >> 12) % 2000 + 1);
+        rows[i].total = rows[i].price * rows[i].quantity;
+        rows[i].timestamp = start + (time_t)((double)i / sales * (now - start));
+        appendSale(&system, &rows[i]);
+        if(rows[i].timestamp >= from) {
+            expected += rows[i].total;
+            if(rows[i].product_id == 42) {
+                expected_product += rows[i].total;
+            }
+        }
+    }
+    printf("%d sales, %zu bytes/sale as structs, %zu bytes/sale as columns\n",
+           sales, sizeof(Sale), sizeof(SaleChunk) / SALE_CHUNK_SIZE);
+    printf("%-34s %12s\n", "kernel (last 7 days)", "Msales/s");
+    
+    // Current viewDailyRevenue(): localtime() per sale
+    t0 = benchSeconds();
+    struct_sum = 0;
+    for(i = 0; i < localtime_rows; i++) {
+        struct tm *day = localtime(&rows[i].timestamp);
+        if(day->tm_yday >= 0) {
+            struct_sum += rows[i].total;
+        }
+    }
+    elapsed = benchSeconds() - t0;
+    sink = struct_sum;
+    printf("%-34s %12.1f\n", "structs + localtime (current loop)", localtime_rows / elapsed / 1e6);
+    
+    t0 = benchSeconds();
+    struct_sum = 0;
+    for(i = 0; i < sales; i++) {
+        if(rows[i].timestamp >= from) {
+            struct_sum += rows[i].total;
+        }
+    }
+    elapsed = benchSeconds() - t0;
+    sink = struct_sum;
+    printf("%-34s %12.1f\n", "structs, range filter", sales / elapsed / 1e6);
+    
+    for(k = 0; k < 3; k++) {
+        setenv("POS_SIMD", variants[k], 1);
+        if(strcmp(selectKernels(), k == 1 ? "sse4.2" : variants[k]) != 0) {
+            continue;
+        }
+        t0 = benchSeconds();
+        cents = revenueInRange(&system, from, LLONG_MAX);
+        elapsed = benchSeconds() - t0;
+        printf("columns, range sum, %-14s %12.1f%s\n", variants[k], sales / elapsed / 1e6,
+               cents == expected ? "" : "   MISMATCH");
+    }
+    
+    printf("%-34s %12s\n", "kernel (one product, last 7 days)", "Msales/s");
+    t0 = benchSeconds();
+    struct_sum = 0;
+    for(i = 0; i < sales; i++) {
+        if(rows[i].product_id == 42 && rows[i].timestamp >= from) {
+            struct_sum += rows[i].total;
+        }
+    }
+    elapsed = benchSeconds() - t0;
+    sink = struct_sum;
+    printf("%-34s %12.1f\n", "structs, product filter", sales / elapsed / 1e6);
+    for(k = 0; k < 3; k++) {
+        setenv("POS_SIMD", variants[k], 1);
+        if(strcmp(selectKernels(), k == 1 ? "sse4.2" : variants[k]) != 0) {
+            continue;
+        }
+        t0 = benchSeconds();
+        cents = productRevenue(&system, 42, from, LLONG_MAX, &quantity);
+        elapsed = benchSeconds() - t0;
+        printf("columns, product sum, %-12s %12.1f%s\n", variants[k], sales / elapsed / 1e6,
+               cents == expected_product ? "" : "   MISMATCH");
+    }
+    unsetenv("POS_SIMD");
+    selectKernels();
+    (void)sink;
+    free(rows);
+}
+
+// Sets the CRC32C kernels against writing and syncing the same bytes, which is
+// what every save pays anyway, on `megabytes` of random data.
+void runChecksumBenchmark(int megabytes) {
+    size_t size = (size_t)megabytes << 20, i;
+    unsigned char *data = malloc(size);
+    unsigned seed = 7, expected;
+    double t0, elapsed;
+    int fd, ok;
+    
+    if(data == NULL) {
+        printf("Out of memory!\n");
+        return;
+    }
+    for(i = 0; i < size; i++) {
+        seed = seed * 1103515245u + 12345u;
+        data[i] = (unsigned char)(seed >> 16);
+    }
+    printf("%d MB, check value %s\n", megabytes,
+           crc32c(0, "123456789", 9) == 0xe3069283u ? "ok" : "MISMATCH");
+    printf("%-24s %12s\n", "step", "MB/s");
+    
+    t0 = benchSeconds();
+    expected = crc32cScalar(0, data, size);
+    elapsed = benchSeconds() - t0;
+    printf("%-24s %12.0f\n", "crc32c, scalar", megabytes / elapsed);
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("sse4.2")) {
+        t0 = benchSeconds();
+        ok = crc32cSse(0, data, size) == expected;
+        elapsed = benchSeconds() - t0;
+        printf("%-24s %12.0f%s\n", "crc32c, sse4.2", megabytes / elapsed, ok ? "" : "   MISMATCH");
+    }
+#endif
+    
+    t0 = benchSeconds();
+    fd = open("checksum-bench.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && writeFully(fd, data, size) && fsync(fd) == 0;
+    elapsed = benchSeconds() - t0;
+    if(fd >= 0) {
+        close(fd);
+        unlink("checksum-bench.tmp");
+    }
+    if(ok) {
+        printf("%-24s %12.0f\n", "write + fsync", megabytes / elapsed);
+    } else {
+        printf("Cannot write checksum-bench.tmp!\n");
+    }
+    free(data);
+}
+
+static int compareByRevenue(const void *a, const void *b) {
+    const ProductTotal *x = a, *y = b;
+    
+    return ranksAbove(x, y, RANK_BY_REVENUE) ? -1 : ranksAbove(y, x, RANK_BY_REVENUE);
+}
+
+// Fills system with `sales` synthetic sales over the last 90 days, with rollups,
+// drawn from 5000 products in a skewed mix (low ids sell far more often).
+static void fillBenchmarkSales(POSSystem *system, int sales) {
+    Sale sale;
+    char (*names)[MAX_NAME_LENGTH] = malloc(sizeof(*names) * 5000);
+    time_t now = time(NULL), start = now - 90 * 24 * 3600;
+    unsigned seed = 11;
+    int i;
+    
+    if(names == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    for(i = 0; i < 5000; i++) {
+        snprintf(names[i], MAX_NAME_LENGTH, "Item %d", i + 1);
+    }
+    initializeSystem(system);
+    for(i = 0; i < sales; i++) {
+        seed = seed * 1103515245u + 12345u;
+        sale.id = i + 1;
+        // product a*b/5000 for uniform a, b
+        sale.product_id = (int)((seed >> 4) % 5000 * ((seed >> 17) % 5000 + 1) / 5000) + 1;
+        memcpy(sale.product_name, names[sale.product_id - 1], MAX_NAME_LENGTH);
+        sale.quantity = (int)(seed >> 9) % 5 + 1;
+        sale.price = (Money)(sale.product_id * 37 % 2000 + 1);
+        sale.total = sale.price * sale.quantity;
+        sale.timestamp = start + (time_t)((double)i / sales * (now - start));
+        appendSale(system, &sale);
+        addToRollups(system, &sale);
+    }
+    free(names);
+}
+
+static void freeBenchmarkSales(POSSystem *system) {
+    int i;
+    
+    for(i = 0; i < system->sale_chunk_count; i++) {
+        free(system->sale_chunks[i]);
+    }
+    free(system->sale_chunks);
+    free(system->names);
+    free(system->name_slots);
+    free(system->days);
+    free(system->product_days);
+    free(system->product_day_slots);
+}
+
+// Top-10 rankings on the synthetic history: hash + heap against hash + full
+// sort, from the raw columns and from the rollups.
+void runTopBenchmark(int sales) {
+    POSSystem system;
+    ProductTotal top[10], check[10];
+    ProductAggregate aggregate;
+    char label[64];
+    time_t now = time(NULL);
+    int i, k, count, today, same;
+    int ranges[] = {1, 7, 30, 90};
+    double t0, elapsed;
+    
+    t0 = benchSeconds();
+    fillBenchmarkSales(&system, sales);
+    printf("%d sales, %d product-day rollups, built in %.1f s\n", sales, system.product_day_count,
+           benchSeconds() - t0);
+    printf("%-40s %10s\n", "top 10 by revenue", "ms");
+    
+    t0 = benchSeconds();
+    count = topProductsInRange(&system, 0, LLONG_MAX, RANK_BY_REVENUE, top, 10);
+    printf("%-40s %10.1f\n", "all time, columns, hash + heap", (benchSeconds() - t0) * 1000);
+    
+    // the ranking step alone, heap against sorting every product
+    initAggregate(&aggregate);
+    for(i = 0; i < system.sale_count; i++) {
+        SaleChunk *chunk = system.sale_chunks[i / SALE_CHUNK_SIZE];
+        int row = i % SALE_CHUNK_SIZE;
+        addToAggregate(&aggregate, chunk->product_id[row], chunk->quantity[row], chunk->total_cents[row]);
+    }
+    t0 = benchSeconds();
+    selectTopProducts(aggregate.totals, aggregate.count, RANK_BY_REVENUE, check, 10);
+    elapsed = benchSeconds() - t0;
+    snprintf(label, sizeof(label), "rank %d products, heap", aggregate.count);
+    printf("%-40s %10.3f\n", label, elapsed * 1000);
+    t0 = benchSeconds();
+    qsort(aggregate.totals, aggregate.count, sizeof(ProductTotal), compareByRevenue);
+    elapsed = benchSeconds() - t0;
+    same = aggregate.count >= count;
+    for(k = 0; k < count && same; k++) {
+        same = aggregate.totals[k].product_id == top[k].product_id && aggregate.totals[k].revenue == top[k].revenue
+               && check[k].product_id == top[k].product_id;
+    }
+    snprintf(label, sizeof(label), "rank %d products, qsort", aggregate.count);
+    printf("%-40s %10.3f%s\n", label, elapsed * 1000, same ? "" : "   MISMATCH");
+    freeAggregate(&aggregate);
+    
+    today = dayNumber(now);
+    for(k = 0; k < 4; k++) {
+        t0 = benchSeconds();
+        count = topProducts(&system, today - (ranges[k] - 1), today, RANK_BY_REVENUE, check, 10);
+        elapsed = benchSeconds() - t0;
+        snprintf(label, sizeof(label), "last %d days, rollups, hash + heap", ranges[k]);
+        printf("%-40s %10.3f\n", label, elapsed * 1000);
+    }
+    same = count == topProducts(&system, INT_MIN, INT_MAX, RANK_BY_REVENUE, check, 10);
+    for(k = 0; k < count && same; k++) {
+        same = check[k].product_id == top[k].product_id && check[k].revenue == top[k].revenue;
+    }
+    printf("rollup and column rankings %s\n", same ? "agree" : "DIFFER");
+    freeBenchmarkSales(&system);
+}
+
+// Times the parallel report paths on the synthetic history with 1 to
+// max_threads threads and checks every result against the one-thread run.
+void runParallelBenchmark(int sales, int max_threads) {
+    POSSystem system;
+    SalesSummary serial, summary;
+    time_t now = time(NULL), week = now - 7 * 24 * 3600;
+    long long serial_week = 0, serial_product = 0, week_revenue, product_cents, quantity;
+    double t0, elapsed, serial_time = 0, best;
+    int threads, round, same, i;
+    
+    fillBenchmarkSales(&system, sales);
+    printf("%d sales in %d chunks, %ld CPUs online\n", sales, system.sale_chunk_count,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %14s %9s %14s %14s\n", "threads", "summary ms", "speedup", "7-day sum ms", "product ms");
+    memset(&serial, 0, sizeof(serial));
+    for(threads = 1; threads <= max_threads; threads = threads < max_threads && threads * 2 > max_threads ?
+                                                           max_threads : threads * 2) {
+        setReportThreads(threads);
+        best = 0;
+        for(round = 0; round < 3; round++) {
+            t0 = benchSeconds();
+            summarizeSales(&system, 0, LLONG_MAX, &summary);
+            elapsed = benchSeconds() - t0;
+            best = round == 0 || elapsed < best ? elapsed : best;
+            if(round < 2) {
+                freeSalesSummary(&summary);
+            }
+        }
+        t0 = benchSeconds();
+        week_revenue = revenueInRange(&system, week, LLONG_MAX);
+        elapsed = benchSeconds() - t0;
+        t0 = benchSeconds();
+        product_cents = productRevenue(&system, 42, 0, LLONG_MAX, &quantity);
+        if(threads == 1) {
+            serial = summary;
+            serial_time = best;
+            serial_week = week_revenue;
+            serial_product = product_cents;
+            same = 1;
+        } else {
+            same = summary.sales == serial.sales && summary.quantity == serial.quantity &&
+                   summary.revenue == serial.revenue && summary.products.count == serial.products.count &&
+                   week_revenue == serial_week && product_cents == serial_product;
+            for(i = 0; same && i < summary.products.count; i++) {
+                same = summary.products.totals[i].product_id == serial.products.totals[i].product_id &&
+                       summary.products.totals[i].quantity == serial.products.totals[i].quantity &&
+                       summary.products.totals[i].revenue == serial.products.totals[i].revenue;
+            }
+            freeSalesSummary(&summary);
+        }
+        printf("%-8d %14.1f %8.2fx %14.2f %14.2f%s\n", threads, best * 1000, serial_time / best, elapsed * 1000,
+               (benchSeconds() - t0) * 1000, same ? "" : "   MISMATCH");
+        if(threads == max_threads) {
+            break;
+        }
+    }
+    freeSalesSummary(&serial);
+    freeBenchmarkSales(&system);
+}
+
+typedef struct {
+    POSSystem *system;
+    Register *reg;
+    int products;
+    int baskets;
+    unsigned seed;
+} RegisterWorker;
+
+static void *registerWorker(void *arg) {
+    RegisterWorker *worker = arg;
+    LineItem items[4];
+    int b, i, count;
+    
+    for(b = 0; b < worker->baskets; b++) {
+        count = 1 + (int)(worker->seed >> 16) % 4;
+        for(i = 0; i < count; i++) {
+            worker->seed = worker->seed * 1103515245u + 12345u;
+            items[i].product_id = 1 + (int)(worker->seed >> 8) % worker->products;
+            items[i].quantity = 1 + (int)(worker->seed >> 4) % 3;
+        }
+        registerSale(worker->system, worker->reg, items, count);
+    }
+    return NULL;
+}
+
+// Runs 1, 2, 4, ... max_registers threads selling random baskets against one
+// catalog, then checks that every unit is accounted for and nothing oversold.
+// The "hot" catalog is small with little stock, so most baskets contend and
+// many run out; the "wide" one spreads sales across 100k products.
+void runRegisterBenchmark(int max_registers) {
+    const int baskets = 200000;
+    int catalogs[2] = {16, 100000}, initial_stock[2] = {20000, 1000000};
+    const char *labels[2] = {"hot", "wide"};
+    int c, n, r, i;
+    
+    printf("%-5s %9s %12s %12s %10s %s\n", "load", "registers", "baskets/s", "lines/s", "rejected", "check");
+    for(c = 0; c < 2; c++) {
+        for(n = 1; n <= max_registers; n *= 2) {
+            POSSystem system;
+            Register *registers = calloc(n, sizeof(Register));
+            RegisterWorker *workers = calloc(n, sizeof(RegisterWorker));
+            pthread_t *threads = calloc(n, sizeof(pthread_t));
+            long long *sold = calloc(catalogs[c] + 1, sizeof(long long));
+            long long lines = 0, rejected = 0;
+            int ok = 1;
+            double t0, elapsed;
+            
+            initializeSystem(&system);
+            system.products = calloc(catalogs[c], sizeof(Product));
+            system.product_count = catalogs[c];
+            for(i = 0; i < catalogs[c]; i++) {
+                system.products[i].id = i + 1;
+                snprintf(system.products[i].name, MAX_NAME_LENGTH, "Item %d", i + 1);
+                system.products[i].price = 125;
+                system.products[i].quantity = initial_stock[c];
+            }
+            buildLowStock(&system);
+            
+            t0 = benchSeconds();
+            for(r = 0; r < n; r++) {
+                workers[r].system = &system;
+                workers[r].reg = &registers[r];
+                workers[r].products = catalogs[c];
+                workers[r].baskets = baskets / n;
+                workers[r].seed = 1000u + (unsigned)r * 7919u;
+                pthread_create(&threads[r], NULL, registerWorker, &workers[r]);
+            }
+            for(r = 0; r < n; r++) {
+                pthread_join(threads[r], NULL);
+            }
+            elapsed = benchSeconds() - t0;
+            
+            for(r = 0; r < n; r++) {
+                for(i = 0; i < registers[r].sale_count; i++) {
+                    sold[registers[r].sales[i].product_id] += registers[r].sales[i].quantity;
+                }
+                lines += registers[r].sale_count;
+                rejected += registers[r].rejected;
+            }
+            for(i = 0; i < catalogs[c]; i++) {
+                Product *p = &system.products[i];
+                int low = (system.low_stock[i / 64] >> (i % 64)) & 1;
+                if(p->quantity < 0 || p->quantity + sold[p->id] != initial_stock[c] ||
+                   low != (p->quantity <= p->min_stock_level)) {
+                    ok = 0;
+                }
+            }
+            flushRegisters(&system, registers, n);
+            if(system.sale_count != lines) {
+                ok = 0;
+            }
+            printf("%-5s %9d %12.0f %12.0f %10lld %s\n", labels[c], n, (baskets / n) * n / elapsed,
+                   lines / elapsed, rejected, ok ? "ok" : "OVERSOLD/LOST");
+            
+            for(r = 0; r < n; r++) {
+                free(registers[r].sales);
+            }
+            for(i = 0; i < system.sale_chunk_count; i++) {
+                free(system.sale_chunks[i]);
+            }
+            free(system.sale_chunks);
+            free(system.names);
+            free(system.name_slots);
+            free(system.days);
+            free(system.product_days);
+            free(system.product_day_slots);
+            free(system.low_stock);
+            free(system.products);
+            free(registers);
+            free(workers);
+            free(threads);
+            free(sold);
+        }
+    }
+}
+
+// Builds a catalog of generated product names and times exact lookups against
+// the old linear scan, then type-ahead prefix and typo-tolerant searches.
+void runSearchBenchmark(int products) {
+    static const char *brands[] = {"Acme", "Bolt", "Crest", "Delta", "Echo", "Fresh", "Golden", "Harbor",
+                                   "Indigo", "Jolly", "Kings", "Lotus", "Maple", "Nova", "Orchid", "Prime"};
+    static const char *items[] = {"Rice", "Sugar", "Flour", "Milk", "Bread", "Soap", "Tea", "Coffee",
+                                  "Beans", "Salt", "Juice", "Butter", "Cheese", "Yogurt", "Honey", "Oil"};
+    const int queries = 2000;
+    POSSystem system;
+    int matches[SEARCH_MAX_RESULTS];
+    char typo[MAX_NAME_LENGTH];
+    unsigned seed = 7;
+    long found;
+    double t0, elapsed;
+    int i, j, q, distance;
+    
+    initializeSystem(&system);
+    system.products = calloc(products, sizeof(Product));
+    if(system.products == NULL) {
+        printf("Out of memory!\n");
+        return;
+    }
+    system.product_count = products;
+    t0 = benchSeconds();
+    for(i = 0; i < products; i++) {
+        system.products[i].id = i + 1;
+        snprintf(system.products[i].name, MAX_NAME_LENGTH, "%s %s %d", brands[i % 16], items[(i / 16) % 16],
+                 i / 256 + 1);
+        indexProductName(&system, i);
+    }
+    elapsed = benchSeconds() - t0;
+    printf("%d products indexed in %.2fs, %d trie nodes (%.1f MB)\n", products, elapsed,
+           system.search_node_count, system.search_node_count * sizeof(SearchNode) / 1e6);
+    printf("%-34s %12s %8s\n", "lookup", "us/query", "found");
+    
+    found = 0;
+    t0 = benchSeconds();
+    for(q = 0; q < queries / 10; q++) {
+        const char *name;
+        seed = seed * 1103515245u + 12345u;
+        name = system.products[(seed >> 4) % (unsigned)products].name;
+        for(j = 0; j < products; j++) {
+            if(strcmp(system.products[j].name, name) == 0) {
+                found++;
+                break;
+            }
+        }
+    }
+    elapsed = benchSeconds() - t0;
+    printf("%-34s %12.2f %8ld\n", "exact, linear strcmp (old)", elapsed / (queries / 10) * 1e6, found);
+    
+    found = 0;
+    t0 = benchSeconds();
+    for(q = 0; q < queries; q++) {
+        seed = seed * 1103515245u + 12345u;
+        found += findProductByName(&system, system.products[(seed >> 4) % (unsigned)products].name) != -1;
+    }
+    elapsed = benchSeconds() - t0;
+    printf("%-34s %12.2f %8ld\n", "exact, trie", elapsed / queries * 1e6, found);
+    
+    found = 0;
+    t0 = benchSeconds();
+    for(q = 0; q < queries; q++) {
+        seed = seed * 1103515245u + 12345u;
+        snprintf(typo, sizeof(typo), "%.3s", brands[(seed >> 4) % 16]);
+        typo[0] = (char)tolower((unsigned char)typo[0]);
+        found += findProductsByPrefix(&system, typo, matches, SEARCH_MAX_RESULTS);
+    }
+    elapsed = benchSeconds() - t0;
+    printf("%-34s %12.2f %8ld\n", "prefix, 3 letters, first 20", elapsed / queries * 1e6, found);
+    
+    for(distance = 1; distance <= SEARCH_MAX_EDITS; distance++) {
+        found = 0;
+        t0 = benchSeconds();
+        for(q = 0; q < queries; q++) {
+            seed = seed * 1103515245u + 12345u;
+            strcpy(typo, system.products[(seed >> 4) % (unsigned)products].name);
+            for(j = 0; j < distance; j++) {
+                seed = seed * 1103515245u + 12345u;
+                typo[(seed >> 8) % strlen(typo)] = 'q'; // substitution typo
+            }
+            found += findProductsFuzzy(&system, typo, distance, matches, SEARCH_MAX_RESULTS) > 0;
+        }
+        elapsed = benchSeconds() - t0;
+        snprintf(typo, sizeof(typo), "fuzzy, %d edit%s", distance, distance == 1 ? "" : "s");
+        printf("%-34s %12.2f %8ld\n", typo, elapsed / queries * 1e6, found);
+    }
+    
+    free(system.search_nodes);
+    free(system.search_next);
+    free(system.products);
+}
+
+static int sameSales(POSSystem *a, POSSystem *b) {
+    Sale x, y;
+    int i;
+    
+    if(a->sale_count != b->sale_count) {
+        return 0;
+    }
+    for(i = 0; i < a->sale_count; i++) {
+        getSale(a, i, &x);
+        getSale(b, i, &y);
+        if(x.id != y.id || x.product_id != y.product_id || strcmp(x.product_name, y.product_name) != 0 ||
+           x.quantity != y.quantity || x.price != y.price || x.total != y.total || x.timestamp != y.timestamp) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writes `sales` synthetic sales as raw Sale records, the layout the sales file
+// used up to version 3, and in the version 4 encoding with and without block
+// compression, then reads each back into an empty system. Writes are synced.
+void runFormatBenchmark(int sales) {
+    const char *formats[] = {"raw structs (v3)", "compact", "compact + lz"};
+    POSSystem system, loaded;
+    Sale *buffer = malloc(sizeof(Sale) * SALE_CHUNK_SIZE);
+    double t0, write_time, read_time;
+    off_t raw_size = 0;
+    struct stat st;
+    int k, i, j, n, fd, ok;
+    
+    if(buffer == NULL) {
+        printf("Out of memory!\n");
+        return;
+    }
+    fillBenchmarkSales(&system, sales);
+    printf("%d sales\n%-18s %12s %10s %8s %10s %10s\n", sales, "format", "bytes", "bytes/sale", "ratio", "write s",
+           "read s");
+    for(k = 0; k < 3; k++) {
+        t0 = benchSeconds();
+        if(k == 0) {
+            fd = open("format-bench.dat", O_RDWR | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0;
+            for(i = 0; ok && i < sales; i += n) {
+                n = sales - i < SALE_CHUNK_SIZE ? sales - i : SALE_CHUNK_SIZE;
+                for(j = 0; j < n; j++) {
+                    getSale(&system, i + j, &buffer[j]);
+                }
+                ok = writeFully(fd, buffer, sizeof(Sale) * n);
+            }
+            ok = ok && fsync(fd) == 0;
+            if(fd >= 0) {
+                close(fd);
+            }
+        } else {
+            setenv("POS_COMPRESS", k == 1 ? "off" : "on", 1);
+            ok = writeSalesFile(&system, "format-bench.tmp", "format-bench.dat");
+        }
+        write_time = benchSeconds() - t0;
+        fd = open("format-bench.dat", O_RDONLY);
+        if(!ok || fd < 0 || fstat(fd, &st) != 0) {
+            printf("Cannot write format-bench.dat!\n");
+            break;
+        }
+        if(k == 0) {
+            raw_size = st.st_size;
+        }
+        initializeSystem(&loaded);
+        t0 = benchSeconds();
+        ok = k == 0 ? readSaleRange(&loaded, fd, 0, sales, 0) : readSaleBlocks(&loaded, fd, st.st_size, SALES_FILE_VERSION);
+        read_time = benchSeconds() - t0;
+        close(fd);
+        printf("%-18s %12lld %10.1f %7.1fx %10.3f %10.3f%s\n", formats[k], (long long)st.st_size,
+               (double)st.st_size / sales, (double)raw_size / st.st_size, write_time, read_time,
+               ok && sameSales(&system, &loaded) ? "" : "   MISMATCH");
+        freeBenchmarkSales(&loaded);
+    }
+    unsetenv("POS_COMPRESS");
+    unlink("format-bench.dat");
+    freeBenchmarkSales(&system);
+    free(buffer);
+}
+
+// Writes the sales listing for `sales` synthetic sales with one printf() and
+// ctime() per row as it used to be done, then through Output, and checks that
+// both produce the same bytes.
+void runOutputBenchmark(int sales) {
+    POSSystem system;
+    Output out;
+    Sale s;
+    FILE *old_file = tmpfile(), *new_file = tmpfile();
+    char price[MONEY_TEXT_LENGTH], total[MONEY_TEXT_LENGTH], old_buffer[4096], new_buffer[4096];
+    double t0, old_time, new_time, json_time;
+    long size;
+    size_t old_read, new_read;
+    int i, same = 1;
+    
+    if(old_file == NULL || new_file == NULL) {
+        printf("Cannot create temporary files!\n");
+        return;
+    }
+    fillBenchmarkSales(&system, sales);
+    
+    t0 = benchSeconds();
+    for(i = 0; i < system.sale_count; i++) {
+        getSale(&system, i, &s);
+        fprintf(old_file, "%-5d %-20s %-10d $%-9s $%-14s %s", 
+                s.id, s.product_name, s.quantity, formatMoney(s.price, price), 
+                formatMoney(s.total, total), ctime(&s.timestamp));
+    }
+    fflush(old_file);
+    old_time = benchSeconds() - t0;
+    size = ftell(old_file);
+    
+    t0 = benchSeconds();
+    openOutput(&out, new_file);
+    out.json = 0;
+    for(i = 0; i < system.sale_count; i++) {
+        getSale(&system, i, &s);
+        outSale(&out, &s);
+    }
+    closeOutput(&out);
+    fflush(new_file);
+    new_time = benchSeconds() - t0;
+    
+    rewind(old_file);
+    rewind(new_file);
+    do {
+        old_read = fread(old_buffer, 1, sizeof(old_buffer), old_file);
+        new_read = fread(new_buffer, 1, sizeof(new_buffer), new_file);
+        same = same && old_read == new_read && memcmp(old_buffer, new_buffer, old_read) == 0;
+    } while(same && old_read > 0);
+    
+    rewind(new_file);
+    t0 = benchSeconds();
+    openOutput(&out, new_file);
+    out.json = 1;
+    for(i = 0; i < system.sale_count; i++) {
+        getSale(&system, i, &s);
+        outSale(&out, &s);
+    }
+    closeOutput(&out);
+    fflush(new_file);
+    json_time = benchSeconds() - t0;
+    
+    printf("%d sales, %.1f MB of text\n", sales, size / 1e6);
+    printf("%-24s %10s %14s\n", "writer", "seconds", "rows/s");
+    printf("%-24s %10.3f %14.0f\n", "printf + ctime", old_time, sales / old_time);
+    printf("%-24s %10.3f %14.0f%s\n", "Output, text", new_time, sales / new_time, same ? "" : "  MISMATCH");
+    printf("%-24s %10.3f %14.0f\n", "Output, json lines", json_time, sales / json_time);
+    fclose(old_file);
+    fclose(new_file);
+    freeBenchmarkSales(&system);
+}
+
+// Benchmark suite. Each round builds a synthetic catalog (1000 products, then
+// ten times more up to max_products) and a sales history over 90 days in which
+// products sell by a Zipf distribution (the product of rank k in proportion to
+// 1/k) and timestamps follow a day-of-week and hour-of-day curve. It then times
+// the operations behind the menu and writes one JSON line per operation and
+// catalog size to stdout so runs can be kept and compared. Everything the
+// operations print themselves goes to stderr. Files are made in a scratch
+// directory under dir.
+typedef struct {
+    double *cdf;        // cdf[k] = P(rank <= k)
+    int *index;         // rank -> product index, so best sellers are spread out
+    int count;
+} ZipfTable;
+
+static unsigned long long benchRandom(unsigned long long *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double benchUniform(unsigned long long *state) {
+    return (benchRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int initZipf(ZipfTable *zipf, int count, unsigned long long *state) {
+    double sum = 0;
+    int k, j, t;
+    
+    zipf->count = count;
+    zipf->cdf = malloc(sizeof(double) * count);
+    zipf->index = malloc(sizeof(int) * count);
+    if(zipf->cdf == NULL || zipf->index == NULL) {
+        return 0;
+    }
+    for(k = 0; k < count; k++) {
+        zipf->cdf[k] = sum += 1.0 / (k + 1);
+    }
+    for(k = 0; k < count; k++) {
+        zipf->cdf[k] /= sum;
+        zipf->index[k] = k;
+    }
+    for(k = count - 1; k > 0; k--) {
+        j = (int)(benchRandom(state) % (unsigned long long)(k + 1));
+        t = zipf->index[k];
+        zipf->index[k] = zipf->index[j];
+        zipf->index[j] = t;
+    }
+    return 1;
+}
+
+static void freeZipf(ZipfTable *zipf) {
+    free(zipf->cdf);
+    free(zipf->index);
+}
+
+// A product index, drawn by popularity.
+static int nextZipf(const ZipfTable *zipf, unsigned long long *state) {
+    double u = benchUniform(state);
+    int low = 0, high = zipf->count - 1, mid;
+    
+    while(low < high) {
+        mid = (low + high) / 2;
+        if(zipf->cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return zipf->index[low];
+}
+
+// Relative sales by hour of day and by weekday from Sunday.
+static const double hour_weight[24] = {0.2, 0.1, 0.1, 0.1, 0.1, 0.3, 0.8, 2, 4, 5, 6, 8,
+                                       10, 9, 7, 6, 7, 9, 10, 8, 6, 4, 2, 1};
+static const double weekday_weight[7] = {1.3, 0.9, 0.9, 1, 1, 1.2, 1.5};
+
+static int compareLongLong(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    
+    return (x > y) - (x < y);
+}
+
+// Writes one result: ops operations in seconds and, when samples > 0, latency
+// percentiles in nanoseconds of the timings in latency (which gets sorted).
+static void outBenchResult(Output *out, int products, const char *op, long long ops, double seconds,
+                           long long *latency, int samples, long long bytes) {
+    outRecord(out, "result");
+    outJsonInt(out, "products", products);
+    outJsonText(out, "op", op);
+    outJsonInt(out, "ops", ops);
+    outJsonInt(out, "elapsed_ns", (long long)(seconds * 1e9));
+    outJsonInt(out, "ops_per_sec", seconds > 0 ? (long long)(ops / seconds) : 0);
+    if(samples > 0) {
+        qsort(latency, samples, sizeof(long long), compareLongLong);
+        outJsonInt(out, "p50_ns", latency[samples / 2]);
+        outJsonInt(out, "p90_ns", latency[(long long)samples * 9 / 10]);
+        outJsonInt(out, "p99_ns", latency[(long long)samples * 99 / 100]);
+        outJsonInt(out, "p999_ns", latency[(long long)samples * 999 / 1000]);
+        outJsonInt(out, "max_ns", latency[samples - 1]);
+    }
+    if(bytes > 0) {
+        outJsonInt(out, "bytes", bytes);
+    }
+    outEndRecord(out);
+    flushOutput(out);
+    fprintf(stderr, "  %-24s %14.0f ops/s\n", op, seconds > 0 ? ops / seconds : 0);
+}
+
+static long long nanosSince(double t0) {
+    return (long long)((benchSeconds() - t0) * 1e9);
+}
+
+// Appends `count` sales over the `days` days up to today, each day's share set
+// by weekday_weight and spread over its hours by hour_weight.
+static void fillSuiteHistory(POSSystem *system, const ZipfTable *zipf, int count, int days,
+                             unsigned long long *state) {
+    time_t now = time(NULL), t, start;
+    double week = 0, hour_cdf[24], sum = 0, u;
+    int per_hour[24], d, h, i, n, done = 0;
+    struct tm tm, at;
+    Sale sale;
+    
+    for(h = 0; h < 24; h++) {
+        hour_cdf[h] = sum += hour_weight[h];
+    }
+    for(d = 0; d < days; d++) {
+        t = now - (time_t)(days - 1 - d) * 86400;
+        localtime_r(&t, &tm);
+        week += weekday_weight[tm.tm_wday];
+    }
+    for(d = 0; d < days; d++) {
+        t = now - (time_t)(days - 1 - d) * 86400;
+        localtime_r(&t, &tm);
+        n = d == days - 1 ? count - done : (int)(count * weekday_weight[tm.tm_wday] / week);
+        memset(per_hour, 0, sizeof(per_hour));
+        for(i = 0; i < n; i++) {
+            u = benchUniform(state) * sum;
+            for(h = 0; h < 23 && hour_cdf[h] < u; h++) {
+            }
+            per_hour[h]++;
+        }
+        for(h = 0; h < 24; h++) {
+            at = tm;
+            at.tm_hour = h;
+            at.tm_min = at.tm_sec = 0;
+            at.tm_isdst = -1;
+            start = mktime(&at);
+            for(i = 0; i < per_hour[h]; i++) {
+                Product *product = &system->products[nextZipf(zipf, state)];
+                fillSale(system, &sale, product, 1 + (int)(benchRandom(state) % 3), 0,
+                         start + (time_t)((long long)i * 3600 / per_hour[h]));
+                product->quantity += sale.quantity;  // history, not stock taken today
+                appendSale(system, &sale);
+                addToRollups(system, &sale);
+                system->daily_revenue += sale.total;
+            }
+        }
+        done += n;
+    }
+}
+
+// Releases everything system holds; its files are left as they are.
+static void freeSystem(POSSystem *system) {
+    int i;
+    
+    freeBenchmarkSales(system);
+    free(system->products);
+    free(system->search_nodes);
+    free(system->search_next);
+    free(system->low_stock);
+    for(i = 0; i < system->price_chain_capacity; i++) {
+        free(system->price_chains[i].versions);
+    }
+    free(system->price_chains);
+}
+
+static void runSuiteRound(Output *out, int count, int history, int sells, unsigned long long *state) {
+    const int lookups = 2000000, samples = 200000;
+    POSSystem system, loaded;
+    ZipfTable zipf;
+    SalesSummary summary;
+    ProductTotal top[10];
+    Basket basket;
+    long long *latency = malloc(sizeof(long long) * (samples > sells ? samples : sells));
+    int *ids = malloc(sizeof(int) * lookups);
+    long long found = 0, bytes;
+    int today = dayNumber(time(NULL)), rounds, sales, i, j, items;
+    double t0, seconds;
+    struct stat st;
+    
+    fprintf(stderr, "%d products\n", count);
+    initializeSystem(&system);
+    if(latency == NULL || ids == NULL || !resizeProducts(&system, count) || !initZipf(&zipf, count, state)) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    for(i = 0; i < count; i++) {
+        Product *p = &system.products[i];
+        memset(p, 0, sizeof(*p));
+        p->id = i + 1;
+        snprintf(p->name, MAX_NAME_LENGTH, "Item %d", i + 1);
+        p->price = 50 + (Money)(benchRandom(state) % 20000);
+        p->quantity = 1000000000;
+        p->min_stock_level = 10;
+    }
+    system.product_count = count;
+    buildSearchIndex(&system);
+    buildLowStock(&system);
+    
+    // lookups: throughput over a batch, then individually timed ones
+    for(i = 0; i < lookups; i++) {
+        ids[i] = system.products[nextZipf(&zipf, state)].id;
+    }
+    t0 = benchSeconds();
+    for(i = 0; i < lookups; i++) {
+        found += findProductById(&system, ids[i]);
+    }
+    seconds = benchSeconds() - t0;
+    for(i = 0; i < samples; i++) {
+        t0 = benchSeconds();
+        found += findProductById(&system, ids[i]);
+        latency[i] = nanosSince(t0);
+    }
+    if(found == -1) {
+        fprintf(stderr, "\n");  // keeps the loops from being optimised away
+    }
+    outBenchResult(out, count, "findProductById", lookups, seconds, latency, samples, 0);
+    
+    t0 = benchSeconds();
+    fillSuiteHistory(&system, &zipf, history, 90, state);
+    outBenchResult(out, count, "appendSale+addToRollups", history, benchSeconds() - t0, NULL, 0, 0);
+    
+    // what processSale does once the products are entered: one to three
+    // lines into the basket, then the commit
+    initBasket(&basket);
+    t0 = benchSeconds();
+    for(i = 0; i < sells; i++) {
+        double s = benchSeconds();
+        items = 1 + i % 3;
+        clearBasket(&basket);
+        for(j = 0; j < items; j++) {
+            addToBasket(&basket, findProductById(&system, system.products[nextZipf(&zipf, state)].id), 1 + j);
+        }
+        commitBasket(&system, &basket);
+        latency[i] = nanosSince(s);
+    }
+    freeBasket(&basket);
+    outBenchResult(out, count, "processSale", sells, benchSeconds() - t0, latency, sells, 0);
+    
+    t0 = benchSeconds();
+    saveProducts(&system);
+    seconds = benchSeconds() - t0;
+    bytes = stat(FILENAME_PRODUCTS, &st) == 0 ? (long long)st.st_size : 0;
+    outBenchResult(out, count, "saveProducts", 1, seconds, NULL, 0, bytes);
+    
+    t0 = benchSeconds();
+    saveSales(&system);
+    seconds = benchSeconds() - t0;
+    bytes = stat(FILENAME_SALES, &st) == 0 ? (long long)st.st_size : 0;
+    outBenchResult(out, count, "saveSales", system.sale_count, seconds, NULL, 0, bytes);
+    
+    initializeSystem(&loaded);
+    t0 = benchSeconds();
+    loadProducts(&loaded);
+    outBenchResult(out, count, "loadProducts", 1, benchSeconds() - t0, NULL, 0, 0);
+    t0 = benchSeconds();
+    loadSales(&loaded);
+    outBenchResult(out, count, "loadSales", loaded.sale_count, benchSeconds() - t0, NULL, 0, 0);
+    if(loaded.product_count != count || loaded.sale_count != system.sale_count) {
+        fprintf(stderr, "  reload MISMATCH: %d products, %d sales\n", loaded.product_count, loaded.sale_count);
+    }
+    freeSystem(&loaded);
+    
+    // the three rollup reads of viewDailyRevenue
+    rounds = 1000;
+    t0 = benchSeconds();
+    for(i = 0; i < rounds; i++) {
+        double s = benchSeconds();
+        rollupRevenue(&system, today, today, &sales);
+        rollupRevenue(&system, today - 6, today, &sales);
+        rollupRevenue(&system, today - 29, today, &sales);
+        latency[i] = nanosSince(s);
+    }
+    outBenchResult(out, count, "viewDailyRevenue", rounds, benchSeconds() - t0, latency, rounds, 0);
+    
+    // what the best-seller reports and a 30-day summary compute
+    rounds = 50;
+    t0 = benchSeconds();
+    for(i = 0; i < rounds; i++) {
+        double s = benchSeconds();
+        topProducts(&system, today - 29, today, i & 1 ? RANK_BY_REVENUE : RANK_BY_QUANTITY, top, 10);
+        latency[i] = nanosSince(s);
+    }
+    outBenchResult(out, count, "topProducts_30_days", rounds, benchSeconds() - t0, latency, rounds, 0);
+    
+    rounds = 10;
+    t0 = benchSeconds();
+    for(i = 0; i < rounds; i++) {
+        double s = benchSeconds();
+        summarizeSales(&system, time(NULL) - 30 * 86400, time(NULL), &summary);
+        freeSalesSummary(&summary);
+        latency[i] = nanosSince(s);
+    }
+    outBenchResult(out, count, "summarizeSales_30_days", rounds, benchSeconds() - t0, latency, rounds, 0);
+    
+    unlink(FILENAME_PRODUCTS);
+    unlink(FILENAME_SALES);
+    unlink(FILENAME_ROLLUPS);
+    unlink(FILENAME_PRICES);
+    freeSystem(&system);
+    freeZipf(&zipf);
+    free(ids);
+    free(latency);
+}
+
+void runBenchmarkSuite(int max_products, int history, int sells, const char *dir) {
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    char path[512];
+    FILE *results;
+    Output out;
+    int count, saved;
+    
+    snprintf(path, sizeof(path), "%s/pos-bench.XXXXXX", dir);
+    if(mkdtemp(path) == NULL || chdir(path) != 0) {
+        perror(path);
+        return;
+    }
+    // results keep the real stdout; anything else printed goes to stderr
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    results = saved >= 0 ? fdopen(saved, "w") : NULL;
+    if(results == NULL) {
+        perror("stdout");
+        return;
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    openOutput(&out, results);
+    out.json = 1;
+    outRecord(&out, "run");
+    outJsonText(&out, "program", "pos");
+    outJsonInt(&out, "time", time(NULL));
+    outJsonInt(&out, "max_products", max_products);
+    outJsonInt(&out, "history_sales", history);
+    outJsonInt(&out, "live_sales", sells);
+    outJsonInt(&out, "zipf_exponent", 1);
+    outEndRecord(&out);
+    flushOutput(&out);
+    for(count = 1000; count <= max_products; count *= 10) {
+        runSuiteRound(&out, count, history, sells, &state);
+    }
+    closeOutput(&out);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    fclose(results);
+    if(chdir("..") == 0) {
+        rmdir(path);
+    }
+}
+
+// Chain of stores. Every store is a POSSystem of its own, with its own catalog,
+// sales, rollups and files (in CHAIN_DIRECTORY/store-<n>), and is owned by one
+// worker thread pinned to a CPU: only that thread ever touches the store, so
+// no lock, counter or cache line is shared between two branches. Work reaches
+// a store through its mailbox, a ring of requests that only the store's own
+// worker and whoever is sending to that store ever lock. Cross-store queries
+// are scattered to every mailbox at once, each store answers into its own
+// result slot, and the caller merges the slots once the last one is in.
+static int runStoreRequest(Store *store, StoreRequest *request, StoreResult *result) {
+    POSSystem *system = &store->system;
+    Product product;
+    int index;
+    
+    memset(result, 0, sizeof(*result));
+    if(request->type == CHAIN_READY || !store->loaded) {
+        store->rejected += request->type == CHAIN_SALE;
+        return store->loaded;
+    }
+    switch(request->type) {
+        case CHAIN_SALE:
+            clearBasket(&store->basket);
+            index = findProductById(system, request->product_id);
+            if(index < 0 || !addToBasket(&store->basket, index, request->quantity) ||
+               !commitBasket(system, &store->basket)) {
+                store->rejected++;
+                return 0;
+            }
+            store->sales++;
+            result->quantity = request->quantity;
+            result->revenue = store->basket.total;
+            return 1;
+        case CHAIN_ADD_PRODUCT:
+            memset(&product, 0, sizeof(product));
+            memcpy(product.name, request->name, MAX_NAME_LENGTH);
+            product.price = request->price;
+            product.quantity = request->quantity;
+            product.min_stock_level = request->min_stock_level;
+            if(!insertProduct(system, &product)) {
+                return 0;
+            }
+            result->quantity = product.id;
+            return 1;
+        case CHAIN_STOCK:
+            index = findProductByName(system, request->name);
+            if(index < 0) {
+                return 0;
+            }
+            result->quantity = system->products[index].quantity;
+            return 1;
+        case CHAIN_REVENUE: {
+            int sales;
+            result->revenue = rollupRevenue(system, request->from_day, request->to_day, &sales);
+            result->sales = sales;
+            return 1;
+        }
+        case CHAIN_SAVE:
+            saveProducts(system);
+            saveSales(system);
+            return 1;
+    }
+    return 0;
+}
+
+static void *storeWorker(void *arg) {
+    Store *store = arg;
+    StoreRequest batch[CHAIN_BATCH];
+    StoreResult result;
+    char path[64];
+    cpu_set_t cpus;
+    int count, i, stop = 0, ok;
+    
+    CPU_ZERO(&cpus);
+    CPU_SET(store->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    reportSerial = 1;
+    
+    // loaded here so the store's memory is first touched on its own CPU
+    snprintf(path, sizeof(path), "%s/store-%d", CHAIN_DIRECTORY, store->index);
+    mkdir(path, 0755);
+    initializeSystem(&store->system);
+    initBasket(&store->basket);
+    store->system.dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    store->loaded = store->system.dir_fd >= 0;
+    if(store->loaded) {
+        loadProducts(&store->system);
+        loadSales(&store->system);
+    } else {
+        printf("Cannot open %s!\n", path); // the store refuses everything but CHAIN_STOP
+    }
+    
+    while(!stop) {
+        pthread_mutex_lock(&store->lock);
+        while(store->head == store->tail) {
+            pthread_cond_wait(&store->wake, &store->lock);
+        }
+        for(count = 0; count < CHAIN_BATCH && store->head != store->tail; count++) {
+            batch[count] = store->queue[store->head++ % CHAIN_QUEUE_SIZE];
+        }
+        pthread_cond_broadcast(&store->room);
+        pthread_mutex_unlock(&store->lock);
+        
+        for(i = 0; i < count; i++) {
+            if(batch[i].type == CHAIN_STOP) {
+                stop = 1;
+                ok = 1;
+                memset(&result, 0, sizeof(result));
+            } else {
+                ok = runStoreRequest(store, &batch[i], &result);
+            }
+            if(batch[i].gather != NULL) {
+                ChainGather *gather = batch[i].gather;
+                result.ok = ok;
+                gather->results[batch[i].slot] = result;
+                if(__atomic_sub_fetch(&gather->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                    pthread_mutex_lock(&gather->lock);
+                    pthread_cond_signal(&gather->done);
+                    pthread_mutex_unlock(&gather->lock);
+                }
+            }
+        }
+    }
+    freeBasket(&store->basket);
+    freeSystem(&store->system);
+    if(store->loaded) {
+        close(store->system.dir_fd);
+    }
+    return NULL;
+}
+
+// Queues request on store; waits while the store's mailbox is full.
+void sendToStore(Chain *chain, int store_index, const StoreRequest *request) {
+    Store *store = &chain->stores[store_index];
+    
+    pthread_mutex_lock(&store->lock);
+    while(store->tail - store->head == CHAIN_QUEUE_SIZE) {
+        pthread_cond_wait(&store->room, &store->lock);
+    }
+    store->queue[store->tail++ % CHAIN_QUEUE_SIZE] = *request;
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->lock);
+}
+
+static void initGather(ChainGather *gather, int count) {
+    pthread_mutex_init(&gather->lock, NULL);
+    pthread_cond_init(&gather->done, NULL);
+    gather->pending = count;
+    gather->results = aligned_alloc(64, sizeof(StoreResult) * count);
+    if(gather->results == NULL) {
+        printf("Out of memory!\n");
+        exit(1);
+    }
+}
+
+static void waitGather(ChainGather *gather) {
+    pthread_mutex_lock(&gather->lock);
+    while(__atomic_load_n(&gather->pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&gather->done, &gather->lock);
+    }
+    pthread_mutex_unlock(&gather->lock);
+}
+
+static void freeGather(ChainGather *gather) {
+    pthread_mutex_destroy(&gather->lock);
+    pthread_cond_destroy(&gather->done);
+    free(gather->results);
+}
+
+// Sends request to every store and waits for all the answers, which are left
+// in gather->results by store; the caller frees them with freeGather().
+static void scatter(Chain *chain, StoreRequest *request, ChainGather *gather) {
+    int i;
+    
+    initGather(gather, chain->store_count);
+    request->gather = gather;
+    for(i = 0; i < chain->store_count; i++) {
+        request->slot = i;
+        sendToStore(chain, i, request);
+    }
+    waitGather(gather);
+}
+
+// Sends request to one store and waits for its answer; returns whether the
+// store carried it out.
+static int askStore(Chain *chain, int store_index, StoreRequest *request, StoreResult *result) {
+    ChainGather gather;
+    
+    initGather(&gather, 1);
+    request->gather = &gather;
+    request->slot = 0;
+    sendToStore(chain, store_index, request);
+    waitGather(&gather);
+    *result = gather.results[0];
+    freeGather(&gather);
+    return result->ok;
+}
+
+// Stops the first `started` stores of the chain, whose workers are running,
+// and frees the chain.
+static void stopStores(Chain *chain, int started) {
+    StoreRequest request;
+    int i;
+    
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_STOP;
+    for(i = 0; i < started; i++) {
+        sendToStore(chain, i, &request);
+    }
+    for(i = 0; i < started; i++) {
+        Store *store = &chain->stores[i];
+        pthread_join(store->thread, NULL);
+        pthread_mutex_destroy(&store->lock);
+        pthread_cond_destroy(&store->wake);
+        pthread_cond_destroy(&store->room);
+        free(store->queue);
+    }
+    free(chain->stores);
+}
+
+// Starts `stores` stores, loading each from CHAIN_DIRECTORY/store-<n>, and
+// waits until all of them have loaded. Returns 0, with no store left running,
+// if the chain cannot be set up.
+int openChain(Chain *chain, int stores) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    StoreRequest request;
+    ChainGather gather;
+    size_t size;
+    int i, ok = 1;
+    
+    if(stores < 1 || stores > CHAIN_MAX_STORES) {
+        return 0;
+    }
+    mkdir(CHAIN_DIRECTORY, 0755);
+    chain->store_count = stores;
+    size = (sizeof(Store) * stores + 63) / 64 * 64;  // aligned_alloc takes whole lines only
+    chain->stores = aligned_alloc(64, size);
+    if(chain->stores == NULL) {
+        return 0;
+    }
+    memset(chain->stores, 0, sizeof(Store) * stores);
+    for(i = 0; i < stores; i++) {
+        Store *store = &chain->stores[i];
+        store->index = i;
+        store->cpu = (int)(i % (cpus > 0 ? cpus : 1));
+        store->queue = malloc(sizeof(StoreRequest) * CHAIN_QUEUE_SIZE);
+        if(store->queue == NULL) {
+            stopStores(chain, i);
+            return 0;
+        }
+        pthread_mutex_init(&store->lock, NULL);
+        pthread_cond_init(&store->wake, NULL);
+        pthread_cond_init(&store->room, NULL);
+        if(pthread_create(&store->thread, NULL, storeWorker, store) != 0) {
+            pthread_mutex_destroy(&store->lock);
+            pthread_cond_destroy(&store->wake);
+            pthread_cond_destroy(&store->room);
+            free(store->queue);
+            stopStores(chain, i);
+            return 0;
+        }
+    }
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_READY;
+    scatter(chain, &request, &gather);
+    for(i = 0; i < stores; i++) {
+        ok = ok && gather.results[i].ok;
+    }
+    freeGather(&gather);
+    if(!ok) {
+        stopStores(chain, stores);
+    }
+    return ok;
+}
+
+// Saves every store, stops the workers and frees the chain.
+void closeChain(Chain *chain) {
+    StoreRequest request;
+    ChainGather gather;
+    
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_SAVE;
+    scatter(chain, &request, &gather);
+    freeGather(&gather);
+    stopStores(chain, chain->store_count);
+}
+
+// Queues a sale at one store without waiting for it; refused sales are
+// counted in the store's `rejected`.
+void chainSale(Chain *chain, int store_index, int product_id, int quantity) {
+    StoreRequest request;
+    
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_SALE;
+    request.product_id = product_id;
+    request.quantity = quantity;
+    sendToStore(chain, store_index, &request);
+}
+
+// Adds a product to one store's catalog; returns its id there, or 0.
+int addChainProduct(Chain *chain, int store_index, const char *name, Money price, int quantity, int min_stock) {
+    StoreRequest request;
+    StoreResult result;
+    
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_ADD_PRODUCT;
+    snprintf(request.name, MAX_NAME_LENGTH, "%s", name);
+    request.price = price;
+    request.quantity = quantity;
+    request.min_stock_level = min_stock;
+    return askStore(chain, store_index, &request, &result) ? (int)result.quantity : 0;
+}
+
+// Units of the product called name (exactly, as findProductByName() matches)
+// in stock over all stores; stores counts the stores that carry it. Each store
+// looks the name up in its own index.
+long long chainStock(Chain *chain, const char *name, int *stores) {
+    StoreRequest request;
+    ChainGather gather;
+    long long total = 0;
+    int i;
+    
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_STOCK;
+    snprintf(request.name, MAX_NAME_LENGTH, "%s", name);
+    scatter(chain, &request, &gather);
+    *stores = 0;
+    for(i = 0; i < chain->store_count; i++) {
+        if(gather.results[i].ok) {
+            total += gather.results[i].quantity;
+            (*stores)++;
+        }
+    }
+    freeGather(&gather);
+    return total;
+}
+
+// Chain-wide revenue over days [from_day, to_day], from every store's rollups;
+// sales receives the number of line items. per_store, if not NULL, receives
+// each store's revenue.
+Money chainRevenue(Chain *chain, int from_day, int to_day, long long *sales, Money *per_store) {
+    StoreRequest request;
+    ChainGather gather;
+    Money total = 0;
+    int i;
+    
+    memset(&request, 0, sizeof(request));
+    request.type = CHAIN_REVENUE;
+    request.from_day = from_day;
+    request.to_day = to_day;
+    scatter(chain, &request, &gather);
+    *sales = 0;
+    for(i = 0; i < chain->store_count; i++) {
+        total += gather.results[i].revenue;
+        *sales += gather.results[i].sales;
+        if(per_store != NULL) {
+            per_store[i] = gather.results[i].revenue;
+        }
+    }
+    freeGather(&gather);
+    return total;
+}
+
+// Drives a chain of `stores` stores from commands on stdin, one per line:
+//   SALE <store> <product id> <quantity>        (queued, not answered)
+//   ADD <store> <price> <quantity> <min stock> <name>
+//                                               -> OK <id>
+//   STOCK <name>                                -> OK <units> <stores carrying it>
+//   REVENUE <days>                              -> OK <line items> <revenue>, then
+//                                                  "<store> <revenue>" per store
+//   SAVE                                        -> OK
+// Anything else answers "ERR <reason>". Stores are numbered from 0. Only the
+// replies go to stdout; anything the stores print goes to stderr.
+int runChain(int stores) {
+    Chain chain;
+    Money *per_store = malloc(sizeof(Money) * (stores > 0 ? stores : 1));
+    char line[256], name[MAX_NAME_LENGTH], amount[MONEY_TEXT_LENGTH], *cursor;
+    int store, a, b, c, offset, i;
+    Money price;
+    long long sales;
+    FILE *replies;
+    int saved;
+    
+    // replies keep the real stdout; what the stores print as they load and
+    // work goes to stderr, from threads that would interleave with them
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    replies = saved >= 0 ? fdopen(saved, "w") : NULL;
+    if(replies == NULL) {
+        perror("stdout");
+        return 1;
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    if(per_store == NULL || !openChain(&chain, stores)) {
+        printf("Cannot start %d stores (1 to %d)!\n", stores, CHAIN_MAX_STORES);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        fclose(replies);
+        free(per_store);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), stdin) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if(sscanf(line, "SALE %d %d %d", &store, &a, &b) == 3) {
+            if(store < 0 || store >= stores) {
+                fprintf(replies, "ERR no such store\n");
+                continue;
+            }
+            chainSale(&chain, store, a, b);
+        } else if(sscanf(line, "ADD %d %n", &store, &offset) == 1) {
+            cursor = line + offset;
+            if(store < 0 || store >= stores || !parseMoney(&cursor, &price) ||
+               sscanf(cursor, "%d %d %n", &b, &c, &offset) != 2 || cursor[offset] == '\0') {
+                fprintf(replies, "ERR usage: ADD <store> <price> <quantity> <min stock> <name>\n");
+                continue;
+            }
+            snprintf(name, sizeof(name), "%s", cursor + offset);
+            a = addChainProduct(&chain, store, name, price, b, c);
+            if(a) {
+                fprintf(replies, "OK %d\n", a);
+            } else {
+                fprintf(replies, "ERR cannot add product\n");
+            }
+        } else if(strncmp(line, "STOCK ", 6) == 0) {
+            sales = chainStock(&chain, line + 6, &a);
+            fprintf(replies, "OK %lld %d\n", sales, a);
+        } else if(sscanf(line, "REVENUE %d", &a) == 1 && a > 0) {
+            b = dayNumber(time(NULL));
+            price = chainRevenue(&chain, b - (a - 1), b, &sales, per_store);
+            fprintf(replies, "OK %lld %s\n", sales, formatMoney(price, amount));
+            for(i = 0; i < stores; i++) {
+                fprintf(replies, "%d %s\n", i, formatMoney(per_store[i], amount));
+            }
+        } else if(strcmp(line, "SAVE") == 0) {
+            StoreRequest request;
+            ChainGather gather;
+            memset(&request, 0, sizeof(request));
+            request.type = CHAIN_SAVE;
+            scatter(&chain, &request, &gather);
+            freeGather(&gather);
+            fprintf(replies, "OK\n");
+        } else if(line[0] != '\0') {
+            fprintf(replies, "ERR bad command\n");
+        }
+        fflush(replies);
+    }
+    closeChain(&chain);
+    free(per_store);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    fclose(replies);
+    return 0;
+}
+
+typedef struct {
+    Chain *chain;
+    int store;
+    int sales;
+    int products;
+} ChainFeeder;
+
+static void *chainFeeder(void *arg) {
+    ChainFeeder *feeder = arg;
+    unsigned seed = 17u + (unsigned)feeder->store;
+    int i;
+    
+    for(i = 0; i < feeder->sales; i++) {
+        seed = seed * 1103515245u + 12345u;
+        chainSale(feeder->chain, feeder->store, (int)((seed >> 8) % (unsigned)feeder->products) + 1, 1);
+    }
+    return NULL;
+}
+
+// Sale throughput with 1, 2, 4... up to max_stores stores, each fed by its own
+// thread, and the latency of the two cross-store queries. With no sharing
+// between branches the throughput should grow with the stores until the CPUs
+// run out. Runs in a scratch directory under the working one.
+void runChainBenchmark(int max_stores, int sales) {
+    const int products = 1000, queries = 200;
+    char path[] = "chain-bench.XXXXXX", name[MAX_NAME_LENGTH], file[128];
+    ChainFeeder *feeders = malloc(sizeof(ChainFeeder) * max_stores);
+    pthread_t *threads = malloc(sizeof(pthread_t) * max_stores);
+    Chain chain;
+    double t0, elapsed, stock_time, revenue_time;
+    long long sold, line_items;
+    int stores, i, j, carrying, today = dayNumber(time(NULL));
+    
+    FILE *results;
+    int saved;
+    
+    if(feeders == NULL || threads == NULL || mkdtemp(path) == NULL || chdir(path) != 0) {
+        printf("Cannot set up the chain benchmark!\n");
+        return;
+    }
+    // the table keeps the real stdout; what the stores print on loading goes to stderr
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    results = saved >= 0 ? fdopen(saved, "w") : NULL;
+    if(results == NULL) {
+        printf("Cannot set up the chain benchmark!\n");
+        return;
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    fprintf(results, "%d sales per store, %d products per store\n", sales, products);
+    fprintf(results, "%-8s %14s %14s %14s %14s\n", "stores", "sales/s", "per store", "stock us", "revenue us");
+    for(stores = 1; stores <= max_stores; stores *= 2) {
+        if(!openChain(&chain, stores)) {
+            printf("Cannot start %d stores!\n", stores);
+            break;
+        }
+        for(i = 0; i < stores; i++) {
+            for(j = 0; j < products; j++) {
+                snprintf(name, sizeof(name), "Item %d", j + 1);
+                addChainProduct(&chain, i, name, 100 + j, 1000000000, 10);
+            }
+        }
+        t0 = benchSeconds();
+        for(i = 0; i < stores; i++) {
+            feeders[i].chain = &chain;
+            feeders[i].store = i;
+            feeders[i].sales = sales;
+            feeders[i].products = products;
+            pthread_create(&threads[i], NULL, chainFeeder, &feeders[i]);
+        }
+        for(i = 0; i < stores; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        // one query per store drains what the feeders queued
+        chainRevenue(&chain, today, today, &line_items, NULL);
+        elapsed = benchSeconds() - t0;
+        sold = 0;
+        for(i = 0; i < stores; i++) {
+            sold += chain.stores[i].sales;
+        }
+        
+        t0 = benchSeconds();
+        for(i = 0; i < queries; i++) {
+            snprintf(name, sizeof(name), "Item %d", i % products + 1);
+            chainStock(&chain, name, &carrying);
+        }
+        stock_time = (benchSeconds() - t0) / queries;
+        t0 = benchSeconds();
+        for(i = 0; i < queries; i++) {
+            chainRevenue(&chain, today - 29, today, &line_items, NULL);
+        }
+        revenue_time = (benchSeconds() - t0) / queries;
+        fprintf(results, "%-8d %14.0f %14.0f %14.1f %14.1f%s\n", stores, sold / elapsed, sold / elapsed / stores,
+                stock_time * 1e6, revenue_time * 1e6, sold == (long long)sales * stores ? "" : "   MISMATCH");
+        fflush(results);
+        closeChain(&chain);
+        for(i = 0; i < stores; i++) {
+            const char *files[] = {FILENAME_PRODUCTS, FILENAME_SALES, FILENAME_ROLLUPS, FILENAME_PRICES};
+            for(j = 0; j < 4; j++) {
+                snprintf(file, sizeof(file), "%s/store-%d/%s", CHAIN_DIRECTORY, i, files[j]);
+                unlink(file);
+            }
+            snprintf(file, sizeof(file), "%s/store-%d", CHAIN_DIRECTORY, i);
+            rmdir(file);
+        }
+        rmdir(CHAIN_DIRECTORY);
+    }
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    fclose(results);
+    free(feeders);
+    free(threads);
+    if(chdir("..") == 0) {
+        rmdir(path);
+    }
+}
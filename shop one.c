@@ -4,281 +4,4591 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#include <x86intrin.h>
+#endif
+
+#define PRODUCTS_FILE "products.dat"
+#define SALES_FILE "sales.csv"
+#define WAL_FILE "products.wal"
+#define LEDGER_FILE "sales.ledger"
+#define LEDGER_INDEX_FILE "sales.idx"
+#define ROLLUP_FILE "sales.rollup"
+#define PRICES_FILE "prices.hist"
+#define NAME_LEN 64
+#define BUFFER 128
+#define INDEX_MIN_CAPACITY 64
+#define MONEY_LEN 24                 // longest formatted Money plus terminator
+#define WAL_GROUP_COMMIT 32          // fsync after this many records...
+#define WAL_GROUP_COMMIT_MS 50       // ...or once the oldest unsynced record is this old
+#define WAL_CHECKPOINT_RECORDS 4096  // compact the log into PRODUCTS_FILE past this size
+#define WAL_MAGIC 0x57504853u        // "SHPW"
+#define WAL_VERSION 1                // 1 encoded records; before it the log held raw WalRecords
+#define WAL_HEADER_SIZE 8
+#define WAL_RECORD_MAX (STORE_RECORD_MAX + 40)
+#define PRICES_MAGIC 0x48504853u     // "SHPH"
+#define PRICES_VERSION 1             // 1 encoded records; before it the file held raw PriceRecords
+#define PRICES_HEADER_SIZE 8
+#define PRICE_RECORD_MAX 40          // longest encoded price version
+#define STORE_MAGIC 0x4d504853u      // "SHPM"
+#define STORE_VERSION 6             // 2 added Product.min_stock, 3 made prices integer cents, 4 checksums, 5 encoded records, 6 last_id
+#define STORE_ENCODED_VERSION 5      // first version written by save_products()
+#define STORE_FILE_HEADER_SIZE 36
+#define STORE_RECORD_MAX (NAME_LEN + 40) // longest encoded product
+#define STORE_CHECKSUM_BLOCK 1024    // records covered by one CRC32C
+#define DEFAULT_MIN_STOCK 5          // low-stock level given to products from older files
+#define STORE_INITIAL_CAPACITY 1024
+#define COMPACT_TOMBSTONE_SHARE 4    // compact once 1 in this many slots is a tombstone
+#define LEDGER_MAGIC 0x4c504853u     // "SHPL"
+#define LEDGER_VERSION 3             // 2 made prices integer cents, 3 added record checksums
+#define LEDGER_READ_BATCH 4096       // records per read() when scanning the ledger
+#define ROLLUP_MAGIC 0x52504853u     // "SHPR"
+#define ROLLUP_VERSION 2
+#define ROLLUP_SAVE_EVERY 256        // sales between rollup file rewrites
+#define SERVER_MAX_EVENTS 256
+#define SERVER_MAX_REQUEST 4096      // longest request line accepted
+#define SERVER_READ_CHUNK 65536
+#define SERVER_MAX_TOP 100           // most rows a TOP request returns
+#define REPORT_MAX_THREADS 64        // most threads a ledger scan is split across
+#define TOP_DEFAULT 10               // products a ranked report lists unless told otherwise
+#define CSV_BUFFER (1 << 20)          // CSV writer buffer; one write() per fill
+#define CSV_ROW_MAX 4096             // most bytes a single CSV put may add
+#define STAT_SUB_BITS 4              // latency histogram steps per power of two, as a power of two
+#define STAT_BUCKETS ((64 - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+#define STATS_DUMP_INTERVAL 10       // seconds between SHOP_STATS_FILE rewrites unless SHOP_STATS_INTERVAL says
+
+// Amounts of money are whole cents, so totals add up exactly however many
+// sales go into them.
+typedef long long Money;
+
+typedef struct {
+    int id;
+    char name[NAME_LEN];
+    Money price;
+    int stock;
+    int min_stock;  // stock at or below this is low
+} Product;
+
+// Open-addressing id -> array slot index (linear probing, power-of-two capacity).
+typedef struct {
+    int *slots;      // index into the product array, -1 = empty
+    int capacity;
+    int used;
+} IdIndex;
+
+// PRODUCTS_FILE is the snapshot taken at the last checkpoint. Since version 5
+// it is a little-endian header and blocks of encoded products (see
+// save_products()), so it reads the same on any compiler or machine.
+// products[] is a heap array loaded from it; changes since the snapshot are
+// in the log. StoreHeader is what versions 1 to 4 wrote as is, followed by
+// `count` raw Product records and a CRC32C for each run of block_size records.
+// Before version 4 the file held `capacity` records and was edited in place.
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    unsigned header_size;
+    unsigned record_size;
+    long long count;
+    long long capacity;
+    long long checkpoint_lsn;
+    unsigned block_size;
+    unsigned checksum;  // CRC32C of the fields above
+    char reserved[16];
+} StoreHeader;
+
+int store_fd = -1;
+unsigned store_version = 0; // version PRODUCTS_FILE was loaded from, until upgraded
+Product *products = NULL;
+int product_count = 0;
+int product_capacity = 0;
+IdIndex id_index = {NULL, 0, 0};
+int index_ready = 0; // built lazily; many runs never look a product up by id
+int max_id = 0;      // highest id currently in products[]
+int last_id = 0;     // highest id ever issued, kept in PRODUCTS_FILE so ids are never reused
+
+// Deleting a product leaves a tombstone (id 0) in its slot instead of shifting
+// every later record down. Tombstoned slots are reused by later adds, and
+// compact_products() squeezes out the rest once they make up a good share.
+typedef struct {
+    int *slots;
+    int count, capacity;
+} FreeSlots;
+
+FreeSlots free_slots = {NULL, 0, 0};
+int tombstones = 0;  // slots in products[] holding no product
+
+// Mutation log. Every record carries the after-image of the product, so replay
+// is idempotent and safe even if a checkpoint was interrupted half way. Logs
+// before WAL_VERSION 1 held these structs raw; see wal_log() for the encoding.
+enum { WAL_ADD = 1, WAL_UPDATE, WAL_DELETE, WAL_STOCK };
+
+typedef struct {
+    long long lsn;
+    int type;
+    int delta;          // stock change for WAL_STOCK (informational)
+    Product p;          // after-image; only p.id is used for WAL_DELETE
+    unsigned checksum;
+} WalRecord;
+
+int wal_fd = -1;
+int price_fd = -1;            // PRICES_FILE, synced along with the log
+int ledger_fd = -1;           // LEDGER_FILE and its day index, also synced
+int ledger_index_fd = -1;     // with the log, ahead of it
+long long next_lsn = 1;
+long long checkpoint_lsn = 0; // last lsn folded into PRODUCTS_FILE
+int wal_records = 0;          // records in the log since the last checkpoint
+int wal_unsynced = 0;
+double wal_oldest_unsynced = 0;
+int wal_checkpoint_held = 0;  // a batch is part applied; checkpoint after it
+
+// Copies src into a NAME_LEN name field, cutting it short if need be.
+void copy_name(char *dst, const char *src) {
+    size_t len = strnlen(src, NAME_LEN - 1);
+    memcpy(dst, src, len);
+    dst[len] = 0;
+}
+
+void trim_newline(char *s) {
+    size_t l = strlen(s);
+    if (l && s[l - 1] == '\n')
+        s[l - 1] = 0;
+}
+
+// Writes m as "-123.45" into out (at least MONEY_LEN bytes) and returns out.
+char *format_money(Money m, char *out) {
+    char tmp[MONEY_LEN];
+    unsigned long long v = m < 0 ? 0 - (unsigned long long)m : (unsigned long long)m;
+    int n = 0;
+    tmp[n++] = '0' + v % 10;
+    tmp[n++] = '0' + v / 10 % 10;
+    tmp[n++] = '.';
+    v /= 100;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (m < 0) tmp[n++] = '-';
+    for (int i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    out[n] = 0;
+    return out;
+}
+
+// Parses "12", "12.3", "12.34" or "-0.5" (leading blanks allowed). Digits past
+// the cents round half away from zero. Returns a pointer just past the amount,
+// or NULL if s does not start with one.
+const char *parse_money(const char *s, Money *out) {
+    while (*s == ' ' || *s == '\t') s++;
+    int neg = *s == '-';
+    if (*s == '-' || *s == '+') s++;
+    Money v = 0;
+    int digits = 0;
+    for (; *s >= '0' && *s <= '9'; s++, digits++) {
+        if (v > (LLONG_MAX - 9) / 1000) return NULL;
+        v = v * 10 + (*s - '0');
+    }
+    v *= 100;
+    if (*s == '.') {
+        s++;
+        if (*s >= '0' && *s <= '9') v += 10 * (*s++ - '0'), digits++;
+        if (*s >= '0' && *s <= '9') v += *s++ - '0';
+        if (*s >= '5' && *s <= '9') v++;
+        while (*s >= '0' && *s <= '9') s++;
+    }
+    if (!digits) return NULL;
+    *out = neg ? -v : v;
+    return s;
+}
+
+// Cents nearest to a floating-point amount, for converting older files.
+Money money_from_double(double d) {
+    return (Money)(d * 100 + (d < 0 ? -0.5 : 0.5));
+}
+
+static unsigned hash_id(int id) {
+    return (unsigned)id * 2654435761u;
+}
+
+int index_init(IdIndex *ix, int expected) {
+    int cap = INDEX_MIN_CAPACITY;
+    while (cap < expected * 2) cap <<= 1; // keep load factor <= 0.5
+    int *slots = malloc(sizeof(int) * cap);
+    if (!slots) return 0;
+    for (int i = 0; i < cap; i++) slots[i] = -1;
+    free(ix->slots);
+    ix->slots = slots;
+    ix->capacity = cap;
+    ix->used = 0;
+    return 1;
+}
+
+void index_free(IdIndex *ix) {
+    free(ix->slots);
+    ix->slots = NULL;
+    ix->capacity = ix->used = 0;
+}
+
+// Returns the slot holding id, or the empty slot where it would go.
+static int index_probe(const IdIndex *ix, const Product *arr, int id) {
+    unsigned mask = (unsigned)ix->capacity - 1;
+    unsigned h = hash_id(id) & mask;
+    while (ix->slots[h] >= 0 && arr[ix->slots[h]].id != id)
+        h = (h + 1) & mask;
+    return (int)h;
+}
+
+int index_find(const IdIndex *ix, const Product *arr, int id) {
+    if (!ix->capacity) return -1;
+    return ix->slots[index_probe(ix, arr, id)];
+}
+
+int index_build(IdIndex *ix, const Product *arr, int n) {
+    if (!index_init(ix, n)) return 0;
+    for (int i = 0; i < n; i++) {
+        if (!arr[i].id) continue; // tombstone
+        ix->slots[index_probe(ix, arr, arr[i].id)] = i;
+        ix->used++;
+    }
+    return 1;
+}
+
+// Points id at array position pos, growing the table if needed.
+int index_put(IdIndex *ix, const Product *arr, int id, int pos) {
+    if ((ix->used + 1) * 2 > ix->capacity) {
+        IdIndex grown = {NULL, 0, 0};
+        if (!index_init(&grown, ix->used + 1)) return 0;
+        for (int i = 0; i < ix->capacity; i++) {
+            int p = ix->slots[i];
+            if (p >= 0 && arr[p].id != id) {
+                grown.slots[index_probe(&grown, arr, arr[p].id)] = p;
+                grown.used++;
+            }
+        }
+        free(ix->slots);
+        *ix = grown;
+    }
+    int h = index_probe(ix, arr, id);
+    if (ix->slots[h] < 0) ix->used++;
+    ix->slots[h] = pos;
+    return 1;
+}
+
+// Backward-shift deletion so probe chains stay unbroken without tombstones.
+void index_remove(IdIndex *ix, const Product *arr, int id) {
+    if (!ix->capacity) return;
+    unsigned mask = (unsigned)ix->capacity - 1;
+    unsigned hole = (unsigned)index_probe(ix, arr, id);
+    if (ix->slots[hole] < 0) return;
+    ix->slots[hole] = -1;
+    ix->used--;
+    for (unsigned j = (hole + 1) & mask; ix->slots[j] >= 0; j = (j + 1) & mask) {
+        unsigned home = hash_id(arr[ix->slots[j]].id) & mask;
+        // move j into the hole unless its home lies cyclically in (hole, j]
+        if ((j > hole && (home <= hole || home > j)) || (j < hole && home <= hole && home > j)) {
+            ix->slots[hole] = ix->slots[j];
+            ix->slots[j] = -1;
+            hole = j;
+        }
+    }
+}
+
+void rebuild_index() {
+    if (!index_build(&id_index, products, product_count)) {
+        fprintf(stderr, "Out of memory building product index\n");
+        exit(1);
+    }
+    max_id = 0;
+    for (int i = 0; i < product_count; i++)
+        if (products[i].id > max_id) max_id = products[i].id;
+    if (max_id > last_id) last_id = max_id;
+    index_ready = 1;
+}
+
+void ensure_index() {
+    if (!index_ready) rebuild_index();
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Operation statistics: per instrumented operation a count, the time spent,
+// the bytes it moved and a log-linear latency histogram with STAT_SUB_BITS
+// sub-buckets per power of two (about 6% resolution), as HDR histograms keep
+// them. Only completed operations are counted. Build with -DSHOP_NO_STATS to
+// compile the timing out of the hot paths.
+enum { STAT_SALE, STAT_SAVE_PRODUCTS, STAT_LOAD_PRODUCTS, STAT_REPORT, STAT_OPS };
+static const char *stat_names[STAT_OPS] = {"sale", "save_products", "load_products", "report"};
+
+typedef struct {
+    long long count;
+    long long total;    // ticks
+    long long max;      // ticks
+    long long bytes;
+    long long buckets[STAT_BUCKETS];
+} OpStats;
+
+static OpStats op_stats[STAT_OPS];
+
+static inline long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Operations are timed in ticks: on x86-64 the time-stamp counter, which
+// costs a few nanoseconds to read against about 30 for clock_gettime(), and
+// elsewhere nanoseconds. Ticks become nanoseconds only when reported.
+#ifdef __x86_64__
+static inline long long stat_ticks() {
+    return (long long)__rdtsc();
+}
+#else
+static inline long long stat_ticks() {
+    return now_ns();
+}
+#endif
+
+// Nanoseconds per tick, measured against the clock since the first call
+// (which waits 10 ms to have something to measure).
+static double stat_ns_per_tick() {
+#ifdef __x86_64__
+    static long long base_ticks, base_ns;
+    if (!base_ns) now_ns(); // the first call can take a millisecond
+    long long ticks = stat_ticks(), ns = now_ns();
+    if (!base_ns) {
+        base_ticks = ticks;
+        base_ns = ns;
+    }
+    while (ns - base_ns < 10000000) {
+        ticks = stat_ticks();
+        ns = now_ns();
+    }
+    return (double)(ns - base_ns) / (double)(ticks - base_ticks);
+#else
+    return 1;
+#endif
+}
+
+// Values below 2^STAT_SUB_BITS get a bucket each; above that, a bucket per
+// power of two split into 2^STAT_SUB_BITS steps.
+static inline int stat_bucket(long long ticks) {
+    unsigned long long v = ticks > 0 ? (unsigned long long)ticks : 0;
+    if (v < (1u << STAT_SUB_BITS)) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - STAT_SUB_BITS + 1) << STAT_SUB_BITS) + (int)((v >> (e - STAT_SUB_BITS)) & ((1u << STAT_SUB_BITS) - 1));
+}
+
+// Largest value that falls in bucket b.
+static long long stat_bucket_top(int b) {
+    if (b < (1 << STAT_SUB_BITS)) return b;
+    int e = (b >> STAT_SUB_BITS) + STAT_SUB_BITS - 1, sub = b & ((1 << STAT_SUB_BITS) - 1);
+    return ((long long)((1 << STAT_SUB_BITS) + sub + 1) << (e - STAT_SUB_BITS)) - 1;
+}
+
+static inline void stat_record(int op, long long ticks, long long bytes) {
+    OpStats *s = &op_stats[op];
+    s->count++;
+    s->total += ticks;
+    s->bytes += bytes;
+    if (ticks > s->max) s->max = ticks;
+    s->buckets[stat_bucket(ticks)]++;
+}
+
+// The latency in ticks below which q (0..1) of the operations completed.
+static long long stat_quantile(const OpStats *s, double q) {
+    long long want = (long long)(q * s->count + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int b = 0; b < STAT_BUCKETS; b++)
+        if ((seen += s->buckets[b]) >= want) {
+            long long top = stat_bucket_top(b);
+            return top < s->max ? top : s->max;
+        }
+    return s->max;
+}
+
+#ifndef SHOP_NO_STATS
+#define STAT_BEGIN(t) long long t = stat_ticks()
+#define STAT_END(op, t, bytes) stat_record(op, stat_ticks() - (t), bytes)
+#else
+#define STAT_BEGIN(t) ((void)0)
+#define STAT_END(op, t, bytes) ((void)0)
+#endif
+
+// CRC32C (Castagnoli), carrying on from crc; pass 0 to start. Uses the SSE4.2
+// crc32 instruction when the CPU has it.
+static unsigned crc32c_sw(unsigned crc, const void *data, size_t len) {
+    static unsigned table[256];
+    if (!table[1])
+        for (unsigned i = 0; i < 256; i++) {
+            unsigned c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+            table[i] = c;
+        }
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2"))) static unsigned crc32c_hw(unsigned crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    unsigned long long c = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; len; p++, len--) c = _mm_crc32_u8((unsigned)c, *p);
+    return ~(unsigned)c;
+}
+#endif
+
+unsigned crc32c(unsigned crc, const void *data, size_t len) {
+    static unsigned (*impl)(unsigned, const void *, size_t);
+    if (!impl) {
+        impl = crc32c_sw;
+#ifdef __x86_64__
+        if (__builtin_cpu_supports("sse4.2")) impl = crc32c_hw;
+#endif
+    }
+    return impl(crc, data, len);
+}
+
+static void put_le32(unsigned char *p, unsigned v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned get_le32(const unsigned char *p) {
+    return p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+static void put_le64(unsigned char *p, unsigned long long v) {
+    put_le32(p, (unsigned)v);
+    put_le32(p + 4, (unsigned)(v >> 32));
+}
+
+static unsigned long long get_le64(const unsigned char *p) {
+    return get_le32(p) | (unsigned long long)get_le32(p + 4) << 32;
+}
+
+// Varints hold seven bits per byte, low bits first, with the top bit set on
+// every byte but the last. Signed values are zigzag-mapped first so that small
+// negative numbers stay short too.
+static unsigned char *put_varint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static unsigned char *put_signed(unsigned char *p, long long v) {
+    return put_varint(p, ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63));
+}
+
+// Returns the byte after the varint, or NULL if it runs past end. A NULL p
+// passes straight through, so a run of reads needs one check at the end.
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned long long *v) {
+    if (!p) return NULL;
+    unsigned long long result = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        result |= (unsigned long long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *v = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const unsigned char *get_signed(const unsigned char *p, const unsigned char *end, long long *v) {
+    unsigned long long u = 0;
+    p = get_varint(p, end, &u);
+    *v = (long long)(u >> 1) ^ -(long long)(u & 1);
+    return p;
+}
+
+// A product is its id, the length and bytes of its name, then its price, stock
+// and minimum stock, all as varints.
+static unsigned char *encode_product(unsigned char *p, const Product *prod) {
+    size_t len = strnlen(prod->name, NAME_LEN - 1);
+    p = put_signed(p, prod->id);
+    p = put_varint(p, len);
+    memcpy(p, prod->name, len);
+    p += len;
+    p = put_signed(p, prod->price);
+    p = put_signed(p, prod->stock);
+    return put_signed(p, prod->min_stock);
+}
+
+static const unsigned char *decode_product(const unsigned char *p, const unsigned char *end, Product *prod) {
+    unsigned long long len = 0;
+    long long id = 0, price = 0, stock = 0, min_stock = 0;
+    memset(prod, 0, sizeof(*prod));
+    p = get_signed(p, end, &id);
+    p = get_varint(p, end, &len);
+    if (!p || len >= NAME_LEN || len > (unsigned long long)(end - p)) return NULL;
+    memcpy(prod->name, p, len);
+    p = get_signed(p + len, end, &price);
+    p = get_signed(p, end, &stock);
+    p = get_signed(p, end, &min_stock);
+    prod->id = (int)id;
+    prod->price = price;
+    prod->stock = (int)stock;
+    prod->min_stock = (int)min_stock;
+    return p;
+}
+
+// Renames a finished temp file over path once its data is on disk, then syncs
+// the directory (the data files live in the working directory) so the rename
+// survives a crash too. Closes fd either way.
+static int replace_file(int fd, const char *tmp, const char *path) {
+    int ok = fsync(fd) == 0;
+    ok = close(fd) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok) {
+        unlink(tmp);
+        return 0;
+    }
+    int dir = open(".", O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+    return 1;
+}
+
+// Makes room for n records, doubling the capacity so appends stay amortised O(1).
+int store_reserve(int n) {
+    if (n <= product_capacity) return 1;
+    long long cap = product_capacity ? product_capacity : STORE_INITIAL_CAPACITY;
+    while (cap < n) cap *= 2;
+    if (cap > INT_MAX) cap = INT_MAX;
+    Product *grown = realloc(products, (size_t)cap * sizeof(Product));
+    if (!grown) {
+        perror("Grow product store");
+        return 0;
+    }
+    products = grown;
+    product_capacity = (int)cap;
+    return 1;
+}
+
+// Puts p in a tombstoned slot if there is one, else at the end, and indexes
+// it. Returns the slot, or -1 when out of memory.
+int store_insert(const Product *p) {
+    ensure_index();
+    int slot;
+    if (free_slots.count) slot = free_slots.slots[free_slots.count - 1];
+    else if (store_reserve(product_count + 1)) slot = product_count;
+    else return -1;
+    products[slot] = *p;
+    if (!index_put(&id_index, products, p->id, slot)) {
+        products[slot].id = 0;
+        return -1;
+    }
+    if (slot == product_count) {
+        product_count++;
+    } else {
+        free_slots.count--;
+        tombstones--;
+    }
+    if (p->id > max_id) max_id = p->id;
+    if (p->id > last_id) last_id = p->id;
+    return slot;
+}
+
+// Drops the product in slot idx from the index and leaves a tombstone there.
+// max_id is left alone; callers deleting many products fix it up once.
+void store_tombstone(int idx) {
+    index_remove(&id_index, products, products[idx].id);
+    products[idx].id = 0;
+    tombstones++;
+    if (free_slots.count == free_slots.capacity) {
+        int cap = free_slots.capacity ? free_slots.capacity * 2 : INDEX_MIN_CAPACITY;
+        int *slots = realloc(free_slots.slots, sizeof(int) * cap);
+        if (!slots) return; // still a tombstone, just not reused before compaction
+        free_slots.slots = slots;
+        free_slots.capacity = cap;
+    }
+    free_slots.slots[free_slots.count++] = idx;
+}
+
+// Squeezes the tombstones out of products[] in one pass and rebuilds the index
+// to match. moved, if set, hears of every record that changes slot.
+void store_compact(void (*moved)(int from, int to)) {
+    int n = 0;
+    for (int i = 0; i < product_count; i++) {
+        if (!products[i].id) continue;
+        if (i != n) {
+            products[n] = products[i];
+            if (moved) moved(i, n);
+        }
+        n++;
+    }
+    product_count = n;
+    free_slots.count = 0;
+    tombstones = 0;
+    rebuild_index();
+}
+
+// Converts a pre-versioned products.dat (int count, raw records, optional
+// checkpoint lsn) into the versioned format via a temp file and rename.
+static int store_migrate_legacy(long long size) {
+    int count;
+    if (pread(store_fd, &count, sizeof(count), 0) != (ssize_t)sizeof(count) || count < 0)
+        return 0;
+    long long body = sizeof(int) + (long long)count * sizeof(Product);
+    if (size != body && size != body + (long long)sizeof(long long)) return 0;
+    size_t len = sizeof(StoreHeader) + (size_t)count * sizeof(Product);
+    char *buf = calloc(1, len);
+    if (!buf) return 0;
+    StoreHeader *h = (StoreHeader *)buf;
+    h->magic = STORE_MAGIC;
+    h->version = 1; // brought up to STORE_VERSION by store_upgrade()
+    h->header_size = sizeof(StoreHeader);
+    h->record_size = sizeof(Product);
+    h->count = h->capacity = count;
+    int ok = pread(store_fd, buf + sizeof(StoreHeader), len - sizeof(StoreHeader), sizeof(int))
+             == (ssize_t)(len - sizeof(StoreHeader));
+    if (ok && size > body) ok = pread(store_fd, &h->checkpoint_lsn, sizeof(long long), body) == sizeof(long long);
+    int tmp = ok ? open(PRODUCTS_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+    ok = tmp >= 0 && write(tmp, buf, len) == (ssize_t)len && fsync(tmp) == 0
+         && rename(PRODUCTS_FILE ".tmp", PRODUCTS_FILE) == 0;
+    free(buf);
+    if (!ok) {
+        if (tmp >= 0) close(tmp);
+        return 0;
+    }
+    close(store_fd);
+    store_fd = tmp;
+    printf("Migrated %d products to the new %s format.\n", count, PRODUCTS_FILE);
+    return 1;
+}
+
+static unsigned store_header_checksum(const StoreHeader *h) {
+    return crc32c(0, h, offsetof(StoreHeader, checksum));
+}
+
+static unsigned store_block_checksum(const Product *p, long long count, long long block, unsigned size) {
+    long long first = block * size, n = count - first < size ? count - first : size;
+    return crc32c(0, p + first, (size_t)n * sizeof(Product));
+}
+
+// Reads a version 5 or later file: the header, then blocks of up to block_size
+// encoded products, each led by its length and CRC32C. Version 5 headers stop
+// before last_id.
+static int store_read_encoded(off_t size) {
+    unsigned char *buf = malloc(size);
+    int ok = buf && pread(store_fd, buf, size, 0) == (ssize_t)size;
+    unsigned version = ok ? get_le32(buf + 4) : 0;
+    off_t header = version == STORE_ENCODED_VERSION ? 32 : STORE_FILE_HEADER_SIZE;
+    ok = ok && version <= STORE_VERSION && size >= header
+         && get_le32(buf + header - 4) == crc32c(0, buf, header - 4);
+    long long count = ok ? (long long)get_le64(buf + 8) : 0;
+    long long lsn = ok ? (long long)get_le64(buf + 16) : 0;
+    unsigned block_size = ok ? get_le32(buf + 24) : 0;
+    unsigned high = ok && version > STORE_ENCODED_VERSION ? get_le32(buf + 28) : 0;
+    // every product takes at least five bytes, which bounds count by the file
+    if (!ok || block_size == 0 || count < 0 || count > size / 5 || count > INT_MAX) {
+        fprintf(stderr, "%s: unsupported version or corrupt header.\n", PRODUCTS_FILE);
+        free(buf);
+        return 0;
+    }
+    if (!store_reserve((int)count)) {
+        free(buf);
+        return 0;
+    }
+    const unsigned char *p = buf + header, *end = buf + size;
+    long long loaded = 0;
+    while (ok && loaded < count) {
+        unsigned len = end - p >= 8 ? get_le32(p) : 0;
+        ok = end - p >= 8 && len <= (size_t)(end - p - 8);
+        if (ok && crc32c(0, p + 8, len) != get_le32(p + 4)) {
+            fprintf(stderr, "%s: records from %lld fail their checksum.\n", PRODUCTS_FILE, loaded);
+            free(buf);
+            return 0;
+        }
+        const unsigned char *block_end = p + 8 + len;
+        p += 8;
+        for (unsigned i = 0; ok && i < block_size && loaded < count; i++) {
+            p = decode_product(p, block_end, &products[loaded++]);
+            ok = p != NULL;
+        }
+        ok = ok && p == block_end;
+    }
+    free(buf);
+    if (!ok || p != end) {
+        fprintf(stderr, "%s: cannot read the products.\n", PRODUCTS_FILE);
+        return 0;
+    }
+    store_version = version;
+    product_count = (int)count;
+    checkpoint_lsn = lsn;
+    last_id = (int)high;
+    return 1;
+}
+
+// Loads PRODUCTS_FILE into memory, creating or migrating it as needed. Sizes
+// are checked against the file before they are trusted and, from version 4,
+// every block against its checksum.
+int load_products() {
+    STAT_BEGIN(t0);
+    store_fd = open(PRODUCTS_FILE, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (store_fd < 0 || fstat(store_fd, &st) != 0) {
+        perror("Open products");
+        return 0;
+    }
+    unsigned char prefix[8];
+    if (st.st_size >= (off_t)sizeof(prefix) && pread(store_fd, prefix, sizeof(prefix), 0) == (ssize_t)sizeof(prefix)
+        && get_le32(prefix) == STORE_MAGIC && get_le32(prefix + 4) >= STORE_ENCODED_VERSION) {
+        int ok = store_read_encoded(st.st_size);
+        close(store_fd);
+        store_fd = -1;
+        if (!ok) return 0;
+        next_lsn = checkpoint_lsn + 1;
+        STAT_END(STAT_LOAD_PRODUCTS, t0, (long long)st.st_size);
+        return 1;
+    }
+    StoreHeader h;
+    memset(&h, 0, sizeof(h));
+    if (st.st_size > 0 && (pread(store_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.magic != STORE_MAGIC)) {
+        if (!store_migrate_legacy(st.st_size)) {
+            fprintf(stderr, "%s is not a shop manager product file.\n", PRODUCTS_FILE);
+            return 0;
+        }
+        pread(store_fd, &h, sizeof(h), 0);
+        fstat(store_fd, &st);
+    }
+    long long blocks = 0;
+    off_t records = sizeof(StoreHeader) + (off_t)h.count * (off_t)sizeof(Product);
+    if (st.st_size == 0) {
+        h.magic = STORE_MAGIC;
+        h.version = STORE_VERSION;
+        h.header_size = sizeof(StoreHeader);
+        h.record_size = sizeof(Product);
+    } else {
+        int ok = h.version >= 1 && h.version < STORE_ENCODED_VERSION && h.header_size == sizeof(StoreHeader)
+                 && h.record_size == sizeof(Product) && h.count >= 0 && h.count <= INT_MAX;
+        if (ok && h.version < 4) {
+            ok = h.count <= h.capacity && records <= st.st_size;
+        } else if (ok) {
+            blocks = h.block_size ? (h.count + h.block_size - 1) / h.block_size : 0;
+            ok = h.checksum == store_header_checksum(&h) && h.block_size > 0
+                 && st.st_size == records + (off_t)blocks * (off_t)sizeof(unsigned);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: unsupported version or corrupt header.\n", PRODUCTS_FILE);
+            return 0;
+        }
+    }
+    if (!store_reserve((int)h.count)) return 0;
+    size_t bytes = (size_t)h.count * sizeof(Product);
+    unsigned *sums = blocks ? malloc(blocks * sizeof(unsigned)) : NULL;
+    int ok = pread(store_fd, products, bytes, sizeof(StoreHeader)) == (ssize_t)bytes
+             && (!blocks || (sums && pread(store_fd, sums, blocks * sizeof(unsigned), records)
+                                         == (ssize_t)(blocks * sizeof(unsigned))));
+    if (!ok) fprintf(stderr, "%s: cannot read the products.\n", PRODUCTS_FILE);
+    for (long long b = 0; ok && b < blocks; b++)
+        if (sums[b] != store_block_checksum(products, h.count, b, h.block_size)) {
+            fprintf(stderr, "%s: records from %lld fail their checksum.\n", PRODUCTS_FILE, b * h.block_size);
+            ok = 0;
+        }
+    free(sums);
+    close(store_fd);
+    store_fd = -1;
+    if (!ok) return 0;
+    store_version = h.version;
+    product_count = (int)h.count;
+    checkpoint_lsn = h.checkpoint_lsn;
+    next_lsn = checkpoint_lsn + 1;
+    STAT_END(STAT_LOAD_PRODUCTS, t0, (long long)(sizeof(StoreHeader) + bytes + blocks * sizeof(unsigned)));
+    return 1;
+}
+
+// Writes the live products to a temp file and renames it over PRODUCTS_FILE,
+// so a crash leaves either the old snapshot or the new one. After the header
+// come blocks of up to STORE_CHECKSUM_BLOCK encoded products, each led by its
+// length and CRC32C. Tombstones are skipped without moving any slot: this runs
+// from inside wal_log() while callers still hold slot numbers.
+int save_products() {
+    STAT_BEGIN(t0);
+    long long lsn = next_lsn - 1, count = product_count - tombstones;
+    long long blocks = (count + STORE_CHECKSUM_BLOCK - 1) / STORE_CHECKSUM_BLOCK, bytes = STORE_FILE_HEADER_SIZE;
+    unsigned char head[STORE_FILE_HEADER_SIZE];
+    unsigned char *block = malloc(8 + (size_t)STORE_CHECKSUM_BLOCK * STORE_RECORD_MAX);
+    if (!block) {
+        perror("Save products");
+        return 0;
+    }
+    put_le32(head, STORE_MAGIC);
+    put_le32(head + 4, STORE_VERSION);
+    put_le64(head + 8, (unsigned long long)count);
+    put_le64(head + 16, (unsigned long long)lsn);
+    put_le32(head + 24, STORE_CHECKSUM_BLOCK);
+    put_le32(head + 28, (unsigned)last_id);
+    put_le32(head + 32, crc32c(0, head, 32));
+    int fd = open(PRODUCTS_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write(fd, head, sizeof(head)) == (ssize_t)sizeof(head), next = 0;
+    for (long long b = 0; ok && b < blocks; b++) {
+        unsigned char *p = block + 8;
+        for (int n = 0; n < STORE_CHECKSUM_BLOCK && next < product_count; next++)
+            if (products[next].id) {
+                p = encode_product(p, &products[next]);
+                n++;
+            }
+        put_le32(block, (unsigned)(p - block - 8));
+        put_le32(block + 4, crc32c(0, block + 8, p - block - 8));
+        ok = write(fd, block, p - block) == (ssize_t)(p - block);
+        bytes += p - block;
+    }
+    free(block);
+    if (!ok && fd >= 0) {
+        close(fd);
+        unlink(PRODUCTS_FILE ".tmp");
+    }
+    if (!ok || !replace_file(fd, PRODUCTS_FILE ".tmp", PRODUCTS_FILE)) {
+        perror("Save products");
+        return 0;
+    }
+    checkpoint_lsn = lsn;
+    STAT_END(STAT_SAVE_PRODUCTS, t0, bytes);
+    return 1;
+}
+
+// Brings records written by an older version up to date in place. Log records
+// written by that version hold the same old layout, so this runs once the log
+// has been replayed. Version 1 had padding where min_stock now sits; versions
+// before 3 kept the price as a double in the same eight bytes.
+static void store_upgrade() {
+    unsigned from = store_version;
+    for (int i = 0; i < product_count; i++) {
+        if (from < 2) products[i].min_stock = DEFAULT_MIN_STOCK;
+        if (from < 3) {
+            double price;
+            memcpy(&price, &products[i].price, sizeof(price));
+            products[i].price = money_from_double(price);
+        }
+    }
+    store_version = STORE_VERSION;
+    printf("Upgraded %d products in %s from version %u to %d.\n", product_count, PRODUCTS_FILE, from,
+           STORE_VERSION);
+}
+
+// FNV-1a; pass 2166136261u as h to start a new hash.
+unsigned fnv1a(const void *data, size_t len, unsigned h) {
+    const unsigned char *b = data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ b[i]) * 16777619u;
+    return h;
+}
+
+static unsigned wal_checksum(const WalRecord *r) {
+    return fnv1a(r, offsetof(WalRecord, checksum), 2166136261u);
+}
+
+void wal_sync() {
+    if (wal_fd >= 0 && wal_unsynced) {
+        if (ledger_fd >= 0) fdatasync(ledger_fd);
+        if (ledger_index_fd >= 0) fdatasync(ledger_index_fd);
+        if (price_fd >= 0) fdatasync(price_fd);
+        fsync(wal_fd);
+        wal_unsynced = 0;
+    }
+}
+
+// Empties the log down to its header and leaves the file offset after it.
+static int wal_reset() {
+    unsigned char h[WAL_HEADER_SIZE];
+    put_le32(h, WAL_MAGIC);
+    put_le32(h + 4, WAL_VERSION);
+    return ftruncate(wal_fd, 0) == 0 && pwrite(wal_fd, h, sizeof(h), 0) == (ssize_t)sizeof(h)
+           && lseek(wal_fd, sizeof(h), SEEK_SET) >= 0;
+}
+
+// Folds the log into PRODUCTS_FILE and empties it.
+int checkpoint() {
+    wal_sync();
+    if (!save_products()) return 0;
+    if (wal_fd >= 0) {
+        if (!wal_reset()) {
+            perror("Reset log");
+            return 0;
+        }
+        fsync(wal_fd);
+        wal_records = 0;
+    }
+    return 1;
+}
+
+// Decodes the log record at p into r. Returns the byte after it, or NULL if it
+// is torn or fails its checksum.
+static const unsigned char *wal_decode(const unsigned char *p, const unsigned char *end, WalRecord *r) {
+    if (end - p < 8) return NULL;
+    unsigned len = get_le32(p);
+    if (len > (size_t)(end - p - 8) || crc32c(0, p + 8, len) != get_le32(p + 4)) return NULL;
+    const unsigned char *q = p + 8, *next = q + len;
+    unsigned long long lsn = 0, type = 0;
+    long long delta = 0;
+    q = get_varint(q, next, &lsn);
+    q = get_varint(q, next, &type);
+    q = get_signed(q, next, &delta);
+    q = decode_product(q, next, &r->p);
+    if (q != next) return NULL;
+    r->lsn = (long long)lsn;
+    r->type = (int)type;
+    r->delta = (int)delta;
+    return next;
+}
+
+// Applies one logged mutation to the catalog.
+static void wal_apply(const WalRecord *r) {
+    ensure_index();
+    int idx = index_find(&id_index, products, r->p.id);
+    switch (r->type) {
+        case WAL_ADD:
+        case WAL_UPDATE:
+        case WAL_STOCK:
+            if (idx >= 0) products[idx] = r->p;
+            else store_insert(&r->p);
+            break;
+        case WAL_DELETE:
+            if (idx >= 0) store_tombstone(idx); // compacted once replay is done
+            break;
+    }
+}
+
+// Replays records newer than the last checkpoint and opens the log for appending.
+// A torn record at the tail (crash mid-append) is cut off. A log of raw records
+// from before WAL_VERSION 1 is replayed, then folded away by a checkpoint.
+int wal_open() {
+    wal_fd = open(WAL_FILE, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (wal_fd < 0 || fstat(wal_fd, &st) != 0) {
+        perror("Open log");
+        return 0;
+    }
+    unsigned char *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf || pread(wal_fd, buf, st.st_size, 0) != (ssize_t)st.st_size) {
+        perror("Open log");
+        free(buf);
+        return 0;
+    }
+    const unsigned char *p = buf, *end = buf + st.st_size, *next;
+    int legacy = st.st_size > 0 && (st.st_size < WAL_HEADER_SIZE || get_le32(buf) != WAL_MAGIC);
+    if (!legacy && st.st_size) {
+        if (get_le32(buf + 4) != WAL_VERSION) {
+            fprintf(stderr, "%s: unsupported version.\n", WAL_FILE);
+            free(buf);
+            return 0;
+        }
+        p += WAL_HEADER_SIZE;
+    }
+    WalRecord r;
+    int replayed = 0;
+    for (;; p = next) {
+        if (!legacy) {
+            if (!(next = wal_decode(p, end, &r))) break;
+        } else {
+            if (end - p < (ptrdiff_t)sizeof(r)) break;
+            memcpy(&r, p, sizeof(r));
+            if (r.checksum != wal_checksum(&r)) break;
+            next = p + sizeof(r);
+        }
+        wal_records++;
+        if (r.lsn <= checkpoint_lsn) continue;
+        wal_apply(&r);
+        next_lsn = r.lsn + 1;
+        replayed++;
+    }
+    off_t good = p - buf;
+    free(buf);
+    if (tombstones) store_compact(NULL);
+    if (ftruncate(wal_fd, good) != 0 || lseek(wal_fd, good, SEEK_SET) < 0
+        || (!legacy && good < WAL_HEADER_SIZE && !wal_reset())) {
+        perror("Open log");
+        return 0;
+    }
+    if (replayed) printf("Recovered %d change(s) from %s.\n", replayed, WAL_FILE);
+    int upgrade = store_version < STORE_VERSION;
+    if (upgrade || legacy) {
+        if (upgrade) store_upgrade();
+        if (!checkpoint() && legacy) return 0; // new records must not follow raw ones
+    }
+    return 1;
+}
+
+// Appends one mutation: its length and CRC32C, then the lsn, type and delta as
+// varints and the after-image encoded as in PRODUCTS_FILE. Records are fsynced
+// in groups; a checkpoint runs once the log grows past WAL_CHECKPOINT_RECORDS.
+// Call it after the change is made to products[]: the checkpoint saves
+// products[] as covering this record. A batch holds the checkpoint off until
+// all of its changes are made. Returns the bytes written, 0 on failure.
+int wal_log(int type, const Product *p, int delta) {
+    unsigned char buf[WAL_RECORD_MAX], *end = buf + 8;
+    end = put_varint(end, (unsigned long long)next_lsn);
+    end = put_varint(end, (unsigned)type);
+    end = put_signed(end, delta);
+    end = encode_product(end, p);
+    put_le32(buf, (unsigned)(end - buf - 8));
+    put_le32(buf + 4, crc32c(0, buf + 8, end - buf - 8));
+    if (wal_fd < 0 || write(wal_fd, buf, end - buf) != (ssize_t)(end - buf)) {
+        perror("Write log");
+        return 0;
+    }
+    next_lsn++;
+    wal_records++;
+    double now = now_sec();
+    if (!wal_unsynced++) wal_oldest_unsynced = now;
+    if (wal_unsynced >= WAL_GROUP_COMMIT || now - wal_oldest_unsynced >= WAL_GROUP_COMMIT_MS / 1000.0)
+        wal_sync();
+    if (wal_records >= WAL_CHECKPOINT_RECORDS && !wal_checkpoint_held) checkpoint();
+    return (int)(end - buf);
+}
+
+int find_product_index_by_id(int id) {
+    ensure_index();
+    return index_find(&id_index, products, id);
+}
+
+int next_id() {
+    ensure_index();
+    return last_id + 1;
+}
+
+// Price history. Every price a product has had is kept as a version, oldest
+// first, in a chain per product id, so "what did this cost on that day" is a
+// binary search, and a report resolving all prices as of one moment sees a
+// consistent catalog however many updates land while it runs. Versions are
+// appended to PRICES_FILE and never rewritten; a product with no chain has
+// always had its current price. Chains outlive deleted products; ids are not
+// reused (see last_id), so a chain never passes to a new product. Files before
+// PRICES_VERSION 1 held PriceRecords raw; see price_encode() for the encoding.
+typedef struct {
+    long long since;  // 0 = from before price history was kept
+    Money price;
+    int id;
+    unsigned checksum;
+} PriceRecord;
+
+typedef struct {
+    int id;           // 0 = empty slot
+    int count, capacity;
+    PriceRecord *versions;
+} PriceChain;
+
+typedef struct {
+    PriceChain *slots;
+    int capacity, used;
+} PriceHistory;
+
+PriceHistory price_history = {NULL, 0, 0};
+long long price_last_since = 0; // since of the last record in PRICES_FILE
+
+static unsigned price_checksum(const PriceRecord *r) {
+    return fnv1a(r, offsetof(PriceRecord, checksum), 2166136261u);
+}
+
+// Encodes r as its length and CRC32C, then varints for the id, since as a
+// change from prev_since (the record before it) and the price. Returns the
+// byte after it.
+static unsigned char *price_encode(unsigned char *buf, const PriceRecord *r, long long prev_since) {
+    unsigned char *end = buf + 8;
+    end = put_varint(end, (unsigned)r->id);
+    end = put_signed(end, r->since - prev_since);
+    end = put_signed(end, r->price);
+    put_le32(buf, (unsigned)(end - buf - 8));
+    put_le32(buf + 4, crc32c(0, buf + 8, end - buf - 8));
+    return end;
+}
+
+// Decodes the record at p, which follows one dated prev_since, into r. Returns
+// the byte after it, or NULL if it is torn or fails its checksum.
+static const unsigned char *price_decode(const unsigned char *p, const unsigned char *end, long long prev_since,
+                                         PriceRecord *r) {
+    if (end - p < 8) return NULL;
+    unsigned len = get_le32(p);
+    if (len > (size_t)(end - p - 8) || crc32c(0, p + 8, len) != get_le32(p + 4)) return NULL;
+    const unsigned char *q = p + 8, *next = q + len;
+    unsigned long long id = 0;
+    long long since = 0, price = 0;
+    q = get_varint(q, next, &id);
+    q = get_signed(q, next, &since);
+    q = get_signed(q, next, &price);
+    if (q != next || id == 0 || id > INT_MAX) return NULL;
+    memset(r, 0, sizeof(*r));
+    r->id = (int)id;
+    r->since = prev_since + since;
+    r->price = price;
+    return next;
+}
+
+// Returns id's chain, creating an empty one if create is set; NULL if there is
+// none or no memory.
+static PriceChain *price_chain(int id, int create) {
+    PriceHistory *h = &price_history;
+    if (create && (h->used + 1) * 2 > h->capacity) {
+        PriceHistory grown = {NULL, h->capacity ? h->capacity * 2 : INDEX_MIN_CAPACITY, h->used};
+        grown.slots = calloc(grown.capacity, sizeof(PriceChain));
+        if (!grown.slots) return NULL;
+        for (int i = 0; i < h->capacity; i++) {
+            if (!h->slots[i].id) continue;
+            unsigned j = hash_id(h->slots[i].id) & (grown.capacity - 1);
+            while (grown.slots[j].id) j = (j + 1) & (grown.capacity - 1);
+            grown.slots[j] = h->slots[i];
+        }
+        free(h->slots);
+        *h = grown;
+    }
+    if (!h->capacity) return NULL;
+    unsigned mask = (unsigned)h->capacity - 1, j = hash_id(id) & mask;
+    while (h->slots[j].id && h->slots[j].id != id) j = (j + 1) & mask;
+    if (!h->slots[j].id) {
+        if (!create) return NULL;
+        h->slots[j].id = id;
+        h->used++;
+    }
+    return &h->slots[j];
+}
+
+// Adds a version to id's chain in memory. Two changes in the same second (or
+// a clock stepped back) cannot be told apart by time, so the later replaces
+// the last version instead.
+static int price_chain_add(const PriceRecord *r) {
+    PriceChain *chain = price_chain(r->id, 1);
+    if (!chain) return 0;
+    if (chain->count && r->since <= chain->versions[chain->count - 1].since) {
+        chain->versions[chain->count - 1].price = r->price;
+        return 1;
+    }
+    if (chain->count == chain->capacity) {
+        int cap = chain->capacity ? chain->capacity * 2 : 2;
+        PriceRecord *versions = realloc(chain->versions, sizeof(PriceRecord) * cap);
+        if (!versions) return 0;
+        chain->versions = versions;
+        chain->capacity = cap;
+    }
+    chain->versions[chain->count++] = *r;
+    return 1;
+}
+
+// Records that id costs price from since on, in memory and in PRICES_FILE.
+int price_history_add(int id, long long since, Money price) {
+    PriceRecord r;
+    memset(&r, 0, sizeof(r));
+    r.since = since;
+    r.price = price;
+    r.id = id;
+    if (!price_chain_add(&r)) {
+        printf("Out of memory.\n");
+        return 0;
+    }
+    unsigned char buf[PRICE_RECORD_MAX], *end = price_encode(buf, &r, price_last_since);
+    if (price_fd >= 0 && write(price_fd, buf, end - buf) != (ssize_t)(end - buf)) {
+        perror("Write price history");
+        return 0;
+    }
+    price_last_since = since;
+    return 1;
+}
+
+// Writes every chain to a fresh PRICES_FILE through a temp file and leaves
+// price_fd open on it for appending. Used to convert a file of raw records.
+static int price_history_rewrite() {
+    int fd = open(PRICES_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644), n = 0;
+    unsigned char buf[PRICE_RECORD_MAX], *end;
+    put_le32(buf, PRICES_MAGIC);
+    put_le32(buf + 4, PRICES_VERSION);
+    int ok = fd >= 0 && write(fd, buf, PRICES_HEADER_SIZE) == PRICES_HEADER_SIZE;
+    price_last_since = 0;
+    for (int i = 0; ok && i < price_history.capacity; i++) {
+        const PriceChain *chain = &price_history.slots[i];
+        for (int v = 0; ok && chain->id && v < chain->count; v++) {
+            end = price_encode(buf, &chain->versions[v], price_last_since);
+            ok = write(fd, buf, end - buf) == (ssize_t)(end - buf);
+            price_last_since = chain->versions[v].since;
+            n++;
+        }
+    }
+    if (!ok && fd >= 0) {
+        close(fd);
+        unlink(PRICES_FILE ".tmp");
+    }
+    if (!ok || !replace_file(fd, PRICES_FILE ".tmp", PRICES_FILE)) return 0;
+    close(price_fd);
+    price_fd = open(PRICES_FILE, O_RDWR);
+    if (price_fd < 0 || lseek(price_fd, 0, SEEK_END) < 0) return 0;
+    printf("Upgraded %d price versions in %s to version %d.\n", n, PRICES_FILE, PRICES_VERSION);
+    return 1;
+}
+
+// Loads PRICES_FILE into the chains and opens it for appending. A torn record
+// at the tail is cut off, as in the log. A file of raw records from before
+// PRICES_VERSION 1 is loaded, then rewritten encoded.
+int price_history_open() {
+    price_fd = open(PRICES_FILE, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (price_fd < 0 || fstat(price_fd, &st) != 0) {
+        perror("Open price history");
+        return 0;
+    }
+    unsigned char *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf || pread(price_fd, buf, st.st_size, 0) != (ssize_t)st.st_size) {
+        perror("Open price history");
+        free(buf);
+        return 0;
+    }
+    const unsigned char *p = buf, *end = buf + st.st_size, *next;
+    int legacy = st.st_size > 0 && (st.st_size < PRICES_HEADER_SIZE || get_le32(buf) != PRICES_MAGIC);
+    if (!legacy && st.st_size) {
+        if (get_le32(buf + 4) != PRICES_VERSION) {
+            fprintf(stderr, "%s: unsupported version.\n", PRICES_FILE);
+            free(buf);
+            return 0;
+        }
+        p += PRICES_HEADER_SIZE;
+    }
+    PriceRecord r;
+    price_last_since = 0;
+    for (;; p = next) {
+        if (!legacy) {
+            if (!(next = price_decode(p, end, price_last_since, &r))) break;
+        } else {
+            if (end - p < (ptrdiff_t)sizeof(r)) break;
+            memcpy(&r, p, sizeof(r));
+            if (r.checksum != price_checksum(&r)) break;
+            next = p + sizeof(r);
+        }
+        if (!price_chain_add(&r)) {
+            fprintf(stderr, "Out of memory loading %s\n", PRICES_FILE);
+            free(buf);
+            return 0;
+        }
+        price_last_since = r.since;
+    }
+    off_t good = p - buf;
+    free(buf);
+    if (legacy) {
+        if (price_history_rewrite()) return 1;
+        perror("Upgrade price history");
+        return 0;
+    }
+    unsigned char h[PRICES_HEADER_SIZE];
+    put_le32(h, PRICES_MAGIC);
+    put_le32(h + 4, PRICES_VERSION);
+    if ((good < PRICES_HEADER_SIZE && pwrite(price_fd, h, sizeof(h), 0) != (ssize_t)sizeof(h))
+        || ftruncate(price_fd, good < PRICES_HEADER_SIZE ? PRICES_HEADER_SIZE : good) != 0
+        || lseek(price_fd, 0, SEEK_END) < 0) {
+        perror("Open price history");
+        return 0;
+    }
+    return 1;
+}
+
+// Gives p a new price from now on, keeping the old one as a version. A product
+// priced before history was kept first gets a version holding its old price.
+void set_product_price(Product *p, Money price) {
+    if (price == p->price) return;
+    PriceChain *chain = price_chain(p->id, 0);
+    if (!chain || !chain->count) price_history_add(p->id, 0, p->price);
+    price_history_add(p->id, time(NULL), price);
+    p->price = price;
+}
+
+// Finds the price product id had at time at by binary search of its chain.
+// Returns 0 if it had none yet, or has no chain and is no longer in the catalog.
+int price_at(int id, long long at, Money *price) {
+    PriceChain *chain = price_chain(id, 0);
+    if (!chain || !chain->count) {
+        int idx = find_product_index_by_id(id);
+        if (idx < 0) return 0;
+        *price = products[idx].price;
+        return 1;
+    }
+    int lo = 0, hi = chain->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (chain->versions[mid].since <= at) lo = mid + 1;
+        else hi = mid;
+    }
+    if (!lo) return 0;
+    *price = chain->versions[lo - 1].price;
+    return 1;
+}
+
+// Products at or below their min_stock, as an intrusive doubly linked list over
+// product slots in the order they ran low. Every stock change calls
+// low_stock_refresh(), so membership changes exactly when a threshold is crossed
+// and listing low stock costs O(low items) instead of a catalog scan.
+typedef struct {
+    int *next, *prev;   // per slot, -1 = end of list
+    char *member;       // per slot, 1 = on the list
+    int head, tail, count, capacity;
+} LowStockList;
+
+LowStockList low_stock = {NULL, NULL, NULL, -1, -1, 0, 0};
+
+// Called on every crossing: low is 1 when p just went low, 0 when restocked.
+void (*low_stock_alert)(const Product *p, int low) = NULL;
+
+static int low_stock_reserve(int n) {
+    if (n <= low_stock.capacity) return 1;
+    int cap = low_stock.capacity ? low_stock.capacity : INDEX_MIN_CAPACITY;
+    while (cap < n) cap *= 2;
+    int *next = realloc(low_stock.next, sizeof(int) * cap);
+    if (next) low_stock.next = next;
+    int *prev = realloc(low_stock.prev, sizeof(int) * cap);
+    if (prev) low_stock.prev = prev;
+    char *member = realloc(low_stock.member, cap);
+    if (member) low_stock.member = member;
+    if (!next || !prev || !member) return 0;
+    memset(member + low_stock.capacity, 0, cap - low_stock.capacity);
+    low_stock.capacity = cap;
+    return 1;
+}
+
+static void low_stock_link(int i) {
+    low_stock.next[i] = -1;
+    low_stock.prev[i] = low_stock.tail;
+    if (low_stock.tail >= 0) low_stock.next[low_stock.tail] = i;
+    else low_stock.head = i;
+    low_stock.tail = i;
+    low_stock.member[i] = 1;
+    low_stock.count++;
+}
+
+static void low_stock_unlink(int i) {
+    if (low_stock.prev[i] >= 0) low_stock.next[low_stock.prev[i]] = low_stock.next[i];
+    else low_stock.head = low_stock.next[i];
+    if (low_stock.next[i] >= 0) low_stock.prev[low_stock.next[i]] = low_stock.prev[i];
+    else low_stock.tail = low_stock.prev[i];
+    low_stock.member[i] = 0;
+    low_stock.count--;
+}
+
+// Re-evaluates slot i after its stock or min_stock changed.
+void low_stock_refresh(int i) {
+    if (!low_stock_reserve(i + 1)) {
+        printf("Out of memory.\n");
+        return;
+    }
+    int low = products[i].stock <= products[i].min_stock;
+    if (low == low_stock.member[i]) return;
+    if (low) low_stock_link(i);
+    else low_stock_unlink(i);
+    if (low_stock_alert) low_stock_alert(&products[i], low);
+}
+
+// Rebuilds the list from scratch (after loading, or when slots shift); no alerts.
+void low_stock_rebuild() {
+    if (!low_stock_reserve(product_count)) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+    memset(low_stock.member, 0, low_stock.capacity);
+    low_stock.head = low_stock.tail = -1;
+    low_stock.count = 0;
+    for (int i = 0; i < product_count; i++)
+        if (products[i].id && products[i].stock <= products[i].min_stock) low_stock_link(i);
+}
+
+// Keeps the list in step while compaction moves a product from slot from down
+// to slot to, so products keep their place in the order they ran low.
+static void low_stock_move(int from, int to) {
+    if (from >= low_stock.capacity || !low_stock.member[from]) return;
+    int prev = low_stock.prev[from], next = low_stock.next[from];
+    low_stock.prev[to] = prev;
+    low_stock.next[to] = next;
+    if (prev >= 0) low_stock.next[prev] = to;
+    else low_stock.head = to;
+    if (next >= 0) low_stock.prev[next] = to;
+    else low_stock.tail = to;
+    low_stock.member[from] = 0;
+    low_stock.member[to] = 1;
+}
+
+void print_low_stock_alert(const Product *p, int low) {
+    if (low) printf("** Low stock: %s (ID %d) is down to %d, minimum %d **\n", p->name, p->id, p->stock, p->min_stock);
+}
+
+void add_product() {
+    char buf[BUFFER];
+    Product p;
+    p.id = next_id();
+
+    printf("Name: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    trim_newline(buf);
+    copy_name(p.name, buf);
+
+    printf("Price: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    if (!parse_money(buf, &p.price) || p.price < 0) {
+        printf("Invalid price.\n");
+        return;
+    }
+
+    printf("Stock: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    p.stock = atoi(buf);
+
+    printf("Min stock (leave empty for %d): ", DEFAULT_MIN_STOCK);
+    if (!fgets(buf, BUFFER, stdin)) return;
+    trim_newline(buf);
+    p.min_stock = strlen(buf) ? atoi(buf) : DEFAULT_MIN_STOCK;
+
+    int slot = store_insert(&p);
+    if (slot < 0) {
+        printf("Out of memory.\n");
+        return;
+    }
+    wal_log(WAL_ADD, &p, 0);
+    price_history_add(p.id, time(NULL), p.price);
+    printf("Added product ID %d.\n", p.id);
+    low_stock_refresh(slot);
+}
+
+void update_product() {
+    char buf[BUFFER];
+    printf("Enter product ID to update: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int id = atoi(buf);
+    int idx = find_product_index_by_id(id);
+    if (idx < 0) {
+        printf("Not found.\n");
+        return;
+    }
+    Product *p = &products[idx];
+
+    printf("Current name: %s\nNew name (leave empty to keep): ", p->name);
+    if (!fgets(buf, BUFFER, stdin)) return;
+    trim_newline(buf);
+    if (strlen(buf)) copy_name(p->name, buf);
+
+    char money[MONEY_LEN];
+    printf("Current price: %s\nNew price (leave empty to keep): ", format_money(p->price, money));
+    if (!fgets(buf, BUFFER, stdin)) return;
+    trim_newline(buf);
+    Money price;
+    if (strlen(buf) && parse_money(buf, &price) && price >= 0) set_product_price(p, price);
+
+    printf("Current stock: %d\nNew stock (leave empty to keep): ", p->stock);
+    if (!fgets(buf, BUFFER, stdin)) return;
+    trim_newline(buf);
+    if (strlen(buf)) p->stock = atoi(buf);
+
+    printf("Current min stock: %d\nNew min stock (leave empty to keep): ", p->min_stock);
+    if (!fgets(buf, BUFFER, stdin)) return;
+    trim_newline(buf);
+    if (strlen(buf)) p->min_stock = atoi(buf);
+
+    wal_log(WAL_UPDATE, p, 0);
+    printf("Product updated.\n");
+    low_stock_refresh(idx);
+}
+
+// Deletes the products with the given ids, logging each one once its slot is
+// gone. Their slots become tombstones, so nothing else moves and no index entry
+// is rewritten; unknown ids are skipped. A checkpoint the log comes due for runs
+// once the whole batch is applied. Returns how many products were deleted.
+int delete_products(const int *ids, int n) {
+    int deleted = 0, lost_max = 0;
+    wal_checkpoint_held++;
+    for (int k = 0; k < n; k++) {
+        int idx = find_product_index_by_id(ids[k]);
+        if (idx < 0) continue;
+        Product gone = products[idx];
+        if (idx < low_stock.capacity && low_stock.member[idx]) low_stock_unlink(idx);
+        lost_max |= ids[k] == max_id;
+        store_tombstone(idx);
+        deleted++;
+        if (!wal_log(WAL_DELETE, &gone, 0)) break;
+    }
+    if (lost_max) {
+        max_id = 0;
+        for (int i = 0; i < product_count; i++)
+            if (products[i].id > max_id) max_id = products[i].id;
+    }
+    if (!--wal_checkpoint_held && wal_records >= WAL_CHECKPOINT_RECORDS) checkpoint();
+    return deleted;
+}
+
+// Deletes every product match() accepts. The ids are gathered first, so the
+// match sees the catalog as it was before any of the deletes.
+int delete_products_where(int (*match)(const Product *p, void *arg), void *arg) {
+    int *ids = malloc(sizeof(int) * (product_count ? product_count : 1)), n = 0;
+    if (!ids) return -1;
+    for (int i = 0; i < product_count; i++)
+        if (products[i].id && match(&products[i], arg)) ids[n++] = products[i].id;
+    int deleted = delete_products(ids, n);
+    free(ids);
+    return deleted;
+}
+
+// Rewrites products[] without its tombstones, along with the index and the
+// low-stock list, in a single pass.
+void compact_products() {
+    if (tombstones) store_compact(low_stock_move);
+}
+
+// Called from the menu and server loops, between requests, when no slot
+// numbers are held: compacts once enough of the slots are tombstones.
+void compact_tick() {
+    if (tombstones && tombstones * COMPACT_TOMBSTONE_SHARE >= product_count) compact_products();
+}
+
+static int id_in_range(const Product *p, void *arg) {
+    const int *range = arg;
+    return p->id >= range[0] && p->id <= range[1];
+}
+
+// Takes one id or a list such as "3 7 10-20"; ranges are matched against the
+// catalog rather than expanded, so a wide one costs a single scan.
+void delete_product() {
+    char buf[BUFFER];
+    printf("Enter product ID(s) to delete (e.g. 4 or 3 7 10-20): ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int ids[BUFFER / 2], n = 0, deleted = 0;
+    char *s = buf, *end;
+    for (long id = strtol(s, &end, 10); end != s && n < BUFFER / 2; id = strtol(s, &end, 10)) {
+        s = end;
+        if (*s == '-') {
+            int range[2] = {(int)id, (int)strtol(s + 1, &end, 10)};
+            if (end == s + 1) break;
+            s = end;
+            int matched = delete_products_where(id_in_range, range);
+            if (matched > 0) deleted += matched;
+        } else {
+            ids[n++] = (int)id;
+        }
+    }
+    deleted += delete_products(ids, n);
+    if (!deleted) printf("Not found.\n");
+    else if (deleted == 1) printf("Deleted.\n");
+    else printf("Deleted %d products.\n", deleted);
+}
+
+void get_date_str(time_t t, char *out, size_t n) {
+    struct tm tm = *localtime(&t);
+    strftime(out, n, "%Y-%m-%d", &tm);
+}
+
+time_t parse_date(const char *s) {
+    struct tm tm = {0};
+#if defined(_XOPEN_SOURCE) || defined(_GNU_SOURCE)
+    if (strptime(s, "%Y-%m-%d", &tm) == NULL) return (time_t)0;
+#else
+    // Fallback if strptime not available (Windows)
+    sscanf(s, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday);
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+#endif
+    return mktime(&tm);
+}
+
+void format_day(int day, char *out, size_t n) {
+    // inverse of days_from_civil
+    int z = day + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    int d = doy - (153 * mp + 2) / 5 + 1;
+    int m = mp + (mp < 10 ? 3 : -9);
+    snprintf(out, n, "%04d-%02d-%02d", yoe + era * 400 + (m <= 2), m, d);
+}
+
+// CSV files (RFC 4180). The writer fills a large buffer and hands it to write()
+// whole; the reader maps the file and returns fields as pointers into the
+// mapping, so import and export cost little more than the I/O. The same writer
+// prints the console listings, as padded columns or, with SHOP_OUTPUT=json, as
+// one JSON object per line.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    int failed;
+    int console;                // writing to stdout: buffer and fd are not ours
+    int json;                   // console listing as JSON lines
+    int cached_day;             // last day written by csv_put_day...
+    char cached_date[10];       // ...and its text
+} CsvWriter;
+
+int csv_writer_open(CsvWriter *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    w->cached_day = INT_MIN;
+    w->buf = malloc(CSV_BUFFER);
+    w->fd = w->buf ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (w->fd < 0) {
+        free(w->buf);
+        return 0;
+    }
+    return 1;
+}
+
+static void csv_flush(CsvWriter *w) {
+    if (w->console) fflush(stdout); // headers printf()ed before the rows stay in front of them
+    for (size_t done = 0; done < w->len && !w->failed;) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) w->failed = 1;
+        else done += (size_t)n;
+    }
+    w->len = 0;
+}
+
+// Starts a console listing. Lines printf()ed before the first row still come
+// out ahead of it, but nothing may be printed between rows.
+void csv_writer_console(CsvWriter *w) {
+    static char *console_buf;
+    if (!console_buf && !(console_buf = malloc(CSV_BUFFER))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    const char *mode = getenv("SHOP_OUTPUT");
+    memset(w, 0, sizeof(*w));
+    w->cached_day = INT_MIN;
+    w->buf = console_buf;
+    w->fd = STDOUT_FILENO;
+    w->console = 1;
+    w->json = mode && strcmp(mode, "json") == 0;
+}
+
+// Flushes and closes; returns 0 if anything failed to reach the file.
+int csv_writer_close(CsvWriter *w) {
+    csv_flush(w);
+    if (w->console) return !w->failed;
+    if (close(w->fd) != 0) w->failed = 1;
+    free(w->buf);
+    return !w->failed;
+}
+
+// Makes room for n more bytes (n must not exceed CSV_ROW_MAX).
+static inline char *csv_room(CsvWriter *w, size_t n) {
+    if (CSV_BUFFER - w->len < n) csv_flush(w);
+    return w->buf + w->len;
+}
+
+// Writes bytes as they are (separators, headers).
+static inline void csv_put_raw(CsvWriter *w, const char *s, size_t n) {
+    memcpy(csv_room(w, n), s, n);
+    w->len += n;
+}
+
+static inline void csv_put_char(CsvWriter *w, char c) {
+    *csv_room(w, 1) = c;
+    w->len++;
+}
+
+// Writes v in decimal into out (at least 21 bytes, not terminated); returns the length.
+static int int_text(long long v, char *out) {
+    char tmp[24];
+    unsigned long long u = v < 0 ? 0 - (unsigned long long)v : (unsigned long long)v;
+    int n = 0;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0) tmp[n++] = '-';
+    for (int i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    return n;
+}
+
+void csv_put_int(CsvWriter *w, long long v) {
+    w->len += int_text(v, csv_room(w, 24));
+}
+
+void csv_put_money(CsvWriter *w, Money m) {
+    char *out = csv_room(w, MONEY_LEN);
+    w->len += strlen(format_money(m, out));
+}
+
+// Writes a text field, quoted (with quotes doubled) only if it holds a
+// separator, quote or line break. Text is cut at CSV_ROW_MAX / 2 bytes.
+void csv_put_text(CsvWriter *w, const char *s) {
+    size_t n = strnlen(s, CSV_ROW_MAX / 2 - 2);
+    if (strcspn(s, ",\"\r\n") >= n) {
+        memcpy(csv_room(w, n), s, n);
+        w->len += n;
+        return;
+    }
+    char *out = csv_room(w, 2 * n + 2);
+    size_t k = 0;
+    out[k++] = '"';
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '"') out[k++] = '"';
+        out[k++] = s[i];
+    }
+    out[k++] = '"';
+    w->len += k;
+}
+
+// Writes a day number as YYYY-MM-DD; consecutive rows of one day reuse the text.
+void csv_put_day(CsvWriter *w, int day) {
+    if (day != w->cached_day) {
+        char date[16];
+        format_day(day, date, sizeof(date));
+        memcpy(w->cached_date, date, sizeof(w->cached_date));
+        w->cached_day = day;
+    }
+    memcpy(csv_room(w, sizeof(w->cached_date)), w->cached_date, sizeof(w->cached_date));
+    w->len += sizeof(w->cached_date);
+}
+
+// Ends a row; the buffer goes out in CSV_BUFFER sized writes, not per row.
+static inline void csv_end_row(CsvWriter *w) {
+    csv_put_char(w, '\n');
+}
+
+// Console columns, padded like printf's "%*s": right-aligned for width > 0,
+// left-aligned for width < 0. Text is never cut.
+void csv_put_column(CsvWriter *w, const char *s, int width) {
+    size_t n = strnlen(s, CSV_ROW_MAX / 2), field = width < 0 ? -(size_t)width : (size_t)width;
+    size_t pad = field > n ? field - n : 0;
+    char *out = csv_room(w, n + pad);
+    if (width > 0) {
+        memset(out, ' ', pad);
+        out += pad;
+    }
+    memcpy(out, s, n);
+    if (width < 0) memset(out + n, ' ', pad);
+    w->len += n + pad;
+}
+
+void csv_put_int_column(CsvWriter *w, long long v, int width) {
+    char tmp[24];
+    tmp[int_text(v, tmp)] = 0;
+    csv_put_column(w, tmp, width);
+}
+
+void csv_put_money_column(CsvWriter *w, Money m, int width) {
+    char tmp[MONEY_LEN];
+    csv_put_column(w, format_money(m, tmp), width);
+}
+
+// JSON lines: json_begin() opens a record tagged with its type, the json_*
+// calls add fields and json_end() closes the line.
+static void json_string(CsvWriter *w, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = strnlen(s, CSV_ROW_MAX / 8);
+    char *out = csv_room(w, 6 * n + 2);
+    size_t k = 0;
+    out[k++] = '"';
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out[k++] = '\\';
+            out[k++] = c;
+        } else if (c < 0x20) {
+            memcpy(out + k, "\\u00", 4);
+            out[k + 4] = hex[c >> 4];
+            out[k + 5] = hex[c & 15];
+            k += 6;
+        } else {
+            out[k++] = c;
+        }
+    }
+    out[k++] = '"';
+    w->len += k;
+}
+
+static void json_key(CsvWriter *w, const char *key) {
+    csv_put_raw(w, ",\"", 2);
+    csv_put_raw(w, key, strlen(key));
+    csv_put_raw(w, "\":", 2);
+}
+
+void json_begin(CsvWriter *w, const char *type) {
+    csv_put_raw(w, "{\"type\":", 8);
+    json_string(w, type);
+}
+
+void json_int(CsvWriter *w, const char *key, long long v) {
+    json_key(w, key);
+    csv_put_int(w, v);
+}
+
+// Money is a plain decimal number, exactly as stored.
+void json_money(CsvWriter *w, const char *key, Money m) {
+    json_key(w, key);
+    csv_put_money(w, m);
+}
+
+void json_text(CsvWriter *w, const char *key, const char *s) {
+    json_key(w, key);
+    json_string(w, s);
+}
+
+void json_day(CsvWriter *w, const char *key, int day) {
+    json_key(w, key);
+    csv_put_char(w, '"');
+    csv_put_day(w, day);
+    csv_put_char(w, '"');
+}
+
+void json_bool(CsvWriter *w, const char *key, int v) {
+    json_key(w, key);
+    if (v) csv_put_raw(w, "true", 4);
+    else csv_put_raw(w, "false", 5);
+}
+
+static inline void json_end(CsvWriter *w) {
+    csv_put_raw(w, "}\n", 2);
+}
+
+static void list_product_row(CsvWriter *w, const Product *p, int low) {
+    if (w->json) {
+        json_begin(w, "product");
+        json_int(w, "id", p->id);
+        json_text(w, "name", p->name);
+        json_money(w, "price", p->price);
+        json_int(w, "stock", p->stock);
+        json_int(w, "min_stock", p->min_stock);
+        json_bool(w, "low", low);
+        json_end(w);
+        return;
+    }
+    csv_put_int_column(w, p->id, -3);
+    csv_put_char(w, ' ');
+    csv_put_column(w, p->name, -32);
+    csv_put_char(w, ' ');
+    csv_put_money_column(w, p->price, 7);
+    csv_put_char(w, ' ');
+    csv_put_int_column(w, p->stock, 7);
+    csv_put_char(w, ' ');
+    csv_put_int_column(w, p->min_stock, 6);
+    csv_put_raw(w, low ? "  YES\n" : "  \n", low ? 6 : 3);
+}
+
+void list_products(int show_low_only) {
+    CsvWriter w;
+    csv_writer_console(&w);
+    if (!w.json) {
+        csv_put_raw(&w, "ID  Name                             Price    Stock    Min  Low\n", 64);
+        csv_put_raw(&w, "---------------------------------------------------------------\n", 64);
+    }
+    if (show_low_only) {
+        for (int i = low_stock.head; i >= 0; i = low_stock.next[i]) list_product_row(&w, &products[i], 1);
+    } else {
+        for (int i = 0; i < product_count; i++)
+            if (products[i].id) list_product_row(&w, &products[i], low_stock.member[i]);
+    }
+    csv_writer_close(&w);
+}
+
+// One operation's figures, with ticks converted at ns_per_tick.
+static void stats_row(CsvWriter *w, int op, double ns_per_tick) {
+    const OpStats *s = &op_stats[op];
+    long long mean = s->count ? (long long)((double)s->total / s->count * ns_per_tick) : 0;
+#define STAT_NS(q) (s->count ? (long long)(stat_quantile(s, q) * ns_per_tick) : 0)
+    if (w->json) {
+        json_begin(w, "op_stats");
+        json_text(w, "op", stat_names[op]);
+        json_int(w, "count", s->count);
+        json_int(w, "total_ns", (long long)(s->total * ns_per_tick));
+        json_int(w, "mean_ns", mean);
+        json_int(w, "p50_ns", STAT_NS(0.5));
+        json_int(w, "p90_ns", STAT_NS(0.9));
+        json_int(w, "p99_ns", STAT_NS(0.99));
+        json_int(w, "p999_ns", STAT_NS(0.999));
+        json_int(w, "max_ns", (long long)(s->max * ns_per_tick));
+        json_int(w, "bytes", s->bytes);
+        json_end(w);
+        return;
+    }
+    csv_put_column(w, stat_names[op], -14);
+    csv_put_int_column(w, s->count, 10);
+    csv_put_int_column(w, mean / 1000, 9);
+    csv_put_int_column(w, STAT_NS(0.5) / 1000, 9);
+    csv_put_int_column(w, STAT_NS(0.99) / 1000, 9);
+    csv_put_int_column(w, (long long)(s->max * ns_per_tick) / 1000, 9);
+    csv_put_int_column(w, s->bytes, 14);
+    csv_end_row(w);
+#undef STAT_NS
+}
+
+// Operation counts, latencies in microseconds and bytes moved since start-up.
+void show_stats() {
+    double ns_per_tick = stat_ns_per_tick();
+    CsvWriter w;
+    csv_writer_console(&w);
+    if (!w.json) {
+        csv_put_raw(&w, "Operation          Count  Mean us   p50 us   p99 us   Max us         Bytes\n", 75);
+        csv_put_raw(&w, "--------------------------------------------------------------------------\n", 75);
+    }
+    for (int op = 0; op < STAT_OPS; op++) stats_row(&w, op, ns_per_tick);
+    csv_writer_close(&w);
+}
+
+// Rewrites path with the statistics as JSON lines, through a temp file so a
+// reader never sees half a dump.
+int stats_dump(const char *path) {
+    double ns_per_tick = stat_ns_per_tick();
+    char tmp[512];
+    CsvWriter w;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!csv_writer_open(&w, tmp)) return 0;
+    w.json = 1;
+    json_begin(&w, "stats");
+    json_int(&w, "time", time(NULL));
+    json_end(&w);
+    for (int op = 0; op < STAT_OPS; op++) stats_row(&w, op, ns_per_tick);
+    if (!csv_writer_close(&w) || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+// Called from the menu and server loops: with SHOP_STATS_FILE set, dumps the
+// statistics there every SHOP_STATS_INTERVAL seconds, or at once if force.
+void stats_tick(int force) {
+    static const char *path;
+    static double interval = -1, next_dump;
+    if (interval < 0) {
+        const char *every = getenv("SHOP_STATS_INTERVAL");
+        path = getenv("SHOP_STATS_FILE");
+        interval = every && atof(every) > 0 ? atof(every) : STATS_DUMP_INTERVAL;
+        next_dump = now_sec() + interval;
+    }
+    if (!path || (!force && now_sec() < next_dump)) return;
+    if (!stats_dump(path)) perror(path);
+    next_dump = now_sec() + interval;
+}
+
+typedef struct {
+    const char *s;
+    size_t len;
+} CsvField;
+
+typedef struct {
+    char *map;
+    size_t size;
+    char *p;        // start of the next row
+    char *end;
+    long long row;  // rows returned so far
+    const char *block;  // last 16 bytes scanned for delimiters...
+    unsigned mask;      // ...and where the ',' and '\n' in them are
+} CsvReader;
+
+// Maps path privately and writable: quoted fields with doubled quotes are
+// unescaped in place, which only ever touches (copies) the pages they are on.
+int csv_reader_open(CsvReader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    r->size = (size_t)st.st_size;
+    if (r->size) {
+        void *m = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        madvise(m, r->size, MADV_SEQUENTIAL);
+        r->map = m;
+    }
+    close(fd);
+    r->p = r->map;
+    r->end = r->map + r->size;
+    return 1;
+}
+
+void csv_reader_close(CsvReader *r) {
+    if (r->map) munmap(r->map, r->size);
+    r->map = r->p = r->end = NULL;
+}
+
+// First ',' or '\n' at or after p, or end. Sixteen bytes are classified at a
+// time with SSE2 and the bitmask is kept, so the short fields that make up
+// most rows share one compare.
+static char *csv_scan(CsvReader *r, char *p) {
+#ifdef __SSE2__
+    const __m128i comma = _mm_set1_epi8(','), newline = _mm_set1_epi8('\n');
+    for (;;) {
+        if (r->block && p >= r->block && p < r->block + 16) {
+            unsigned m = r->mask & (~0u << (p - r->block));
+            if (m) return (char *)r->block + __builtin_ctz(m);
+            p = (char *)r->block + 16;
+        }
+        if (r->end - p < 16) break;
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        r->block = p;
+        r->mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, newline)));
+    }
+#endif
+    for (; p < r->end; p++)
+        if (*p == ',' || *p == '\n') return p;
+    return r->end;
+}
+
+// Reads the next row into fields[0..max). Returns the number of fields in the
+// row (fields past max are skipped), 0 at end of input, or -1 for a malformed
+// row (unterminated quote, text after a closing quote), which is skipped.
+// Blank lines are ignored. Fields stay valid until the reader is closed.
+int csv_read_row(CsvReader *r, CsvField *fields, int max) {
+    while (r->p < r->end && (*r->p == '\n' || (*r->p == '\r' && r->p + 1 < r->end && r->p[1] == '\n')))
+        r->p += *r->p == '\r' ? 2 : 1;
+    if (r->p >= r->end) return 0;
+    char *p = r->p;
+    int n = 0;
+    for (;;) {
+        const char *s;
+        size_t len;
+        char *e;
+        if (p < r->end && *p == '"') {
+            // quoted: "" stands for one quote; separators and newlines are data
+            char *q = p + 1, *dst = NULL;
+            s = q;
+            for (;;) {
+                char *quote = memchr(q, '"', (size_t)(r->end - q));
+                if (!quote) {
+                    r->p = r->end;
+                    return -1;
+                }
+                if (dst) {
+                    memmove(dst, q, (size_t)(quote - q));
+                    dst += quote - q;
+                }
+                if (quote + 1 < r->end && quote[1] == '"') {
+                    if (!dst) dst = quote + 1;
+                    else *dst++ = '"';
+                    q = quote + 2;
+                    continue;
+                }
+                len = (size_t)((dst ? dst : quote) - s);
+                e = quote + 1;
+                break;
+            }
+            if (e < r->end && *e == '\r') e++;
+            if (e < r->end && *e != ',' && *e != '\n') {
+                char *nl = memchr(e, '\n', (size_t)(r->end - e));
+                r->p = nl ? nl + 1 : r->end;
+                return -1;
+            }
+        } else {
+            s = p;
+            e = csv_scan(r, p);
+            len = (size_t)(e - p);
+            if ((e == r->end || *e == '\n') && len && s[len - 1] == '\r') len--;
+        }
+        if (n < max) {
+            fields[n].s = s;
+            fields[n].len = len;
+        }
+        n++;
+        if (e < r->end && *e == ',') {
+            p = e + 1;
+            continue;
+        }
+        r->p = e < r->end ? e + 1 : r->end;
+        r->row++;
+        return n;
+    }
+}
+
+// Whole-field integer; 0 if the field is not one.
+int csv_int(const CsvField *f, long long *out) {
+    const char *s = f->s, *end = s + f->len;
+    int neg = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) s++;
+    if (s == end || end - s > 18) return 0;
+    long long v = 0;
+    for (; s < end; s++) {
+        if (*s < '0' || *s > '9') return 0;
+        v = v * 10 + (*s - '0');
+    }
+    *out = neg ? -v : v;
+    return 1;
+}
+
+// Whole-field amount as parse_money() reads it; 0 if the field is not one.
+// Plain "123", "123.4" and "123.45" are converted in place; anything else
+// (blanks, more decimals to round) goes through parse_money().
+int csv_money(const CsvField *f, Money *out) {
+    const char *s = f->s, *end = s + f->len;
+    int neg = s < end && *s == '-';
+    if (s < end && (*s == '-' || *s == '+')) s++;
+    const char *digits = s;
+    Money v = 0;
+    for (; s < end && s - digits < 16 && *s >= '0' && *s <= '9'; s++) v = v * 10 + (*s - '0');
+    if (s > digits) {
+        int frac = end - s == 2 || end - s == 3 ? (int)(end - s) - 1 : 0;
+        if (s == end || (frac && *s == '.' && s[1] >= '0' && s[1] <= '9'
+                         && (frac == 1 || (s[2] >= '0' && s[2] <= '9')))) {
+            v *= 100;
+            if (frac) v += (s[1] - '0') * 10 + (frac == 2 ? s[2] - '0' : 0);
+            *out = neg ? -v : v;
+            return 1;
+        }
+    }
+    char tmp[32];
+    if (f->len == 0 || f->len >= sizeof(tmp)) return 0;
+    memcpy(tmp, f->s, f->len);
+    tmp[f->len] = 0;
+    const char *stop = parse_money(tmp, out);
+    return stop == tmp + f->len;
+}
+
+// Copies a text field into out (n bytes), truncating; returns out.
+char *csv_text(const CsvField *f, char *out, size_t n) {
+    size_t len = f->len < n - 1 ? f->len : n - 1;
+    memcpy(out, f->s, len);
+    out[len] = 0;
+    return out;
+}
+
+// Sales ledger: LEDGER_FILE is a small header followed by fixed-size records in
+// the order they were recorded. LEDGER_INDEX_FILE holds one entry per calendar
+// day giving the position of that day's first record, so a date range is one
+// binary search plus a sequential read.
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    unsigned record_size;
+    unsigned reserved;
+} LedgerHeader;
+
+typedef struct {
+    long long time;
+    int day;            // local calendar day, see day_number()
+    int product_id;
+    int qty;
+    unsigned checksum;  // crc32c of the rest of the record (version 3)
+    Money price;
+    Money total;
+    char name[NAME_LEN];
+} SaleRecord;
+
+typedef struct {
+    int day;
+    long long first;    // record number of the day's first sale
+} DayIndexEntry;
+
+long long ledger_count = 0;
+DayIndexEntry *day_index = NULL;
+int day_index_count = 0, day_index_cap = 0;
+
+// Days since 1970-01-01 for a civil date (proleptic Gregorian).
+int days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+int day_number(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+static off_t ledger_offset(long long record) {
+    return (off_t)sizeof(LedgerHeader) + (off_t)record * sizeof(SaleRecord);
+}
+
+static int day_index_push(int day, long long first) {
+    if (day_index_count == day_index_cap) {
+        int cap = day_index_cap ? day_index_cap * 2 : 256;
+        DayIndexEntry *n = realloc(day_index, sizeof(DayIndexEntry) * cap);
+        if (!n) return 0;
+        day_index = n;
+        day_index_cap = cap;
+    }
+    day_index[day_index_count].day = day;
+    day_index[day_index_count].first = first;
+    day_index_count++;
+    return 1;
+}
+
+// Appends a day index entry if rec starts a day later than any seen so far.
+static int ledger_index_record(const SaleRecord *rec, long long pos, int persist) {
+    if (day_index_count && rec->day <= day_index[day_index_count - 1].day) return 1;
+    if (!day_index_push(rec->day, pos)) return 0;
+    if (persist && write(ledger_index_fd, &day_index[day_index_count - 1], sizeof(DayIndexEntry))
+                   != (ssize_t)sizeof(DayIndexEntry))
+        return 0;
+    return 1;
+}
+
+// Rebuilds LEDGER_INDEX_FILE with one pass over the ledger.
+static int ledger_rebuild_index() {
+    SaleRecord *buf = malloc(sizeof(SaleRecord) * LEDGER_READ_BATCH);
+    if (!buf) return 0;
+    day_index_count = 0;
+    for (long long pos = 0; pos < ledger_count;) {
+        ssize_t got = pread(ledger_fd, buf, sizeof(SaleRecord) * LEDGER_READ_BATCH, ledger_offset(pos));
+        int n = got > 0 ? (int)(got / sizeof(SaleRecord)) : 0;
+        if (n == 0) break;
+        for (int i = 0; i < n; i++) ledger_index_record(&buf[i], pos + i, 0);
+        pos += n;
+    }
+    free(buf);
+    size_t len = sizeof(DayIndexEntry) * day_index_count;
+    if (ftruncate(ledger_index_fd, 0) != 0 || pwrite(ledger_index_fd, day_index, len, 0) != (ssize_t)len
+        || lseek(ledger_index_fd, 0, SEEK_END) < 0)
+        return 0;
+    return 1;
+}
+
+// Appends one sale to the ledger and, on a new day, to the day index.
+// Returns the bytes written to both, 0 if the sale was not recorded.
+int ledger_append(const SaleRecord *rec) {
+    if (pwrite(ledger_fd, rec, sizeof(*rec), ledger_offset(ledger_count)) != (ssize_t)sizeof(*rec)) {
+        perror("Append sale");
+        return 0;
+    }
+    int bytes = sizeof(*rec), days = day_index_count;
+    if (!ledger_index_record(rec, ledger_count, 1)) perror("Append sale index");
+    else bytes += (day_index_count - days) * (int)sizeof(DayIndexEntry);
+    ledger_count++;
+    return bytes;
+}
+
+static unsigned sale_checksum(const SaleRecord *r) {
+    unsigned crc = crc32c(0, r, offsetof(SaleRecord, checksum));
+    return crc32c(crc, &r->price, sizeof(*r) - offsetof(SaleRecord, price));
+}
+
+void make_sale_record(SaleRecord *rec, time_t t, int product_id, const char *name, int qty, Money price) {
+    memset(rec, 0, sizeof(*rec));
+    rec->time = t;
+    rec->day = day_number(t);
+    rec->product_id = product_id;
+    rec->qty = qty;
+    rec->price = price;
+    rec->total = price * qty;
+    memcpy(rec->name, name, strnlen(name, NAME_LEN - 1)); // the memset left the terminator
+    rec->checksum = sale_checksum(rec);
+}
+
+// Import keeps the last date it converted: rows are in time order, so most
+// share it and skip mktime().
+typedef struct {
+    char text[10];
+    time_t t;           // 0 until a date has been converted
+    int day;
+} CsvDateCache;
+
+// Converts a sales CSV row (date,product_id,product_name,qty,price,total).
+static int csv_sale_record(const CsvField *f, int n, SaleRecord *rec, CsvDateCache *dc) {
+    if (n < 6 || f[0].len != sizeof(dc->text)) return 0;
+    if (dc->t == 0 || memcmp(f[0].s, dc->text, sizeof(dc->text)) != 0) {
+        const char *d = f[0].s;
+        for (int i = 0; i < 10; i++)
+            if (i == 4 || i == 7 ? d[i] != '-' : d[i] < '0' || d[i] > '9') return 0;
+        struct tm tm = {0};
+        tm.tm_year = (d[0] - '0') * 1000 + (d[1] - '0') * 100 + (d[2] - '0') * 10 + (d[3] - '0') - 1900;
+        tm.tm_mon = (d[5] - '0') * 10 + (d[6] - '0') - 1;
+        tm.tm_mday = (d[8] - '0') * 10 + (d[9] - '0');
+        tm.tm_isdst = -1;
+        if (tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 || tm.tm_mday > 31) return 0;
+        dc->day = days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+        dc->t = mktime(&tm);
+        memcpy(dc->text, d, sizeof(dc->text));
+    }
+    long long id, qty;
+    Money price, total;
+    if (!csv_int(&f[1], &id) || !csv_int(&f[3], &qty) || !csv_money(&f[4], &price) || !csv_money(&f[5], &total)
+        || id < INT_MIN || id > INT_MAX || qty < INT_MIN || qty > INT_MAX)
+        return 0;
+    memset(rec, 0, sizeof(*rec));
+    rec->time = dc->t;
+    rec->day = dc->day;
+    rec->product_id = (int)id;
+    rec->qty = (int)qty;
+    rec->price = price;
+    rec->total = total;
+    csv_text(&f[2], rec->name, NAME_LEN);
+    rec->checksum = sale_checksum(rec);
+    return 1;
+}
+
+// Appends the sales in a CSV file to the ledger, LEDGER_READ_BATCH records per
+// write. A header row is skipped; other rows that do not parse are counted in
+// *skipped. Returns the number imported, or -1 if the file cannot be read.
+long long ledger_import_csv_file(const char *path, long long *skipped) {
+    CsvReader r;
+    if (!csv_reader_open(&r, path)) return -1;
+    SaleRecord *batch = malloc(sizeof(SaleRecord) * LEDGER_READ_BATCH);
+    if (!batch) {
+        csv_reader_close(&r);
+        return -1;
+    }
+    CsvDateCache dc = {{0}, 0, 0};
+    CsvField f[6];
+    long long imported = 0;
+    int n = 0, fields, failed = 0;
+    *skipped = 0;
+    while (!failed && (fields = csv_read_row(&r, f, 6)) != 0) {
+        if (fields > 0 && csv_sale_record(f, fields, &batch[n], &dc)) n++;
+        else if (!(r.row == 1 && fields > 0 && f[0].len == 4 && memcmp(f[0].s, "date", 4) == 0)) (*skipped)++;
+        if (n == LEDGER_READ_BATCH || (n && r.p == r.end)) {
+            size_t len = sizeof(SaleRecord) * n;
+            if (pwrite(ledger_fd, batch, len, ledger_offset(ledger_count)) != (ssize_t)len) {
+                perror("Import sales");
+                failed = 1;
+                break;
+            }
+            for (int i = 0; i < n; i++) ledger_index_record(&batch[i], ledger_count + i, 1);
+            ledger_count += n;
+            imported += n;
+            n = 0;
+        }
+    }
+    free(batch);
+    csv_reader_close(&r);
+    fsync(ledger_fd);
+    fsync(ledger_index_fd);
+    return imported;
+}
+
+// One-off import of a sales.csv written by earlier versions.
+static void ledger_import_csv() {
+    long long skipped, imported = ledger_import_csv_file(SALES_FILE, &skipped);
+    if (imported > 0) printf("Imported %lld sales from %s.\n", imported, SALES_FILE);
+    if (imported >= 0 && skipped > 0) printf("Skipped %lld malformed rows in %s.\n", skipped, SALES_FILE);
+}
+
+// Rewrites an older ledger in the current version: version 1 had doubles where
+// price and total are now cents, and neither 1 nor 2 had record checksums.
+// Goes through a temp file so a crash leaves the old file.
+static int ledger_upgrade(const char *path, off_t size, unsigned version) {
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int out = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    SaleRecord *buf = malloc(sizeof(SaleRecord) * LEDGER_READ_BATCH);
+    LedgerHeader h = {LEDGER_MAGIC, LEDGER_VERSION, sizeof(SaleRecord), 0};
+    long long count = (size - (off_t)sizeof(LedgerHeader)) / (off_t)sizeof(SaleRecord);
+    int ok = out >= 0 && buf && pwrite(out, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    for (long long pos = 0; ok && pos < count;) {
+        int n = count - pos < LEDGER_READ_BATCH ? (int)(count - pos) : LEDGER_READ_BATCH;
+        size_t len = sizeof(SaleRecord) * n;
+        ok = pread(ledger_fd, buf, len, ledger_offset(pos)) == (ssize_t)len;
+        for (int i = 0; ok && i < n; i++) {
+            if (version == 1) {
+                double price, total;
+                memcpy(&price, &buf[i].price, sizeof(price));
+                memcpy(&total, &buf[i].total, sizeof(total));
+                buf[i].price = money_from_double(price);
+                buf[i].total = money_from_double(total);
+            }
+            buf[i].checksum = sale_checksum(&buf[i]);
+        }
+        ok = ok && pwrite(out, buf, len, ledger_offset(pos)) == (ssize_t)len;
+        pos += n;
+    }
+    free(buf);
+    ok = ok && fsync(out) == 0 && rename(tmp_path, path) == 0;
+    if (!ok) {
+        if (out >= 0) close(out);
+        unlink(tmp_path);
+        return 0;
+    }
+    close(ledger_fd);
+    ledger_fd = out;
+    printf("Upgraded %lld sales in %s to version %d.\n", count, path, LEDGER_VERSION);
+    return 1;
+}
+
+// Opens (or creates) the ledger and its day index. The index is rebuilt from
+// the ledger if it is missing or does not cover the last record.
+int ledger_open(const char *path, const char *index_path, int import_csv) {
+    ledger_fd = open(path, O_RDWR | O_CREAT, 0644);
+    ledger_index_fd = open(index_path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (ledger_fd < 0 || ledger_index_fd < 0 || fstat(ledger_fd, &st) != 0) {
+        perror("Open sales ledger");
+        return 0;
+    }
+    LedgerHeader h = {LEDGER_MAGIC, LEDGER_VERSION, sizeof(SaleRecord), 0};
+    int fresh = st.st_size == 0;
+    if (fresh) {
+        if (pwrite(ledger_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+            perror("Create sales ledger");
+            return 0;
+        }
+    } else if (pread(ledger_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.magic != LEDGER_MAGIC
+               || h.version < 1 || h.version > LEDGER_VERSION || h.record_size != sizeof(SaleRecord)) {
+        fprintf(stderr, "%s: not a sales ledger or unsupported version.\n", path);
+        return 0;
+    } else if (h.version < LEDGER_VERSION && !ledger_upgrade(path, st.st_size, h.version)) {
+        perror("Upgrade sales ledger");
+        return 0;
+    }
+    // a torn final record is dropped, as are records at the tail whose
+    // checksum does not match (written but not synced before a crash)
+    ledger_count = fresh ? 0 : (st.st_size - (off_t)sizeof(LedgerHeader)) / (off_t)sizeof(SaleRecord);
+    while (ledger_count > 0) {
+        SaleRecord last;
+        if (pread(ledger_fd, &last, sizeof(last), ledger_offset(ledger_count - 1)) == (ssize_t)sizeof(last)
+            && last.checksum == sale_checksum(&last))
+            break;
+        ledger_count--;
+    }
+    if (!fresh && ftruncate(ledger_fd, ledger_offset(ledger_count)) != 0) return 0;
+
+    struct stat ist;
+    fstat(ledger_index_fd, &ist);
+    day_index_count = 0;
+    int n = (int)(ist.st_size / (off_t)sizeof(DayIndexEntry));
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++) {
+        DayIndexEntry e;
+        ok = pread(ledger_index_fd, &e, sizeof(e), (off_t)i * sizeof(e)) == (ssize_t)sizeof(e)
+             && e.first < ledger_count && (i == 0 ? e.first == 0 : e.day > day_index[i - 1].day)
+             && day_index_push(e.day, e.first);
+    }
+    if (ok && ledger_count > 0) {
+        SaleRecord last;
+        ok = day_index_count > 0 && pread(ledger_fd, &last, sizeof(last), ledger_offset(ledger_count - 1)) == sizeof(last)
+             && last.day <= day_index[day_index_count - 1].day;
+    }
+    if (!ok || ist.st_size % sizeof(DayIndexEntry)) {
+        if (!ledger_rebuild_index()) {
+            perror("Rebuild sales index");
+            return 0;
+        }
+    }
+    lseek(ledger_index_fd, 0, SEEK_END);
+    if (fresh && import_csv) ledger_import_csv();
+    return 1;
+}
+
+void ledger_close() {
+    if (ledger_fd >= 0) {
+        fsync(ledger_fd);
+        close(ledger_fd);
+    }
+    if (ledger_index_fd >= 0) close(ledger_index_fd);
+    ledger_fd = ledger_index_fd = -1;
+    free(day_index);
+    day_index = NULL;
+    day_index_count = day_index_cap = 0;
+    ledger_count = 0;
+}
+
+// Position of the first record dated on or after from_day.
+long long ledger_seek_day(int from_day) {
+    int lo = 0, hi = day_index_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (day_index[mid].day < from_day) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < day_index_count ? day_index[lo].first : ledger_count;
+}
+
+// Visits records at or after position start that are dated on or after from_day.
+long long ledger_scan(long long start, int from_day, void (*visit)(const SaleRecord *, void *), void *ctx) {
+    SaleRecord *buf = malloc(sizeof(SaleRecord) * LEDGER_READ_BATCH);
+    if (!buf) return 0;
+    long long visited = 0;
+    for (long long pos = start; pos < ledger_count;) {
+        ssize_t got = pread(ledger_fd, buf, sizeof(SaleRecord) * LEDGER_READ_BATCH, ledger_offset(pos));
+        int n = got > 0 ? (int)(got / sizeof(SaleRecord)) : 0;
+        if (n == 0) break;
+        for (int i = 0; i < n; i++) {
+            if (buf[i].day < from_day) continue; // only if the clock went backwards
+            visit(&buf[i], ctx);
+            visited++;
+        }
+        pos += n;
+    }
+    free(buf);
+    return visited;
+}
+
+// Visits every record dated on or after from_day; reads only that tail of the ledger.
+long long ledger_scan_from(int from_day, void (*visit)(const SaleRecord *, void *), void *ctx) {
+    return ledger_scan(ledger_seek_day(from_day), from_day, visit, ctx);
+}
+
+// Revenue rollups, updated as each sale is recorded: one total per day and one
+// per (day, product). Both arrays are kept sorted by day so a range query is a
+// binary search plus a walk over the days in range. ROLLUP_FILE stores them
+// with the number of ledger records they cover; anything newer is replayed
+// from the ledger on startup and a bad file is rebuilt from scratch.
+typedef struct {
+    int day;
+    int qty;
+    Money revenue;
+} DayTotal;
+
+typedef struct {
+    int day;
+    int product_id;
+    int qty;
+    Money revenue;
+} ProductDayTotal;
+
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    long long covered;      // ledger records folded into the rollups
+    int day_count;
+    int product_day_count;
+    unsigned checksum;      // over both arrays
+    unsigned reserved;
+} RollupHeader;
+
+DayTotal *day_totals = NULL;
+int day_total_count = 0, day_total_cap = 0;
+ProductDayTotal *pd_totals = NULL;
+int pd_count = 0, pd_cap = 0;
+int *pd_slots = NULL;       // (day, product) -> pd_totals index, -1 = empty
+int pd_slot_cap = 0;
+long long rollup_covered = 0;
+int rollup_unsaved = 0;
+
+static unsigned pd_hash(int day, int product_id) {
+    return ((unsigned)day * 2654435761u) ^ ((unsigned)product_id * 2246822519u);
+}
+
+static void pd_rehash(int cap) {
+    free(pd_slots);
+    pd_slots = malloc(sizeof(int) * cap);
+    if (!pd_slots) {
+        fprintf(stderr, "Out of memory building rollups\n");
+        exit(1);
+    }
+    pd_slot_cap = cap;
+    for (int i = 0; i < cap; i++) pd_slots[i] = -1;
+    for (int i = 0; i < pd_count; i++) {
+        unsigned h = pd_hash(pd_totals[i].day, pd_totals[i].product_id) & (cap - 1);
+        while (pd_slots[h] >= 0) h = (h + 1) & (cap - 1);
+        pd_slots[h] = i;
+    }
+}
+
+static void *grow(void *arr, int *cap, size_t elem) {
+    int n = *cap ? *cap * 2 : 256;
+    void *p = realloc(arr, elem * n);
+    if (!p) {
+        fprintf(stderr, "Out of memory building rollups\n");
+        exit(1);
+    }
+    *cap = n;
+    return p;
+}
+
+// First entry with day >= day in an array sorted by day (works for both rollups).
+#define LOWER_BOUND_DAY(arr, n, d, out) do {      \
+        int lo_ = 0, hi_ = (n);                   \
+        while (lo_ < hi_) {                       \
+            int mid_ = (lo_ + hi_) / 2;           \
+            if ((arr)[mid_].day < (d)) lo_ = mid_ + 1; \
+            else hi_ = mid_;                      \
+        }                                         \
+        (out) = lo_;                              \
+    } while (0)
+
+static DayTotal *day_total_for(int day) {
+    int pos;
+    if (day_total_count && day_totals[day_total_count - 1].day < day) pos = day_total_count;
+    else LOWER_BOUND_DAY(day_totals, day_total_count, day, pos);
+    if (pos < day_total_count && day_totals[pos].day == day) return &day_totals[pos];
+    if (day_total_count == day_total_cap) day_totals = grow(day_totals, &day_total_cap, sizeof(DayTotal));
+    memmove(&day_totals[pos + 1], &day_totals[pos], sizeof(DayTotal) * (day_total_count - pos));
+    day_totals[pos].day = day;
+    day_totals[pos].qty = 0;
+    day_totals[pos].revenue = 0;
+    day_total_count++;
+    return &day_totals[pos];
+}
+
+static ProductDayTotal *product_day_total_for(int day, int product_id) {
+    if ((pd_count + 1) * 2 > pd_slot_cap) pd_rehash(pd_slot_cap ? pd_slot_cap * 2 : 1024);
+    unsigned mask = (unsigned)pd_slot_cap - 1;
+    unsigned h = pd_hash(day, product_id) & mask;
+    for (; pd_slots[h] >= 0; h = (h + 1) & mask) {
+        ProductDayTotal *e = &pd_totals[pd_slots[h]];
+        if (e->day == day && e->product_id == product_id) return e;
+    }
+    if (pd_count == pd_cap) pd_totals = grow(pd_totals, &pd_cap, sizeof(ProductDayTotal));
+    int pos = pd_count;
+    if (pd_count && pd_totals[pd_count - 1].day > day) {
+        // sale dated before the latest day (clock moved back): keep the order
+        LOWER_BOUND_DAY(pd_totals, pd_count, day + 1, pos);
+        memmove(&pd_totals[pos + 1], &pd_totals[pos], sizeof(ProductDayTotal) * (pd_count - pos));
+    }
+    ProductDayTotal *e = &pd_totals[pos];
+    e->day = day;
+    e->product_id = product_id;
+    e->qty = 0;
+    e->revenue = 0;
+    pd_count++;
+    if (pos < pd_count - 1) pd_rehash(pd_slot_cap);
+    else pd_slots[h] = pos;
+    return e;
+}
+
+void rollup_add(const SaleRecord *r) {
+    DayTotal *d = day_total_for(r->day);
+    d->qty += r->qty;
+    d->revenue += r->total;
+    ProductDayTotal *pd = product_day_total_for(r->day, r->product_id);
+    pd->qty += r->qty;
+    pd->revenue += r->total;
+    rollup_covered++;
+}
+
+// Parallel ledger aggregation. The records to scan are cut into blocks of
+// LEDGER_READ_BATCH and shared between threads by work stealing: each thread
+// owns a range of blocks packed into one word (first << 32 | end) that only
+// changes by compare-and-swap. A thread takes blocks off the front of its own
+// range and, once that is empty, steals the back half of another thread's.
+// Each thread sums into its own (day, product) table; the tables are merged
+// and sorted at the end, so the result does not depend on how the blocks were
+// shared out or on the number of threads.
+typedef struct {
+    unsigned long long range;   // first << 32 | end of the blocks left
+    char padding[56];           // one cache line per thread
+} WorkRange;
+
+// (day, product) sums of one thread, open addressing like pd_slots.
+typedef struct {
+    ProductDayTotal *entries;
+    int count, cap;
+    int *slots;
+    int slot_cap;
+    char padding[32];
+} PdTable;
+
+typedef struct {
+    WorkRange *ranges;
+    PdTable *tables;
+    int threads;
+    long long start;            // first record of block 0
+    int from_day, to_day;
+} LedgerJob;
+
+typedef struct {
+    LedgerJob *job;
+    int self;
+} LedgerWorker;
+
+int report_threads = 0;         // threads for ledger aggregation, 0 = not chosen yet
+
+// SHOP_THREADS if set, otherwise the number of online CPUs.
+int choose_report_threads() {
+    const char *forced = getenv("SHOP_THREADS");
+    long n = forced ? atol(forced) : sysconf(_SC_NPROCESSORS_ONLN);
+    report_threads = n < 1 ? 1 : n > REPORT_MAX_THREADS ? REPORT_MAX_THREADS : (int)n;
+    return report_threads;
+}
+
+static void pd_table_add(PdTable *t, const SaleRecord *r) {
+    if ((t->count + 1) * 2 > t->slot_cap) {
+        int cap = t->slot_cap ? t->slot_cap * 2 : 1024;
+        free(t->slots);
+        t->slots = malloc(sizeof(int) * cap);
+        if (!t->slots) {
+            fprintf(stderr, "Out of memory building rollups\n");
+            exit(1);
+        }
+        t->slot_cap = cap;
+        for (int i = 0; i < cap; i++) t->slots[i] = -1;
+        for (int i = 0; i < t->count; i++) {
+            unsigned h = pd_hash(t->entries[i].day, t->entries[i].product_id) & (cap - 1);
+            while (t->slots[h] >= 0) h = (h + 1) & (cap - 1);
+            t->slots[h] = i;
+        }
+    }
+    unsigned mask = (unsigned)t->slot_cap - 1, h = pd_hash(r->day, r->product_id) & mask;
+    for (; t->slots[h] >= 0; h = (h + 1) & mask) {
+        ProductDayTotal *e = &t->entries[t->slots[h]];
+        if (e->day == r->day && e->product_id == r->product_id) {
+            e->qty += r->qty;
+            e->revenue += r->total;
+            return;
+        }
+    }
+    if (t->count == t->cap) t->entries = grow(t->entries, &t->cap, sizeof(ProductDayTotal));
+    ProductDayTotal *e = &t->entries[t->count];
+    memset(e, 0, sizeof(*e));
+    e->day = r->day;
+    e->product_id = r->product_id;
+    e->qty = r->qty;
+    e->revenue = r->total;
+    t->slots[h] = t->count++;
+}
+
+// Next block for thread self, stolen if its own range is empty; -1 when none are left.
+static long long take_block(LedgerJob *job, int self) {
+    unsigned long long range, first, end, middle;
+    for (;;) {
+        range = __atomic_load_n(&job->ranges[self].range, __ATOMIC_ACQUIRE);
+        first = range >> 32;
+        end = range & 0xffffffffu;
+        if (first >= end) break;
+        if (__atomic_compare_exchange_n(&job->ranges[self].range, &range, (first + 1) << 32 | end, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return (long long)first;
+    }
+    for (int i = 1; i < job->threads; i++) {
+        WorkRange *victim = &job->ranges[(self + i) % job->threads];
+        range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while ((first = range >> 32) < (end = range & 0xffffffffu)) {
+            if (end - first == 1) {
+                // the victim's last block is taken whole
+                if (__atomic_compare_exchange_n(&victim->range, &range, end << 32 | end, 0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE))
+                    return (long long)first;
+                continue;
+            }
+            middle = first + (end - first) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &range, first << 32 | middle, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&job->ranges[self].range, (middle + 1) << 32 | end, __ATOMIC_RELEASE);
+                return (long long)middle;
+            }
+        }
+    }
+    return -1;
+}
+
+static void *ledger_worker(void *arg) {
+    LedgerWorker *w = arg;
+    LedgerJob *job = w->job;
+    PdTable *table = &job->tables[w->self];
+    SaleRecord *buf = malloc(sizeof(SaleRecord) * LEDGER_READ_BATCH);
+    if (!buf) {
+        fprintf(stderr, "Out of memory building rollups\n");
+        exit(1);
+    }
+    for (long long block; (block = take_block(job, w->self)) >= 0;) {
+        long long pos = job->start + block * LEDGER_READ_BATCH;
+        long long want = ledger_count - pos < LEDGER_READ_BATCH ? ledger_count - pos : LEDGER_READ_BATCH;
+        ssize_t got = pread(ledger_fd, buf, sizeof(SaleRecord) * want, ledger_offset(pos));
+        int n = got > 0 ? (int)(got / sizeof(SaleRecord)) : 0;
+        for (int i = 0; i < n; i++)
+            if (buf[i].day >= job->from_day && buf[i].day <= job->to_day) pd_table_add(table, &buf[i]);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int cmp_day_product(const void *a, const void *b) {
+    const ProductDayTotal *x = a, *y = b;
+    if (x->day != y->day) return x->day < y->day ? -1 : 1;
+    return (x->product_id > y->product_id) - (x->product_id < y->product_id);
+}
+
+// Units and revenue per (day, product) for ledger records from position start
+// on that are dated within [from_day, to_day], summed on report_threads
+// threads. Returns the number of sums and stores them in *out (malloc'd,
+// sorted by day then product id; NULL if none).
+int ledger_aggregate(long long start, int from_day, int to_day, ProductDayTotal **out) {
+    long long blocks = start < ledger_count ? (ledger_count - start + LEDGER_READ_BATCH - 1) / LEDGER_READ_BATCH : 0;
+    int threads = report_threads ? report_threads : choose_report_threads();
+    if (threads > blocks) threads = blocks > 0 ? (int)blocks : 1;
+    LedgerJob job = {aligned_alloc(64, sizeof(WorkRange) * threads), calloc(threads, sizeof(PdTable)), threads,
+                     start, from_day, to_day};
+    LedgerWorker *workers = malloc(sizeof(LedgerWorker) * threads);
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    if (!job.ranges || !job.tables || !workers || !ids) {
+        fprintf(stderr, "Out of memory building rollups\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++) {
+        job.ranges[i].range = (unsigned long long)(blocks * i / threads) << 32
+                              | (unsigned long long)(blocks * (i + 1) / threads);
+        workers[i].job = &job;
+        workers[i].self = i;
+    }
+    int started = 1;
+    for (; started < threads; started++)
+        if (pthread_create(&ids[started], NULL, ledger_worker, &workers[started]) != 0) break;
+    ledger_worker(&workers[0]); // steals whatever threads that failed to start would have done
+    for (int i = 1; i < started; i++) pthread_join(ids[i], NULL);
+
+    int total = 0;
+    for (int i = 0; i < threads; i++) total += job.tables[i].count;
+    ProductDayTotal *all = malloc(sizeof(ProductDayTotal) * (total ? total : 1));
+    if (!all) {
+        fprintf(stderr, "Out of memory building rollups\n");
+        exit(1);
+    }
+    int n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(&all[n], job.tables[i].entries, sizeof(ProductDayTotal) * job.tables[i].count);
+        n += job.tables[i].count;
+        free(job.tables[i].entries);
+        free(job.tables[i].slots);
+    }
+    qsort(all, n, sizeof(ProductDayTotal), cmp_day_product);
+    int merged = 0;
+    for (int i = 0; i < n; i++) {
+        if (merged && cmp_day_product(&all[merged - 1], &all[i]) == 0) {
+            all[merged - 1].qty += all[i].qty;
+            all[merged - 1].revenue += all[i].revenue;
+        } else {
+            all[merged++] = all[i];
+        }
+    }
+    free(job.ranges);
+    free(job.tables);
+    free(workers);
+    free(ids);
+    if (!merged) {
+        free(all);
+        all = NULL;
+    }
+    *out = all;
+    return merged;
+}
+
+// Folds every ledger record the rollups do not cover yet into them.
+static void rollup_catch_up() {
+    ProductDayTotal *sums;
+    int n = ledger_aggregate(rollup_covered, INT_MIN, INT_MAX, &sums);
+    for (int i = 0; i < n; i++) {
+        DayTotal *d = day_total_for(sums[i].day);
+        d->qty += sums[i].qty;
+        d->revenue += sums[i].revenue;
+        ProductDayTotal *pd = product_day_total_for(sums[i].day, sums[i].product_id);
+        pd->qty += sums[i].qty;
+        pd->revenue += sums[i].revenue;
+    }
+    free(sums);
+    rollup_covered = ledger_count;
+}
+
+static void rollup_reset() {
+    day_total_count = pd_count = 0;
+    rollup_covered = 0;
+    if (pd_slots) pd_rehash(pd_slot_cap);
+}
+
+static unsigned rollup_checksum() {
+    unsigned h = fnv1a(day_totals, sizeof(DayTotal) * day_total_count, 2166136261u);
+    return fnv1a(pd_totals, sizeof(ProductDayTotal) * pd_count, h);
+}
+
+// Writes the rollups next to the ledger (temp file + rename).
+int rollup_save() {
+    RollupHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = ROLLUP_MAGIC;
+    h.version = ROLLUP_VERSION;
+    h.covered = rollup_covered;
+    h.day_count = day_total_count;
+    h.product_day_count = pd_count;
+    h.checksum = rollup_checksum();
+    FILE *f = fopen(ROLLUP_FILE ".tmp", "wb");
+    if (!f) {
+        perror("Save rollups");
+        return 0;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+             && fwrite(day_totals, sizeof(DayTotal), day_total_count, f) == (size_t)day_total_count
+             && fwrite(pd_totals, sizeof(ProductDayTotal), pd_count, f) == (size_t)pd_count;
+    ok = fclose(f) == 0 && ok && rename(ROLLUP_FILE ".tmp", ROLLUP_FILE) == 0;
+    if (!ok) perror("Save rollups");
+    else rollup_unsaved = 0;
+    return ok;
+}
+
+// Loads the saved rollups and folds in any ledger records they do not cover.
+// Missing, corrupt or inconsistent rollups are rebuilt from the whole ledger.
+void rollup_open() {
+    RollupHeader h;
+    int ok = 0;
+    FILE *f = fopen(ROLLUP_FILE, "rb");
+    if (f && fread(&h, sizeof(h), 1, f) == 1 && h.magic == ROLLUP_MAGIC && h.version == ROLLUP_VERSION
+        && h.covered >= 0 && h.covered <= ledger_count && h.day_count >= 0 && h.product_day_count >= 0) {
+        while (day_total_cap < h.day_count) day_totals = grow(day_totals, &day_total_cap, sizeof(DayTotal));
+        while (pd_cap < h.product_day_count) pd_totals = grow(pd_totals, &pd_cap, sizeof(ProductDayTotal));
+        day_total_count = h.day_count;
+        pd_count = h.product_day_count;
+        ok = fread(day_totals, sizeof(DayTotal), day_total_count, f) == (size_t)day_total_count
+             && fread(pd_totals, sizeof(ProductDayTotal), pd_count, f) == (size_t)pd_count
+             && rollup_checksum() == h.checksum;
+    }
+    if (f) fclose(f);
+    if (ok) {
+        rollup_covered = h.covered;
+        int cap = 1024;
+        while (cap < pd_count * 2 + 2) cap <<= 1;
+        pd_rehash(cap);
+    } else {
+        rollup_reset();
+    }
+    if (rollup_covered < ledger_count) {
+        if (ok) printf("Updating sales rollups from the ledger...\n");
+        else if (ledger_count) printf("Rebuilding sales rollups from the ledger...\n");
+        rollup_catch_up();
+        rollup_save();
+    }
+}
+
+// Sums the daily rollups for days in [from_day, to_day]; O(days in range).
+void rollup_range(int from_day, int to_day, int *qty, Money *revenue) {
+    int i;
+    LOWER_BOUND_DAY(day_totals, day_total_count, from_day, i);
+    *qty = 0;
+    *revenue = 0;
+    for (; i < day_total_count && day_totals[i].day <= to_day; i++) {
+        *qty += day_totals[i].qty;
+        *revenue += day_totals[i].revenue;
+    }
+}
+
+// Report engine: per-product totals over a day range are summed from the
+// (day, product) rollups in a hash keyed by product id, and the best n are
+// picked with a bounded min-heap, O(entries in range + products * log n).
+typedef struct {
+    int product_id;
+    long long qty;
+    Money revenue;
+} ProductTotal;
+
+// Sums pd_totals for days [from_day, to_day] by product. Returns the number of
+// products and stores a malloc'd array in *out (NULL if none), in no order.
+int product_totals(int from_day, int to_day, ProductTotal **out) {
+    STAT_BEGIN(t0);
+    ProductTotal *totals = NULL;
+    int count = 0, cap = 0, slot_cap = 0, i;
+    int *slots = NULL;
+    LOWER_BOUND_DAY(pd_totals, pd_count, from_day, i);
+    for (; i < pd_count && pd_totals[i].day <= to_day; i++) {
+        const ProductDayTotal *e = &pd_totals[i];
+        if ((count + 1) * 2 > slot_cap) {
+            slot_cap = slot_cap ? slot_cap * 2 : 256;
+            free(slots);
+            slots = malloc(sizeof(int) * slot_cap);
+            if (!slots) {
+                fprintf(stderr, "Out of memory building report\n");
+                exit(1);
+            }
+            for (int s = 0; s < slot_cap; s++) slots[s] = -1;
+            for (int t = 0; t < count; t++) {
+                unsigned h = hash_id(totals[t].product_id) & (slot_cap - 1);
+                while (slots[h] >= 0) h = (h + 1) & (slot_cap - 1);
+                slots[h] = t;
+            }
+        }
+        unsigned mask = (unsigned)slot_cap - 1, h = hash_id(e->product_id) & mask;
+        while (slots[h] >= 0 && totals[slots[h]].product_id != e->product_id) h = (h + 1) & mask;
+        if (slots[h] < 0) {
+            if (count == cap) totals = grow(totals, &cap, sizeof(ProductTotal));
+            totals[count].product_id = e->product_id;
+            totals[count].qty = 0;
+            totals[count].revenue = 0;
+            slots[h] = count++;
+        }
+        totals[slots[h]].qty += e->qty;
+        totals[slots[h]].revenue += e->revenue;
+    }
+    free(slots);
+    *out = totals;
+    STAT_END(STAT_REPORT, t0, 0);
+    return count;
+}
+
+// 1 if a ranks above b: more revenue (or units) first, lower id on ties.
+static int ranks_above(const ProductTotal *a, const ProductTotal *b, int by_revenue) {
+    long long x = by_revenue ? a->revenue : a->qty, y = by_revenue ? b->revenue : b->qty;
+    return x != y ? x > y : a->product_id < b->product_id;
+}
+
+// Heap with the lowest-ranked kept total at the root.
+static void top_sift_down(ProductTotal *heap, int n, int i, int by_revenue) {
+    ProductTotal moving = heap[i];
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && ranks_above(&heap[child], &heap[child + 1], by_revenue)) child++;
+        if (!ranks_above(&moving, &heap[child], by_revenue)) break;
+        heap[i] = heap[child];
+    }
+    heap[i] = moving;
+}
+
+// Copies the n best of totals into top, best first; returns how many.
+int select_top(const ProductTotal *totals, int count, int by_revenue, ProductTotal *top, int n) {
+    int kept = 0;
+    for (int i = 0; i < count && n > 0; i++) {
+        if (kept < n) {
+            int at = kept++;
+            for (int parent; at > 0 && ranks_above(&top[parent = (at - 1) / 2], &totals[i], by_revenue); at = parent)
+                top[at] = top[parent];
+            top[at] = totals[i];
+        } else if (ranks_above(&totals[i], &top[0], by_revenue)) {
+            top[0] = totals[i];
+            top_sift_down(top, kept, 0, by_revenue);
+        }
+    }
+    for (int i = kept - 1; i > 0; i--) {
+        ProductTotal last = top[i];
+        top[i] = top[0];
+        top[0] = last;
+        top_sift_down(top, i, 0, by_revenue);
+    }
+    return kept;
+}
+
+// Best n products by units sold or revenue over days [from_day, to_day].
+int top_products(int from_day, int to_day, int by_revenue, ProductTotal *top, int n) {
+    ProductTotal *totals;
+    int count = product_totals(from_day, to_day, &totals);
+    int kept = select_top(totals, count, by_revenue, top, n);
+    free(totals);
+    return kept;
+}
+
+// One product's rollup for a day, or NULL if it sold nothing that day.
+const ProductDayTotal *product_day_find(int day, int product_id) {
+    if (!pd_slot_cap) return NULL;
+    unsigned mask = (unsigned)pd_slot_cap - 1;
+    for (unsigned h = pd_hash(day, product_id) & mask; pd_slots[h] >= 0; h = (h + 1) & mask) {
+        const ProductDayTotal *e = &pd_totals[pd_slots[h]];
+        if (e->day == day && e->product_id == product_id) return e;
+    }
+    return NULL;
+}
+
+static int cmp_product_id(const void *a, const void *b) {
+    const ProductTotal *x = a, *y = b;
+    return (x->product_id > y->product_id) - (x->product_id < y->product_id);
+}
+
+// Sells qty units of product id: ledger, rollups and stock log in that order.
+// Returns NULL on success or the reason the sale was refused.
+const char *sell_product(int id, int qty, int *remaining) {
+    STAT_BEGIN(t0);
+    int idx = find_product_index_by_id(id);
+    if (idx < 0) return "not found";
+    Product *p = &products[idx];
+    if (qty <= 0) return "invalid qty";
+    if (qty > p->stock) return "insufficient stock";
+    SaleRecord rec;
+    make_sale_record(&rec, time(NULL), p->id, p->name, qty, p->price);
+    int bytes = ledger_append(&rec);
+    if (!bytes) return "ledger write failed";
+    rollup_add(&rec);
+    if (++rollup_unsaved >= ROLLUP_SAVE_EVERY) rollup_save();
+    p->stock -= qty;
+    bytes += wal_log(WAL_STOCK, p, -qty);
+    *remaining = p->stock;
+    low_stock_refresh(idx);
+    STAT_END(STAT_SALE, t0, bytes);
+    return NULL;
+}
+
+void record_sale() {
+    char buf[BUFFER];
+    printf("Enter product ID: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int id = atoi(buf);
+    int idx = find_product_index_by_id(id);
+    if (idx < 0) {
+        printf("Not found.\n");
+        return;
+    }
+    Product *p = &products[idx];
+    printf("Enter quantity sold: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int qty = atoi(buf);
+    if (qty <= 0) {
+        printf("Invalid qty.\n");
+        return;
+    }
+    if (qty > p->stock) {
+        printf("Insufficient stock (%d available).\n", p->stock);
+        return;
+    }
+    int remaining;
+    const char *err = sell_product(id, qty, &remaining);
+    if (err) {
+        printf("Sale failed: %s.\n", err);
+        return;
+    }
+    printf("Sale recorded. Remaining stock: %d\n", remaining);
+}
+
+void export_products_csv() {
+    CsvWriter w;
+    if (!csv_writer_open(&w, "products_export.csv")) {
+        perror("Export");
+        return;
+    }
+    csv_put_raw(&w, "id,name,price,stock\n", 20);
+    for (int i = 0; i < product_count; i++) {
+        if (!products[i].id) continue;
+        csv_put_int(&w, products[i].id);
+        csv_put_char(&w, ',');
+        csv_put_text(&w, products[i].name);
+        csv_put_char(&w, ',');
+        csv_put_money(&w, products[i].price);
+        csv_put_char(&w, ',');
+        csv_put_int(&w, products[i].stock);
+        csv_end_row(&w);
+    }
+    if (!csv_writer_close(&w)) perror("Export");
+    else printf("Exported to products_export.csv\n");
+}
+
+typedef struct {
+    CsvWriter *w;       // rows are listed here, or only summed if NULL
+    int total_qty;
+    Money total_revenue;
+    int to_day;         // records dated after this are left out
+} ReportTotals;
+
+static void report_visit(const SaleRecord *r, void *ctx) {
+    ReportTotals *t = ctx;
+    if (r->day > t->to_day) return;
+    CsvWriter *w = t->w;
+    if (w && w->json) {
+        json_begin(w, "sale");
+        json_day(w, "date", r->day);
+        json_int(w, "time", r->time);
+        json_int(w, "product_id", r->product_id);
+        json_text(w, "name", r->name);
+        json_int(w, "qty", r->qty);
+        json_money(w, "price", r->price);
+        json_money(w, "total", r->total);
+        json_end(w);
+    } else if (w) {
+        csv_put_day(w, r->day);
+        csv_put_char(w, ' ');
+        csv_put_int_column(w, r->product_id, -3);
+        csv_put_char(w, ' ');
+        csv_put_column(w, r->name, -30);
+        csv_put_char(w, ' ');
+        csv_put_int_column(w, r->qty, 4);
+        csv_put_char(w, ' ');
+        csv_put_money_column(w, r->price, 7);
+        csv_put_char(w, ' ');
+        csv_put_money_column(w, r->total, 8);
+        csv_end_row(w);
+    }
+    t->total_qty += r->qty;
+    t->total_revenue += r->total;
+}
+
+// One day of a report: "date qty revenue", or a JSON record of the given type
+// (with the product id, if there is one).
+static void day_row(CsvWriter *w, const char *type, int day, int product_id, int qty, Money revenue) {
+    if (w->json) {
+        json_begin(w, type);
+        json_day(w, "date", day);
+        if (product_id) json_int(w, "product_id", product_id);
+        json_int(w, "qty", qty);
+        json_money(w, "revenue", revenue);
+        json_end(w);
+        return;
+    }
+    csv_put_day(w, day);
+    csv_put_char(w, ' ');
+    csv_put_int_column(w, qty, 6);
+    csv_put_char(w, ' ');
+    csv_put_money_column(w, revenue, 11);
+    csv_end_row(w);
+}
+
+// Per-day and per-product summary comes from the rollups (O(days in range));
+// individual sales are read from the ledger only if asked for.
+void generate_report() {
+    char buf[BUFFER];
+    printf("Report range in days (e.g., 1 for today, 7 for last 7 days) or FROM TO dates (YYYY-MM-DD YYYY-MM-DD): ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int today = day_number(time(NULL)), from_day, to_day;
+    char from_text[16], to_text[16];
+    if (sscanf(buf, "%15s %15s", from_text, to_text) == 2) {
+        time_t from = parse_date(from_text), to = parse_date(to_text);
+        if (from == 0 || to == 0 || to < from) {
+            printf("Invalid dates.\n");
+            return;
+        }
+        from_day = day_number(from);
+        to_day = day_number(to);
+    } else {
+        int days = atoi(buf);
+        if (days <= 0) {
+            printf("Invalid days.\n");
+            return;
+        }
+        from_day = today - (days - 1); // include today
+        to_day = today;
+    }
+    if (ledger_count == 0) {
+        printf("No sales recorded yet.\n");
+        return;
+    }
+    int i;
+    CsvWriter w;
+
+    csv_writer_console(&w);
+    if (!w.json) {
+        printf("Date          Qty     Revenue\n");
+        printf("-----------------------------\n");
+    }
+    LOWER_BOUND_DAY(day_totals, day_total_count, from_day, i);
+    for (; i < day_total_count && day_totals[i].day <= to_day; i++)
+        day_row(&w, "day", day_totals[i].day, 0, day_totals[i].qty, day_totals[i].revenue);
+    csv_writer_close(&w);
+
+    printf("Rank products by (q)uantity or (r)evenue, or Enter to list them by id: ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int by_revenue = buf[0] == 'r' || buf[0] == 'R', ranked = by_revenue || buf[0] == 'q' || buf[0] == 'Q';
+    ProductTotal *totals;
+    int n = product_totals(from_day, to_day, &totals);
+    if (ranked) {
+        printf("How many products [%d]: ", TOP_DEFAULT);
+        if (!fgets(buf, BUFFER, stdin)) {
+            free(totals);
+            return;
+        }
+        int want = atoi(buf) > 0 ? atoi(buf) : TOP_DEFAULT;
+        ProductTotal *top = malloc(sizeof(ProductTotal) * (want < n ? want : n ? n : 1));
+        if (top) {
+            n = select_top(totals, n, by_revenue, top, want);
+            free(totals);
+            totals = top;
+        }
+    } else if (n) {
+        qsort(totals, n, sizeof(ProductTotal), cmp_product_id);
+    }
+    csv_writer_console(&w);
+    if (!w.json) {
+        printf("\n%s  ID  Name                              Qty     Revenue\n", ranked ? "Rank" : "");
+        printf("%s-----------------------------------------------------\n", ranked ? "------" : "");
+    }
+    for (int j = 0; j < n; j++) {
+        int idx = find_product_index_by_id(totals[j].product_id);
+        const char *name = idx >= 0 ? products[idx].name : "(deleted)";
+        if (w.json) {
+            json_begin(&w, "product_total");
+            if (ranked) json_int(&w, "rank", j + 1);
+            json_int(&w, "product_id", totals[j].product_id);
+            json_text(&w, "name", name);
+            json_int(&w, "qty", totals[j].qty);
+            json_money(&w, "revenue", totals[j].revenue);
+            json_end(&w);
+            continue;
+        }
+        if (ranked) {
+            csv_put_int_column(&w, j + 1, -5);
+            csv_put_char(&w, ' ');
+        }
+        csv_put_int_column(&w, totals[j].product_id, -3);
+        csv_put_char(&w, ' ');
+        csv_put_column(&w, name, -32);
+        csv_put_char(&w, ' ');
+        csv_put_int_column(&w, totals[j].qty, 5);
+        csv_put_char(&w, ' ');
+        csv_put_money_column(&w, totals[j].revenue, 11);
+        csv_end_row(&w);
+    }
+    free(totals);
+
+    int total_qty;
+    Money total_revenue;
+    rollup_range(from_day, to_day, &total_qty, &total_revenue);
+    if (w.json) {
+        json_begin(&w, "total");
+        json_int(&w, "qty", total_qty);
+        json_money(&w, "revenue", total_revenue);
+        json_end(&w);
+    } else {
+        csv_put_raw(&w, "-----------------------------------------------------\nTotal items sold: ", 72);
+        csv_put_int(&w, total_qty);
+        csv_put_raw(&w, "\nTotal revenue: ", 16);
+        csv_put_money(&w, total_revenue);
+        csv_end_row(&w);
+    }
+    csv_writer_close(&w);
+
+    printf("Daily history for product ID (Enter to skip): ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int id = atoi(buf);
+    if (id > 0) {
+        csv_writer_console(&w);
+        if (!w.json) {
+            printf("Date          Qty     Revenue\n");
+            printf("-----------------------------\n");
+        }
+        LOWER_BOUND_DAY(day_totals, day_total_count, from_day, i);
+        for (; i < day_total_count && day_totals[i].day <= to_day; i++) {
+            const ProductDayTotal *e = product_day_find(day_totals[i].day, id);
+            if (e) day_row(&w, "product_day", e->day, id, e->qty, e->revenue);
+        }
+        csv_writer_close(&w);
+    }
+
+    printf("Show individual sales? (y/N): ");
+    if (!fgets(buf, BUFFER, stdin) || (buf[0] != 'y' && buf[0] != 'Y')) return;
+    csv_writer_console(&w);
+    ReportTotals t = {&w, 0, 0, to_day};
+    if (!w.json) {
+        printf("Date       ID Name                           Qty  Price   Total\n");
+        printf("----------------------------------------------------------------\n");
+    }
+    ledger_scan_from(from_day, report_visit, &t);
+    csv_writer_close(&w);
+}
+
+static void export_visit(const SaleRecord *r, void *ctx) {
+    CsvWriter *w = ctx;
+    csv_put_day(w, r->day);
+    csv_put_char(w, ',');
+    csv_put_int(w, r->product_id);
+    csv_put_char(w, ',');
+    csv_put_text(w, r->name);
+    csv_put_char(w, ',');
+    csv_put_int(w, r->qty);
+    csv_put_char(w, ',');
+    csv_put_money(w, r->price);
+    csv_put_char(w, ',');
+    csv_put_money(w, r->total);
+    csv_end_row(w);
+}
+
+// Writes the whole ledger as CSV; returns the number of sales or -1 on error.
+long long export_sales_csv_file(const char *path) {
+    CsvWriter w;
+    if (!csv_writer_open(&w, path)) return -1;
+    csv_put_raw(&w, "date,product_id,product_name,qty,price,total\n", 45);
+    long long n = ledger_scan_from(day_index_count ? day_index[0].day : 0, export_visit, &w);
+    return csv_writer_close(&w) ? n : -1;
+}
+
+// The ledger is the primary store; sales.csv is produced on demand.
+void export_sales_csv() {
+    if (export_sales_csv_file(SALES_FILE) < 0) perror("Export");
+    else printf("Exported to %s\n", SALES_FILE);
+}
+
+// Flushes everything the program keeps open; called on every way out.
+void close_stores() {
+    checkpoint();
+    rollup_save();
+    ledger_close();
+    stats_tick(1);
+}
+
+// Growable output buffer for building responses.
+typedef struct {
+    char *data;
+    size_t len, cap, sent;
+} OutBuf;
+
+static void out_reserve(OutBuf *o, size_t extra) {
+    if (o->len + extra <= o->cap) return;
+    size_t cap = o->cap ? o->cap : 4096;
+    while (cap < o->len + extra) cap *= 2;
+    char *d = realloc(o->data, cap);
+    if (!d) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    o->data = d;
+    o->cap = cap;
+}
+
+void out_printf(OutBuf *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    out_reserve(o, (size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(o->data + o->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    o->len += n;
+}
+
+typedef struct {
+    int fd;
+    int watching;       // subscribed to low-stock alerts
+    char *in;
+    size_t in_len, in_cap;
+    OutBuf out;
+} Conn;
+
+static int server_ep = -1;
+static Conn **watchers = NULL;
+static int watcher_count = 0, watcher_cap = 0;
+
+// Queues an alert line on every watching connection and arms EPOLLOUT for it.
+static void server_alert(const Product *p, int low) {
+    for (int i = 0; i < watcher_count; i++) {
+        Conn *w = watchers[i];
+        out_printf(&w->out, "ALERT %s %d %d %d\n", low ? "LOW" : "OK", p->id, p->stock, p->min_stock);
+        struct epoll_event ev = {EPOLLIN | EPOLLOUT, {.ptr = w}};
+        epoll_ctl(server_ep, EPOLL_CTL_MOD, w->fd, &ev);
+    }
+}
+
+// Server protocol: one request per line, answered in order, so clients may
+// pipeline as many requests as they like without waiting.
+//   PING                -> OK
+//   GET <id>            -> OK <id> <stock> <price> <name>
+//   SALE <id> <qty>     -> OK <remaining stock>
+//   LIST [LOW]          -> OK <n>, then n lines "<id> <stock> <price> <name>"
+//   REPORT <days>       -> OK <items sold> <revenue>
+//   TOP <days> [n] [REVENUE]
+//                       -> OK <k>, then k lines "<id> <qty> <revenue> <name>",
+//                          best sellers by units (or revenue) over the days
+//   WATCH               -> OK, then "ALERT LOW|OK <id> <stock> <min stock>"
+//                          whenever a product crosses its min stock level
+//   STATS               -> OK <k>, then k lines "<op> <count> <total ns> <p50 ns>
+//                          <p99 ns> <max ns> <bytes>"
+//   PRICE <id> [<time>] -> OK <price>, what the product cost at that unix time
+//                          (default now), deleted products included
+// Failures answer "ERR <reason>".
+void handle_request(Conn *c, char *line) {
+    OutBuf *out = &c->out;
+    char cmd[16], money[MONEY_LEN];
+    int a = 0, b = 0, n = sscanf(line, "%15s %d %d", cmd, &a, &b);
+    if (n < 1) {
+        out_printf(out, "ERR empty request\n");
+    } else if (strcmp(cmd, "PING") == 0) {
+        out_printf(out, "OK\n");
+    } else if (strcmp(cmd, "GET") == 0 && n == 2) {
+        int idx = find_product_index_by_id(a);
+        if (idx < 0) out_printf(out, "ERR not found\n");
+        else out_printf(out, "OK %d %d %s %s\n", products[idx].id, products[idx].stock,
+                        format_money(products[idx].price, money), products[idx].name);
+    } else if (strcmp(cmd, "PRICE") == 0 && n >= 2) {
+        long long at = time(NULL);
+        Money price;
+        sscanf(line, "%*s %*d %lld", &at);
+        if (!price_at(a, at, &price)) out_printf(out, "ERR no price\n");
+        else out_printf(out, "OK %s\n", format_money(price, money));
+    } else if (strcmp(cmd, "SALE") == 0 && n == 3) {
+        int remaining;
+        const char *err = sell_product(a, b, &remaining);
+        if (err) out_printf(out, "ERR %s\n", err);
+        else out_printf(out, "OK %d\n", remaining);
+    } else if (strcmp(cmd, "LIST") == 0 && strstr(line, "LOW")) {
+        out_printf(out, "OK %d\n", low_stock.count);
+        for (int i = low_stock.head; i >= 0; i = low_stock.next[i]) {
+            Product *p = &products[i];
+            out_printf(out, "%d %d %s %s\n", p->id, p->stock, format_money(p->price, money), p->name);
+        }
+    } else if (strcmp(cmd, "LIST") == 0) {
+        out_printf(out, "OK %d\n", product_count - tombstones);
+        for (int i = 0; i < product_count; i++) {
+            Product *p = &products[i];
+            if (!p->id) continue;
+            out_printf(out, "%d %d %s %s\n", p->id, p->stock, format_money(p->price, money), p->name);
+        }
+    } else if (strcmp(cmd, "WATCH") == 0) {
+        if (!c->watching && watcher_count == watcher_cap) {
+            int cap = watcher_cap ? watcher_cap * 2 : 16;
+            Conn **grown = realloc(watchers, sizeof(Conn *) * cap);
+            if (!grown) {
+                out_printf(out, "ERR out of memory\n");
+                return;
+            }
+            watchers = grown;
+            watcher_cap = cap;
+        }
+        if (!c->watching) {
+            watchers[watcher_count++] = c;
+            c->watching = 1;
+        }
+        out_printf(out, "OK\n");
+    } else if (strcmp(cmd, "REPORT") == 0 && n == 2 && a > 0) {
+        int today = day_number(time(NULL)), qty;
+        Money revenue;
+        rollup_range(today - (a - 1), today, &qty, &revenue);
+        out_printf(out, "OK %d %s\n", qty, format_money(revenue, money));
+    } else if (strcmp(cmd, "TOP") == 0 && n >= 2 && a > 0) {
+        ProductTotal top[SERVER_MAX_TOP];
+        int today = day_number(time(NULL));
+        int want = n == 3 && b > 0 ? (b < SERVER_MAX_TOP ? b : SERVER_MAX_TOP) : TOP_DEFAULT;
+        int k = top_products(today - (a - 1), today, strstr(line, "REVENUE") != NULL, top, want);
+        out_printf(out, "OK %d\n", k);
+        for (int i = 0; i < k; i++) {
+            int idx = find_product_index_by_id(top[i].product_id);
+            out_printf(out, "%d %lld %s %s\n", top[i].product_id, top[i].qty, format_money(top[i].revenue, money),
+                       idx >= 0 ? products[idx].name : "(deleted)");
+        }
+    } else if (strcmp(cmd, "STATS") == 0) {
+        double ns_per_tick = stat_ns_per_tick();
+        out_printf(out, "OK %d\n", STAT_OPS);
+        for (int op = 0; op < STAT_OPS; op++) {
+            const OpStats *s = &op_stats[op];
+            long long p50 = s->count ? stat_quantile(s, 0.5) : 0, p99 = s->count ? stat_quantile(s, 0.99) : 0;
+            out_printf(out, "%s %lld %lld %lld %lld %lld %lld\n", stat_names[op], s->count,
+                       (long long)(s->total * ns_per_tick), (long long)(p50 * ns_per_tick),
+                       (long long)(p99 * ns_per_tick), (long long)(s->max * ns_per_tick), s->bytes);
+        }
+    } else {
+        out_printf(out, "ERR bad request\n");
+    }
+}
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// "unix:/path" or "tcp:port" (TCP listens on 127.0.0.1 only) -> socket address.
+static int parse_address(const char *addr, struct sockaddr_storage *ss, socklen_t *len) {
+    memset(ss, 0, sizeof(*ss));
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)ss;
+        un->sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof(un->sun_path)) return 0;
+        strcpy(un->sun_path, addr + 5);
+        *len = sizeof(*un);
+        return 1;
+    }
+    if (strncmp(addr, "tcp:", 4) == 0) {
+        struct sockaddr_in *in = (struct sockaddr_in *)ss;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((unsigned short)atoi(addr + 4));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *len = sizeof(*in);
+        return 1;
+    }
+    return 0;
+}
+
+static void conn_close(int ep, Conn *c) {
+    for (int i = 0; c->watching && i < watcher_count; i++)
+        if (watchers[i] == c) watchers[i] = watchers[--watcher_count];
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out.data);
+    free(c);
+}
+
+// Writes queued output; returns 0 if the connection failed.
+static int conn_flush(int ep, Conn *c) {
+    while (c->out.sent < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out.sent, c->out.len - c->out.sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return 0;
+        c->out.sent += n;
+    }
+    struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+    if (c->out.sent == c->out.len) c->out.len = c->out.sent = 0;
+    else ev.events |= EPOLLOUT;
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    return 1;
+}
+
+// Reads what is available and answers every complete request line in it.
+static int conn_read(Conn *c) {
+    for (;;) {
+        if (c->in_cap - c->in_len < SERVER_READ_CHUNK) {
+            size_t cap = c->in_cap ? c->in_cap * 2 : SERVER_READ_CHUNK * 2;
+            char *in = realloc(c->in, cap);
+            if (!in) return 0;
+            c->in = in;
+            c->in_cap = cap;
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return 0;
+        c->in_len += n;
+        if (n < SERVER_READ_CHUNK) break;
+    }
+    char *start = c->in, *end = c->in + c->in_len, *nl;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        *nl = 0;
+        if (nl > start && nl[-1] == '\r') nl[-1] = 0;
+        handle_request(c, start);
+        start = nl + 1;
+    }
+    c->in_len = end - start;
+    memmove(c->in, start, c->in_len);
+    return c->in_len <= SERVER_MAX_REQUEST;
+}
+
+// Serves the catalog to many clients from one process with an epoll loop.
+// Unsynced log records are fsynced whenever the loop goes idle.
+int serve(const char *addr) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    if (!parse_address(addr, &ss, &len)) {
+        fprintf(stderr, "Address must be unix:/path or tcp:port\n");
+        return 1;
+    }
+    int lfd = socket(ss.ss_family, SOCK_STREAM, 0), one = 1;
+    if (ss.ss_family == AF_UNIX) unlink(((struct sockaddr_un *)&ss)->sun_path);
+    else setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&ss, len) != 0 || listen(lfd, 128) != 0) {
+        perror("Listen");
+        return 1;
+    }
+    int ep = epoll_create1(0);
+    struct epoll_event ev = {EPOLLIN, {.ptr = NULL}}, events[SERVER_MAX_EVENTS];
+    if (!set_nonblocking(lfd) || ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev) != 0) {
+        perror("Listen");
+        return 1;
+    }
+    server_ep = ep;
+    low_stock_alert = server_alert;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+    printf("Serving %d products on %s\n", product_count - tombstones, addr);
+    fflush(stdout);
+
+    while (!server_stop) {
+        int n = epoll_wait(ep, events, SERVER_MAX_EVENTS, WAL_GROUP_COMMIT_MS);
+        stats_tick(0);
+        compact_tick();
+        if (n <= 0) {
+            wal_sync();
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (!c) {
+                int fd;
+                while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                    // a connection that cannot be set up is dropped; the rest carry on
+                    Conn *nc = set_nonblocking(fd) ? calloc(1, sizeof(Conn)) : NULL;
+                    struct epoll_event cev = {EPOLLIN, {.ptr = nc}};
+                    if (nc) nc->fd = fd;
+                    if (!nc || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev) != 0) {
+                        free(nc);
+                        close(fd);
+                        continue;
+                    }
+                    if (ss.ss_family == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                }
+                continue;
+            }
+            int ok = 1;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ok = conn_read(c);
+            if (ok) ok = conn_flush(ep, c);
+            if (!ok) conn_close(ep, c);
+        }
+    }
+    close(lfd);
+    if (ss.ss_family == AF_UNIX) unlink(((struct sockaddr_un *)&ss)->sun_path);
+    close_stores();
+    printf("Server stopped.\n");
+    return 0;
+}
 
-#define PRODUCTS_FILE "products.dat"
-#define SALES_FILE "sales.csv"
-#define MAX_PRODUCTS 1000
-#define NAME_LEN 64
-#define BUFFER 128
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-typedef struct {
-    int id;
-    char name[NAME_LEN];
-    double price;
-    int stock;
-} Product;
+// Load generator: `conns` connections each send `requests` requests, keeping up
+// to `depth` in flight. sale_pct percent are SALE 1 unit, the rest GET; ids are
+// drawn from 1..max_id. Prints throughput and latency percentiles.
+int loadgen(const char *addr, int conns, int requests, int depth, int sale_pct, int max_id) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    if (!parse_address(addr, &ss, &len) || conns <= 0 || requests <= 0 || depth <= 0 || max_id <= 0) {
+        fprintf(stderr, "usage: --loadgen unix:/path|tcp:port [conns] [requests/conn] [depth] [sale%%] [max id]\n");
+        return 1;
+    }
+    typedef struct {
+        int fd, sent, received;
+        double *sent_at;    // ring of send times, depth entries
+        char buf[65536];
+        size_t buf_len;
+    } Client;
+    Client *cl = calloc(conns, sizeof(Client));
+    double *lat = malloc(sizeof(double) * (size_t)conns * requests);
+    long nlat = 0, errors = 0;
+    int ep = epoll_create1(0), one = 1;
+    unsigned seed = 99;
+    if (!cl || !lat) return 1;
 
-Product products[MAX_PRODUCTS];
-int product_count = 0;
+    for (int i = 0; i < conns; i++) {
+        cl[i].fd = socket(ss.ss_family, SOCK_STREAM, 0);
+        if (connect(cl[i].fd, (struct sockaddr *)&ss, len) != 0) {
+            perror("Connect");
+            return 1;
+        }
+        if (ss.ss_family == AF_INET) setsockopt(cl[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        cl[i].sent_at = malloc(sizeof(double) * depth);
+        struct epoll_event ev = {EPOLLIN, {.ptr = &cl[i]}};
+        epoll_ctl(ep, EPOLL_CTL_ADD, cl[i].fd, &ev);
+    }
 
-void trim_newline(char *s) {
-    size_t l = strlen(s);
-    if (l && s[l - 1] == '\n')
-        s[l - 1] = 0;
+    double t0 = now_sec();
+    int done = 0;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    for (int i = 0; i < conns; i++) cl[i].sent = -1; // marks "needs initial window"
+    while (done < conns) {
+        // top up every client's window of outstanding requests
+        for (int i = 0; i < conns; i++) {
+            Client *c = &cl[i];
+            if (c->sent < 0) c->sent = 0;
+            char req[64 * 32];
+            size_t rl = 0;
+            while (c->sent < requests && c->sent - c->received < depth && rl < sizeof(req) - 64) {
+                seed = seed * 1103515245u + 12345u;
+                int id = 1 + (int)((seed >> 8) % (unsigned)max_id);
+                if ((int)((seed >> 4) % 100) < sale_pct) rl += sprintf(req + rl, "SALE %d 1\n", id);
+                else rl += sprintf(req + rl, "GET %d\n", id);
+                c->sent_at[c->sent % depth] = now_sec();
+                c->sent++;
+            }
+            if (rl && write(c->fd, req, rl) != (ssize_t)rl) {
+                perror("Send");
+                return 1;
+            }
+        }
+        int n = epoll_wait(ep, events, SERVER_MAX_EVENTS, 1000);
+        for (int e = 0; e < n; e++) {
+            Client *c = events[e].data.ptr;
+            ssize_t r = read(c->fd, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len);
+            if (r <= 0) {
+                fprintf(stderr, "Server closed the connection\n");
+                return 1;
+            }
+            c->buf_len += r;
+            char *start = c->buf, *end = c->buf + c->buf_len, *nl;
+            double now = now_sec();
+            while ((nl = memchr(start, '\n', end - start)) != NULL) {
+                if (start[0] == 'E') errors++;
+                lat[nlat++] = now - c->sent_at[c->received % depth];
+                c->received++;
+                start = nl + 1;
+            }
+            c->buf_len = end - start;
+            memmove(c->buf, start, c->buf_len);
+            if (c->received == requests) done++;
+        }
+    }
+    double elapsed = now_sec() - t0;
+    qsort(lat, nlat, sizeof(double), cmp_double);
+    printf("%ld requests over %d connections (depth %d) in %.2fs\n", nlat, conns, depth, elapsed);
+    printf("throughput: %.0f req/s\n", nlat / elapsed);
+    printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n", lat[nlat / 2] * 1e6,
+           lat[(long)(nlat * 0.99)] * 1e6, lat[nlat - 1] * 1e6);
+    printf("errors: %ld\n", errors);
+    for (int i = 0; i < conns; i++) {
+        close(cl[i].fd);
+        free(cl[i].sent_at);
+    }
+    free(cl);
+    free(lat);
+    return 0;
 }
 
-int load_products() {
-    FILE *f = fopen(PRODUCTS_FILE, "rb");
-    if (!f) return 0;
-    if (fread(&product_count, sizeof(int), 1, f) != 1) {
-        fclose(f);
-        return 0;
+// Lookup micro-benchmark: linear scan vs hash index on synthetic catalogs.
+void bench_lookup() {
+    int sizes[] = {1000, 100000, 1000000};
+    printf("%-9s %16s %16s %9s\n", "products", "linear lookups/s", "index lookups/s", "speedup");
+    for (int s = 0; s < 3; s++) {
+        int n = sizes[s];
+        Product *arr = malloc(sizeof(Product) * n);
+        IdIndex ix = {NULL, 0, 0};
+        if (!arr) {
+            perror("bench");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            arr[i].id = i * 3 + 1; // sparse ids, as after deletes
+            arr[i].stock = i;
+        }
+        index_build(&ix, arr, n);
+
+        unsigned seed = 12345;
+        long linear_ops = 20000000L / n + 100, found = 0;
+        double t0 = now_sec();
+        for (long k = 0; k < linear_ops; k++) {
+            seed = seed * 1103515245u + 12345u;
+            int id = (int)(seed % (unsigned)n) * 3 + 1;
+            for (int i = 0; i < n; i++)
+                if (arr[i].id == id) { found += i; break; }
+        }
+        double linear = linear_ops / (now_sec() - t0);
+
+        long index_ops = 10000000L;
+        t0 = now_sec();
+        for (long k = 0; k < index_ops; k++) {
+            seed = seed * 1103515245u + 12345u;
+            found += index_find(&ix, arr, (int)(seed % (unsigned)n) * 3 + 1);
+        }
+        double indexed = index_ops / (now_sec() - t0);
+
+        printf("%-9d %16.0f %16.0f %8.1fx\n", n, linear, indexed, indexed / linear);
+        if (found == -1) printf("\n"); // keep the loops from being optimised away
+        index_free(&ix);
+        free(arr);
     }
-    if (product_count > MAX_PRODUCTS) {
-        fclose(f);
-        return 0;
+}
+
+static void bench_visit(const SaleRecord *r, void *ctx) {
+    ReportTotals *t = ctx;
+    t->total_qty += r->qty;
+    t->total_revenue += r->total;
+}
+
+// Opens a fresh ledger at dir/bench_sales.* and fills it with `rows` sales
+// spread evenly over the span_days days up to now.
+static int bench_fill_ledger(const char *dir, long long rows, int span_days) {
+    char path[512], index_path[512];
+    snprintf(path, sizeof(path), "%s/bench_sales.ledger", dir);
+    snprintf(index_path, sizeof(index_path), "%s/bench_sales.idx", dir);
+    unlink(path);
+    unlink(index_path);
+    if (!ledger_open(path, index_path, 0)) return 0;
+
+    time_t end = time(NULL), start = end - (time_t)span_days * 24 * 3600;
+    SaleRecord *batch = malloc(sizeof(SaleRecord) * LEDGER_READ_BATCH);
+    if (!batch) return 0;
+    double t0 = now_sec();
+    unsigned seed = 42;
+    for (long long pos = 0; pos < rows;) {
+        int n = 0;
+        for (; n < LEDGER_READ_BATCH && pos + n < rows; n++) {
+            seed = seed * 1103515245u + 12345u;
+            time_t t = start + (time_t)((double)(pos + n) / rows * (end - start));
+            make_sale_record(&batch[n], t, (int)(seed >> 8) % 5000 + 1, "bench item", (int)(seed >> 4) % 5 + 1, 250);
+            ledger_index_record(&batch[n], pos + n, 1);
+        }
+        size_t len = sizeof(SaleRecord) * n;
+        if (pwrite(ledger_fd, batch, len, ledger_offset(pos)) != (ssize_t)len) {
+            perror("bench");
+            break;
+        }
+        pos += n;
+        ledger_count = pos;
     }
-    fread(products, sizeof(Product), product_count, f);
-    fclose(f);
+    free(batch);
+    printf("wrote %lld rows (%lld MB) in %.2fs\n", ledger_count,
+           (long long)ledger_offset(ledger_count) >> 20, now_sec() - t0);
     return 1;
 }
 
-int save_products() {
-    FILE *f = fopen(PRODUCTS_FILE, "wb");
-    if (!f) {
-        perror("Save products");
-        return 0;
+static void bench_remove_ledger(const char *dir) {
+    char path[512];
+    ledger_close();
+    snprintf(path, sizeof(path), "%s/bench_sales.ledger", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/bench_sales.idx", dir);
+    unlink(path);
+}
+
+// Builds a 10M-row ledger spread over a year and times "last N days" reports
+// against a full scan of the same file.
+void bench_ledger(const char *dir) {
+    const int span_days = 365;
+    if (!bench_fill_ledger(dir, 10000000LL, span_days)) return;
+    time_t end = time(NULL);
+    double t0;
+
+    int ranges[] = {1, 7, 30, span_days + 1};
+    printf("%-6s %12s %12s %12s\n", "days", "rows", "indexed ms", "scan ms");
+    for (int i = 0; i < 4; i++) {
+        int from_day = day_number(end) - (ranges[i] - 1);
+        ReportTotals a = {0, 0, 0, INT_MAX}, b = {0, 0, 0, INT_MAX};
+        t0 = now_sec();
+        long long hit = ledger_scan_from(from_day, bench_visit, &a);
+        double indexed = now_sec() - t0;
+
+        // baseline: read every record and filter, as the CSV report did
+        t0 = now_sec();
+        ledger_scan(0, from_day, bench_visit, &b);
+        double scan = now_sec() - t0;
+
+        printf("%-6d %12lld %12.1f %12.1f%s\n", ranges[i], hit, indexed * 1000, scan * 1000,
+               a.total_qty == b.total_qty ? "" : "  MISMATCH");
     }
-    fwrite(&product_count, sizeof(int), 1, f);
-    fwrite(products, sizeof(Product), product_count, f);
-    fclose(f);
-    return 1;
+    bench_remove_ledger(dir);
 }
 
-int find_product_index_by_id(int id) {
-    for (int i = 0; i < product_count; i++)
-        if (products[i].id == id) return i;
-    return -1;
+static void bench_rollup_visit(const SaleRecord *r, void *ctx) {
+    (void)ctx;
+    rollup_add(r);
 }
 
-int next_id() {
-    int m = 0;
-    for (int i = 0; i < product_count; i++)
-        if (products[i].id > m) m = products[i].id;
-    return m + 1;
+static int same_sums(const ProductDayTotal *a, const ProductDayTotal *b, int n) {
+    for (int i = 0; i < n; i++)
+        if (a[i].day != b[i].day || a[i].product_id != b[i].product_id || a[i].qty != b[i].qty
+            || a[i].revenue != b[i].revenue)
+            return 0;
+    return 1;
 }
 
-void list_products(int show_low_only) {
-    printf("ID  Name                             Price    Stock  Low\n");
-    printf("--------------------------------------------------------\n");
-    for (int i = 0; i < product_count; i++) {
-        Product *p = &products[i];
-        int low = (p->stock <= 5);
-        if (show_low_only && !low) continue;
-        printf("%-3d %-32s %7.2f %7d   %s\n", p->id, p->name, p->price, p->stock, low ? "YES" : "");
+// Times ledger_aggregate over a `rows`-row ledger with 1 to max_threads
+// threads, checking every result against the one-record-at-a-time rollup path.
+void bench_parallel(long long rows, const char *dir, int max_threads) {
+    if (!bench_fill_ledger(dir, rows, 365)) return;
+    double t0 = now_sec();
+    rollup_reset();
+    ledger_scan(0, INT_MIN, bench_rollup_visit, NULL);
+    double serial = now_sec() - t0;
+    ProductDayTotal *expected = malloc(sizeof(ProductDayTotal) * (pd_count ? pd_count : 1));
+    if (!expected) return;
+    int expected_count = pd_count;
+    memcpy(expected, pd_totals, sizeof(ProductDayTotal) * pd_count);
+    qsort(expected, expected_count, sizeof(ProductDayTotal), cmp_day_product);
+    printf("%ld CPUs online; serial rollup_add scan %.1f ms\n", sysconf(_SC_NPROCESSORS_ONLN), serial * 1000);
+    printf("%-8s %12s %9s\n", "threads", "ms", "speedup");
+    double one = 0;
+    for (int threads = 1;; threads = threads * 2 > max_threads ? max_threads : threads * 2) {
+        report_threads = threads;
+        double best = 0;
+        int same = 1;
+        for (int round = 0; round < 3; round++) {
+            ProductDayTotal *sums;
+            t0 = now_sec();
+            int n = ledger_aggregate(0, INT_MIN, INT_MAX, &sums);
+            double elapsed = now_sec() - t0;
+            best = round == 0 || elapsed < best ? elapsed : best;
+            same = same && n == expected_count && same_sums(sums, expected, n);
+            free(sums);
+        }
+        if (threads == 1) one = best;
+        printf("%-8d %12.1f %8.2fx%s\n", threads, best * 1000, one / best, same ? "" : "  MISMATCH");
+        if (threads >= max_threads) break;
     }
+    report_threads = 0;
+    free(expected);
+    bench_remove_ledger(dir);
 }
 
-void add_product() {
-    if (product_count >= MAX_PRODUCTS) {
-        printf("Product limit reached.\n");
+// Writes and reads `rows` sales as CSV both the old way (fprintf per row,
+// fgets + sscanf) and with CsvWriter/CsvReader, and prints MB/s. Some names
+// hold commas and quotes; the old parser's losses are reported as "bad".
+void bench_csv(long long rows, const char *dir) {
+    static const char *names[] = {"Widget", "Bolt, 5mm", "12\" ruler", "Tape \"Pro\", wide", "Glue"};
+    enum { POOL = 4096 };
+    char old_path[512], new_path[512];
+    snprintf(old_path, sizeof(old_path), "%s/bench_sales_old.csv", dir);
+    snprintf(new_path, sizeof(new_path), "%s/bench_sales_new.csv", dir);
+    SaleRecord *pool = malloc(sizeof(SaleRecord) * POOL);
+    if (!pool) return;
+    time_t start = time(NULL) - 365 * 24 * 3600;
+    unsigned seed = 42;
+    Money expected = 0;
+    for (int i = 0; i < POOL; i++) {
+        seed = seed * 1103515245u + 12345u;
+        make_sale_record(&pool[i], start + (time_t)i * 7700, (int)(seed >> 8) % 5000 + 1, names[i % 5],
+                         (int)(seed >> 4) % 5 + 1, 99 + (seed >> 12) % 10000);
+    }
+    for (long long i = 0; i < rows; i++) expected += pool[i % POOL].total;
+    int first_day = day_number(start);
+
+    double t0 = now_sec();
+    FILE *f = fopen(old_path, "w");
+    if (!f) {
+        perror("bench");
+        free(pool);
         return;
     }
-    char buf[BUFFER];
-    Product p;
-    p.id = next_id();
+    fprintf(f, "date,product_id,product_name,qty,price,total\n");
+    for (long long i = 0; i < rows; i++) {
+        const SaleRecord *r = &pool[i % POOL];
+        char date[32], price[MONEY_LEN], total[MONEY_LEN];
+        format_day(first_day + (int)(i * 365 / rows), date, sizeof(date));
+        fprintf(f, "%s,%d,\"%s\",%d,%s,%s\n", date, r->product_id, r->name, r->qty, format_money(r->price, price),
+                format_money(r->total, total));
+    }
+    fclose(f);
+    double old_write = now_sec() - t0;
 
-    printf("Name: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    trim_newline(buf);
-    strncpy(p.name, buf, NAME_LEN - 1);
-    p.name[NAME_LEN - 1] = 0;
+    t0 = now_sec();
+    CsvWriter w;
+    if (!csv_writer_open(&w, new_path)) {
+        perror("bench");
+        free(pool);
+        return;
+    }
+    csv_put_raw(&w, "date,product_id,product_name,qty,price,total\n", 45);
+    for (long long i = 0; i < rows; i++) {
+        // a year of sales in time order, as the ledger holds them
+        pool[i % POOL].day = first_day + (int)(i * 365 / rows);
+        export_visit(&pool[i % POOL], &w);
+    }
+    csv_writer_close(&w);
+    double new_write = now_sec() - t0;
 
-    printf("Price: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    p.price = atof(buf);
+    struct stat st;
+    double old_mb = stat(old_path, &st) == 0 ? st.st_size / 1e6 : 0;
+    double mb = stat(new_path, &st) == 0 ? st.st_size / 1e6 : 0;
 
-    printf("Stock: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    p.stock = atoi(buf);
+    // the old import loop, over the file the old export wrote
+    t0 = now_sec();
+    long long old_rows = 0;
+    Money old_sum = 0;
+    f = fopen(old_path, "r");
+    char line[512];
+    if (f && fgets(line, sizeof(line), f)) {
+        while (fgets(line, sizeof(line), f)) {
+            char date[32], name[128], price_text[32], total_text[32];
+            int id, qty;
+            Money price, total;
+            if (sscanf(line, "%31[^,],%d,\"%127[^\"]\",%d,%31[^,],%31s", date, &id, name, &qty, price_text,
+                       total_text) != 6
+                || !parse_money(price_text, &price) || !parse_money(total_text, &total) || parse_date(date) == 0)
+                continue;
+            old_rows++;
+            old_sum += total;
+        }
+    }
+    if (f) fclose(f);
+    double old_read = now_sec() - t0;
 
-    products[product_count++] = p;
-    save_products();
-    printf("Added product ID %d.\n", p.id);
+    t0 = now_sec();
+    long long new_rows = 0, bad = 0;
+    Money new_sum = 0;
+    CsvReader r;
+    if (csv_reader_open(&r, new_path)) {
+        CsvDateCache dc = {{0}, 0, 0};
+        CsvField fields[6];
+        SaleRecord rec;
+        int n;
+        csv_read_row(&r, fields, 6); // header
+        while ((n = csv_read_row(&r, fields, 6)) != 0) {
+            if (n > 0 && csv_sale_record(fields, n, &rec, &dc)) {
+                new_rows++;
+                new_sum += rec.total;
+            } else {
+                bad++;
+            }
+        }
+        csv_reader_close(&r);
+    }
+    double new_read = now_sec() - t0;
+
+    printf("%lld rows, %.1f MB (old format %.1f MB)\n", rows, mb, old_mb);
+    printf("%-22s %10s %10s %12s\n", "", "seconds", "MB/s", "bad rows");
+    printf("%-22s %10.2f %10.0f\n", "write fprintf", old_write, old_mb / old_write);
+    printf("%-22s %10.2f %10.0f\n", "write CsvWriter", new_write, mb / new_write);
+    printf("%-22s %10.2f %10.0f %12lld%s\n", "read fgets+sscanf", old_read, old_mb / old_read, rows - old_rows,
+           old_sum == expected ? "" : "  (total wrong)");
+    printf("%-22s %10.2f %10.0f %12lld%s\n", "read CsvReader", new_read, mb / new_read, bad + rows - new_rows,
+           new_sum == expected ? "" : "  (total wrong)");
+    free(pool);
+    unlink(old_path);
+    unlink(new_path);
 }
 
-void update_product() {
-    char buf[BUFFER];
-    printf("Enter product ID to update: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    int id = atoi(buf);
-    int idx = find_product_index_by_id(id);
-    if (idx < 0) {
-        printf("Not found.\n");
-        return;
+static int cmp_product_day(const void *a, const void *b) {
+    const ProductDayTotal *x = a, *y = b;
+    return (x->product_id > y->product_id) - (x->product_id < y->product_id);
+}
+
+static int cmp_revenue(const void *a, const void *b) {
+    const ProductTotal *x = a, *y = b;
+    return ranks_above(x, y, 1) ? -1 : ranks_above(y, x, 1);
+}
+
+// Folds `sales` synthetic sales over a year (5000 products, skewed towards low
+// ids) into the rollups, then times top-10 by revenue with the hash + heap
+// engine against sorting the range by product and then by revenue.
+void bench_top(long long sales) {
+    const int span_days = 365;
+    int today = day_number(time(NULL));
+    unsigned seed = 11;
+    SaleRecord r;
+    memset(&r, 0, sizeof(r));
+    double t0 = now_sec();
+    for (long long i = 0; i < sales; i++) {
+        seed = seed * 1103515245u + 12345u;
+        r.day = today - span_days + 1 + (int)(i * span_days / sales);
+        r.product_id = (int)((seed >> 4) % 5000 * ((seed >> 17) % 5000 + 1) / 5000) + 1;
+        r.qty = (int)(seed >> 9) % 5 + 1;
+        r.price = r.product_id * 37 % 2000 + 1;
+        r.total = r.price * r.qty;
+        rollup_add(&r);
     }
-    Product *p = &products[idx];
+    printf("%lld sales, %d product-day rollups, built in %.1fs\n", sales, pd_count, now_sec() - t0);
 
-    printf("Current name: %s\nNew name (leave empty to keep): ", p->name);
-    if (!fgets(buf, BUFFER, stdin)) return;
-    trim_newline(buf);
-    if (strlen(buf)) strncpy(p->name, buf, NAME_LEN - 1);
+    int ranges[] = {1, 7, 30, span_days};
+    printf("%-6s %10s %14s %14s\n", "days", "entries", "heap ms", "sort ms");
+    for (int k = 0; k < 4; k++) {
+        int from_day = today - (ranges[k] - 1), first;
+        ProductTotal top[TOP_DEFAULT];
+        t0 = now_sec();
+        int kept = top_products(from_day, today, 1, top, TOP_DEFAULT);
+        double heap = now_sec() - t0;
 
-    printf("Current price: %.2f\nNew price (leave empty to keep): ", p->price);
-    if (!fgets(buf, BUFFER, stdin)) return;
-    trim_newline(buf);
-    if (strlen(buf)) p->price = atof(buf);
+        // baseline: copy the range, sort by product, sum each run, sort by revenue
+        t0 = now_sec();
+        LOWER_BOUND_DAY(pd_totals, pd_count, from_day, first);
+        int n = pd_count - first, groups = 0;
+        ProductDayTotal *copy = malloc(sizeof(ProductDayTotal) * (n ? n : 1));
+        ProductTotal *sums = malloc(sizeof(ProductTotal) * (n ? n : 1));
+        if (!copy || !sums) return;
+        memcpy(copy, &pd_totals[first], sizeof(ProductDayTotal) * n);
+        qsort(copy, n, sizeof(ProductDayTotal), cmp_product_day);
+        for (int j = 0; j < n; groups++) {
+            sums[groups].product_id = copy[j].product_id;
+            sums[groups].qty = 0;
+            sums[groups].revenue = 0;
+            for (; j < n && copy[j].product_id == sums[groups].product_id; j++) {
+                sums[groups].qty += copy[j].qty;
+                sums[groups].revenue += copy[j].revenue;
+            }
+        }
+        qsort(sums, groups, sizeof(ProductTotal), cmp_revenue);
+        double sorted = now_sec() - t0;
 
-    printf("Current stock: %d\nNew stock (leave empty to keep): ", p->stock);
-    if (!fgets(buf, BUFFER, stdin)) return;
-    trim_newline(buf);
-    if (strlen(buf)) p->stock = atoi(buf);
+        int same = kept == (groups < TOP_DEFAULT ? groups : TOP_DEFAULT);
+        for (int j = 0; same && j < kept; j++)
+            same = top[j].product_id == sums[j].product_id && top[j].revenue == sums[j].revenue;
+        printf("%-6d %10d %14.3f %14.3f%s\n", ranges[k], n, heap * 1000, sorted * 1000, same ? "" : "  MISMATCH");
+        free(copy);
+        free(sums);
+    }
+}
 
-    save_products();
-    printf("Product updated.\n");
+// Benchmark suite: synthetic catalogs of growing size, sales drawn from a Zipf
+// distribution over products (a few best sellers, a long tail) and a sales
+// history whose timestamps follow a weekly and a diurnal curve. Each catalog is
+// put through lookups, sales, a checkpoint and reload, the daily revenue view
+// and the report queries. Results go to stdout as JSON lines, one per
+// operation and catalog size, so runs can be stored and compared; progress
+// goes to stderr. Everything runs in a scratch directory made under dir.
+typedef struct {
+    double *cdf;        // cdf[k] = P(rank <= k)
+    int *slot;          // rank -> product slot, so best sellers are spread out
+    int n;
+} Zipf;
+
+static unsigned long long bench_next(unsigned long long *state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
 }
 
-void delete_product() {
-    char buf[BUFFER];
-    printf("Enter product ID to delete: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    int id = atoi(buf);
-    int idx = find_product_index_by_id(id);
-    if (idx < 0) {
-        printf("Not found.\n");
-        return;
+static double bench_uniform(unsigned long long *state) {
+    return (bench_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Classic Zipf (exponent 1): the product of rank k sells in proportion to 1/k.
+static int zipf_init(Zipf *z, int n, unsigned long long *state) {
+    z->n = n;
+    z->cdf = malloc(sizeof(double) * n);
+    z->slot = malloc(sizeof(int) * n);
+    if (!z->cdf || !z->slot) return 0;
+    double sum = 0;
+    for (int k = 0; k < n; k++) z->cdf[k] = sum += 1.0 / (k + 1);
+    for (int k = 0; k < n; k++) z->cdf[k] /= sum;
+    for (int k = 0; k < n; k++) z->slot[k] = k;
+    for (int k = n - 1; k > 0; k--) {
+        int j = (int)(bench_next(state) % (unsigned long long)(k + 1)), t = z->slot[k];
+        z->slot[k] = z->slot[j];
+        z->slot[j] = t;
     }
-    for (int i = idx; i < product_count - 1; i++)
-        products[i] = products[i + 1];
-    product_count--;
-    save_products();
-    printf("Deleted.\n");
+    return 1;
 }
 
-void get_date_str(time_t t, char *out, size_t n) {
-    struct tm tm = *localtime(&t);
-    strftime(out, n, "%Y-%m-%d", &tm);
+static void zipf_free(Zipf *z) {
+    free(z->cdf);
+    free(z->slot);
 }
 
-time_t parse_date(const char *s) {
-    struct tm tm = {0};
-#if defined(_XOPEN_SOURCE) || defined(_GNU_SOURCE)
-    if (strptime(s, "%Y-%m-%d", &tm) == NULL) return (time_t)0;
-#else
-    // Fallback if strptime not available (Windows)
-    sscanf(s, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday);
-    tm.tm_year -= 1900;
-    tm.tm_mon -= 1;
-#endif
-    return mktime(&tm);
+// A product slot, drawn by popularity.
+static int zipf_next(const Zipf *z, unsigned long long *state) {
+    double u = bench_uniform(state);
+    int lo = 0, hi = z->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (z->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return z->slot[lo];
 }
 
-void append_sale_csv(int product_id, const char *product_name, int qty, double price) {
-    FILE *f = fopen(SALES_FILE, "a");
-    if (!f) {
-        perror("Append sale");
-        return;
+// Relative sales by hour of day (quiet nights, lunch and after-work peaks) and
+// by weekday from Sunday (busier weekends).
+static const double diurnal_weight[24] = {0.2, 0.1, 0.1, 0.1, 0.1, 0.3, 0.8, 2, 4, 5, 6, 8,
+                                          10, 9, 7, 6, 7, 9, 10, 8, 6, 4, 2, 1};
+static const double weekday_weight[7] = {1.3, 0.9, 0.9, 1, 1, 1.2, 1.5};
+
+static int cmp_long_long(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// One result line: throughput over `ops` operations taking `seconds` and, if
+// lat holds samples, latency percentiles in nanoseconds (lat gets sorted).
+// Times and rates are whole numbers, in the same fields the POS suite writes.
+static void bench_result(CsvWriter *w, int products, const char *op, long long ops, double seconds, long long *lat,
+                         long long samples, long long bytes) {
+    json_begin(w, "result");
+    json_int(w, "products", products);
+    json_text(w, "op", op);
+    json_int(w, "ops", ops);
+    json_int(w, "elapsed_ns", (long long)(seconds * 1e9));
+    json_int(w, "ops_per_sec", seconds > 0 ? (long long)(ops / seconds) : 0);
+    if (samples > 0) {
+        qsort(lat, samples, sizeof(long long), cmp_long_long);
+        json_int(w, "p50_ns", lat[samples / 2]);
+        json_int(w, "p90_ns", lat[samples * 9 / 10]);
+        json_int(w, "p99_ns", lat[samples * 99 / 100]);
+        json_int(w, "p999_ns", lat[samples * 999 / 1000]);
+        json_int(w, "max_ns", lat[samples - 1]);
     }
-    char datestr[32];
-    get_date_str(time(NULL), datestr, sizeof(datestr));
-    double total = price * qty;
-    fprintf(f, "%s,%d,\"%s\",%d,%.2f,%.2f\n", datestr, product_id, product_name, qty, price, total);
-    fclose(f);
+    if (bytes > 0) json_int(w, "bytes", bytes);
+    json_end(w);
+    fprintf(stderr, "  %-26s %12.0f ops/s\n", op, seconds > 0 ? ops / seconds : 0);
 }
 
-void record_sale() {
-    char buf[BUFFER];
-    printf("Enter product ID: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    int id = atoi(buf);
-    int idx = find_product_index_by_id(id);
-    if (idx < 0) {
-        printf("Not found.\n");
-        return;
+static long long elapsed_ns(double since) {
+    return (long long)((now_sec() - since) * 1e9);
+}
+
+// Drops the catalog, log, ledger and rollups of the previous round.
+static void bench_suite_reset() {
+    if (wal_fd >= 0) close(wal_fd);
+    wal_fd = -1;
+    wal_records = wal_unsynced = 0;
+    ledger_close();
+    rollup_reset();
+    rollup_unsaved = 0;
+    free(products);
+    products = NULL;
+    product_count = product_capacity = last_id = 0;
+    free_slots.count = tombstones = 0;
+    index_ready = 0;
+    const char *files[] = {PRODUCTS_FILE, WAL_FILE, LEDGER_FILE, LEDGER_INDEX_FILE, ROLLUP_FILE};
+    for (int i = 0; i < 5; i++) unlink(files[i]);
+}
+
+// Fills the ledger and rollups with `rows` sales over the `days` days up to
+// today, spread over each day by diurnal_weight.
+static double bench_suite_history(const Zipf *z, long long rows, int days, unsigned long long *state) {
+    time_t now = time(NULL);
+    double week = 0, t0 = now_sec(), hour_cdf[24], sum = 0;
+    for (int h = 0; h < 24; h++) hour_cdf[h] = sum += diurnal_weight[h];
+    struct tm tm;
+    for (int d = 0; d < days; d++) {
+        time_t t = now - (time_t)(days - 1 - d) * 86400;
+        localtime_r(&t, &tm);
+        week += weekday_weight[tm.tm_wday];
     }
-    Product *p = &products[idx];
-    printf("Enter quantity sold: ");
-    if (!fgets(buf, BUFFER, stdin)) return;
-    int qty = atoi(buf);
-    if (qty <= 0) {
-        printf("Invalid qty.\n");
-        return;
+    SaleRecord rec;
+    long long done = 0;
+    for (int d = 0; d < days; d++) {
+        time_t t = now - (time_t)(days - 1 - d) * 86400;
+        localtime_r(&t, &tm);
+        long long today = d == days - 1 ? rows - done : (long long)(rows * weekday_weight[tm.tm_wday] / week);
+        long long per_hour[24] = {0};
+        for (long long i = 0; i < today; i++) {
+            double u = bench_uniform(state) * sum;
+            int h = 0;
+            while (h < 23 && hour_cdf[h] < u) h++;
+            per_hour[h]++;
+        }
+        for (int h = 0; h < 24; h++) {
+            struct tm at = tm;
+            at.tm_hour = h;
+            at.tm_min = at.tm_sec = 0;
+            at.tm_isdst = -1;
+            time_t start = mktime(&at);
+            for (long long i = 0; i < per_hour[h]; i++) {
+                Product *p = &products[zipf_next(z, state)];
+                make_sale_record(&rec, start + (time_t)(i * 3600 / per_hour[h]), p->id, p->name,
+                                 1 + (int)(bench_next(state) % 3), p->price);
+                if (!ledger_append(&rec)) return 0;
+                rollup_add(&rec);
+            }
+        }
+        done += today;
     }
-    if (qty > p->stock) {
-        printf("Insufficient stock (%d available).\n", p->stock);
-        return;
+    rollup_covered = ledger_count;
+    return now_sec() - t0;
+}
+
+static void bench_suite_round(CsvWriter *w, int n, long long history, int sells, unsigned long long *state) {
+    Zipf z;
+    fprintf(stderr, "%d products\n", n);
+    bench_suite_reset();
+    if (!load_products() || !wal_open() || !store_reserve(n)) exit(1);
+    for (int i = 0; i < n; i++) {
+        Product *p = &products[i];
+        memset(p, 0, sizeof(*p));
+        p->id = i + 1;
+        snprintf(p->name, NAME_LEN, "Item %d", i + 1);
+        p->price = 50 + (Money)(bench_next(state) % 20000);
+        p->stock = 1000000000;
+        p->min_stock = 10;
     }
-    p->stock -= qty;
-    append_sale_csv(p->id, p->name, qty, p->price);
-    save_products();
-    printf("Sale recorded. Remaining stock: %d\n", p->stock);
+    product_count = n;
+    rebuild_index();
+    low_stock_rebuild();
+    if (!zipf_init(&z, n, state)) {
+        perror("bench");
+        exit(1);
+    }
+
+    // lookups: throughput over a batch, then latency of individually timed ones
+    long long ops = 2000000, samples = 200000, found = 0;
+    long long *lat = malloc(sizeof(long long) * (samples > sells ? samples : sells));
+    int *ids = malloc(sizeof(int) * ops);
+    if (!lat || !ids) {
+        perror("bench");
+        exit(1);
+    }
+    for (long long i = 0; i < ops; i++) ids[i] = products[zipf_next(&z, state)].id;
+    double t0 = now_sec();
+    for (long long i = 0; i < ops; i++) found += find_product_index_by_id(ids[i]);
+    double seconds = now_sec() - t0;
+    for (long long i = 0; i < samples; i++) {
+        double s = now_sec();
+        found += find_product_index_by_id(ids[i]);
+        lat[i] = elapsed_ns(s);
+    }
+    if (found == -1) fprintf(stderr, "\n"); // keep the loops from being optimised away
+    bench_result(w, n, "find_product_index_by_id", ops, seconds, lat, samples, 0);
+    free(ids);
+
+    // sales history for the reports, then live sales on top of it
+    if (!ledger_open(LEDGER_FILE, LEDGER_INDEX_FILE, 0)) exit(1);
+    rollup_open();
+    seconds = bench_suite_history(&z, history, 90, state);
+    bench_result(w, n, "ledger_append+rollup_add", history, seconds, NULL, 0,
+                 history * (long long)sizeof(SaleRecord));
+
+    t0 = now_sec();
+    for (int i = 0; i < sells; i++) {
+        int remaining;
+        double s = now_sec();
+        if (sell_product(products[zipf_next(&z, state)].id, 1 + i % 3, &remaining)) exit(1);
+        lat[i] = elapsed_ns(s);
+    }
+    seconds = now_sec() - t0;
+    bench_result(w, n, "sell_product", sells, seconds, lat, sells, 0);
+
+    t0 = now_sec();
+    if (!checkpoint()) exit(1);
+    struct stat st;
+    long long bytes = stat(PRODUCTS_FILE, &st) == 0 ? (long long)st.st_size : 0;
+    bench_result(w, n, "save_products", 1, now_sec() - t0, NULL, 0, bytes);
+    free(products);
+    products = NULL;
+    product_count = product_capacity = 0;
+    index_ready = 0;
+    t0 = now_sec();
+    if (!load_products()) exit(1);
+    rebuild_index();
+    bench_result(w, n, "load_products", 1, now_sec() - t0, NULL, 0, bytes);
+    if (product_count != n) fprintf(stderr, "  reload MISMATCH: %d products\n", product_count);
+
+    // what the daily revenue view and the report menu run
+    int today = day_number(time(NULL)), qty, rounds = 1000;
+    Money revenue;
+    t0 = now_sec();
+    for (int i = 0; i < rounds; i++) {
+        double s = now_sec();
+        rollup_range(today, today, &qty, &revenue);
+        rollup_range(today - 6, today, &qty, &revenue);
+        rollup_range(today - 29, today, &qty, &revenue);
+        lat[i] = elapsed_ns(s);
+    }
+    bench_result(w, n, "daily_revenue", rounds, now_sec() - t0, lat, rounds, 0);
+
+    rounds = 50;
+    t0 = now_sec();
+    for (int i = 0; i < rounds; i++) {
+        ProductTotal top[TOP_DEFAULT];
+        double s = now_sec();
+        top_products(today - 29, today, i & 1, top, TOP_DEFAULT);
+        lat[i] = elapsed_ns(s);
+    }
+    bench_result(w, n, "report_top_30_days", rounds, now_sec() - t0, lat, rounds, 0);
+
+    CsvWriter sink;
+    if (!csv_writer_open(&sink, "/dev/null")) exit(1);
+    rounds = 5;
+    long long listed = 0;
+    t0 = now_sec();
+    for (int i = 0; i < rounds; i++) {
+        ReportTotals t = {&sink, 0, 0, today};
+        double s = now_sec();
+        listed += ledger_scan_from(today - 6, report_visit, &t);
+        lat[i] = elapsed_ns(s);
+    }
+    csv_writer_close(&sink);
+    bench_result(w, n, "report_sales_7_days", listed, now_sec() - t0, lat, rounds, 0);
+
+    free(lat);
+    zipf_free(&z);
 }
 
-void export_products_csv() {
-    FILE *f = fopen("products_export.csv", "w");
-    if (!f) {
-        perror("Export");
+void bench_suite(int max_products, long long history, int sells, const char *dir) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/shop-bench.XXXXXX", dir);
+    if (!mkdtemp(path) || chdir(path) != 0) {
+        perror(path);
         return;
     }
-    fprintf(f, "id,name,price,stock\n");
-    for (int i = 0; i < product_count; i++) {
-        fprintf(f, "%d,\"%s\",%.2f,%d\n", products[i].id, products[i].name, products[i].price, products[i].stock);
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    CsvWriter w;
+    csv_writer_console(&w);
+    w.json = 1;
+    json_begin(&w, "run");
+    json_text(&w, "program", "shop");
+    json_int(&w, "time", time(NULL));
+    json_int(&w, "max_products", max_products);
+    json_int(&w, "history_sales", history);
+    json_int(&w, "live_sales", sells);
+    json_int(&w, "zipf_exponent", 1);
+    json_end(&w);
+    for (int n = 1000; n <= max_products; n *= 10) bench_suite_round(&w, n, history, sells, &state);
+    bench_suite_reset();
+    csv_writer_close(&w);
+    if (chdir("..") == 0) rmdir(path);
+}
+
+static void price_version_row(CsvWriter *w, int id, const PriceRecord *v) {
+    if (w->json) {
+        json_begin(w, "price_version");
+        json_int(w, "id", id);
+        json_int(w, "since", v->since);
+        json_money(w, "price", v->price);
+        json_end(w);
+        return;
     }
-    fclose(f);
-    printf("Exported to products_export.csv\n");
+    char when[32] = "(before history)";
+    time_t t = (time_t)v->since;
+    if (v->since) strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    csv_put_column(w, when, -20);
+    csv_put_char(w, ' ');
+    csv_put_money_column(w, v->price, 9);
+    csv_put_char(w, '\n');
 }
 
-void generate_report() {
-    char buf[BUFFER];
-    printf("Report range in days (e.g., 1 for today, 7 for last 7 days): ");
+// Shows one product's price versions and its price on a given day, or the
+// whole catalog at the prices it had that day.
+void show_price_history() {
+    char buf[BUFFER], day_text[16];
+    printf("Product ID (leave empty for the whole catalog): ");
+    if (!fgets(buf, BUFFER, stdin)) return;
+    int id = atoi(buf);
+    printf("Date YYYY-MM-DD (leave empty for now): ");
     if (!fgets(buf, BUFFER, stdin)) return;
-    int days = atoi(buf);
-    if (days <= 0) {
-        printf("Invalid days.\n");
+    trim_newline(buf);
+    long long at = time(NULL);
+    if (strlen(buf)) {
+        time_t start = parse_date(buf);
+        if (!start) {
+            printf("Invalid date.\n");
+            return;
+        }
+        at = start + 24 * 3600 - 1; // prices set at any time that day count
+    }
+    int day = day_number((time_t)at);
+    format_day(day, day_text, sizeof(day_text));
+
+    CsvWriter w;
+    Money price;
+    csv_writer_console(&w);
+    if (!id) {
+        if (!w.json) {
+            csv_put_raw(&w, "ID  Name                                Then       Now\n", 55);
+            csv_put_raw(&w, "------------------------------------------------------\n", 55);
+        }
+        for (int i = 0; i < product_count; i++) {
+            const Product *p = &products[i];
+            if (!p->id || !price_at(p->id, at, &price)) continue;
+            if (w.json) {
+                json_begin(&w, "price");
+                json_int(&w, "id", p->id);
+                json_text(&w, "name", p->name);
+                json_day(&w, "day", day);
+                json_money(&w, "price", price);
+                json_money(&w, "current_price", p->price);
+                json_end(&w);
+                continue;
+            }
+            csv_put_int_column(&w, p->id, -3);
+            csv_put_char(&w, ' ');
+            csv_put_column(&w, p->name, -32);
+            csv_put_char(&w, ' ');
+            csv_put_money_column(&w, price, 7);
+            csv_put_char(&w, ' ');
+            csv_put_money_column(&w, p->price, 9);
+            csv_put_char(&w, '\n');
+        }
+        csv_writer_close(&w);
         return;
     }
-    FILE *f = fopen(SALES_FILE, "r");
-    if (!f) {
-        printf("No sales recorded yet.\n");
+
+    PriceChain *chain = price_chain(id, 0);
+    int idx = find_product_index_by_id(id);
+    if (!chain && idx < 0) {
+        csv_writer_close(&w);
+        printf("Not found.\n");
         return;
     }
-    time_t now = time(NULL);
-    time_t cutoff = now - (time_t)(days - 1) * 24 * 3600; // include today
-    char line[512];
-    double total_revenue = 0;
-    int total_qty = 0;
-
-    printf("Date       ID Name                           Qty  Price   Total\n");
-    printf("----------------------------------------------------------------\n");
-
-    // Skip header
-    fgets(line, sizeof(line), f);
-
-    while (fgets(line, sizeof(line), f)) {
-        char date[32], name[128];
-        int id, qty;
-        double price, total;
-        if (sscanf(line, "%31[^,],%d,\"%127[^\"]\",%d,%lf,%lf",
-                   date, &id, name, &qty, &price, &total) == 6) {
-            time_t sale_time = parse_date(date);
-            if (sale_time == 0) continue;
-
-            struct tm tm_cut = *localtime(&cutoff);
-            tm_cut.tm_hour = 0; tm_cut.tm_min = 0; tm_cut.tm_sec = 0;
-            time_t cutoff_start = mktime(&tm_cut);
-
-            if (sale_time >= cutoff_start) {
-                printf("%-10s %-3d %-30s %4d %7.2f %8.2f\n", date, id, name, qty, price, total);
-                total_qty += qty;
-                total_revenue += total;
-            }
+    if (!w.json) {
+        csv_put_raw(&w, "Since                    Price\n", 31);
+        csv_put_raw(&w, "------------------------------\n", 31);
+    }
+    for (int i = 0; chain && i < chain->count; i++) price_version_row(&w, id, &chain->versions[i]);
+    int known = price_at(id, at, &price);
+    if (w.json) {
+        if (known) {
+            json_begin(&w, "price");
+            json_int(&w, "id", id);
+            json_day(&w, "day", day);
+            json_money(&w, "price", price);
+            json_end(&w);
         }
+    } else if (known) {
+        csv_put_raw(&w, "Price on ", 9);
+        csv_put_raw(&w, day_text, strlen(day_text));
+        csv_put_raw(&w, ": ", 2);
+        csv_put_money(&w, price);
+        csv_put_char(&w, '\n');
+    } else {
+        csv_put_raw(&w, "No price yet on ", 16);
+        csv_put_raw(&w, day_text, strlen(day_text));
+        csv_put_char(&w, '\n');
     }
-    fclose(f);
-    printf("----------------------------------------------------------------\n");
-    printf("Total items sold: %d\nTotal revenue: %.2f\n", total_qty, total_revenue);
+    csv_writer_close(&w);
 }
 
 void show_menu() {
@@ -291,28 +4601,84 @@ void show_menu() {
     printf("6) List low stock products\n");
     printf("7) Generate sales report\n");
     printf("8) Export products to CSV\n");
+    printf("10) Export sales to CSV\n");
+    printf("11) Show operation statistics\n");
+    printf("12) Price history\n");
     printf("9) Exit\n");
     printf("Choose: ");
 }
 
-int main() {
-    load_products();
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--bench-lookup") == 0) {
+        bench_lookup();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-ledger") == 0) {
+        bench_ledger(argc > 2 ? argv[2] : ".");
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-parallel") == 0) {
+        bench_parallel(argc > 2 ? atoll(argv[2]) : 10000000LL, argc > 3 ? argv[3] : ".",
+                       argc > 4 ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-top") == 0) {
+        bench_top(argc > 2 ? atoll(argv[2]) : 50000000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-csv") == 0) {
+        bench_csv(argc > 2 ? atoll(argv[2]) : 5000000, argc > 3 ? argv[3] : ".");
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-suite") == 0) {
+        bench_suite(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoll(argv[3]) : 1000000,
+                    argc > 4 ? atoi(argv[4]) : 100000, argc > 5 ? argv[5] : ".");
+        return 0;
+    }
+
+    if (argc > 2 && strcmp(argv[1], "--loadgen") == 0) {
+        return loadgen(argv[2], argc > 3 ? atoi(argv[3]) : 16, argc > 4 ? atoi(argv[4]) : 100000,
+                       argc > 5 ? atoi(argv[5]) : 32, argc > 6 ? atoi(argv[6]) : 0,
+                       argc > 7 ? atoi(argv[7]) : 1000);
+    }
 
-    // ensure sales file has header if not exists
-    FILE *sf = fopen(SALES_FILE, "r");
-    if (!sf) {
-        sf = fopen(SALES_FILE, "w");
-        if (sf) {
-            fprintf(sf, "date,product_id,product_name,qty,price,total\n");
-            fclose(sf);
-        }
-    } else fclose(sf);
+    if (!load_products() || !wal_open() || !price_history_open()) return 1;
+    low_stock_rebuild();
+    if (!ledger_open(LEDGER_FILE, LEDGER_INDEX_FILE, 1)) return 1;
+    if (argc > 1 && strcmp(argv[1], "--export-sales") == 0) {
+        const char *path = argc > 2 ? argv[2] : SALES_FILE;
+        long long n = export_sales_csv_file(path);
+        if (n < 0) perror(path);
+        else printf("Exported %lld sales to %s\n", n, path);
+        return n < 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "--import-sales") == 0) {
+        long long skipped, n = ledger_import_csv_file(argv[2], &skipped);
+        if (n < 0) perror(argv[2]);
+        else printf("Imported %lld sales from %s (%lld rows skipped)\n", n, argv[2], skipped);
+        rollup_open();
+        close_stores();
+        return n < 0;
+    }
+    rollup_open();
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0) return serve(argv[2]);
+    // For scripts; SHOP_OUTPUT=json lists one JSON object per line
+    if (argc > 1 && strcmp(argv[1], "--list-products") == 0) {
+        list_products(argc > 2 && strcmp(argv[2], "low") == 0);
+        return 0;
+    }
+    low_stock_alert = print_low_stock_alert;
 
     char buf[BUFFER];
     while (1) {
         show_menu();
-        if (!fgets(buf, BUFFER, stdin)) break;
-        int choice = atoi(buf);
+        if (!fgets(buf, BUFFER, stdin)) {
+            close_stores();
+            break;
+        }
+        char *end;
+        int choice = (int)strtol(buf, &end, 10);
+        if (end == buf) choice = -1;
         switch (choice) {
             case 1: list_products(0); break;
             case 2: add_product(); break;
@@ -322,9 +4688,17 @@ int main() {
             case 6: list_products(1); break;
             case 7: generate_report(); break;
             case 8: export_products_csv(); break;
-            case 9: printf("Bye.\n"); exit(0);
+            case 10: export_sales_csv(); break;
+            case 11: show_stats(); break;
+            case 12: show_price_history(); break;
+            case 9:
+                close_stores();
+                printf("Bye.\n");
+                exit(0);
             default: printf("Invalid.\n"); break;
         }
+        stats_tick(0);
+        compact_tick();
     }
     return 0;
 }